@@ -0,0 +1,659 @@
+#ifndef BINARYFUSEFILTER_H
+#define BINARYFUSEFILTER_H
+
+#include <math.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "utils.h"
+#include "filterfile.h"
+#include "rcu.h"
+
+#ifndef XOR_MAX_ITERATIONS
+#define XOR_MAX_ITERATIONS                                                     \
+  100 // probabillity of success should always be > 0.5 so 100 iterations is
+      // highly unlikely
+#endif
+
+// The same source builds the 8, 16 and 32-bit fingerprint filters, one Python
+// module each, picked by BINARYFUSE_BITS.
+#ifndef BINARYFUSE_BITS
+#define BINARYFUSE_BITS 8
+#endif
+
+#if BINARYFUSE_BITS == 8
+typedef uint8_t binary_fuse_fingerprint_t;
+#define FILTER_BINARYFUSE FILTER_BINARYFUSE8
+#define MAGIC_FILTER "$binaryfuse8-filter-1.0\n"
+#elif BINARYFUSE_BITS == 16
+typedef uint16_t binary_fuse_fingerprint_t;
+#define FILTER_BINARYFUSE FILTER_BINARYFUSE16
+#define MAGIC_FILTER "$binaryfuse16-filter-1.0\n"
+#elif BINARYFUSE_BITS == 32
+typedef uint32_t binary_fuse_fingerprint_t;
+#define FILTER_BINARYFUSE FILTER_BINARYFUSE32
+#define MAGIC_FILTER "$binaryfuse32-filter-1.0\n"
+#else
+#error BINARYFUSE_BITS must be 8, 16 or 32.
+#endif
+
+/**
+ * We start with a few utilities.
+ ***/
+static inline uint64_t binary_fuse_murmur64(uint64_t h) {
+  h ^= h >> 33;
+  h *= UINT64_C(0xff51afd7ed558ccd);
+  h ^= h >> 33;
+  h *= UINT64_C(0xc4ceb9fe1a85ec53);
+  h ^= h >> 33;
+  return h;
+}
+static inline uint64_t binary_fuse_mix_split(uint64_t key, uint64_t seed) {
+  return binary_fuse_murmur64(key + seed);
+}
+static inline uint64_t binary_fuse_rotl64(uint64_t n, unsigned int c) {
+  return (n << (c & 63)) | (n >> ((-c) & 63));
+}
+static inline uint32_t binary_fuse_reduce(uint32_t hash, uint32_t n) {
+  // http://lemire.me/blog/2016/06/27/a-fast-alternative-to-the-modulo-reduction/
+  return (uint32_t)(((uint64_t)hash * n) >> 32);
+}
+static inline uint64_t binary_fuse_fingerprint(uint64_t hash) {
+  return hash ^ (hash >> 32);
+}
+
+/**
+ * We need a decent random number generator.
+ **/
+
+// returns random number, modifies the seed
+static inline uint64_t binary_fuse_rng_splitmix64(uint64_t *seed) {
+  uint64_t z = (*seed += UINT64_C(0x9E3779B97F4A7C15));
+  z = (z ^ (z >> 30)) * UINT64_C(0xBF58476D1CE4E5B9);
+  z = (z ^ (z >> 27)) * UINT64_C(0x94D049BB133111EB);
+  return z ^ (z >> 31);
+}
+
+typedef struct binary_fuse_s {
+  uint64_t Seed;
+  uint32_t SegmentLength;
+  uint32_t SegmentLengthMask;
+  uint32_t SegmentCount;
+  uint32_t SegmentCountLength;
+  uint32_t ArrayLength;
+  uint64_t Size;
+  uint32_t Arity; // 3 or 4 probes per key
+  binary_fuse_fingerprint_t *Fingerprints;
+  uint64_t mapped; // bytes of Fingerprints mapped from the filter file, 0 if allocated
+} binary_fuse_t;
+
+// Constructions and loads fill the staging filter; queries only ever read the
+// published copy, which is replaced through RCU.
+static binary_fuse_t filter = {0};
+static rcu_t published = RCU_INITIALIZER;
+
+#ifdef _MSC_VER
+// Windows programmers who target 32-bit platform may need help:
+uint64_t binary_fuse_mulhi(uint64_t a, uint64_t b) { return __umulh(a, b); }
+#else
+uint64_t binary_fuse_mulhi(uint64_t a, uint64_t b) {
+  return ((__uint128_t)a * b) >> 64;
+}
+#endif
+
+typedef struct binary_hashes_s {
+  uint32_t h0;
+  uint32_t h1;
+  uint32_t h2;
+  uint32_t h3;
+} binary_hashes_t;
+
+// The 4th probe takes its offset from a remix of the hash: the bits left
+// over from the first three also pick the segment.
+static inline binary_hashes_t binary_fuse_hash_batch(const binary_fuse_t *filter, uint64_t hash)
+{
+  uint64_t hi = binary_fuse_mulhi(hash, filter->SegmentCountLength);
+  binary_hashes_t ans;
+  ans.h0 = (uint32_t)hi;
+  ans.h1 = ans.h0 + filter->SegmentLength;
+  ans.h2 = ans.h1 + filter->SegmentLength;
+  ans.h3 = ans.h2 + filter->SegmentLength;
+  ans.h1 ^= (uint32_t)(hash >> 18) & filter->SegmentLengthMask;
+  ans.h2 ^= (uint32_t)(hash)&filter->SegmentLengthMask;
+  ans.h3 ^= (uint32_t)binary_fuse_murmur64(hash) & filter->SegmentLengthMask;
+  return ans;
+}
+static inline uint32_t binary_fuse_hash(int index, uint64_t hash)
+{
+    uint64_t h = binary_fuse_mulhi(hash, filter.SegmentCountLength);
+    h += index * filter.SegmentLength;
+    if (index == 3)
+      return h ^ (binary_fuse_murmur64(hash) & filter.SegmentLengthMask);
+    // keep the lower 36 bits
+    uint64_t hh = hash & ((1UL << 36) - 1);
+    // index 0: right shift by 36; index 1: right shift by 18; index 2: no shift
+    h ^= (size_t)((hh >> (36 - 18 * index)) & filter.SegmentLengthMask);
+    return h;
+}
+
+// Report if the key is in the set, with false positive rate.
+static inline bool binary_fuse_contain(const binary_fuse_t *filter, uint64_t key)
+{
+  uint64_t hash = binary_fuse_mix_split(key, filter->Seed);
+  binary_fuse_fingerprint_t f = binary_fuse_fingerprint(hash);
+  binary_hashes_t hashes = binary_fuse_hash_batch(filter, hash);
+  f ^= filter->Fingerprints[hashes.h0] ^ filter->Fingerprints[hashes.h1] ^
+       filter->Fingerprints[hashes.h2];
+  if (filter->Arity == 4)
+    f ^= filter->Fingerprints[hashes.h3];
+  return f == 0;
+}
+
+static inline uint32_t binary_fuse_calculate_segment_length(uint32_t arity,
+                                                             uint32_t size) {
+  // These parameters are very sensitive. Replacing 'floor' by 'round' can
+  // substantially affect the construction time. 
+  if (arity == 3) {
+    return ((uint32_t)1) << (int)(floor(log((double)(size)) / log(3.33) + 2.25));
+  } else if (arity == 4) {
+    return ((uint32_t)1) << (int)(floor(log((double)(size)) / log(2.91) - 0.5));
+  } else {
+    return 65536;
+  }
+}
+
+double binary_fuse_max(double a, double b) {
+  if (a < b) {
+    return b;
+  }
+  return a;
+}
+
+static inline double binary_fuse_calculate_size_factor(uint32_t arity,
+                                                        uint32_t size) {
+  if (arity == 3) {
+    return binary_fuse_max(1.125, 0.875 + 0.25 * log(1000000.0) / log((double)size));
+  } else if (arity == 4) {
+    return binary_fuse_max(1.075, 0.77 + 0.305 * log(600000.0) / log((double)size));
+  } else {
+    return 2.0;
+  }
+}
+
+// allocate enough capacity for a set containing up to 'size' elements
+// caller is responsible to call binary_fuse_free(filter)
+static inline bool binary_fuse_allocate(uint32_t size, uint32_t arity)
+{
+  filter.Arity = arity;
+  filter.SegmentLength = binary_fuse_calculate_segment_length(arity, size);
+  if (filter.SegmentLength > 262144) {
+    filter.SegmentLength = 262144;
+  }
+  filter.SegmentLengthMask = filter.SegmentLength - 1;
+  double sizeFactor = binary_fuse_calculate_size_factor(arity, size);
+  uint32_t capacity = (uint32_t)(round((double)size * sizeFactor));
+  uint32_t initSegmentCount =
+      (capacity + filter.SegmentLength - 1) / filter.SegmentLength -
+      (arity - 1);
+  filter.ArrayLength = (initSegmentCount + arity - 1) * filter.SegmentLength;
+  filter.SegmentCount =
+      (filter.ArrayLength + filter.SegmentLength - 1) / filter.SegmentLength;
+  if (filter.SegmentCount <= arity - 1) {
+    filter.SegmentCount = 1;
+  } else {
+    filter.SegmentCount = filter.SegmentCount - (arity - 1);
+  }
+  filter.ArrayLength =
+      (filter.SegmentCount + arity - 1) * filter.SegmentLength;
+  filter.SegmentCountLength = filter.SegmentCount * filter.SegmentLength;
+  filter.Fingerprints = (binary_fuse_fingerprint_t*)malloc(filter.ArrayLength * sizeof(binary_fuse_fingerprint_t));
+  return filter.Fingerprints != NULL;
+}
+
+// report memory usage
+static inline size_t binary_fuse_size_in_bytes()
+{
+  return filter.ArrayLength * sizeof(binary_fuse_fingerprint_t) + sizeof(binary_fuse_t);
+}
+
+// release memory
+static inline void binary_fuse_free()
+{
+  free_filterfile(filter.Fingerprints, filter.mapped);
+  filter.Fingerprints = NULL;
+  filter.mapped = 0;
+  filter.Seed = 0;
+  filter.SegmentLength = 0;
+  filter.SegmentLengthMask = 0;
+  filter.SegmentCount = 0;
+  filter.SegmentCountLength = 0;
+  filter.ArrayLength = 0;
+  filter.Size = 0;
+  filter.Arity = 0;
+}
+
+
+
+//-------------------------------------------------------------------------------------------------------
+
+static void binaryfuse_release(binary_fuse_t* f)
+{
+  if (f == NULL)
+    return;
+  free_filterfile(f->Fingerprints, f->mapped);
+  free(f);
+}
+
+// Publishes the staging filter if it was staged, otherwise drops it and keeps
+// serving the previous one.
+static bool binaryfuse_publish(bool staged)
+{
+  binary_fuse_t* f = staged ? malloc(sizeof(binary_fuse_t)) : NULL;
+  if (f == NULL)
+  {
+    binary_fuse_free();
+    return false;
+  }
+  *f = filter;
+  bzero(&filter, sizeof(binary_fuse_t));
+  binaryfuse_release(rcu_publish(&published, f));
+  return true;
+}
+
+void binaryfuse_destroy()
+{
+  rcu_write_lock(&published);
+  binary_fuse_free();
+  binaryfuse_release(rcu_publish(&published, NULL));
+  rcu_write_unlock(&published);
+}
+
+static bool binaryfuse_populate_file(char* filename, uint32_t size)
+{
+  ribbon128_key_t* key;
+
+  uint64_t rng_counter = 0x726b2b9d438b9d4d;
+  filter.Seed = binary_fuse_rng_splitmix64(&rng_counter);
+  uint64_t *reverseOrder = (uint64_t *)calloc((size + 1), sizeof(uint64_t));
+  uint32_t capacity = filter.ArrayLength;
+  uint32_t *alone = (uint32_t *)malloc(capacity * sizeof(uint32_t));
+  uint8_t *t2count = (uint8_t *)calloc(capacity, sizeof(uint8_t));
+  uint8_t *reverseH = (uint8_t *)malloc(size * sizeof(uint8_t));
+  uint64_t *t2hash = (uint64_t *)calloc(capacity, sizeof(uint64_t));
+
+  uint32_t blockBits = 1;
+  while (((uint32_t)1 << blockBits) < filter.SegmentCount) {
+    blockBits += 1;
+  }
+  uint32_t block = ((uint32_t)1 << blockBits);
+  uint32_t *startPos = (uint32_t *)malloc((1 << blockBits) * sizeof(uint32_t));
+  const uint32_t arity = filter.Arity;
+  uint32_t h[4];
+
+  if ((alone == NULL) || (t2count == NULL) || (reverseH == NULL) ||
+      (t2hash == NULL) || (reverseOrder == NULL) || (startPos == NULL)) {
+    free(alone);
+    free(t2count);
+    free(reverseH);
+    free(t2hash);
+    free(reverseOrder);
+    free(startPos);
+    return false;
+  }
+  reverseOrder[size] = 1;
+  for (int loop = 0; true; ++loop) {
+    if (loop + 1 > XOR_MAX_ITERATIONS) {
+      fprintf(stderr, "Too many iterations. Are all your keys unique?");
+      free(alone);
+      free(t2count);
+      free(reverseH);
+      free(t2hash);
+      free(reverseOrder);
+      free(startPos);
+      return false;
+    }
+
+    for (uint32_t i = 0; i < block; i++) {
+      // important : i * size would overflow as a 32-bit number in some
+      // cases.
+      startPos[i] = ((uint64_t)i * size) >> blockBits;
+    }
+
+    uint64_t maskblock = block - 1; 
+    if (!open_keys_file(filename, &size))
+      return false;
+    while((key = read_key()) != NULL) {
+      uint64_t hash = binary_fuse_murmur64((uint64_t)key->ribbon + filter.Seed);
+      uint64_t segment_index = hash >> (64 - blockBits);
+      while (reverseOrder[startPos[segment_index]] != 0) {
+        segment_index++;
+        segment_index &= maskblock;
+      }
+      reverseOrder[startPos[segment_index]] = hash;
+      startPos[segment_index]++;
+    }
+    close_keys_file();
+
+    // The low 2 bits of t2count xor the probe numbers of the keys in the
+    // slot, which tells the probe of the last one left; the rest count them.
+    int error = 0;
+    for (uint32_t i = 0; i < size; i++) {
+      uint64_t hash = reverseOrder[i];
+      for (uint32_t j = 0; j < arity; j++) {
+        uint32_t hj = binary_fuse_hash(j, hash);
+        t2count[hj] += 4;
+        t2count[hj] ^= j;
+        t2hash[hj] ^= hash;
+        error = (t2count[hj] < 4) ? 1 : error;
+      }
+    }
+    if(error) { continue; }
+
+    // End of key addition
+    uint32_t Qsize = 0;
+    // Add sets with one key to the queue.
+    for (uint32_t i = 0; i < capacity; i++) {
+      alone[Qsize] = i;
+      Qsize += ((t2count[i] >> 2) == 1) ? 1 : 0;
+    }
+    uint32_t stacksize = 0;
+    while (Qsize > 0) {
+      Qsize--;
+      uint32_t index = alone[Qsize];
+      if ((t2count[index] >> 2) == 1) {
+        uint64_t hash = t2hash[index];
+        uint8_t found = t2count[index] & 3;
+        reverseH[stacksize] = found;
+        reverseOrder[stacksize] = hash;
+        stacksize++;
+        for (uint32_t j = 0; j < arity; j++) {
+          if (j == found)
+            continue;
+          uint32_t other_index = binary_fuse_hash(j, hash);
+          alone[Qsize] = other_index;
+          Qsize += ((t2count[other_index] >> 2) == 2 ? 1 : 0);
+          t2count[other_index] -= 4;
+          t2count[other_index] ^= j;
+          t2hash[other_index] ^= hash;
+        }
+      }
+    }
+    if (stacksize == size) {
+      // success
+      break;
+    }
+    memset(reverseOrder, 0, sizeof(uint64_t[size]));
+    memset(t2count, 0, sizeof(uint8_t[capacity]));
+    memset(t2hash, 0, sizeof(uint64_t[capacity]));
+    filter.Seed = binary_fuse_rng_splitmix64(&rng_counter);
+  }
+
+  for (uint32_t i = size - 1; i < size; i--) {
+    // the hash of the key we insert next
+    uint64_t hash = reverseOrder[i];
+    binary_fuse_fingerprint_t xor2 = binary_fuse_fingerprint(hash);
+    uint8_t found = reverseH[i];
+    for (uint32_t j = 0; j < arity; j++) {
+      h[j] = binary_fuse_hash(j, hash);
+      if (j != found)
+        xor2 ^= filter.Fingerprints[h[j]];
+    }
+    filter.Fingerprints[h[found]] = xor2;
+  }
+  free(alone);
+  free(t2count);
+  free(reverseH);
+  free(t2hash);
+  free(reverseOrder);
+  free(startPos);
+  return true;
+}
+
+static uint32_t binaryfuse_keys(char* filename, uint32_t size)
+{
+  uint32_t maxkeys = calculate_nkeys(filename);
+  return !size || size > maxkeys ? maxkeys : size;
+}
+
+static bool binaryfuse_create_staged(char* filename, uint32_t size, uint32_t arity)
+{
+  if(!(size = binaryfuse_keys(filename, size)))
+    return false;
+  binary_fuse_free();
+  binary_fuse_allocate(size, arity);
+  filter.Size = size;
+  return binaryfuse_populate_file(filename, size);
+}
+
+bool binaryfuse_create(char* filename, uint32_t size, uint32_t arity)
+{
+  rcu_write_lock(&published);
+  bool res = binaryfuse_publish(binaryfuse_create_staged(filename, size, arity));
+  rcu_write_unlock(&published);
+  return res;
+}
+
+// Writes the fingerprints straight into the payload of a new filter file.
+static bool binaryfuse_build_staged(char* filename, char* destfile, uint32_t size, uint32_t arity)
+{
+  filterfile_header_t header;
+  filterfile_out_t out;
+  if(!(size = binaryfuse_keys(filename, size)))
+    return false;
+  binary_fuse_free();
+  binary_fuse_allocate(size, arity);
+  filter.Size = size;
+  // The seed is picked while populating and filled in afterwards.
+  init_filterfile_header(&header, FILTER_BINARYFUSE, filter.Size, 0, sizeof(binary_fuse_fingerprint_t) * filter.ArrayLength);
+  header.params[0] = filter.SegmentLength;
+  header.params[1] = filter.SegmentLengthMask;
+  header.params[2] = filter.SegmentCount;
+  header.params[3] = filter.SegmentCountLength;
+  header.params[4] = filter.ArrayLength;
+  header.params[5] = filter.Arity;
+  free(filter.Fingerprints);
+  filter.Fingerprints = open_filterfile_out(destfile, &header, &out, 0);
+  if (filter.Fingerprints == NULL)
+  {
+    binary_fuse_free();
+    return false;
+  }
+  bool res = binaryfuse_populate_file(filename, size);
+  header.seed = filter.Seed;
+  filter.Fingerprints = NULL;
+  binary_fuse_free();
+  if (!res)
+  {
+    abort_filterfile_out(&out);
+    return false;
+  }
+  return close_filterfile_out(&out, &header);
+}
+
+bool binaryfuse_build(char* filename, char* destfile, uint32_t size, uint32_t arity)
+{
+  rcu_write_lock(&published);
+  bool res = binaryfuse_build_staged(filename, destfile, size, arity);
+  rcu_write_unlock(&published);
+  return res;
+}
+
+bool binaryfuse_exist()
+{
+  return rcu_peek(&published) != NULL;
+}
+
+static bool binaryfuse_contain_key(const void* f, const ribbon128_key_t* key)
+{
+    return binary_fuse_contain(f, (uint64_t)key->ribbon);
+}
+
+bool binaryfuse_sanity(char* filename, uint32_t maxkeys)
+{
+    uint32_t slot;
+    const binary_fuse_t* f = rcu_read_lock(&published, &slot);
+    bool res = f != NULL && check_keys_file(filename, maxkeys, &binaryfuse_contain_key, f);
+    rcu_read_unlock(&published, slot);
+    return res;
+}
+
+uint32_t binaryfuse_fp(uint32_t n)
+{
+    uint32_t slot;
+    const binary_fuse_t* f = rcu_read_lock(&published, &slot);
+    uint32_t matches = 0;
+    init_shishua(clock());
+    ribbon128_key_t randomkey; 
+
+    while(f != NULL && n--)
+    {
+        random_ribbon_key(&randomkey);
+        if(binary_fuse_contain(f, (uint64_t)randomkey.ribbon))
+            matches++;
+    }
+    rcu_read_unlock(&published, slot);
+    return matches;
+}
+
+bool binaryfuse_query(char* pass, bool hashed)
+{
+  uint32_t slot;
+  const binary_fuse_t* f = rcu_read_lock(&published, &slot);
+  ribbon128_key_t key;
+  bool res = f != NULL && ((hashed && hash2key(pass, &key)) || password2key(pass, &key))
+              && binary_fuse_contain(f, (uint64_t)key.ribbon);
+  rcu_read_unlock(&published, slot);
+  return res;
+}
+
+// Answers n keys under one read section. Returns 0 when there is no filter.
+uint32_t binaryfuse_query_batch(const ribbon128_key_t* keys, uint32_t n, uint8_t* results)
+{
+  uint32_t slot;
+  const binary_fuse_t* f = rcu_read_lock(&published, &slot);
+  if (f == NULL)
+    n = 0;
+  for (uint32_t i = 0; i < n; i++)
+    results[i] = binary_fuse_contain(f, (uint64_t)keys[i].ribbon);
+  rcu_read_unlock(&published, slot);
+  return n;
+}
+
+bool binaryfuse_save(char* filename)
+{
+  uint32_t slot;
+  const binary_fuse_t* f = rcu_read_lock(&published, &slot);
+  filterfile_header_t header;
+  bool res = false;
+  if (f != NULL)
+  {
+    init_filterfile_header(&header, FILTER_BINARYFUSE, f->Size, f->Seed, sizeof(binary_fuse_fingerprint_t) * f->ArrayLength);
+    header.params[0] = f->SegmentLength;
+    header.params[1] = f->SegmentLengthMask;
+    header.params[2] = f->SegmentCount;
+    header.params[3] = f->SegmentCountLength;
+    header.params[4] = f->ArrayLength;
+    header.params[5] = f->Arity;
+    res = save_filterfile(filename, &header, f->Fingerprints);
+  }
+  rcu_read_unlock(&published, slot);
+  return res;
+}
+
+static bool binaryfuse_load_v1(char* filename, uint32_t size)
+{
+  FILE* fp = fopen(filename, "rb");
+  if (fp == NULL)
+  {
+    printf("Cannot open the input file %s.", filename);
+    return false;
+  }
+  binary_fuse_free();
+
+  char magic[sizeof(MAGIC_FILTER)];
+  binary_fuse_allocate(size, 3);
+  uint32_t expected_ArrayLength;
+  if (!fread(magic, sizeof(MAGIC_FILTER), 1, fp) 
+      || strcmp(magic, MAGIC_FILTER)
+      || !fread(&filter.Seed, sizeof(filter.Seed), 1, fp)
+      || !fread(&filter.SegmentLength, sizeof(filter.SegmentLength), 1, fp)
+      || !fread(&filter.SegmentLengthMask, sizeof(filter.SegmentLengthMask), 1, fp)
+      || !fread(&filter.SegmentCount, sizeof(filter.SegmentCount), 1, fp)
+      || !fread(&filter.SegmentCountLength, sizeof(filter.SegmentCountLength), 1, fp)
+      || !fread(&expected_ArrayLength, sizeof(filter.ArrayLength), 1, fp)
+      || (size != 0 && filter.ArrayLength != expected_ArrayLength))
+  {
+    perror("Error when reading file");
+    fclose(fp);
+    return false;
+  }
+  
+  filter.ArrayLength = expected_ArrayLength;
+  free(filter.Fingerprints);
+  filter.Fingerprints = (binary_fuse_fingerprint_t*)malloc(filter.ArrayLength * sizeof(binary_fuse_fingerprint_t));
+  if (!fread(filter.Fingerprints, sizeof(binary_fuse_fingerprint_t)*filter.ArrayLength, 1, fp))
+  {
+    perror("Error when reading file");
+    fclose(fp);
+    return false;
+  }
+  fclose(fp);
+  return true;
+}
+
+// Files from before 4-wise filters leave the arity at 0, they are 3-wise.
+static bool binaryfuse_load_staged(char* filename, uint32_t size, bool shared, uint32_t arity)
+{
+  filterfile_header_t header;
+  if (!is_filterfile(filename))
+    return (!arity || arity == 3) && binaryfuse_load_v1(filename, size);
+  binary_fuse_fingerprint_t* fingerprints = shared ? map_filterfile(filename, FILTER_BINARYFUSE, &header)
+                                                   : load_filterfile(filename, FILTER_BINARYFUSE, &header);
+  if (fingerprints == NULL)
+    return false;
+  if (header.payload_size != sizeof(binary_fuse_fingerprint_t) * header.params[4]
+      || header.params[3] != header.params[0]*header.params[2]
+      || (size && header.nkeys != size)
+      || (header.params[5] != 0 && header.params[5] != 3 && header.params[5] != 4)
+      || (arity && (header.params[5] ? header.params[5] : 3) != arity))
+  {
+    printf("Filter file %s was built with other parameters.\n", filename);
+    free_filterfile(fingerprints, shared ? header.payload_size : 0);
+    return false;
+  }
+  binary_fuse_free();
+  filter.Seed = header.seed;
+  filter.SegmentLength = header.params[0];
+  filter.SegmentLengthMask = header.params[1];
+  filter.SegmentCount = header.params[2];
+  filter.SegmentCountLength = header.params[3];
+  filter.ArrayLength = header.params[4];
+  filter.Arity = header.params[5] ? header.params[5] : 3;
+  filter.Size = header.nkeys;
+  filter.Fingerprints = fingerprints;
+  filter.mapped = shared ? header.payload_size : 0;
+  return true;
+}
+
+// Loads into the staging filter and swaps it in, so queries running on the
+// current filter are never interrupted. A shared filter maps the file instead
+// of copying it, so processes loading the same file share its memory.
+// With a keysfile the staged filter must answer every key in it first, or the
+// current filter is kept.
+bool binaryfuse_load(char* filename, uint32_t size, bool shared, uint32_t arity, char* keysfile)
+{
+  rcu_write_lock(&published);
+  bool res = binaryfuse_load_staged(filename, size, shared, arity)
+              && (keysfile == NULL || check_keys_file(keysfile, size, &binaryfuse_contain_key, &filter));
+  res = binaryfuse_publish(res);
+  rcu_write_unlock(&published);
+  return res;
+}
+
+
+#endif
+
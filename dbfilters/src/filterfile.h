@@ -0,0 +1,420 @@
+#ifndef FILTERFILE_H
+#define FILTERFILE_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <stddef.h>
+#include <immintrin.h>
+
+#if !defined(__SSE4_2__)
+#error SSE4.2 required: Compile with "-msse4.2" or "-march=native" option.
+#endif
+
+#define MAGIC_FILTER2 "$pwned-filter-2.0\n"
+#define FILTERFILE_VERSION (2)
+#define FILTERFILE_PAGE (4096)
+#define FILTERFILE_BLOCK (1024*1024)
+#define FILTERFILE_PARAMS (8)
+#define FILTERFILE_THREADS (64)
+
+
+enum
+{
+    FILTER_RIBBON128 = 1,
+    FILTER_BINARYFUSE8 = 2,
+    FILTER_XOR8 = 3,
+    FILTER_XOR16 = 4,
+    FILTER_SPLITBLOCKBLOOM = 5,
+    FILTER_BINARYFUSE16 = 6,
+    FILTER_BINARYFUSE32 = 7,
+};
+
+/*
+ * Filter file v2, shared by every filter:
+ *
+ *   filterfile_header_t | uint32_t crc[nblocks] | padding | payload
+ *
+ * The payload starts on a page boundary and is the filter's fingerprint
+ * array as it lives in memory. params holds whatever the filter needs to
+ * query it (sizes, seeds...). Each block of block_size bytes has its own
+ * CRC32C; payload_crc is the CRC32C of that list and identifies the
+ * contents of the filter.
+ */
+typedef struct __attribute__((__packed__))
+{
+    char magic[32];
+    uint32_t version;
+    uint32_t type;
+    uint64_t nkeys;
+    uint64_t seed;
+    uint64_t created;
+    uint64_t params[FILTERFILE_PARAMS];
+    uint64_t payload_offset;
+    uint64_t payload_size;
+    uint32_t block_size;
+    uint32_t nblocks;
+    uint32_t payload_crc;
+    uint32_t header_crc;
+} filterfile_header_t;
+
+typedef struct
+{
+    int fd;
+    uint8_t* payload;
+    const filterfile_header_t* header;
+    uint32_t* crc;
+    uint8_t mode;
+    uint32_t next;
+    bool ok;
+} filterfile_job_t;
+
+// Filter file being built in place through a shared mapping.
+typedef struct
+{
+    int fd;
+    uint8_t* map;
+    uint64_t size;
+    char filename[PATH_MAX];
+    char tmpfile[PATH_MAX];
+} filterfile_out_t;
+
+enum
+{
+    FILTERFILE_READ,
+    FILTERFILE_WRITE,
+    FILTERFILE_CRC,
+    FILTERFILE_VERIFY,
+};
+
+
+static inline uint32_t crc32c(uint32_t crc, const uint8_t* buf, uint64_t len)
+{
+    crc = ~crc;
+    for (; len >= sizeof(uint64_t); len -= sizeof(uint64_t), buf += sizeof(uint64_t))
+        crc = _mm_crc32_u64(crc, *(const uint64_t*)buf);
+    for (; len; len--, buf++)
+        crc = _mm_crc32_u8(crc, *buf);
+    return ~crc;
+}
+
+static inline uint64_t filterfile_block_len(const filterfile_header_t* header, uint32_t block)
+{
+    uint64_t start = (uint64_t)block*header->block_size;
+    return header->payload_size - start < header->block_size ? header->payload_size - start : header->block_size;
+}
+
+static inline uint64_t filterfile_crc_offset()
+{
+    return sizeof(filterfile_header_t);
+}
+
+static void* filterfile_worker(void* arg)
+{
+    filterfile_job_t* job = (filterfile_job_t*) arg;
+    const filterfile_header_t* header = job->header;
+    uint32_t block;
+    while (__atomic_load_n(&job->ok, __ATOMIC_RELAXED)
+            && (block = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < header->nblocks)
+    {
+        uint64_t start = (uint64_t)block*header->block_size;
+        uint64_t len = filterfile_block_len(header, block);
+        uint8_t* ptr = job->payload + start;
+        if (job->mode == FILTERFILE_CRC)
+            job->crc[block] = crc32c(0, ptr, len);
+        else if (job->mode == FILTERFILE_VERIFY)
+        {
+            if (crc32c(0, ptr, len) != job->crc[block])
+            {
+                printf("Corrupted block %u in filter file.\n", block);
+                __atomic_store_n(&job->ok, false, __ATOMIC_RELAXED);
+            }
+        }
+        else if (job->mode == FILTERFILE_WRITE)
+        {
+            job->crc[block] = crc32c(0, ptr, len);
+            if (pwrite(job->fd, ptr, len, header->payload_offset + start) != len)
+                __atomic_store_n(&job->ok, false, __ATOMIC_RELAXED);
+        }
+        else if (pread(job->fd, ptr, len, header->payload_offset + start) != len
+                    || crc32c(0, ptr, len) != job->crc[block])
+        {
+            printf("Corrupted block %u in filter file.\n", block);
+            __atomic_store_n(&job->ok, false, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+// Reads or writes the payload blocks, one thread per block up to the number of cores.
+static bool filterfile_run(filterfile_job_t* job)
+{
+    pthread_t threads[FILTERFILE_THREADS];
+    uint32_t nthreads = 0;
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t maxthreads = ncpus > 0 ? ncpus : 1;
+    maxthreads = maxthreads < job->header->nblocks ? maxthreads : job->header->nblocks;
+    maxthreads = maxthreads < FILTERFILE_THREADS ? maxthreads : FILTERFILE_THREADS;
+    job->next = 0;
+    job->ok = true;
+    for (uint32_t i = 1; i < maxthreads; i++)
+    {
+        if (pthread_create(&threads[nthreads], NULL, filterfile_worker, job))
+            break;
+        nthreads++;
+    }
+    filterfile_worker(job);
+    for (uint32_t i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    return job->ok;
+}
+
+static inline void init_filterfile_header(filterfile_header_t* header, uint32_t type, uint64_t nkeys, uint64_t seed, uint64_t payload_size)
+{
+    bzero(header, sizeof(filterfile_header_t));
+    strcpy(header->magic, MAGIC_FILTER2);
+    header->version = FILTERFILE_VERSION;
+    header->type = type;
+    header->nkeys = nkeys;
+    header->seed = seed;
+    header->created = time(NULL);
+    header->payload_size = payload_size;
+    header->block_size = FILTERFILE_BLOCK;
+    header->nblocks = (payload_size + FILTERFILE_BLOCK - 1)/FILTERFILE_BLOCK;
+    header->payload_offset = (filterfile_crc_offset() + header->nblocks*sizeof(uint32_t) + FILTERFILE_PAGE - 1)
+                                & ~(uint64_t)(FILTERFILE_PAGE - 1);
+}
+
+// Written to <filename>.tmp and renamed over filename, so processes that have
+// the previous file mapped keep reading it undisturbed.
+bool save_filterfile(char* filename, filterfile_header_t* header, const void* payload)
+{
+    filterfile_job_t job = {.payload = (uint8_t*) payload, .header = header, .mode = FILTERFILE_WRITE};
+    char tmpfile[PATH_MAX];
+    snprintf(tmpfile, PATH_MAX, "%s.tmp", filename);
+    job.crc = calloc(header->nblocks + 1, sizeof(uint32_t));
+    job.fd = open(tmpfile, O_CREAT|O_WRONLY|O_TRUNC, 0666);
+    if (job.fd < 0 || job.crc == NULL)
+    {
+        printf("Cannot open the output file %s.", tmpfile);
+        if (job.fd >= 0)
+            close(job.fd);
+        free(job.crc);
+        return false;
+    }
+    bool res = filterfile_run(&job);
+    header->payload_crc = crc32c(0, (uint8_t*) job.crc, header->nblocks*sizeof(uint32_t));
+    header->header_crc = crc32c(0, (uint8_t*) header, offsetof(filterfile_header_t, header_crc));
+    res = res
+        && pwrite(job.fd, header, sizeof(filterfile_header_t), 0) == sizeof(filterfile_header_t)
+        && pwrite(job.fd, job.crc, header->nblocks*sizeof(uint32_t), filterfile_crc_offset())
+            == header->nblocks*sizeof(uint32_t);
+    free(job.crc);
+    close(job.fd);
+    res = res && !rename(tmpfile, filename);
+    if (!res)
+    {
+        perror("Error when writing into file");
+        unlink(tmpfile);
+    }
+    return res;
+}
+
+bool read_filterfile_header(int fd, filterfile_header_t* header)
+{
+    if (pread(fd, header, sizeof(filterfile_header_t), 0) != sizeof(filterfile_header_t)
+        || strncmp(header->magic, MAGIC_FILTER2, sizeof(header->magic))
+        || header->version != FILTERFILE_VERSION
+        || header->header_crc != crc32c(0, (uint8_t*) header, offsetof(filterfile_header_t, header_crc))
+        || !header->block_size
+        || header->nblocks != (header->payload_size + header->block_size - 1)/header->block_size
+        || header->payload_offset % FILTERFILE_PAGE)
+        return false;
+    return true;
+}
+
+bool is_filterfile(char* filename)
+{
+    filterfile_header_t header;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return false;
+    bool res = read_filterfile_header(fd, &header);
+    close(fd);
+    return res;
+}
+
+/*
+ * Loads the payload of a filter file v2 of the given type into a new buffer
+ * aligned to 32 bytes, checking every block. The header is left in *header.
+ */
+void* load_filterfile(char* filename, uint32_t type, filterfile_header_t* header)
+{
+    filterfile_job_t job = {.header = header, .mode = FILTERFILE_READ};
+    job.fd = open(filename, O_RDONLY);
+    if (job.fd < 0)
+    {
+        printf("Cannot open the input file %s.", filename);
+        return NULL;
+    }
+    if (!read_filterfile_header(job.fd, header) || header->type != type)
+    {
+        printf("Invalid filter file %s.\n", filename);
+        close(job.fd);
+        return NULL;
+    }
+    job.crc = malloc(header->nblocks*sizeof(uint32_t) + 1);
+    job.payload = aligned_alloc(sizeof(__m256i), (header->payload_size + sizeof(__m256i) - 1) & ~(sizeof(__m256i) - 1));
+    if (job.crc == NULL || job.payload == NULL
+        || pread(job.fd, job.crc, header->nblocks*sizeof(uint32_t), filterfile_crc_offset())
+            != header->nblocks*sizeof(uint32_t)
+        || crc32c(0, (uint8_t*) job.crc, header->nblocks*sizeof(uint32_t)) != header->payload_crc
+        || !filterfile_run(&job))
+    {
+        printf("Error when reading file %s.\n", filename);
+        free(job.payload);
+        job.payload = NULL;
+    }
+    free(job.crc);
+    close(job.fd);
+    return job.payload;
+}
+
+/*
+ * Maps the payload of a filter file v2 of the given type read-only and shared,
+ * checking every block. Every process mapping the same file shares one copy
+ * of it in the page cache. Release it with free_filterfile(payload, size).
+ */
+void* map_filterfile(char* filename, uint32_t type, filterfile_header_t* header)
+{
+    filterfile_job_t job = {.header = header, .mode = FILTERFILE_VERIFY};
+    job.fd = open(filename, O_RDONLY);
+    if (job.fd < 0)
+    {
+        printf("Cannot open the input file %s.", filename);
+        return NULL;
+    }
+    if (!read_filterfile_header(job.fd, header) || header->type != type || !header->payload_size)
+    {
+        printf("Invalid filter file %s.\n", filename);
+        close(job.fd);
+        return NULL;
+    }
+    job.crc = malloc(header->nblocks*sizeof(uint32_t) + 1);
+    job.payload = mmap(NULL, header->payload_size, PROT_READ, MAP_SHARED, job.fd, header->payload_offset);
+    if (job.payload == MAP_FAILED)
+        job.payload = NULL;
+    else
+        madvise(job.payload, header->payload_size, MADV_WILLNEED);
+    if (job.crc == NULL || job.payload == NULL
+        || pread(job.fd, job.crc, header->nblocks*sizeof(uint32_t), filterfile_crc_offset())
+            != header->nblocks*sizeof(uint32_t)
+        || crc32c(0, (uint8_t*) job.crc, header->nblocks*sizeof(uint32_t)) != header->payload_crc
+        || !filterfile_run(&job))
+    {
+        printf("Error when mapping file %s.\n", filename);
+        if (job.payload != NULL)
+            munmap(job.payload, header->payload_size);
+        job.payload = NULL;
+    }
+    free(job.crc);
+    close(job.fd);
+    return job.payload;
+}
+
+// Releases a payload from load_filterfile (mapped == 0) or map_filterfile.
+static inline void free_filterfile(void* payload, uint64_t mapped)
+{
+    if (mapped)
+        munmap(payload, mapped);
+    else
+        free(payload);
+}
+
+// Checks every block of a filter file of any type, as a load would, without
+// keeping it.
+bool verify_filterfile(char* filename)
+{
+    filterfile_header_t header;
+    int fd = open(filename, O_RDONLY);
+    bool res = fd >= 0 && read_filterfile_header(fd, &header);
+    if (fd >= 0)
+        close(fd);
+    void* payload = res ? map_filterfile(filename, header.type, &header) : NULL;
+    if (payload != NULL)
+        free_filterfile(payload, header.payload_size);
+    return payload != NULL;
+}
+
+void abort_filterfile_out(filterfile_out_t* out)
+{
+    if (out->map != NULL && out->map != MAP_FAILED)
+        munmap(out->map, out->size);
+    if (out->fd > 0)
+    {
+        close(out->fd);
+        unlink(out->tmpfile);
+    }
+    bzero(out, sizeof(filterfile_out_t));
+}
+
+/*
+ * Creates <filename>.tmp with room for the header and payload (plus slack
+ * bytes of zeros after it) and maps it, returning where the payload goes.
+ * The filter is constructed straight into the returned memory.
+ */
+void* open_filterfile_out(char* filename, const filterfile_header_t* header, filterfile_out_t* out, uint64_t slack)
+{
+    bzero(out, sizeof(filterfile_out_t));
+    snprintf(out->filename, PATH_MAX, "%s", filename);
+    snprintf(out->tmpfile, PATH_MAX, "%s.tmp", filename);
+    out->size = header->payload_offset + header->payload_size + slack;
+    out->fd = open(out->tmpfile, O_CREAT|O_RDWR|O_TRUNC, 0666);
+    if (out->fd < 0 || ftruncate(out->fd, out->size)
+        || (out->map = mmap(NULL, out->size, PROT_READ|PROT_WRITE, MAP_SHARED, out->fd, 0)) == MAP_FAILED)
+    {
+        printf("Cannot map the output file %s", out->tmpfile);
+        perror("");
+        abort_filterfile_out(out);
+        return NULL;
+    }
+    return out->map + header->payload_offset;
+}
+
+// Checksums the payload in place, writes the header and moves the file into place.
+bool close_filterfile_out(filterfile_out_t* out, filterfile_header_t* header)
+{
+    filterfile_job_t job = {.payload = out->map + header->payload_offset, .header = header, .mode = FILTERFILE_CRC};
+    job.crc = (uint32_t*)(out->map + filterfile_crc_offset());
+    bool res = filterfile_run(&job);
+    header->payload_crc = crc32c(0, (uint8_t*) job.crc, header->nblocks*sizeof(uint32_t));
+    header->header_crc = crc32c(0, (uint8_t*) header, offsetof(filterfile_header_t, header_crc));
+    memcpy(out->map, header, sizeof(filterfile_header_t));
+    res = res
+        && !msync(out->map, out->size, MS_SYNC)
+        && !munmap(out->map, out->size);
+    out->map = NULL;
+    res = res
+        && !ftruncate(out->fd, header->payload_offset + header->payload_size)
+        && !rename(out->tmpfile, out->filename);
+    if (!res)
+    {
+        perror("Error when writing into file");
+        abort_filterfile_out(out);
+        return false;
+    }
+    close(out->fd);
+    bzero(out, sizeof(filterfile_out_t));
+    return true;
+}
+
+
+#endif
\ No newline at end of file
@@ -0,0 +1,175 @@
+#ifndef HOTSET_H
+#define HOTSET_H
+
+#include <immintrin.h>
+#include <stdint.h>
+
+#include "utils.h"
+#include "rcu.h"
+
+#define HOTSET_WAYS (8)
+#define HOTSET_LOAD (0.75)
+
+
+/*
+ * Exact set of the most common breached passwords, asked before the main
+ * filter. Each key is kept as the first 64 bits of its SHA1 in buckets of
+ * HOTSET_WAYS slots, one cache line each, so most lookups read a single line.
+ * A full bucket spills into the next one and an empty slot ends the search.
+ * With a million keys a random password matches one of them with odds of
+ * 2^-44, far below the false positive rate of any of the filters.
+ */
+typedef struct hotset {
+    uint64_t num_buckets;
+    uint64_t num_keys;
+    uint64_t* slots;
+} hotset_t;
+
+// Queries only ever read the published set, which is replaced through RCU.
+static rcu_t published = RCU_INITIALIZER;
+
+// 0 marks an empty slot.
+static inline uint64_t hot_fingerprint(const ribbon128_key_t* key)
+{
+    uint64_t fp = key_prefix(key);
+    return fp ? fp : 1;
+}
+
+static inline uint64_t hot_bucket(const hotset_t* h, uint64_t fp)
+{
+    return ((fp >> 32) * h->num_buckets) >> 32;
+}
+
+static inline void add_fingerprint(hotset_t* h, uint64_t fp)
+{
+    for (uint64_t b = hot_bucket(h, fp);; b = b + 1 < h->num_buckets ? b + 1 : 0)
+    {
+        uint64_t* slots = &h->slots[b*HOTSET_WAYS];
+        for (uint32_t w = 0; w < HOTSET_WAYS; w++)
+        {
+            if (slots[w] == fp)
+                return;
+            if (!slots[w])
+            {
+                slots[w] = fp;
+                h->num_keys++;
+                return;
+            }
+        }
+    }
+}
+
+static inline bool find_fingerprint(const hotset_t* h, uint64_t fp)
+{
+    const __m256i target = _mm256_set1_epi64x(fp);
+    const __m256i empty = _mm256_setzero_si256();
+    for (uint64_t b = hot_bucket(h, fp);; b = b + 1 < h->num_buckets ? b + 1 : 0)
+    {
+        const __m256i* slots = (const __m256i*) &h->slots[b*HOTSET_WAYS];
+        __m256i lo = _mm256_load_si256(slots);
+        __m256i hi = _mm256_load_si256(slots + 1);
+        __m256i found = _mm256_or_si256(_mm256_cmpeq_epi64(lo, target), _mm256_cmpeq_epi64(hi, target));
+        if (!_mm256_testz_si256(found, found))
+            return true;
+        __m256i vacant = _mm256_or_si256(_mm256_cmpeq_epi64(lo, empty), _mm256_cmpeq_epi64(hi, empty));
+        if (!_mm256_testz_si256(vacant, vacant))
+            return false;
+    }
+}
+
+
+//-------------------------------------------------------------------------------------------------------
+
+static void hotset_release(hotset_t* h)
+{
+  if (h == NULL)
+    return;
+  free(h->slots);
+  free(h);
+}
+
+void hotset_destroy()
+{
+  rcu_write_lock(&published);
+  hotset_release(rcu_publish(&published, NULL));
+  rcu_write_unlock(&published);
+}
+
+// Builds the set from the first maxkeys keys of a keys file, the hot keys
+// written by preprocess, and swaps it in.
+bool hotset_create(char* filename, uint32_t maxkeys)
+{
+  ribbon128_key_t* key;
+  if (!open_keys_file(filename, &maxkeys))
+    return false;
+  hotset_t* h = calloc(1, sizeof(hotset_t));
+  if (h != NULL)
+  {
+    h->num_buckets = (uint64_t)(maxkeys/(HOTSET_WAYS*HOTSET_LOAD)) + 1;
+    h->slots = aligned_alloc(HOTSET_WAYS*sizeof(uint64_t), h->num_buckets*HOTSET_WAYS*sizeof(uint64_t));
+  }
+  if (h == NULL || h->slots == NULL)
+  {
+    perror("Cannot allocate the hot set");
+    hotset_release(h);
+    close_keys_file();
+    return false;
+  }
+  bzero(h->slots, h->num_buckets*HOTSET_WAYS*sizeof(uint64_t));
+  while((key = read_key()) != NULL)
+  {
+    add_fingerprint(h, hot_fingerprint(key));
+  }
+  close_keys_file();
+
+  rcu_write_lock(&published);
+  hotset_release(rcu_publish(&published, h));
+  rcu_write_unlock(&published);
+  return true;
+}
+
+bool hotset_exist()
+{
+  return rcu_peek(&published) != NULL;
+}
+
+uint64_t hotset_size()
+{
+  uint32_t slot;
+  const hotset_t* h = rcu_read_lock(&published, &slot);
+  uint64_t n = h != NULL ? h->num_keys : 0;
+  rcu_read_unlock(&published, slot);
+  return n;
+}
+
+// False when the password is not one of the hot keys, or there is no set.
+bool hotset_query(char* pass, bool hashed)
+{
+  uint32_t slot;
+  const hotset_t* h = rcu_read_lock(&published, &slot);
+  ribbon128_key_t key;
+  bool res = h != NULL && ((hashed && hash2key(pass, &key)) || password2key(pass, &key))
+              && find_fingerprint(h, hot_fingerprint(&key));
+  rcu_read_unlock(&published, slot);
+  return res;
+}
+
+// Answers n keys under one read section, prefetching the buckets a few keys
+// ahead. Returns 0 when there is no set.
+uint32_t hotset_query_batch(const ribbon128_key_t* keys, uint32_t n, uint8_t* results)
+{
+  uint32_t slot;
+  const hotset_t* h = rcu_read_lock(&published, &slot);
+  if (h == NULL)
+    n = 0;
+  for (uint32_t i = 0; i < n; i++)
+  {
+    if (i + 8 < n)
+      __builtin_prefetch(&h->slots[hot_bucket(h, hot_fingerprint(&keys[i+8]))*HOTSET_WAYS]);
+    results[i] = find_fingerprint(h, hot_fingerprint(&keys[i]));
+  }
+  rcu_read_unlock(&published, slot);
+  return n;
+}
+
+#endif
@@ -0,0 +1,117 @@
+#include <Python.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "hotset.h"
+
+
+static PyObject* method_construct_filter(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    char* filename;
+    uint32_t maxkeys = 0;
+
+    static char *kwlist[] = {"filename", "maxkeys", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|I", kwlist,
+                                     &filename, &maxkeys))
+        return NULL;
+
+    bool res;
+    Py_BEGIN_ALLOW_THREADS
+    res = hotset_create(filename, maxkeys);
+    Py_END_ALLOW_THREADS
+
+    return PyBool_FromLong(res);
+}
+
+static PyObject *method_query_filter(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    char* pass;
+    bool hashed = false;
+
+    static char *kwlist[] = {"password", "hashed", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|b", kwlist, &pass, &hashed))
+        return NULL;
+
+    return PyBool_FromLong(hotset_query(pass, hashed));
+}
+
+static PyObject *method_query_hashes(PyObject *self, PyObject *args)
+{
+    Py_buffer hashes;
+
+    if (!PyArg_ParseTuple(args, "y*", &hashes))
+        return NULL;
+
+    if (hashes.len % sizeof(ribbon128_key_t))
+    {
+        PyBuffer_Release(&hashes);
+        Py_RETURN_NONE;
+    }
+    uint64_t n = hashes.len / sizeof(ribbon128_key_t);
+    PyObject* bitmap = PyBytes_FromStringAndSize(NULL, (n + 7)/8);
+    if (bitmap == NULL)
+    {
+        PyBuffer_Release(&hashes);
+        return NULL;
+    }
+
+    bool res;
+    Py_BEGIN_ALLOW_THREADS
+    res = query_keys_bitmap(&hotset_query_batch, hashes.buf, n, (uint8_t*) PyBytes_AS_STRING(bitmap));
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&hashes);
+
+    if (!res)
+    {
+        Py_DECREF(bitmap);
+        Py_RETURN_NONE;
+    }
+    return bitmap;
+}
+
+static PyObject *method_size_filter(PyObject *self, PyObject *args)
+{
+    return PyLong_FromUnsignedLongLong(hotset_size());
+}
+
+static PyObject *method_exist_filter(PyObject *self, PyObject *args)
+{
+    return PyBool_FromLong(hotset_exist());
+}
+
+static PyObject *method_destroy_filter(PyObject *self, PyObject *args)
+{
+    hotset_destroy();
+    Py_RETURN_NONE;
+}
+
+
+static PyMethodDef HotsetMethods[] =
+{
+    {"construct_filter", (PyCFunction) method_construct_filter, METH_VARARGS | METH_KEYWORDS, ""},
+    {"query_filter", (PyCFunction) method_query_filter, METH_VARARGS | METH_KEYWORDS, ""},
+    {"query_hashes", (PyCFunction) method_query_hashes, METH_VARARGS, ""},
+    {"size_filter", (PyCFunction) method_size_filter, METH_NOARGS, ""},
+    {"exist_filter", (PyCFunction) method_exist_filter, METH_NOARGS, ""},
+    {"destroy_filter", (PyCFunction) method_destroy_filter, METH_NOARGS, ""},
+    {NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef HotsetModule =
+{
+    PyModuleDef_HEAD_INIT,
+    "hotset",
+    "",
+    -1,
+    HotsetMethods,
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
+
+PyMODINIT_FUNC PyInit_hotset(void)
+{
+    //assert(!(__builtin_cpu_supports("avx2"))); //meter excepcion
+    return PyModule_Create(&HotsetModule);
+}
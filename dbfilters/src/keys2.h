@@ -0,0 +1,148 @@
+#ifndef KEYS2_H
+#define KEYS2_H
+
+#include <immintrin.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#if !defined(__AVX2__)
+#error AVX2 required: Compile with "-mavx2" option.
+#endif
+
+#define MAGIC_KEYS2 "$ribbon128-keys-2.0\n"
+#define KEYS2_BLOCK (4096)
+#define KEYS2_TAIL (sizeof(ribbon128_key_t)-sizeof(uint64_t))
+
+
+typedef struct __attribute__((__packed__))
+{
+    __uint128_t ribbon;
+    uint32_t index;
+} ribbon128_key_t;
+
+/*
+ * Keys file v2: keys sorted by their 64-bit big endian prefix (the first 16
+ * hex digits of the SHA-1) and grouped in blocks of KEYS2_BLOCK keys. Inside
+ * a block the prefixes are Elias-Fano coded relative to the first one, and
+ * the remaining 12 bytes of every key are stored raw. The block index lives
+ * at the end of the file so the writer can stream the blocks.
+ *
+ *   MAGIC_KEYS2 | keys2_header_t | block 0 | ... | block n-1 | keys2_index_t[n]
+ *   block = keys2_block_t | lows (n*lowbits bits) | highs (highwords) | tails
+ */
+typedef struct __attribute__((__packed__))
+{
+    uint64_t nkeys;
+    uint32_t blockkeys;
+    uint32_t nblocks;
+    uint64_t index_offset;
+} keys2_header_t;
+
+typedef struct __attribute__((__packed__))
+{
+    uint64_t first;
+    uint64_t offset;
+} keys2_index_t;
+
+typedef struct __attribute__((__packed__))
+{
+    uint8_t lowbits;
+    uint8_t pad[3];
+    uint32_t highwords;
+} keys2_block_t;
+
+static inline uint64_t key_prefix(const ribbon128_key_t* key)
+{
+    return __builtin_bswap64(*(uint64_t*)key);
+}
+
+static inline uint64_t keys2_lowbytes(uint32_t n, uint8_t lowbits)
+{
+    return ((uint64_t)n*lowbits + 7)/8 + sizeof(uint64_t);
+}
+
+static inline uint32_t keys2_block_keys(const keys2_header_t* header, uint32_t block)
+{
+    return block+1 < header->nblocks ? header->blockkeys : header->nkeys - (uint64_t)block*header->blockkeys;
+}
+
+static inline uint64_t keys2_block_size(const keys2_header_t* header, const keys2_index_t* index, uint32_t block)
+{
+    uint64_t end = block+1 < header->nblocks ? index[block+1].offset : header->index_offset;
+    return end - index[block].offset;
+}
+
+// Largest encoded block of n keys.
+static inline uint64_t keys2_block_bound(uint32_t n)
+{
+    return sizeof(keys2_block_t) + ((uint64_t)n*56 + 7)/8 + sizeof(uint64_t)
+            + ((3*(uint64_t)n + 256)/64 + 1)*sizeof(uint64_t) + (uint64_t)n*KEYS2_TAIL;
+}
+
+// Size of a block of n keys with the given layout.
+static inline uint64_t keys2_layout_size(uint32_t n, uint8_t lowbits, uint32_t highwords)
+{
+    return sizeof(keys2_block_t) + keys2_lowbytes(n, lowbits) + (uint64_t)highwords*sizeof(uint64_t)
+            + (uint64_t)n*KEYS2_TAIL;
+}
+
+// Decodes the size bytes of a block of n keys, rejecting a block whose layout
+// does not fit them.
+bool decode_keys2_block(const uint8_t* raw, uint64_t size, uint64_t first, uint32_t n, ribbon128_key_t* keys)
+{
+    const keys2_block_t* block = (const keys2_block_t*) raw;
+    if (size < sizeof(keys2_block_t) || n > KEYS2_BLOCK || block->lowbits > 56
+        || size != keys2_layout_size(n, block->lowbits, block->highwords))
+        return false;
+
+    const uint8_t* lows = raw + sizeof(keys2_block_t);
+    const uint64_t* highs = (const uint64_t*)(lows + keys2_lowbytes(n, block->lowbits));
+    const uint8_t* tails = (const uint8_t*)(highs + block->highwords);
+    const uint8_t l = block->lowbits;
+    uint64_t high[KEYS2_BLOCK+4] __attribute__((aligned(32)));
+    uint64_t prefix[4] __attribute__((aligned(32)));
+    uint32_t i = 0;
+
+    // Upper bits: the i-th set bit of the unary stream is at position high_i + i.
+    for (uint32_t w = 0; w < block->highwords && i < n; w++)
+    {
+        uint64_t word = highs[w];
+        while (word && i < n)
+        {
+            high[i] = ((uint64_t)w*64 + __builtin_ctzll(word) - i) << l;
+            i++;
+            word &= word - 1;
+        }
+    }
+    if (i != n)
+        return false;
+
+    // Lower bits: four keys per round, gathering the 64-bit words that hold each
+    // l-bit field and shifting them into place.
+    const __m256i seven = _mm256_set1_epi64x(7);
+    const __m256i lowmask = _mm256_set1_epi64x(((uint64_t)1 << l) - 1);
+    const __m256i step = _mm256_set_epi64x(3*l, 2*l, l, 0);
+    const __m256i bswap = _mm256_set_epi8(
+        8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7,
+        8, 9, 10, 11, 12, 13, 14, 15, 0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256i base = _mm256_set1_epi64x(first);
+
+    for (i = 0; i < n; i += 4)
+    {
+        __m256i pos = _mm256_add_epi64(_mm256_set1_epi64x((uint64_t)i*l), step);
+        __m256i low = _mm256_i64gather_epi64((const long long*) lows, _mm256_srli_epi64(pos, 3), 1);
+        low = _mm256_and_si256(_mm256_srlv_epi64(low, _mm256_and_si256(pos, seven)), lowmask);
+        __m256i p = _mm256_add_epi64(base, _mm256_or_si256(_mm256_load_si256((__m256i*)&high[i]), low));
+        _mm256_store_si256((__m256i*)prefix, _mm256_shuffle_epi8(p, bswap));
+        for (uint32_t j = 0; j < 4 && i+j < n; j++)
+        {
+            uint8_t* ptr = (uint8_t*)&keys[i+j];
+            *(uint64_t*)ptr = prefix[j];
+            memcpy(ptr + sizeof(uint64_t), tails + (uint64_t)(i+j)*KEYS2_TAIL, KEYS2_TAIL);
+        }
+    }
+    return true;
+}
+
+#endif
@@ -0,0 +1,432 @@
+#ifndef KEYSTORE_H
+#define KEYSTORE_H
+
+#include <stdint.h>
+
+#include "utils.h"
+#include "keys2.h"
+#include "rcu.h"
+
+#define KEYSTORE_BUCKET_BITS (16)
+
+
+/*
+ * Exact second stage for filter positives: the full 20-byte key is looked up
+ * in the compact (v2) keys file the filter was built from. Only the block
+ * index is kept in memory, plus a table of the first block of every prefix
+ * bucket, so a lookup is a short binary search over the index followed by a
+ * single block read, which the page cache keeps warm for repeated hits.
+ * Blocks are read with pread rather than mapped: preprocess rewrites the keys
+ * file in place, and a truncated mapping would fault instead of failing.
+ * Shards cover disjoint prefix ranges, but the delta files an update appends
+ * to the manifest span the whole range, so every file covering a prefix is
+ * searched.
+ */
+typedef struct
+{
+    int fd;
+    keys2_header_t header;
+    keys2_index_t* index;
+    uint32_t* buckets;
+    uint64_t last;
+    uint8_t bits;
+} keystore_file_t;
+
+// version tells apart the files a keystore was opened from, so that answers
+// read from it can be tagged.
+typedef struct
+{
+    uint32_t nfiles;
+    uint64_t version;
+    keystore_file_t* files;
+} keystore_t;
+
+static rcu_t verified = RCU_INITIALIZER;
+
+static inline uint64_t keystore_bucket(const keystore_file_t* f, uint64_t prefix)
+{
+    return f->bits ? prefix >> (64 - f->bits) : 0;
+}
+
+static inline uint64_t keystore_first(const keystore_file_t* f)
+{
+    return f->index[0].first;
+}
+
+// Last block starting at or before prefix, or -1 when it is below the file.
+static int64_t keystore_block(const keystore_file_t* f, uint64_t prefix)
+{
+    uint64_t b = keystore_bucket(f, prefix);
+    int64_t lo = f->buckets[b] ? f->buckets[b] - 1 : 0;
+    int64_t hi = f->buckets[b+1];
+    if (f->index[lo].first > prefix)
+        return -1;
+    while (hi - lo > 1)
+    {
+        int64_t mid = (lo + hi)/2;
+        if (f->index[mid].first <= prefix)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static bool keystore_read_block(const keystore_file_t* f, uint32_t block, uint8_t* raw, ribbon128_key_t* keys)
+{
+    uint64_t size = keys2_block_size(&f->header, f->index, block);
+    return size <= keys2_block_bound(KEYS2_BLOCK)
+        && pread(f->fd, raw, size, f->index[block].offset) == (ssize_t) size
+        && decode_keys2_block(raw, size, f->index[block].first, keys2_block_keys(&f->header, block), keys);
+}
+
+// 1 when the key is in the block, 0 when it is not and -1 when the block
+// cannot be read.
+static int keystore_find_block(const keystore_file_t* f, uint32_t block, const ribbon128_key_t* key,
+                               uint8_t* raw, ribbon128_key_t* keys)
+{
+    if (!keystore_read_block(f, block, raw, keys))
+        return -1;
+    uint32_t lo = 0, hi = keys2_block_keys(&f->header, block);
+    while (lo < hi)
+    {
+        uint32_t mid = (lo + hi)/2;
+        int c = memcmp(&keys[mid], key, sizeof(ribbon128_key_t));
+        if (!c)
+            return 1;
+        if (c < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return 0;
+}
+
+static int keystore_find_file(const keystore_file_t* f, const ribbon128_key_t* key, uint8_t* raw, ribbon128_key_t* keys)
+{
+    uint64_t prefix = key_prefix(key);
+    int64_t block = prefix > f->last ? -1 : keystore_block(f, prefix);
+    if (block < 0)
+        return 0;
+    int res;
+    // Keys sharing a prefix may straddle a block boundary.
+    do
+        res = keystore_find_block(f, block, key, raw, keys);
+    while (!res && block > 0 && f->index[block--].first == prefix);
+    return res;
+}
+
+// 1 when a file has the key, -1 when none has it but one could not be read.
+static int keystore_find(const keystore_t* s, const ribbon128_key_t* key)
+{
+    uint64_t prefix = key_prefix(key);
+    uint8_t* raw = malloc(keys2_block_bound(KEYS2_BLOCK) + sizeof(__m256i));
+    ribbon128_key_t* keys = malloc(KEYS2_BLOCK*sizeof(ribbon128_key_t));
+    bool found = false, unread = raw == NULL || keys == NULL;
+    for (uint32_t i = 0; !found && raw != NULL && keys != NULL && i < s->nfiles
+                         && keystore_first(&s->files[i]) <= prefix; i++)
+    {
+        int res = keystore_find_file(&s->files[i], key, raw, keys);
+        found = res > 0;
+        unread |= res < 0;
+    }
+    free(raw);
+    free(keys);
+    return found ? 1 : unread ? -1 : 0;
+}
+
+
+//-------------------------------------------------------------------------------------------------------
+
+static void keystore_release(keystore_t* s)
+{
+    if (s == NULL)
+        return;
+    for (uint32_t i = 0; s->files != NULL && i < s->nfiles; i++)
+    {
+        close(s->files[i].fd);
+        free(s->files[i].index);
+        free(s->files[i].buckets);
+    }
+    free(s->files);
+    free(s);
+}
+
+static bool keystore_open_file(keystore_file_t* f, char* filename)
+{
+    f->fd = open(filename, O_RDONLY);
+    if (f->fd < 0)
+    {
+        printf("Cannot open keys file %s", filename);
+        perror("");
+        return false;
+    }
+    if (read_keys_version(f->fd) != 2 || !read_keys2_header(f->fd, &f->header))
+    {
+        printf("Keys file %s is not compact, build it with COMPACTKEYS to verify keys\n", filename);
+        return false;
+    }
+    if (!f->header.nblocks)
+        return true;
+    uint64_t size = f->header.nblocks*sizeof(keys2_index_t);
+    f->index = malloc(size);
+    if (f->index == NULL || pread(f->fd, f->index, size, f->header.index_offset) != (ssize_t) size)
+    {
+        printf("Cannot read the index of %s\n", filename);
+        return false;
+    }
+
+    // buckets[b] is the first block whose prefix falls in bucket b or later.
+    while ((1u << f->bits) < f->header.nblocks && f->bits < KEYSTORE_BUCKET_BITS)
+        f->bits++;
+    f->buckets = malloc(((1u << f->bits) + 1)*sizeof(uint32_t));
+    if (f->buckets == NULL)
+    {
+        perror("Cannot allocate the keys index");
+        return false;
+    }
+    uint32_t j = 0;
+    for (uint32_t b = 0; b <= (1u << f->bits); b++)
+    {
+        while (j < f->header.nblocks && keystore_bucket(f, f->index[j].first) < b)
+            j++;
+        f->buckets[b] = j;
+    }
+    f->buckets[1u << f->bits] = f->header.nblocks;
+
+    // The index only has the first prefix of each block, the last one comes
+    // from the last key.
+    uint32_t last = f->header.nblocks - 1;
+    uint8_t* raw = malloc(keys2_block_bound(KEYS2_BLOCK) + sizeof(__m256i));
+    ribbon128_key_t* keys = malloc(KEYS2_BLOCK*sizeof(ribbon128_key_t));
+    bool res = raw != NULL && keys != NULL && keystore_read_block(f, last, raw, keys);
+    if (res)
+        f->last = key_prefix(&keys[keys2_block_keys(&f->header, last) - 1]);
+    else
+        printf("Cannot read the last block of %s\n", filename);
+    free(raw);
+    free(keys);
+    return res;
+}
+
+static int compare_keystore_files(const void* a, const void* b)
+{
+    uint64_t x = keystore_first(a), y = keystore_first(b);
+    return (x > y) - (x < y);
+}
+
+void keystore_destroy()
+{
+    rcu_write_lock(&verified);
+    keystore_release(rcu_publish(&verified, NULL));
+    rcu_write_unlock(&verified);
+}
+
+// Opens a compact keys file, or every shard of a manifest, and swaps it in.
+bool keystore_create(char* filename)
+{
+    shards_t shards;
+    if (!open_shards(filename, &shards))
+        return false;
+    keystore_t* s = calloc(1, sizeof(keystore_t));
+    if (s != NULL)
+        s->files = calloc(shards.nfiles, sizeof(keystore_file_t));
+    if (s == NULL || s->files == NULL)
+    {
+        perror("Cannot allocate the keystore");
+        free_shards(&shards);
+        keystore_release(s);
+        return false;
+    }
+    for (uint32_t i = 0; i < shards.nfiles; i++)
+    {
+        keystore_file_t* f = &s->files[s->nfiles];
+        if (!keystore_open_file(f, shards.files[i]))
+        {
+            s->nfiles++;
+            free_shards(&shards);
+            keystore_release(s);
+            return false;
+        }
+        struct stat st;
+        if (!fstat(f->fd, &st))
+        {
+            uint64_t sig[] = {st.st_ino, st.st_size, st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+            for (uint32_t j = 0; j < sizeof(sig)/sizeof(sig[0]); j++)
+                s->version = (s->version ^ sig[j])*0x100000001b3ULL;
+        }
+        // Empty shards have nothing to look up.
+        if (f->header.nblocks)
+            s->nfiles++;
+        else
+        {
+            close(f->fd);
+            free(f->index);
+            free(f->buckets);
+            bzero(f, sizeof(keystore_file_t));
+        }
+    }
+    free_shards(&shards);
+    if (!s->nfiles)
+    {
+        printf("Keys file %s is empty\n", filename);
+        keystore_release(s);
+        return false;
+    }
+    qsort(s->files, s->nfiles, sizeof(keystore_file_t), compare_keystore_files);
+
+    rcu_write_lock(&verified);
+    keystore_release(rcu_publish(&verified, s));
+    rcu_write_unlock(&verified);
+    return true;
+}
+
+bool keystore_exist()
+{
+    return rcu_peek(&verified) != NULL;
+}
+
+// Version of the keystore being served, false without one.
+bool keystore_version(uint64_t* version)
+{
+    uint32_t slot;
+    const keystore_t* s = rcu_read_lock(&verified, &slot);
+    if (s != NULL)
+        *version = s->version;
+    rcu_read_unlock(&verified, slot);
+    return s != NULL;
+}
+
+// False only when the key is known not to be in the keys file. Without a
+// keystore, or when a block cannot be read, the filter answer stands.
+bool keystore_verify(char* pass, bool hashed)
+{
+    uint32_t slot;
+    const keystore_t* s = rcu_read_lock(&verified, &slot);
+    ribbon128_key_t key;
+    bool res = s == NULL || !((hashed && hash2key(pass, &key)) || password2key(pass, &key))
+                || keystore_find(s, &key) != 0;
+    rcu_read_unlock(&verified, slot);
+    return res;
+}
+
+// Clears the bits of the keys that are not in the keys file. Returns false,
+// leaving the bitmap alone, when there is no keystore.
+bool keystore_verify_bitmap(const ribbon128_key_t* keys, uint64_t n, uint8_t* bitmap)
+{
+    uint32_t slot;
+    const keystore_t* s = rcu_read_lock(&verified, &slot);
+    for (uint64_t i = 0; s != NULL && i < n; i++)
+    {
+        if ((bitmap[i/8] >> (i%8) & 1) && !keystore_find(s, &keys[i]))
+            bitmap[i/8] &= ~(1 << (i%8));
+    }
+    rcu_read_unlock(&verified, slot);
+    return s != NULL;
+}
+
+// Appends the suffix of every key with a prefix in [first, last] as a
+// "SUFFIX:COUNT" line, the suffix being the hash after its first
+// range_digits hex digits. Returns false if a block cannot be read.
+static bool keystore_range_file(const keystore_file_t* f, uint64_t first, uint64_t last, uint8_t range_digits,
+                                char** out, uint64_t* size, uint64_t* capacity, uint8_t* raw, ribbon128_key_t* keys)
+{
+    const uint32_t line = 2*sizeof(ribbon128_key_t) - range_digits + 4;
+    int64_t block = keystore_block(f, first);
+    if (block < 0)
+        block = 0;
+    while (block > 0 && f->index[block].first == first)
+        block--;
+    for (; block < f->header.nblocks && f->index[block].first <= last; block++)
+    {
+        uint32_t n = keys2_block_keys(&f->header, block);
+        if (!keystore_read_block(f, block, raw, keys))
+            return false;
+        if (*size + (uint64_t)n*line > *capacity)
+        {
+            char* grown = realloc(*out, *capacity + (uint64_t)n*line);
+            if (grown == NULL)
+                return false;
+            *out = grown;
+            *capacity += (uint64_t)n*line;
+        }
+        for (uint32_t i = 0; i < n; i++)
+        {
+            uint64_t prefix = key_prefix(&keys[i]);
+            if (prefix < first || prefix > last)
+                continue;
+            // The first 16 bytes in one go, the last 4 one digit at a time.
+            static const char digits[] = "0123456789ABCDEF";
+            const uint8_t* bytes = (const uint8_t*)&keys[i];
+            char hex[2*sizeof(ribbon128_key_t)] __attribute__((aligned(32)));
+            __m256i ascii;
+            hex2ascii(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*) bytes)), &ascii);
+            _mm256_store_si256((__m256i*) hex, ascii);
+            for (uint32_t b = sizeof(__m128i); b < sizeof(ribbon128_key_t); b++)
+            {
+                hex[2*b] = digits[bytes[b] >> 4];
+                hex[2*b+1] = digits[bytes[b] & 15];
+            }
+            memcpy(*out + *size, hex + range_digits, 2*sizeof(ribbon128_key_t) - range_digits);
+            memcpy(*out + *size + line - 4, ":1\r\n", 4);
+            *size += line;
+        }
+    }
+    return true;
+}
+
+// Range lines all have the same length and end in ":1\r\n".
+static int compare_range_lines(const void* a, const void* b)
+{
+    const char* x = a;
+    const char* y = b;
+    while (*x == *y && *x != ':')
+        x++, y++;
+    return (*x > *y) - (*x < *y);
+}
+
+/*
+ * The keys whose hash starts with the range_digits hex digits of prefix, in
+ * the text format of the Pwned Passwords range API: one "SUFFIX:COUNT" line
+ * per key, in hash order. Keys files keep no counts, so every count is 1.
+ * Returns a malloc'd buffer, or NULL without a keystore or on a read error.
+ */
+char* keystore_range(uint64_t prefix, uint8_t range_digits, uint64_t* size)
+{
+    uint32_t slot;
+    const keystore_t* s = rcu_read_lock(&verified, &slot);
+    const uint64_t first = prefix << (64 - 4*range_digits);
+    const uint64_t last = first | (UINT64_MAX >> 4*range_digits);
+    uint8_t* raw = malloc(keys2_block_bound(KEYS2_BLOCK) + sizeof(__m256i));
+    ribbon128_key_t* keys = malloc(KEYS2_BLOCK*sizeof(ribbon128_key_t));
+    char* out = NULL;
+    uint64_t capacity = 0;
+    uint32_t nfiles = 0;
+    bool res = s != NULL && raw != NULL && keys != NULL;
+    *size = 0;
+    for (uint32_t i = 0; res && i < s->nfiles && keystore_first(&s->files[i]) <= last; i++)
+    {
+        if (s->files[i].last < first)
+            continue;
+        res = keystore_range_file(&s->files[i], first, last, range_digits, &out, size, &capacity, raw, keys);
+        nfiles++;
+    }
+    rcu_read_unlock(&verified, slot);
+    // Each file's lines are in hash order, those of overlapping files (the
+    // deltas of an update) are merged.
+    const uint32_t line = 2*sizeof(ribbon128_key_t) - range_digits + 4;
+    if (res && nfiles > 1)
+        qsort(out, *size/line, line, compare_range_lines);
+    free(raw);
+    free(keys);
+    if (!res)
+    {
+        free(out);
+        return NULL;
+    }
+    // Like the public API, no line break after the last line.
+    *size = *size ? *size - 2 : 0;
+    return out != NULL ? out : malloc(1);
+}
+
+#endif
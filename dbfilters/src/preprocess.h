@@ -12,26 +12,27 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
 
 #include "hex_avx2.h"
+#include "keys2.h"
 
 #if !defined(__AVX2__)
 #error AVX2 required: Compile with "-mavx2" option.
 #endif
 
 #define MAGIC_KEYS "$ribbon128-keys-1.0\n"
+#define MAGIC_SHARDS "$ribbon128-shards-1.0\n"
 #define AIO_R_BUF (1024*1024)
 #define AIO_MAXKEYS (64*1024)
 #define AIO_W_BUF (AIO_MAXKEYS*sizeof(ribbon128_key_t))
 #define EXTRA_BUF (32) 
+#define SHARDS_MAX (1024)
+#define SHARDS_BUF (256*1024)
+#define KEYS_RUN (4*1024*1024)
+#define RUN_BUF (4096)
 
 
-typedef struct __attribute__((__packed__))
-{
-    __uint128_t ribbon;
-    uint32_t index;
-} ribbon128_key_t;
-
 typedef struct
 {
     struct aiocb aiocb;
@@ -52,12 +53,96 @@ typedef struct
     
 } aio_w_t;
 
+typedef struct
+{
+    FILE* fp;
+    keys2_header_t header;
+    keys2_index_t* index;
+    uint32_t maxblocks;
+    uint32_t n;
+    uint64_t offset;
+    uint8_t* out;
+    ribbon128_key_t block[KEYS2_BLOCK];
+} keys2_w_t;
+
+// A sorted run of keys spilled to disk, read back by the merge.
+typedef struct
+{
+    FILE* fp;
+    uint32_t count;
+    uint32_t kindex;
+    ribbon128_key_t keys[RUN_BUF];
+} run_t;
+
+// Keys of a compact preprocess. Up to KEYS_RUN of them are sorted in memory;
+// beyond that they are spilled to sorted runs, merged through a heap of runs.
+typedef struct
+{
+    ribbon128_key_t* keys;
+    uint64_t n;
+    uint64_t size;
+    uint64_t next;
+    uint32_t nruns;
+    uint32_t nheap;
+    run_t* runs;
+    uint32_t* heap;
+} keys_mem_t;
+
+// Keys split by the top bits of their prefix into n files plus a manifest.
+typedef struct
+{
+    uint32_t n;
+    uint8_t bits;
+    FILE** fp;
+    uint64_t* nkeys;
+} shards_w_t;
+
+// Sorted (v2) keys file read back by preprocess when merging an update.
+typedef struct
+{
+    int fd;
+    keys2_header_t header;
+    keys2_index_t* index;
+    uint8_t* raw;
+    uint32_t block;
+    uint32_t count;
+    uint32_t kindex;
+    ribbon128_key_t keys[KEYS2_BLOCK];
+} keys2_r_t;
+
+// A key of the password file with its count, in the heap of the hot keys.
+typedef struct
+{
+    uint64_t count;
+    ribbon128_key_t key;
+} hot_key_t;
+
+// Entries of an existing shards manifest, kept by the update.
+typedef struct
+{
+    uint32_t n;
+    uint64_t nkeys[SHARDS_MAX];
+    char names[SHARDS_MAX][NAME_MAX+1];
+    keys2_r_t* readers[SHARDS_MAX];
+} manifest_t;
+
 static aio_r_t aio_r = {0};
 static aio_w_t aio_w = {0};
+static keys2_w_t keys2_w = {0};
+static keys_mem_t keys_mem = {0};
+static shards_w_t shards_w = {0};
+static manifest_t manifest = {0};
+// Only keys whose 64-bit prefix lies in [first, last] are kept, so that each
+// node of a sharded deployment holds its own part of the hash space.
+static struct
+{
+    uint64_t first;
+    uint64_t last;
+} key_range = {0, UINT64_MAX};
 
 void close_passwd_file()
 {
-	if(aio_r.aiocb.aio_fildes <= 0)
+	if(aio_r.aiocb.aio_fildes > 0)
 		close(aio_r.aiocb.aio_fildes);
 	if(aio_r.bufs[0])
         free(aio_r.bufs[0] - EXTRA_BUF);
@@ -241,7 +326,7 @@ bool open_keys_file(char* filename)
 static inline bool write_keys_file(__m256i ribbon, __m256i index)
 {
 	uint8_t* ptr = (uint8_t*)&aio_w.bufs[aio_w.bindex][aio_w.kindex++];
-	*(__uint128_t*)ptr = (__uint128_t) _mm256_extracti128_si256(ribbon, 1);
+	_mm_storeu_si128((__m128i*)ptr, _mm256_extracti128_si256(ribbon, 1));
 	ptr += sizeof(__uint128_t);
     *(uint32_t*)ptr = (uint32_t) _mm256_extract_epi64(index, 3);
 	if(aio_w.kindex >= AIO_MAXKEYS)
@@ -285,7 +370,7 @@ bool flush_keys_file()
 
 void close_keys_file()
 {
-	if(aio_w.aiocb.aio_fildes <= 0)
+	if(aio_w.aiocb.aio_fildes > 0)
 		close(aio_w.aiocb.aio_fildes);
 	if(aio_w.bufs[0])
 		free(aio_w.bufs[0]);
@@ -294,50 +379,926 @@ void close_keys_file()
 	bzero(&aio_w, sizeof(aio_w_t));
 }
 
-bool preprocess_password_file(char* sourcefile, char* destfile, uint32_t maxlines, bool verify)
+static uint64_t encode_keys2_block(const ribbon128_key_t* keys, uint32_t n, uint8_t* out)
+{
+    const uint64_t first = key_prefix(&keys[0]);
+    const uint64_t range = key_prefix(&keys[n-1]) - first;
+    uint8_t l = range/n ? 63 - __builtin_clzll(range/n) : 0;
+    l = l > 56 ? 56 : l;
+    const uint64_t lowmask = ((uint64_t)1 << l) - 1;
+    const uint64_t lowbytes = ((uint64_t)n*l + 7)/8 + sizeof(uint64_t);
+    const uint32_t highwords = ((range >> l) + n + 63)/64;
+
+    keys2_block_t* block = (keys2_block_t*) out;
+    uint8_t* lows = out + sizeof(keys2_block_t);
+    uint64_t* highs = (uint64_t*)(lows + lowbytes);
+    uint8_t* tails = (uint8_t*)(highs + highwords);
+    bzero(out, sizeof(keys2_block_t) + lowbytes + highwords*sizeof(uint64_t));
+    block->lowbits = l;
+    block->highwords = highwords;
+
+    for (uint32_t i = 0; i < n; i++)
+    {
+        uint64_t delta = key_prefix(&keys[i]) - first;
+        uint64_t pos = (uint64_t)i*l;
+        *(uint64_t*)(lows + pos/8) |= (delta & lowmask) << (pos%8);
+        uint64_t high = (delta >> l) + i;
+        highs[high/64] |= (uint64_t)1 << (high%64);
+        memcpy(tails + (uint64_t)i*KEYS2_TAIL, (uint8_t*)&keys[i] + sizeof(uint64_t), KEYS2_TAIL);
+    }
+    return (tails + (uint64_t)n*KEYS2_TAIL) - out;
+}
+
+void close_keys2_file()
+{
+    if (keys2_w.fp)
+        fclose(keys2_w.fp);
+    free(keys2_w.index);
+    free(keys2_w.out);
+    bzero(&keys2_w, sizeof(keys2_w_t));
+}
+
+bool open_keys2_file(char* filename)
+{
+    bzero(&keys2_w, sizeof(keys2_w_t));
+    keys2_w.fp = fopen(filename, "wb");
+    if (keys2_w.fp == NULL)
+    {
+        printf("Cannot open the output file %s", filename);
+        perror("");
+        return false;
+    }
+    keys2_w.header.blockkeys = KEYS2_BLOCK;
+    keys2_w.maxblocks = 1024;
+    keys2_w.index = malloc(keys2_w.maxblocks*sizeof(keys2_index_t));
+    keys2_w.out = malloc(keys2_block_bound(KEYS2_BLOCK));
+    keys2_w.offset = sizeof(MAGIC_KEYS2) + sizeof(keys2_header_t);
+    if (keys2_w.index == NULL || keys2_w.out == NULL
+        || !fwrite(MAGIC_KEYS2, sizeof(MAGIC_KEYS2), 1, keys2_w.fp)
+        || !fwrite(&keys2_w.header, sizeof(keys2_header_t), 1, keys2_w.fp))
+    {
+        printf("Cannot write to the output file %s - ", filename);
+        perror("");
+        close_keys2_file();
+        return false;
+    }
+    return true;
+}
+
+static bool write_keys2_block()
+{
+    if (!keys2_w.n)
+        return true;
+    if (keys2_w.header.nblocks == keys2_w.maxblocks)
+    {
+        keys2_w.maxblocks *= 2;
+        keys2_index_t* index = realloc(keys2_w.index, keys2_w.maxblocks*sizeof(keys2_index_t));
+        if (index == NULL)
+            return false;
+        keys2_w.index = index;
+    }
+    uint64_t size = encode_keys2_block(keys2_w.block, keys2_w.n, keys2_w.out);
+    keys2_w.index[keys2_w.header.nblocks].first = key_prefix(&keys2_w.block[0]);
+    keys2_w.index[keys2_w.header.nblocks].offset = keys2_w.offset;
+    if (!fwrite(keys2_w.out, size, 1, keys2_w.fp))
+    {
+        perror("Error when writing into file");
+        return false;
+    }
+    keys2_w.offset += size;
+    keys2_w.header.nblocks++;
+    keys2_w.header.nkeys += keys2_w.n;
+    keys2_w.n = 0;
+    return true;
+}
+
+// Keys must come in non-decreasing order; repeated keys are written once.
+static inline bool write_keys2_file(const ribbon128_key_t* key)
+{
+    // The block is kept after it is written, so its last key is still there.
+    const ribbon128_key_t* last = keys2_w.n ? &keys2_w.block[keys2_w.n-1]
+                                    : keys2_w.header.nkeys ? &keys2_w.block[KEYS2_BLOCK-1] : NULL;
+    if (last != NULL)
+    {
+        int cmp = memcmp(last, key, sizeof(ribbon128_key_t));
+        if (!cmp)
+            return true;
+        if (cmp > 0)
+        {
+            printf("Keys are not sorted.\n");
+            return false;
+        }
+    }
+    keys2_w.block[keys2_w.n++] = *key;
+    if (keys2_w.n == KEYS2_BLOCK)
+        return write_keys2_block();
+    return true;
+}
+
+bool flush_keys2_file()
+{
+    if (!write_keys2_block())
+        return false;
+    keys2_w.header.index_offset = keys2_w.offset;
+    if ((keys2_w.header.nblocks
+            && !fwrite(keys2_w.index, keys2_w.header.nblocks*sizeof(keys2_index_t), 1, keys2_w.fp))
+        || fseek(keys2_w.fp, sizeof(MAGIC_KEYS2), SEEK_SET)
+        || !fwrite(&keys2_w.header, sizeof(keys2_header_t), 1, keys2_w.fp))
+    {
+        perror("Error when writing into file");
+        return false;
+    }
+    return true;
+}
+
+static bool spill_keys_mem(char* destfile);
+
+static inline bool append_keys_mem(__m256i ribbon, __m256i index, char* destfile)
+{
+    if (keys_mem.n == KEYS_RUN && !spill_keys_mem(destfile))
+        return false;
+    if (keys_mem.n == keys_mem.size)
+    {
+        keys_mem.size = keys_mem.size ? keys_mem.size*2 : AIO_MAXKEYS;
+        keys_mem.size = keys_mem.size < KEYS_RUN ? keys_mem.size : KEYS_RUN;
+        ribbon128_key_t* keys = realloc(keys_mem.keys, keys_mem.size*sizeof(ribbon128_key_t));
+        if (keys == NULL)
+        {
+            perror("Cannot allocate keys");
+            return false;
+        }
+        keys_mem.keys = keys;
+    }
+    ribbon128_key_t* key = &keys_mem.keys[keys_mem.n++];
+    key->ribbon = (__uint128_t) _mm256_extracti128_si256(ribbon, 1);
+    key->index = (uint32_t) _mm256_extract_epi64(index, 3);
+    return true;
+}
+
+static inline void run_filename(char* buf, char* destfile, uint32_t run)
+{
+    snprintf(buf, PATH_MAX, "%s.run%03u", destfile, run);
+}
+
+// Closes and removes the runs. False if one of them could not be read.
+static bool close_runs(char* destfile)
+{
+    char filename[PATH_MAX];
+    bool res = true;
+    for (uint32_t i = 0; i < keys_mem.nruns; i++)
+    {
+        if (keys_mem.runs != NULL && keys_mem.runs[i].fp != NULL)
+        {
+            res = !ferror(keys_mem.runs[i].fp) && res;
+            fclose(keys_mem.runs[i].fp);
+        }
+        run_filename(filename, destfile, i);
+        remove(filename);
+    }
+    free(keys_mem.runs);
+    free(keys_mem.heap);
+    keys_mem.runs = NULL;
+    keys_mem.heap = NULL;
+    keys_mem.nruns = keys_mem.nheap = 0;
+    if (!res)
+        printf("Cannot read back the sorted runs.\n");
+    return res;
+}
+
+void free_keys_mem(char* destfile)
+{
+    close_runs(destfile);
+    free(keys_mem.keys);
+    bzero(&keys_mem, sizeof(keys_mem_t));
+}
+
+static int compare_keys(const void* a, const void* b)
+{
+    return memcmp(a, b, sizeof(ribbon128_key_t));
+}
+
+// Counting sort on the top 16 bits of the prefix, then each bucket on its own.
+// Keys that come sorted, as in the HIBP dumps, are left as they are.
+bool sort_keys_mem()
+{
+    const uint32_t nbuckets = 1 << 16;
+    uint64_t n = 1;
+    while (n < keys_mem.n && compare_keys(&keys_mem.keys[n-1], &keys_mem.keys[n]) <= 0)
+        n++;
+    if (n >= keys_mem.n)
+        return true;
+    uint64_t* start = calloc(nbuckets + 1, sizeof(uint64_t));
+    ribbon128_key_t* sorted = malloc(keys_mem.n*sizeof(ribbon128_key_t) + 1);
+    if (start == NULL || sorted == NULL)
+    {
+        perror("Cannot allocate keys");
+        free(start);
+        free(sorted);
+        return false;
+    }
+    for (uint64_t i = 0; i < keys_mem.n; i++)
+        start[(key_prefix(&keys_mem.keys[i]) >> 48) + 1]++;
+    for (uint32_t b = 0; b < nbuckets; b++)
+        start[b+1] += start[b];
+    for (uint64_t i = 0; i < keys_mem.n; i++)
+        sorted[start[key_prefix(&keys_mem.keys[i]) >> 48]++] = keys_mem.keys[i];
+    for (uint32_t b = 0; b < nbuckets; b++)
+    {
+        uint64_t begin = b ? start[b-1] : 0;
+        qsort(&sorted[begin], start[b] - begin, sizeof(ribbon128_key_t), compare_keys);
+    }
+    free(start);
+    free(keys_mem.keys);
+    keys_mem.keys = sorted;
+    keys_mem.size = keys_mem.n;
+    return true;
+}
+
+// Sorts the keys in memory and writes them to a new run, emptying the buffer.
+static bool spill_keys_mem(char* destfile)
+{
+    char filename[PATH_MAX];
+    if (keys_mem.nruns == SHARDS_MAX)
+    {
+        printf("Too many keys to sort, at most %d runs of %d keys.\n", SHARDS_MAX, KEYS_RUN);
+        return false;
+    }
+    if (!sort_keys_mem())
+        return false;
+    run_filename(filename, destfile, keys_mem.nruns);
+    FILE* fp = fopen(filename, "wb");
+    bool res = fp != NULL && (!keys_mem.n || fwrite(keys_mem.keys, keys_mem.n*sizeof(ribbon128_key_t), 1, fp));
+    if (fp != NULL)
+        res = !fclose(fp) && res;
+    if (!res)
+    {
+        printf("Cannot write the sorted run %s", filename);
+        perror("");
+        remove(filename);
+        return false;
+    }
+    keys_mem.nruns++;
+    keys_mem.n = 0;
+    return true;
+}
+
+static inline bool read_run(run_t* run)
+{
+    run->count = fread(run->keys, sizeof(ribbon128_key_t), RUN_BUF, run->fp);
+    run->kindex = 0;
+    return run->count > 0;
+}
+
+static inline bool run_before(uint32_t a, uint32_t b)
+{
+    const run_t* x = &keys_mem.runs[a];
+    const run_t* y = &keys_mem.runs[b];
+    return compare_keys(&x->keys[x->kindex], &y->keys[y->kindex]) < 0;
+}
+
+static inline void sift_runs(uint32_t i)
+{
+    uint32_t run = keys_mem.heap[i];
+    for (uint32_t child; (child = 2*i + 1) < keys_mem.nheap; i = child)
+    {
+        if (child + 1 < keys_mem.nheap && run_before(keys_mem.heap[child+1], keys_mem.heap[child]))
+            child++;
+        if (!run_before(keys_mem.heap[child], run))
+            break;
+        keys_mem.heap[i] = keys_mem.heap[child];
+    }
+    keys_mem.heap[i] = run;
+}
+
+// Opens every run and heaps them by their first key.
+static bool open_runs(char* destfile)
+{
+    char filename[PATH_MAX];
+    keys_mem.runs = calloc(keys_mem.nruns, sizeof(run_t));
+    keys_mem.heap = malloc(keys_mem.nruns*sizeof(uint32_t));
+    if (keys_mem.runs == NULL || keys_mem.heap == NULL)
+    {
+        perror("Cannot allocate the runs");
+        return false;
+    }
+    for (uint32_t i = 0; i < keys_mem.nruns; i++)
+    {
+        run_filename(filename, destfile, i);
+        keys_mem.runs[i].fp = fopen(filename, "rb");
+        if (keys_mem.runs[i].fp == NULL)
+        {
+            printf("Cannot open the sorted run %s", filename);
+            perror("");
+            return false;
+        }
+        if (read_run(&keys_mem.runs[i]))
+            keys_mem.heap[keys_mem.nheap++] = i;
+    }
+    for (uint32_t i = keys_mem.nheap/2; i-- > 0; )
+        sift_runs(i);
+    return true;
+}
+
+// The next key in sorted order, from memory or from the merge of the runs.
+static inline bool next_sorted_key(ribbon128_key_t* key)
+{
+    if (!keys_mem.nruns)
+    {
+        if (keys_mem.next == keys_mem.n)
+            return false;
+        *key = keys_mem.keys[keys_mem.next++];
+        return true;
+    }
+    if (!keys_mem.nheap)
+        return false;
+    run_t* run = &keys_mem.runs[keys_mem.heap[0]];
+    *key = run->keys[run->kindex++];
+    if (run->kindex == run->count && !read_run(run))
+        keys_mem.heap[0] = keys_mem.heap[--keys_mem.nheap];
+    if (keys_mem.nheap)
+        sift_runs(0);
+    return true;
+}
+
+static inline uint32_t key_shard(const ribbon128_key_t* key)
+{
+    return shards_w.bits ? key_prefix(key) >> (64 - shards_w.bits) : 0;
+}
+
+static inline void shard_filename(char* buf, char* destfile, uint32_t shard)
+{
+    snprintf(buf, PATH_MAX, "%s.%03u", destfile, shard);
+}
+
+void close_shards_files()
+{
+    for (uint32_t i = 0; shards_w.fp != NULL && i < shards_w.n; i++)
+    {
+        if (shards_w.fp[i])
+            fclose(shards_w.fp[i]);
+    }
+    free(shards_w.fp);
+    free(shards_w.nkeys);
+    bzero(&shards_w, sizeof(shards_w_t));
+}
+
+// nshards must be a power of two; 0 and 1 mean a single keys file.
+bool init_shards(uint32_t nshards)
+{
+    bzero(&shards_w, sizeof(shards_w_t));
+    if (nshards <= 1)
+        return true;
+    if (nshards > SHARDS_MAX || (nshards & (nshards - 1)))
+    {
+        printf("Number of shards must be a power of two up to %d.\n", SHARDS_MAX);
+        return false;
+    }
+    shards_w.n = nshards;
+    shards_w.bits = __builtin_ctz(nshards);
+    shards_w.fp = calloc(nshards, sizeof(FILE*));
+    shards_w.nkeys = calloc(nshards, sizeof(uint64_t));
+    if (shards_w.fp == NULL || shards_w.nkeys == NULL)
+    {
+        perror("Cannot allocate shards");
+        close_shards_files();
+        return false;
+    }
+    return true;
+}
+
+bool open_shards_files(char* destfile)
+{
+    char filename[PATH_MAX];
+    for (uint32_t i = 0; i < shards_w.n; i++)
+    {
+        shard_filename(filename, destfile, i);
+        shards_w.fp[i] = fopen(filename, "wb");
+        if (shards_w.fp[i] == NULL
+            || setvbuf(shards_w.fp[i], NULL, _IOFBF, SHARDS_BUF)
+            || !fwrite(MAGIC_KEYS, sizeof(MAGIC_KEYS), 1, shards_w.fp[i]))
+        {
+            printf("Cannot open the output file %s", filename);
+            perror("");
+            close_shards_files();
+            return false;
+        }
+    }
+    return true;
+}
+
+static inline bool write_shards_files(__m256i ribbon, __m256i index)
+{
+    ribbon128_key_t key;
+    key.ribbon = (__uint128_t) _mm256_extracti128_si256(ribbon, 1);
+    key.index = (uint32_t) _mm256_extract_epi64(index, 3);
+    uint32_t shard = key_shard(&key);
+    shards_w.nkeys[shard]++;
+    return fwrite(&key, sizeof(ribbon128_key_t), 1, shards_w.fp[shard]);
+}
+
+// The manifest takes the place of the keys file, naming the shards relative to it.
+bool write_shards_manifest(char* destfile)
+{
+    const char* slash = strrchr(destfile, '/');
+    const char* name = slash ? slash + 1 : destfile;
+    bool res = true;
+    for (uint32_t i = 0; shards_w.fp != NULL && i < shards_w.n; i++)
+    {
+        if (shards_w.fp[i] && fclose(shards_w.fp[i]))
+            res = false;
+        shards_w.fp[i] = NULL;
+    }
+    FILE* fp = fopen(destfile, "w");
+    if (!res || fp == NULL || fputs(MAGIC_SHARDS, fp) == EOF)
+    {
+        perror("Error when writing the shards");
+        if (fp)
+            fclose(fp);
+        return false;
+    }
+    for (uint32_t i = 0; i < shards_w.n; i++)
+        fprintf(fp, "%lu %s.%03u\n", shards_w.nkeys[i], name, i);
+    return !fclose(fp);
+}
+
+// Writes the keys of the shard, key being the next one not written yet.
+static bool write_keys_shard(char* filename, uint32_t shard, ribbon128_key_t* key, bool* more, uint64_t* nkeys)
+{
+    if (!open_keys2_file(filename))
+        return false;
+    for (; *more && key_shard(key) == shard; *more = next_sorted_key(key))
+    {
+        if (!write_keys2_file(key))
+        {
+            close_keys2_file();
+            return false;
+        }
+    }
+    bool res = flush_keys2_file();
+    *nkeys = keys2_w.header.nkeys;
+    close_keys2_file();
+    return res;
+}
+
+bool write_keys_mem(char* destfile)
+{
+    char filename[PATH_MAX];
+    ribbon128_key_t key;
+    uint64_t nkeys;
+    if (keys_mem.nruns)
+    {
+        if (!spill_keys_mem(destfile) || !open_runs(destfile))
+            return false;
+        free(keys_mem.keys);
+        keys_mem.keys = NULL;
+        keys_mem.size = 0;
+    }
+    else if (!sort_keys_mem())
+        return false;
+    // Sorted keys leave every shard as one contiguous range.
+    bool more = next_sorted_key(&key);
+    bool res = true;
+    for (uint32_t i = 0; res && i < (shards_w.n ? shards_w.n : 1); i++)
+    {
+        shard_filename(filename, destfile, i);
+        res = write_keys_shard(shards_w.n ? filename : destfile, i, &key, &more,
+                               shards_w.n ? &shards_w.nkeys[i] : &nkeys);
+    }
+    res = close_runs(destfile) && res;
+    return res && (!shards_w.n || write_shards_manifest(destfile));
+}
+
+static inline bool in_key_range(__m256i ribbon)
+{
+    ribbon128_key_t key;
+    _mm_storeu_si128((__m128i*)&key, _mm256_extracti128_si256(ribbon, 1));
+    uint64_t prefix = key_prefix(&key);
+    return prefix >= key_range.first && prefix <= key_range.last;
+}
+
+// Parses the hash at the current line, skipping badly formatted lines and
+// those outside key_range.
+static inline bool read_passwd_key(__m256i* ribbon, __m256i* index, bool verify, uint32_t* ignored)
+{
+	uint8_t* ptr;
+	while((ptr = read_passwd_data(sizeof(__m256i))) != NULL)
+	{
+		if(ascii2hex(_mm256_loadu_si256((__m256i *) ptr), ribbon, verify))
+		{
+			ptr = read_passwd_data(sizeof(uint64_t));
+			if(!ptr)
+				return false;
+			if(ascii2hex(_mm256_set1_epi64x(*(uint64_t*) ptr), index, verify))
+			{
+				if(in_key_range(*ribbon))
+					return true;
+				if(!skip2line())
+					return false;
+				continue;
+			}
+		}
+		if(!skip2line())
+			return false;
+		(*ignored)++;
+	}
+	return false;
+}
+
+bool preprocess_password_file(char* sourcefile, char* destfile, uint32_t maxlines, bool verify, bool compact, uint32_t nshards)
 {	
-	if(!open_passwd_file(sourcefile) || !open_keys_file(destfile))
+	if(!init_shards(nshards))
+		return false;
+	if(!open_passwd_file(sourcefile) || (!compact && shards_w.n && !open_shards_files(destfile))
+		|| (!compact && !shards_w.n && !open_keys_file(destfile)))
 	{
 		close_passwd_file();
 		close_keys_file();
+		close_shards_files();
 		return false;
 	}
     uint32_t ignored = 0;
+    bool res = true;
     __m256i ribbon, index;
-	while(maxlines)
+	while(maxlines && read_passwd_key(&ribbon, &index, verify, &ignored))
 	{
-		uint8_t* ptr = read_passwd_data(sizeof(__m256i));
-		if(!ptr)
-			break;
-		if(!ascii2hex(_mm256_loadu_si256((__m256i *) ptr), &ribbon, verify))
+		maxlines--;
+		if (compact)
 		{
-			if(!skip2line())
+			if (!(res = append_keys_mem(ribbon, index, destfile)))
 				break;
-            ignored++;
-			continue;
 		}
-		ptr = read_passwd_data(sizeof(uint64_t));
-		if(!ptr)
-			break;
-		if(!ascii2hex(_mm256_set1_epi64x(*(uint64_t*) ptr), &index, verify))
+		else if (shards_w.n)
 		{
-			if(!skip2line())
+			if (!(res = write_shards_files(ribbon, index)))
 				break;
-            ignored++;
-			continue;
 		}
-		maxlines--;
-		write_keys_file(ribbon, index);
+		else
+			write_keys_file(ribbon, index);
 		if(!skip2line())
 			break;
 	}
-	flush_keys_file();
 	close_passwd_file();
-	close_keys_file();
+	if (compact)
+	{
+		res = res && write_keys_mem(destfile);
+		free_keys_mem(destfile);
+	}
+	else if (shards_w.n)
+		res = res && write_shards_manifest(destfile);
+	else
+	{
+		flush_keys_file();
+		close_keys_file();
+	}
+	close_shards_files();
     if (ignored)
         printf("Ignored %d lines due to bad format.\n", ignored);
+    return res;
+}
+
+// The count after the hash of the current line, as in "HASH:COUNT"; 0 if
+// there is none. Stops before the end of the line.
+static inline uint64_t read_passwd_count()
+{
+	uint8_t* ptr = read_passwd_data(1);
+	uint64_t count = 0;
+	if(ptr != NULL && *ptr == ':')
+	{
+		while((ptr = read_passwd_data(1)) != NULL && *ptr >= '0' && *ptr <= '9')
+			count = count*10 + (*ptr - '0');
+	}
+	if(ptr != NULL)
+		unread_passwd_data(1);
+	return count;
+}
+
+static inline void sift_hot_keys(hot_key_t* heap, uint32_t n, uint32_t i)
+{
+	hot_key_t key = heap[i];
+	for (uint32_t child; (child = 2*i + 1) < n; i = child)
+	{
+		if (child + 1 < n && heap[child+1].count < heap[child].count)
+			child++;
+		if (heap[child].count >= key.count)
+			break;
+		heap[i] = heap[child];
+	}
+	heap[i] = key;
+}
+
+static int compare_hot_keys(const void* a, const void* b)
+{
+	return compare_keys(&((const hot_key_t*)a)->key, &((const hot_key_t*)b)->key);
+}
+
+/*
+ * Writes a keys file with the nkeys keys of the password file that have the
+ * highest counts, through a min-heap of the best ones seen so far, so the
+ * file is read once whatever its order. The keys are written sorted.
+ */
+bool preprocess_hot_keys(char* sourcefile, char* destfile, uint32_t nkeys, bool verify)
+{
+	hot_key_t* heap = malloc(((uint64_t)nkeys + 1)*sizeof(hot_key_t));
+	if (heap == NULL || !nkeys || !open_passwd_file(sourcefile))
+	{
+		free(heap);
+		return false;
+	}
+	uint32_t n = 0, ignored = 0;
+	__m256i ribbon, index;
+	hot_key_t hot;
+	while(read_passwd_key(&ribbon, &index, verify, &ignored))
+	{
+		hot.key.ribbon = (__uint128_t) _mm256_extracti128_si256(ribbon, 1);
+		hot.key.index = (uint32_t) _mm256_extract_epi64(index, 3);
+		hot.count = read_passwd_count();
+		if (n < nkeys)
+		{
+			// Sifts the new key up from the bottom.
+			uint32_t i = n++;
+			for (; i && heap[(i-1)/2].count > hot.count; i = (i-1)/2)
+				heap[i] = heap[(i-1)/2];
+			heap[i] = hot;
+		}
+		else if (hot.count > heap[0].count)
+		{
+			heap[0] = hot;
+			sift_hot_keys(heap, n, 0);
+		}
+		if(!skip2line())
+			break;
+	}
+	close_passwd_file();
+	if (ignored)
+		printf("Ignored %d lines due to bad format.\n", ignored);
+
+	qsort(heap, n, sizeof(hot_key_t), compare_hot_keys);
+	FILE* fp = fopen(destfile, "wb");
+	bool res = fp != NULL && fwrite(MAGIC_KEYS, sizeof(MAGIC_KEYS), 1, fp);
+	for (uint32_t i = 0; res && i < n; i++)
+		res = fwrite(&heap[i].key, sizeof(ribbon128_key_t), 1, fp);
+	if (fp != NULL)
+		res = !fclose(fp) && res;
+	if (!res)
+		perror("Error when writing into file");
+	free(heap);
+	return res;
+}
+
+void close_keys2_reader(keys2_r_t* r)
+{
+    if (r == NULL)
+        return;
+    if (r->fd > 0)
+        close(r->fd);
+    free(r->index);
+    free(r->raw);
+    free(r);
+}
+
+keys2_r_t* open_keys2_reader(char* filename)
+{
+    char magic[sizeof(MAGIC_KEYS2)];
+    uint64_t rawsize = 0;
+    keys2_r_t* r = calloc(1, sizeof(keys2_r_t));
+    if (r == NULL)
+        return NULL;
+    r->fd = open(filename, O_RDONLY);
+    if (r->fd < 0
+        || pread(r->fd, magic, sizeof(MAGIC_KEYS2), 0) != sizeof(MAGIC_KEYS2)
+        || strcmp(magic, MAGIC_KEYS2)
+        || pread(r->fd, &r->header, sizeof(keys2_header_t), sizeof(MAGIC_KEYS2)) != sizeof(keys2_header_t)
+        || !r->header.blockkeys || r->header.blockkeys > KEYS2_BLOCK
+        || (r->index = malloc(r->header.nblocks*sizeof(keys2_index_t) + 1)) == NULL
+        || pread(r->fd, r->index, r->header.nblocks*sizeof(keys2_index_t), r->header.index_offset)
+            != r->header.nblocks*sizeof(keys2_index_t))
+    {
+        printf("Cannot read %s, updates need the compact keys format.\n", filename);
+        close_keys2_reader(r);
+        return NULL;
+    }
+    for (uint32_t b = 0; b < r->header.nblocks; b++)
+    {
+        uint64_t size = keys2_block_size(&r->header, r->index, b);
+        rawsize = size > rawsize ? size : rawsize;
+    }
+    r->raw = malloc(rawsize + sizeof(__m256i));
+    if (r->raw == NULL)
+    {
+        close_keys2_reader(r);
+        return NULL;
+    }
+    return r;
+}
+
+// Moves the reader up to the first key not below key; blocks that end before
+// it are skipped using the index without being read.
+static bool seek_keys2_reader(keys2_r_t* r, const ribbon128_key_t* key)
+{
+    const uint64_t prefix = key_prefix(key);
+    while (true)
+    {
+        while (r->kindex < r->count)
+        {
+            int cmp = memcmp(&r->keys[r->kindex], key, sizeof(ribbon128_key_t));
+            if (cmp >= 0)
+                return !cmp;
+            r->kindex++;
+        }
+        while (r->block+1 < r->header.nblocks && r->index[r->block+1].first < prefix)
+            r->block++;
+        if (r->block >= r->header.nblocks)
+            return false;
+        uint64_t size = keys2_block_size(&r->header, r->index, r->block);
+        r->count = keys2_block_keys(&r->header, r->block);
+        r->kindex = 0;
+        if (pread(r->fd, r->raw, size, r->index[r->block].offset) != size
+            || !decode_keys2_block(r->raw, size, r->index[r->block].first, r->count, r->keys))
+        {
+            printf("Corrupted block %u in keys file.\n", r->block);
+            r->count = 0;
+            r->block = r->header.nblocks;
+            return false;
+        }
+        r->block++;
+    }
+}
+
+// Rewrites the manifest through a temporary file so readers never see it half written.
+bool write_manifest(char* destfile)
+{
+    char tmpfile[PATH_MAX];
+    snprintf(tmpfile, PATH_MAX, "%s.tmp", destfile);
+    FILE* fp = fopen(tmpfile, "w");
+    if (fp == NULL || fputs(MAGIC_SHARDS, fp) == EOF)
+    {
+        perror("Error when writing the shards");
+        if (fp)
+            fclose(fp);
+        return false;
+    }
+    for (uint32_t i = 0; i < manifest.n; i++)
+        fprintf(fp, "%lu %s\n", manifest.nkeys[i], manifest.names[i]);
+    if (fclose(fp) || rename(tmpfile, destfile))
+    {
+        perror("Error when writing the shards");
+        return false;
+    }
+    return true;
+}
+
+void close_manifest()
+{
+    for (uint32_t i = 0; i < manifest.n; i++)
+        close_keys2_reader(manifest.readers[i]);
+    bzero(&manifest, sizeof(manifest_t));
+}
+
+// Loads the files making up destfile. A single compact keys file is moved to
+// <destfile>.000 so that destfile can become the manifest.
+bool open_manifest(char* destfile)
+{
+    char path[PATH_MAX];
+    char line[PATH_MAX + 32];
+    const char* slash = strrchr(destfile, '/');
+    const char* name = slash ? slash + 1 : destfile;
+    int dirlen = slash ? slash - destfile + 1 : 0;
+
+    bzero(&manifest, sizeof(manifest_t));
+    FILE* fp = fopen(destfile, "r");
+    if (fp == NULL)
+    {
+        printf("Cannot open the keys file %s", destfile);
+        perror("");
+        return false;
+    }
+    if (fgets(line, sizeof(line), fp) != NULL && !strcmp(line, MAGIC_SHARDS))
+    {
+        while (fgets(line, sizeof(line), fp) != NULL)
+        {
+            if (manifest.n == SHARDS_MAX
+                || sscanf(line, "%lu %255[^\n]", &manifest.nkeys[manifest.n], manifest.names[manifest.n]) != 2)
+            {
+                printf("Invalid shards file %s\n", destfile);
+                fclose(fp);
+                close_manifest();
+                return false;
+            }
+            manifest.n++;
+        }
+        fclose(fp);
+    }
+    else
+    {
+        fclose(fp);
+        shard_filename(path, destfile, 0);
+        manifest.readers[0] = open_keys2_reader(destfile);
+        if (manifest.readers[0] == NULL)
+            return false;
+        manifest.nkeys[0] = manifest.readers[0]->header.nkeys;
+        snprintf(manifest.names[0], NAME_MAX+1, "%s.%03u", name, 0);
+        manifest.n = 1;
+        if (rename(destfile, path) || !write_manifest(destfile))
+        {
+            perror("Cannot move the keys file");
+            close_manifest();
+            return false;
+        }
+        return true;
+    }
+    for (uint32_t i = 0; i < manifest.n; i++)
+    {
+        snprintf(path, PATH_MAX, "%.*s%s", dirlen, destfile, manifest.names[i]);
+        manifest.readers[i] = open_keys2_reader(path);
+        if (manifest.readers[i] == NULL)
+        {
+            close_manifest();
+            return false;
+        }
+        manifest.nkeys[i] = manifest.readers[i]->header.nkeys;
+    }
     return true;
 }
 
+static inline bool manifest_has_key(const ribbon128_key_t* key)
+{
+    bool found = false;
+    for (uint32_t i = 0; i < manifest.n; i++)
+        found |= seek_keys2_reader(manifest.readers[i], key);
+    return found;
+}
+
+/*
+ * Merges a new password dump into the compact keys file (or manifest) at
+ * destfile. The dump must be sorted by hash, as HIBP publishes it, so both
+ * sides are walked once; the keys not already present are written to a new
+ * compact file that is appended to the manifest.
+ */
+bool update_password_file(char* sourcefile, char* destfile, uint32_t maxlines, bool verify)
+{
+    char filename[PATH_MAX];
+    ribbon128_key_t key, last = {0};
+    __m256i ribbon, index;
+    uint32_t ignored = 0;
+    uint64_t nkeys = 0, known = 0;
+    bool res = true;
+
+    if (!open_manifest(destfile))
+        return false;
+    if (manifest.n == SHARDS_MAX)
+    {
+        printf("Too many files in %s, run a full preprocess.\n", destfile);
+        close_manifest();
+        return false;
+    }
+    shard_filename(filename, destfile, manifest.n);
+    if (!open_passwd_file(sourcefile) || !open_keys2_file(filename))
+    {
+        close_passwd_file();
+        close_manifest();
+        return false;
+    }
+    while (maxlines && read_passwd_key(&ribbon, &index, verify, &ignored))
+    {
+        maxlines--;
+        _mm_storeu_si128((__m128i*)&key, _mm256_extracti128_si256(ribbon, 1));
+        key.index = (uint32_t) _mm256_extract_epi64(index, 3);
+        if ((nkeys || known) && memcmp(&last, &key, sizeof(ribbon128_key_t)) > 0)
+        {
+            printf("The password file is not sorted by hash, run a full preprocess.\n");
+            res = false;
+            break;
+        }
+        last = key;
+        if (manifest_has_key(&key))
+            known++;
+        else if (!(res = write_keys2_file(&key)))
+            break;
+        else
+            nkeys++;
+        if (!skip2line())
+            break;
+    }
+    close_passwd_file();
+    res = res && flush_keys2_file();
+    nkeys = keys2_w.header.nkeys;
+    close_keys2_file();
+    if (res && nkeys)
+    {
+        const char* slash = strrchr(filename, '/');
+        snprintf(manifest.names[manifest.n], NAME_MAX+1, "%s", slash ? slash + 1 : filename);
+        manifest.nkeys[manifest.n++] = nkeys;
+    }
+    else
+        remove(filename);
+    res = write_manifest(destfile) && res;
+    close_manifest();
+    if (ignored)
+        printf("Ignored %d lines due to bad format.\n", ignored);
+    if (res)
+        printf("Added %lu new keys, %lu already present.\n", nkeys, known);
+    return res;
+}
+
 
 #endif
\ No newline at end of file
@@ -10,19 +10,74 @@ static PyObject *method_preprocess_password_file(PyObject *self, PyObject *args,
     char* destfile;
     uint maxlines = -1;
     bool verify = false;
+    bool compact = false;
+    uint nshards = 0;
+    unsigned long long first = 0;
+    unsigned long long last = UINT64_MAX;
 
-    static char *kwlist[] = {"sourcefile", "destfile", "maxlines", "verify", NULL};
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "ss|Ib", kwlist, 
-                                     &sourcefile, &destfile, &maxlines, &verify)) 
+    static char *kwlist[] = {"sourcefile", "destfile", "maxlines", "verify", "compact", "shards", "first", "last", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "ss|IbbIKK", kwlist, 
+                                     &sourcefile, &destfile, &maxlines, &verify, &compact, &nshards, &first, &last)) 
         return NULL;
     
-    return PyBool_FromLong(preprocess_password_file(sourcefile, destfile, maxlines, verify));
+    key_range.first = first;
+    key_range.last = last;
+    bool res = preprocess_password_file(sourcefile, destfile, maxlines, verify, compact, nshards);
+    key_range.first = 0;
+    key_range.last = UINT64_MAX;
+    return PyBool_FromLong(res);
+}
+
+static PyObject *method_update_password_file(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    char* sourcefile;
+    char* destfile;
+    uint maxlines = -1;
+    bool verify = false;
+    unsigned long long first = 0;
+    unsigned long long last = UINT64_MAX;
+
+    static char *kwlist[] = {"sourcefile", "destfile", "maxlines", "verify", "first", "last", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "ss|IbKK", kwlist, 
+                                     &sourcefile, &destfile, &maxlines, &verify, &first, &last)) 
+        return NULL;
+    
+    key_range.first = first;
+    key_range.last = last;
+    bool res = update_password_file(sourcefile, destfile, maxlines, verify);
+    key_range.first = 0;
+    key_range.last = UINT64_MAX;
+    return PyBool_FromLong(res);
+}
+
+static PyObject *method_preprocess_hot_keys(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    char* sourcefile;
+    char* destfile;
+    uint nkeys;
+    bool verify = false;
+    unsigned long long first = 0;
+    unsigned long long last = UINT64_MAX;
+
+    static char *kwlist[] = {"sourcefile", "destfile", "nkeys", "verify", "first", "last", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "ssI|bKK", kwlist, 
+                                     &sourcefile, &destfile, &nkeys, &verify, &first, &last)) 
+        return NULL;
+    
+    key_range.first = first;
+    key_range.last = last;
+    bool res = preprocess_hot_keys(sourcefile, destfile, nkeys, verify);
+    key_range.first = 0;
+    key_range.last = UINT64_MAX;
+    return PyBool_FromLong(res);
 }
 
 
 static PyMethodDef PreprocessMethods[] =
 {
     {"preprocess_pwd_file", (PyCFunction) method_preprocess_password_file, METH_VARARGS | METH_KEYWORDS, ""},
+    {"update_pwd_file", (PyCFunction) method_update_password_file, METH_VARARGS | METH_KEYWORDS, ""},
+    {"hot_keys", (PyCFunction) method_preprocess_hot_keys, METH_VARARGS | METH_KEYWORDS, ""},
     {NULL, NULL, 0, NULL}
 };
 
@@ -0,0 +1,898 @@
+#ifndef QUERYSERVER_H
+#define QUERYSERVER_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "sha256.h"
+
+#define QUERYSERVER_THREADS_MAX (64)
+#define QUERYSERVER_EVENTS (256)
+#define QUERYSERVER_INPUT (16384)
+#define QUERYSERVER_PASSWORD (1024)
+#define QUERYSERVER_TIMEOUT_MS (100)
+
+
+/*
+ * Standalone HTTP/1.1 front end for a filter module, answering the same
+ * GET SERVER_URL?password=<sha1> contract as filterserver's FilterserverView
+ * (and SERVER_URL + 'health/'). Each thread owns an epoll loop and a
+ * SO_REUSEPORT listener; connections are kept alive and every complete
+ * request in the input buffer is answered before a single write, so
+ * pipelined requests cost one syscall per batch. Tokens are only checked
+ * here (HS256, exp and iss, as jwt.decode does in the view); they are still
+ * issued by the Django server through POST, with the same secret.
+ */
+typedef bool (*queryserver_query_t)(char* pass, bool hashed);
+typedef bool (*queryserver_exist_t)();
+
+typedef struct
+{
+    queryserver_query_t query;
+    queryserver_exist_t exist;
+    char url[256];
+    uint32_t urllen;
+    char secret[256];
+    uint32_t secretlen;
+    char issuer[256];
+    bool open;
+    uint32_t nthreads;
+    int listeners[QUERYSERVER_THREADS_MAX];
+    pthread_t threads[QUERYSERVER_THREADS_MAX];
+    uint32_t stop;
+} queryserver_t;
+
+typedef struct queryserver_conn_t
+{
+    int fd;
+    bool closing;
+    uint32_t events;
+    uint32_t inlen;
+    char* out;
+    uint32_t outlen;
+    uint32_t outsent;
+    uint32_t outsize;
+    struct queryserver_conn_t* prev;
+    struct queryserver_conn_t* next;
+    char in[QUERYSERVER_INPUT];
+} queryserver_conn_t;
+
+typedef struct
+{
+    queryserver_t* qs;
+    int listener;
+    int epfd;
+    queryserver_conn_t* conns;
+} queryserver_worker_t;
+
+// Same codes and messages as ServerErrorCode and ServerErrorMsg in filterclient.
+enum {QS_BAD_PASSWORD = 1, QS_BAD_ISSUER, QS_BAD_TOKEN, QS_EXPIRED_TOKEN, QS_TOKEN_REQUIRED, QS_TOKEN_UNNECESSARY};
+static const char* queryserver_errors[] = {
+    "",
+    "A password to check must be provided",
+    "Incorrect Issuer",
+    "Incorrect authorization token, try requesting a new one",
+    "Token has expired, try requesting a new one",
+    "A Bearer Authorization token must be provided",
+    "Server is already open, no authentication is needed"};
+
+
+//-------------------------------------------------------------------------------------------------------
+
+static int base64url_value(char c)
+{
+    if (c >= 'A' && c <= 'Z') return c - 'A';
+    if (c >= 'a' && c <= 'z') return c - 'a' + 26;
+    if (c >= '0' && c <= '9') return c - '0' + 52;
+    if (c == '-') return 62;
+    if (c == '_') return 63;
+    return -1;
+}
+
+// Decodes unpadded base64url, returning the output length or -1.
+static int base64url_decode(const char* in, uint32_t len, uint8_t* out, uint32_t size)
+{
+    uint32_t n = 0, acc = 0, bits = 0;
+    for (uint32_t i = 0; i < len; i++)
+    {
+        int v = base64url_value(in[i]);
+        if (v < 0)
+            return -1;
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8)
+        {
+            bits -= 8;
+            if (n == size)
+                return -1;
+            out[n++] = acc >> bits;
+        }
+    }
+    return n;
+}
+
+// Value of a top level member of a flat JSON object: a pointer just past the colon.
+static const char* json_member(const char* json, uint32_t len, const char* name)
+{
+    uint32_t namelen = strlen(name);
+    for (uint32_t i = 0; i + namelen + 2 < len; i++)
+    {
+        if (json[i] != '"' || memcmp(json + i + 1, name, namelen) || json[i+namelen+1] != '"')
+            continue;
+        uint32_t j = i + namelen + 2;
+        while (j < len && json[j] == ' ')
+            j++;
+        if (j < len && json[j] == ':')
+        {
+            j++;
+            while (j < len && json[j] == ' ')
+                j++;
+            return json + j;
+        }
+    }
+    return NULL;
+}
+
+static bool json_string_equals(const char* value, const char* end, const char* expected)
+{
+    uint32_t n = strlen(expected);
+    return value != NULL && value + n + 2 <= end && value[0] == '"'
+            && !memcmp(value + 1, expected, n) && value[n+1] == '"';
+}
+
+static int queryserver_check_token(const queryserver_t* qs, const char* token, uint32_t len)
+{
+    char json[1024];
+    uint8_t sig[64];
+    uint8_t mac[SHA256_DIGEST];
+    const char* dot1 = memchr(token, '.', len);
+    const char* dot2 = dot1 ? memchr(dot1 + 1, '.', token + len - dot1 - 1) : NULL;
+    if (dot2 == NULL)
+        return QS_BAD_TOKEN;
+
+    hmac_sha256(qs->secret, qs->secretlen, token, dot2 - token, mac);
+    int n = base64url_decode(dot2 + 1, token + len - dot2 - 1, sig, sizeof(sig));
+    uint8_t diff = n != SHA256_DIGEST;
+    for (int i = 0; i < SHA256_DIGEST; i++)
+        diff |= sig[i] ^ mac[i];
+    if (diff)
+        return QS_BAD_TOKEN;
+
+    n = base64url_decode(token, dot1 - token, (uint8_t*) json, sizeof(json));
+    if (n < 0 || !json_string_equals(json_member(json, n, "alg"), json + n, "HS256"))
+        return QS_BAD_TOKEN;
+
+    n = base64url_decode(dot1 + 1, dot2 - dot1 - 1, (uint8_t*) json, sizeof(json) - 1);
+    if (n < 0)
+        return QS_BAD_TOKEN;
+    json[n] = '\0';
+    const char* exp = json_member(json, n, "exp");
+    const char* iss = json_member(json, n, "iss");
+    char* expend;
+    double expires = exp != NULL ? strtod(exp, &expend) : 0;
+    if (exp == NULL || iss == NULL || expend == exp)
+        return QS_BAD_TOKEN;
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (expires <= now.tv_sec + now.tv_nsec*1e-9)
+        return QS_EXPIRED_TOKEN;
+    if (!json_string_equals(iss, json + n, qs->issuer))
+        return QS_BAD_ISSUER;
+    return 0;
+}
+
+//-------------------------------------------------------------------------------------------------------
+
+static int hex_value(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Last value of the password parameter in a query string, URL decoded.
+static int queryserver_password(const char* query, uint32_t len, char* out)
+{
+    int found = -1;
+    const char* end = query + len;
+    while (query < end)
+    {
+        const char* amp = memchr(query, '&', end - query);
+        const char* next = amp ? amp : end;
+        if (next - query >= 9 && !memcmp(query, "password=", 9))
+        {
+            uint32_t n = 0;
+            for (const char* p = query + 9; p < next && n < QUERYSERVER_PASSWORD - 1; p++)
+            {
+                if (*p == '+')
+                    out[n++] = ' ';
+                else if (*p == '%' && p + 2 < next && hex_value(p[1]) >= 0 && hex_value(p[2]) >= 0)
+                {
+                    out[n++] = hex_value(p[1])*16 + hex_value(p[2]);
+                    p += 2;
+                }
+                else
+                    out[n++] = *p;
+            }
+            out[n] = '\0';
+            found = n;
+        }
+        query = next + 1;
+    }
+    return found;
+}
+
+// False when the output cannot grow; the connection then closes once the
+// answers already queued are sent.
+static bool queryserver_reserve(queryserver_conn_t* c, uint32_t n)
+{
+    if (c->outlen + n <= c->outsize)
+        return true;
+    uint32_t size = c->outsize;
+    while (c->outlen + n > size)
+        size = size ? size*2 : 4096;
+    char* out = realloc(c->out, size);
+    if (out == NULL)
+    {
+        c->closing = true;
+        return false;
+    }
+    c->out = out;
+    c->outsize = size;
+    return true;
+}
+
+// Appends s as a JSON string the way json.dumps does, non-ASCII as \uXXXX.
+static void queryserver_json_string(queryserver_conn_t* c, const char* s)
+{
+    if (!queryserver_reserve(c, strlen(s)*12 + 2))
+        return;
+    char* o = c->out + c->outlen;
+    *o++ = '"';
+    for (const uint8_t* p = (const uint8_t*) s; *p; )
+    {
+        uint32_t cp = *p++;
+        if (cp >= 0x80)
+        {
+            int extra = cp >= 0xF0 ? 3 : cp >= 0xE0 ? 2 : cp >= 0xC0 ? 1 : -1;
+            cp &= extra == 3 ? 0x07 : extra == 2 ? 0x0F : 0x1F;
+            for (int i = 0; i < extra; i++)
+            {
+                if ((*p & 0xC0) != 0x80)
+                {
+                    extra = -1;
+                    break;
+                }
+                cp = (cp << 6) | (*p++ & 0x3F);
+            }
+            if (extra < 0 || cp > 0x10FFFF)
+                cp = 0xFFFD;
+            if (cp >= 0x10000)
+            {
+                cp -= 0x10000;
+                o += sprintf(o, "\\u%04x\\u%04x", 0xD800 | (cp >> 10), 0xDC00 | (cp & 0x3FF));
+            }
+            else
+                o += sprintf(o, "\\u%04x", cp);
+        }
+        else if (cp == '"' || cp == '\\')
+        {
+            *o++ = '\\';
+            *o++ = cp;
+        }
+        else if (cp == '\n') o += sprintf(o, "\\n");
+        else if (cp == '\r') o += sprintf(o, "\\r");
+        else if (cp == '\t') o += sprintf(o, "\\t");
+        else if (cp == '\b') o += sprintf(o, "\\b");
+        else if (cp == '\f') o += sprintf(o, "\\f");
+        else if (cp < 0x20) o += sprintf(o, "\\u%04x", cp);
+        else *o++ = cp;
+    }
+    *o++ = '"';
+    c->outlen = o - c->out;
+}
+
+// Writes the status line and headers, leaving room for the length of the body
+// that follows; queryserver_end fills it in.
+static uint32_t queryserver_begin(queryserver_conn_t* c, uint32_t status)
+{
+    const char* reason = status == 200 ? "OK" : status == 400 ? "Bad Request" : status == 404 ? "Not Found"
+                        : status == 405 ? "Method Not Allowed" : status == 413 ? "Payload Too Large"
+                        : status == 431 ? "Request Header Fields Too Large" : status == 501 ? "Not Implemented"
+                        : "Service Unavailable";
+    if (!queryserver_reserve(c, 256))
+        return 0;
+    c->outlen += sprintf(c->out + c->outlen,
+                         "HTTP/1.1 %u %s\r\nContent-Type: application/json\r\n%sContent-Length: %8s\r\n\r\n",
+                         status, reason, c->closing ? "Connection: close\r\n" : "", "");
+    return c->outlen;
+}
+
+static void queryserver_end(queryserver_conn_t* c, uint32_t body)
+{
+    if (!body)
+        return;
+    char len[16];
+    int n = sprintf(len, "%u", c->outlen - body);
+    memcpy(c->out + body - 4 - 8, len, n);
+}
+
+static void queryserver_append(queryserver_conn_t* c, const char* s)
+{
+    uint32_t n = strlen(s);
+    if (!queryserver_reserve(c, n))
+        return;
+    memcpy(c->out + c->outlen, s, n);
+    c->outlen += n;
+}
+
+static void queryserver_error(queryserver_conn_t* c, int code)
+{
+    uint32_t body = queryserver_begin(c, 200);
+    if (!body || !queryserver_reserve(c, 128))
+        return;
+    c->outlen += sprintf(c->out + c->outlen, "{\"errorcode\": %d, \"errormsg\": \"%s\"}", code, queryserver_errors[code]);
+    queryserver_end(c, body);
+}
+
+static void queryserver_status(queryserver_conn_t* c, uint32_t status)
+{
+    queryserver_end(c, queryserver_begin(c, status));
+}
+
+static void queryserver_health(const queryserver_t* qs, queryserver_conn_t* c)
+{
+    bool ready = qs->exist();
+    uint32_t body = queryserver_begin(c, ready ? 200 : 503);
+    queryserver_append(c, ready ? "{\"state\": \"READY\", \"ready\": true}" : "{\"state\": \"LOADING\", \"ready\": false}");
+    queryserver_end(c, body);
+}
+
+static void queryserver_get(const queryserver_t* qs, queryserver_conn_t* c, const char* query, uint32_t querylen,
+                            const char* auth, uint32_t authlen)
+{
+    char pass[QUERYSERVER_PASSWORD];
+    if (!qs->open)
+    {
+        if (auth == NULL)
+            return queryserver_error(c, QS_TOKEN_REQUIRED);
+        if (authlen >= 7 && !memcmp(auth, "Bearer ", 7))
+        {
+            auth += 7;
+            authlen -= 7;
+        }
+        int err = queryserver_check_token(qs, auth, authlen);
+        if (err)
+            return queryserver_error(c, err);
+    }
+    if (queryserver_password(query, querylen, pass) <= 0)
+        return queryserver_error(c, QS_BAD_PASSWORD);
+    if (!qs->exist())
+        return queryserver_health(qs, c);
+    bool compromised = qs->query(pass, true);
+    uint32_t body = queryserver_begin(c, 200);
+    queryserver_append(c, "{\"password\": ");
+    queryserver_json_string(c, pass);
+    queryserver_append(c, compromised ? ", \"compromised\": true}" : ", \"compromised\": false}");
+    queryserver_end(c, body);
+}
+
+// Content-Length as digits only, false past the input buffer.
+static bool queryserver_length(const char* v, const char* eol, uint64_t* len)
+{
+    while (eol > v && (eol[-1] == ' ' || eol[-1] == '\t'))
+        eol--;
+    *len = 0;
+    for (const char* p = v; p < eol; p++)
+    {
+        if (*p < '0' || *p > '9')
+            return false;
+        *len = *len*10 + (*p - '0');
+        if (*len > QUERYSERVER_INPUT)
+            return false;
+    }
+    return eol > v;
+}
+
+// Whether a comma separated header value lists token, in any case.
+static bool queryserver_token(const char* v, const char* eol, const char* token)
+{
+    uint32_t n = strlen(token);
+    while (v < eol)
+    {
+        const char* next = memchr(v, ',', eol - v);
+        if (next == NULL)
+            next = eol;
+        const char* a = v;
+        const char* b = next;
+        while (a < b && (*a == ' ' || *a == '\t'))
+            a++;
+        while (b > a && (b[-1] == ' ' || b[-1] == '\t'))
+            b--;
+        if (b - a == n && !strncasecmp(a, token, n))
+            return true;
+        v = next + 1;
+    }
+    return false;
+}
+
+// Answers every complete request in the input buffer. Returns false on a malformed one.
+static bool queryserver_process(const queryserver_t* qs, queryserver_conn_t* c)
+{
+    uint32_t offset = 0;
+    while (!c->closing)
+    {
+        char* req = c->in + offset;
+        uint32_t avail = c->inlen - offset;
+        char* end = memmem(req, avail, "\r\n\r\n", 4);
+        if (end == NULL)
+        {
+            if (offset == 0 && c->inlen == QUERYSERVER_INPUT)
+            {
+                c->closing = true;
+                queryserver_status(c, 431);
+            }
+            break;
+        }
+        char* line = memchr(req, '\r', end + 2 - req);
+        char* sp1 = memchr(req, ' ', line - req);
+        char* sp2 = sp1 ? memchr(sp1 + 1, ' ', line - sp1 - 1) : NULL;
+        if (sp2 == NULL)
+            return false;
+
+        const char* auth = NULL;
+        uint32_t authlen = 0;
+        uint64_t bodylen = 0;
+        uint32_t refused = 0;
+        bool http10 = line - sp2 - 1 == 8 && !memcmp(sp2 + 1, "HTTP/1.0", 8);
+        bool keepalive = !http10;
+        for (char* h = line + 2; h < end; )
+        {
+            char* eol = memmem(h, end + 2 - h, "\r\n", 2);
+            char* colon = memchr(h, ':', eol - h);
+            if (colon != NULL)
+            {
+                char* v = colon + 1;
+                while (v < eol && *v == ' ')
+                    v++;
+                uint32_t namelen = colon - h;
+                if (namelen == 13 && !strncasecmp(h, "authorization", 13))
+                {
+                    auth = v;
+                    authlen = eol - v;
+                }
+                else if (namelen == 14 && !strncasecmp(h, "content-length", 14))
+                    refused = queryserver_length(v, eol, &bodylen) ? refused : 400;
+                else if (namelen == 17 && !strncasecmp(h, "transfer-encoding", 17))
+                    refused = 501;
+                else if (namelen == 10 && !strncasecmp(h, "connection", 10))
+                    keepalive = queryserver_token(v, eol, "close") ? false
+                                : queryserver_token(v, eol, "keep-alive") ? true : keepalive;
+            }
+            h = eol + 2;
+        }
+        // Without a trusted body length the next request cannot be found.
+        if (refused)
+        {
+            c->closing = true;
+            queryserver_status(c, refused);
+            break;
+        }
+        uint64_t total = (end + 4 - req) + bodylen;
+        if (total > QUERYSERVER_INPUT)
+        {
+            c->closing = true;
+            queryserver_status(c, 413);
+            break;
+        }
+        if (total > avail)
+            break;
+        offset += total;
+        c->closing = !keepalive;
+
+        char* target = sp1 + 1;
+        uint32_t targetlen = sp2 - target;
+        char* question = memchr(target, '?', targetlen);
+        uint32_t pathlen = question ? question - target : targetlen;
+        bool api = pathlen == qs->urllen && !memcmp(target, qs->url, pathlen);
+        bool health = pathlen == qs->urllen + 7 && !memcmp(target, qs->url, qs->urllen)
+                        && !memcmp(target + qs->urllen, "health/", 7);
+        bool get = sp1 - req == 3 && !memcmp(req, "GET", 3);
+        bool post = sp1 - req == 4 && !memcmp(req, "POST", 4);
+
+        if (health && get)
+            queryserver_health(qs, c);
+        else if (api && get)
+            queryserver_get(qs, c, question ? question + 1 : target + targetlen,
+                            question ? target + targetlen - question - 1 : 0, auth, authlen);
+        else if (api && post && qs->open)
+            queryserver_error(c, QS_TOKEN_UNNECESSARY);
+        else if (api || health)
+            queryserver_status(c, 405);
+        else
+            queryserver_status(c, 404);
+    }
+    memmove(c->in, c->in + offset, c->inlen - offset);
+    c->inlen -= offset;
+    return true;
+}
+
+//-------------------------------------------------------------------------------------------------------
+
+static void queryserver_close(queryserver_worker_t* w, queryserver_conn_t* c)
+{
+    close(c->fd);
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        w->conns = c->next;
+    if (c->next)
+        c->next->prev = c->prev;
+    free(c->out);
+    free(c);
+}
+
+// Returns false once the connection is done with.
+static bool queryserver_flush(queryserver_worker_t* w, queryserver_conn_t* c)
+{
+    while (c->outsent < c->outlen)
+    {
+        ssize_t n = write(c->fd, c->out + c->outsent, c->outlen - c->outsent);
+        if (n < 0 && errno == EAGAIN)
+            break;
+        if (n <= 0)
+            return false;
+        c->outsent += n;
+    }
+    if (c->outsent == c->outlen)
+    {
+        c->outsent = c->outlen = 0;
+        if (c->closing)
+            return false;
+    }
+    // A closing connection is only waited on to take its last answers.
+    uint32_t events = (c->closing ? 0 : EPOLLIN) | (c->outlen > 0 ? EPOLLOUT : 0);
+    if (events != c->events)
+    {
+        struct epoll_event ev = {.events = events, .data.ptr = c};
+        epoll_ctl(w->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->events = events;
+    }
+    return true;
+}
+
+static bool queryserver_read(queryserver_worker_t* w, queryserver_conn_t* c)
+{
+    while (c->inlen < QUERYSERVER_INPUT && !c->closing)
+    {
+        ssize_t n = read(c->fd, c->in + c->inlen, QUERYSERVER_INPUT - c->inlen);
+        if (n < 0 && errno == EAGAIN)
+            break;
+        if (n < 0)
+            return false;
+        // The client is done sending: the answers already queued still go out.
+        if (n == 0)
+        {
+            c->closing = true;
+            break;
+        }
+        c->inlen += n;
+        if (!queryserver_process(w->qs, c))
+        {
+            c->closing = true;
+            queryserver_status(c, 400);
+        }
+        // Stop reading while the client does not take its answers.
+        if (c->outlen >= QUERYSERVER_INPUT*16)
+            break;
+    }
+    return queryserver_flush(w, c);
+}
+
+static void queryserver_accept(queryserver_worker_t* w)
+{
+    const int one = 1;
+    int fd;
+    while ((fd = accept4(w->listener, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC)) >= 0)
+    {
+        queryserver_conn_t* c = calloc(1, sizeof(queryserver_conn_t));
+        if (c == NULL)
+        {
+            close(fd);
+            continue;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        c->fd = fd;
+        c->events = EPOLLIN;
+        c->next = w->conns;
+        if (w->conns)
+            w->conns->prev = c;
+        w->conns = c;
+        struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+}
+
+static void* queryserver_worker(void* arg)
+{
+    queryserver_worker_t w = {.qs = ((queryserver_worker_t*) arg)->qs, .listener = ((queryserver_worker_t*) arg)->listener};
+    struct epoll_event events[QUERYSERVER_EVENTS];
+    free(arg);
+    w.epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    epoll_ctl(w.epfd, EPOLL_CTL_ADD, w.listener, &ev);
+
+    while (!__atomic_load_n(&w.qs->stop, __ATOMIC_ACQUIRE))
+    {
+        int n = epoll_wait(w.epfd, events, QUERYSERVER_EVENTS, QUERYSERVER_TIMEOUT_MS);
+        for (int i = 0; i < n; i++)
+        {
+            queryserver_conn_t* c = events[i].data.ptr;
+            if (c == NULL)
+                queryserver_accept(&w);
+            else if (events[i].events & (EPOLLERR|EPOLLHUP))
+                queryserver_close(&w, c);
+            else if (!((events[i].events & EPOLLIN) ? queryserver_read(&w, c) : queryserver_flush(&w, c)))
+                queryserver_close(&w, c);
+        }
+    }
+    while (w.conns)
+        queryserver_close(&w, w.conns);
+    close(w.epfd);
+    return NULL;
+}
+
+static int queryserver_listen(const char* host, uint16_t port)
+{
+    const int one = 1;
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    if (inet_pton(AF_INET, host, &addr.sin_addr) != 1)
+        return -1;
+    int fd = socket(AF_INET, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one))
+        || setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one))
+        || bind(fd, (struct sockaddr*) &addr, sizeof(addr)) || listen(fd, SOMAXCONN))
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void queryserver_stop(queryserver_t* qs)
+{
+    __atomic_store_n(&qs->stop, 1, __ATOMIC_RELEASE);
+    for (uint32_t i = 0; i < qs->nthreads; i++)
+    {
+        pthread_join(qs->threads[i], NULL);
+        close(qs->listeners[i]);
+    }
+    qs->nthreads = 0;
+}
+
+/*
+ * Starts nthreads workers (one per CPU if 0) listening on host:port. url is
+ * SERVER_URL with its leading slash; secret and issuer are only used when the
+ * server is not open.
+ */
+bool queryserver_start(queryserver_t* qs, const char* host, uint16_t port, uint32_t nthreads)
+{
+    if (!nthreads)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    nthreads = nthreads > QUERYSERVER_THREADS_MAX ? QUERYSERVER_THREADS_MAX : nthreads;
+    qs->urllen = strlen(qs->url);
+    qs->secretlen = strlen(qs->secret);
+    qs->nthreads = 0;
+    qs->stop = 0;
+    for (uint32_t i = 0; i < nthreads; i++)
+    {
+        queryserver_worker_t* w = malloc(sizeof(queryserver_worker_t));
+        int fd = queryserver_listen(host, port);
+        if (fd < 0 || w == NULL)
+        {
+            printf("Cannot listen on %s:%u", host, port);
+            perror("");
+            if (fd >= 0)
+                close(fd);
+            free(w);
+            queryserver_stop(qs);
+            return false;
+        }
+        w->qs = qs;
+        w->listener = fd;
+        qs->listeners[i] = fd;
+        pthread_create(&qs->threads[i], NULL, queryserver_worker, w);
+        qs->nthreads++;
+    }
+    return true;
+}
+
+// Waits up to ms milliseconds, returning true once the server is asked to stop.
+bool queryserver_wait(queryserver_t* qs, uint32_t ms)
+{
+    for (uint32_t i = 0; i < ms/10; i++)
+    {
+        if (__atomic_load_n(&qs->stop, __ATOMIC_ACQUIRE))
+            return true;
+        usleep(10000);
+    }
+    return __atomic_load_n(&qs->stop, __ATOMIC_ACQUIRE);
+}
+
+//-------------------------------------------------------------------------------------------------------
+
+/*
+ * Load generator for the benchmark: threads x connections keep pipeline
+ * copies of request in flight against host:port for the given seconds.
+ * Returns the responses received; errors counts non 200 answers and
+ * requests lost to closed connections.
+ */
+typedef struct
+{
+    const char* host;
+    uint16_t port;
+    const char* request;
+    uint32_t connections;
+    uint32_t pipeline;
+    uint32_t seconds;
+    uint64_t responses;
+    uint64_t errors;
+} queryserver_bench_t;
+
+typedef struct
+{
+    int fd;
+    bool closing;
+    uint32_t inflight;
+    uint32_t inlen;
+    char in[QUERYSERVER_INPUT];
+} queryserver_bench_conn_t;
+
+static bool queryserver_bench_connect(queryserver_bench_t* b, int epfd, queryserver_bench_conn_t* c)
+{
+    const int one = 1;
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(b->port)};
+    inet_pton(AF_INET, b->host, &addr.sin_addr);
+    c->fd = socket(AF_INET, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (c->fd < 0 || connect(c->fd, (struct sockaddr*) &addr, sizeof(addr)))
+    {
+        if (c->fd >= 0)
+            close(c->fd);
+        c->fd = -1;
+        return false;
+    }
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    c->closing = false;
+    c->inflight = c->inlen = 0;
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+    return true;
+}
+
+static bool queryserver_bench_send(queryserver_bench_t* b, queryserver_bench_conn_t* c, uint32_t n)
+{
+    uint32_t len = strlen(b->request);
+    for (uint32_t i = 0; i < n; i++)
+    {
+        if (write(c->fd, b->request, len) != len)
+            return false;
+        c->inflight++;
+    }
+    return true;
+}
+
+static void* queryserver_bench_worker(void* arg)
+{
+    queryserver_bench_t* b = arg;
+    struct epoll_event events[QUERYSERVER_EVENTS];
+    queryserver_bench_conn_t* conns = calloc(b->connections, sizeof(queryserver_bench_conn_t));
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (uint32_t i = 0; i < b->connections; i++)
+        if (!queryserver_bench_connect(b, epfd, &conns[i]) || !queryserver_bench_send(b, &conns[i], b->pipeline))
+            b->errors++;
+
+    do
+    {
+        int n = epoll_wait(epfd, events, QUERYSERVER_EVENTS, QUERYSERVER_TIMEOUT_MS);
+        for (int i = 0; i < n; i++)
+        {
+            queryserver_bench_conn_t* c = events[i].data.ptr;
+            ssize_t r = read(c->fd, c->in + c->inlen, QUERYSERVER_INPUT - c->inlen);
+            uint32_t done = 0;
+            if (r > 0)
+            {
+                c->inlen += r;
+                char* p = c->in;
+                char* end;
+                while (!c->closing && (end = memmem(p, c->in + c->inlen - p, "\r\n\r\n", 4)) != NULL)
+                {
+                    // Without a length the body runs until the server closes.
+                    char* cl = memmem(p, end - p, "Content-Length:", 15);
+                    c->closing = cl == NULL || memmem(p, end - p, "Connection: close", 17) != NULL;
+                    if (cl == NULL)
+                        break;
+                    uint64_t total = (end + 4 - p) + strtoull(cl + 15, NULL, 10);
+                    if (p + total > c->in + c->inlen)
+                    {
+                        c->closing = false;
+                        break;
+                    }
+                    b->responses++;
+                    b->errors += memcmp(p + 9, "200", 3) != 0;
+                    p += total;
+                    done++;
+                }
+                memmove(c->in, p, c->in + c->inlen - p);
+                c->inlen -= p - c->in;
+                c->inflight -= done;
+            }
+            else if (c->inlen && !memcmp(c->in, "HTTP/", 5))
+            {
+                b->responses++;
+                b->errors += memcmp(c->in + 9, "200", 3) != 0;
+                c->inflight--;
+            }
+            if (r <= 0 || (done && !c->closing && !queryserver_bench_send(b, c, done)))
+            {
+                b->errors += c->inflight;
+                close(c->fd);
+                if (!queryserver_bench_connect(b, epfd, c) || !queryserver_bench_send(b, c, b->pipeline))
+                    b->errors++;
+            }
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (now.tv_sec - start.tv_sec < b->seconds);
+
+    for (uint32_t i = 0; i < b->connections; i++)
+        if (conns[i].fd >= 0)
+            close(conns[i].fd);
+    free(conns);
+    close(epfd);
+    return NULL;
+}
+
+uint64_t queryserver_bench(const char* host, uint16_t port, const char* request, uint32_t connections,
+                           uint32_t pipeline, uint32_t seconds, uint32_t nthreads, uint64_t* errors)
+{
+    queryserver_bench_t b[QUERYSERVER_THREADS_MAX];
+    pthread_t threads[QUERYSERVER_THREADS_MAX];
+    uint64_t responses = 0;
+    nthreads = nthreads < 1 ? 1 : (nthreads > QUERYSERVER_THREADS_MAX ? QUERYSERVER_THREADS_MAX : nthreads);
+    *errors = 0;
+    for (uint32_t i = 0; i < nthreads; i++)
+    {
+        b[i] = (queryserver_bench_t) {host, port, request, (connections + nthreads - 1 - i)/nthreads,
+                                      pipeline ? pipeline : 1, seconds, 0, 0};
+        pthread_create(&threads[i], NULL, queryserver_bench_worker, &b[i]);
+    }
+    for (uint32_t i = 0; i < nthreads; i++)
+    {
+        pthread_join(threads[i], NULL);
+        responses += b[i].responses;
+        *errors += b[i].errors;
+    }
+    return responses;
+}
+
+
+#endif
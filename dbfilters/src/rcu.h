@@ -0,0 +1,77 @@
+#ifndef RCU_H
+#define RCU_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sched.h>
+
+
+/*
+ * Read-copy-update slot for the filter a module serves queries from.
+ *
+ * Readers register in the counter of the current epoch and then read the
+ * pointer, without taking any lock. Writers are serialized by the mutex: they
+ * swap the pointer, move readers to the other epoch and wait for the old
+ * epoch to drain before handing back the replaced pointer, so it can be freed
+ * while queries that started later keep running on the new one.
+ */
+typedef struct
+{
+    void* ptr;
+    uint32_t epoch;
+    uint64_t readers[2];
+    pthread_mutex_t writer;
+} rcu_t;
+
+#define RCU_INITIALIZER {NULL, 0, {0, 0}, PTHREAD_MUTEX_INITIALIZER}
+
+
+static inline void* rcu_read_lock(rcu_t* rcu, uint32_t* slot)
+{
+    for (;;)
+    {
+        uint32_t epoch = __atomic_load_n(&rcu->epoch, __ATOMIC_SEQ_CST);
+        __atomic_add_fetch(&rcu->readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&rcu->epoch, __ATOMIC_SEQ_CST) == epoch)
+        {
+            *slot = epoch & 1;
+            return __atomic_load_n(&rcu->ptr, __ATOMIC_SEQ_CST);
+        }
+        // A writer flipped the epoch in between: it may not wait for this slot.
+        __atomic_sub_fetch(&rcu->readers[epoch & 1], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static inline void rcu_read_unlock(rcu_t* rcu, uint32_t slot)
+{
+    __atomic_sub_fetch(&rcu->readers[slot], 1, __ATOMIC_RELEASE);
+}
+
+static inline void* rcu_peek(rcu_t* rcu)
+{
+    return __atomic_load_n(&rcu->ptr, __ATOMIC_ACQUIRE);
+}
+
+static inline void rcu_write_lock(rcu_t* rcu)
+{
+    pthread_mutex_lock(&rcu->writer);
+}
+
+static inline void rcu_write_unlock(rcu_t* rcu)
+{
+    pthread_mutex_unlock(&rcu->writer);
+}
+
+// Must hold the writer lock. Returns the replaced pointer once no reader can see it.
+static void* rcu_publish(rcu_t* rcu, void* ptr)
+{
+    void* old = __atomic_exchange_n(&rcu->ptr, ptr, __ATOMIC_SEQ_CST);
+    uint32_t epoch = __atomic_fetch_add(&rcu->epoch, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&rcu->readers[epoch & 1], __ATOMIC_ACQUIRE))
+        sched_yield();
+    return old;
+}
+
+
+#endif
@@ -13,6 +13,8 @@
 #include <errno.h>
 
 #include "utils.h"
+#include "filterfile.h"
+#include "rcu.h"
 
 
 #if !defined(__AVX2__)
@@ -28,11 +30,16 @@ typedef struct
 {
     uint8_t r;
     uint32_t m;
+    uint64_t nkeys;
     uint8_t* f;
+    uint64_t mapped; // Bytes of f mapped from the filter file, 0 if allocated.
 } ribbon128_t;
 
 
+// Constructions and loads fill the staging filter; queries only ever read the
+// published copy, which is replaced through RCU.
 static ribbon128_t filter = {0};
+static rcu_t published = RCU_INITIALIZER;
 
 
 static inline void solve_avx2_r8(__m128i* coeff)
@@ -212,21 +219,55 @@ static inline void solve_avx2_r16(__m128i* coeff)
 	}	
 }
 
-void destroy_filter()
+static void reset_filter()
 {
-    free(filter.f);
+    free_filterfile(filter.f, filter.mapped);
     bzero(&filter, sizeof(ribbon128_t));
 }
 
-bool create_ribbon128(char* filename, uint32_t maxkeys, uint8_t r, double oversize)
+static void release_filter(ribbon128_t* f)
+{
+    if (f == NULL)
+        return;
+    free_filterfile(f->f, f->mapped);
+    free(f);
+}
+
+// Publishes the staging filter if it was staged, otherwise drops it and keeps
+// serving the previous one.
+static bool publish_filter(bool staged)
+{
+    ribbon128_t* f = staged ? malloc(sizeof(ribbon128_t)) : NULL;
+    if (f == NULL)
+    {
+        reset_filter();
+        return false;
+    }
+    *f = filter;
+    bzero(&filter, sizeof(ribbon128_t));
+    release_filter(rcu_publish(&published, f));
+    return true;
+}
+
+void destroy_filter()
+{
+    rcu_write_lock(&published);
+    reset_filter();
+    release_filter(rcu_publish(&published, NULL));
+    rcu_write_unlock(&published);
+}
+
+// Inserts every key into a new coefficient matrix, to be solved afterwards.
+static __uint128_t* insert_ribbon128(char* filename, uint32_t maxkeys, uint8_t r, double oversize)
 {
     const __uint128_t msbmask = ((__uint128_t)1<<127);
     ribbon128_key_t* key;
     if (!open_keys_file(filename, &maxkeys))
-        return false;
-    destroy_filter();
+        return NULL;
+    reset_filter();
 
     filter.r = r;
+    filter.nkeys = maxkeys;
 	/*
     filter.m = filter.r == 1 
                     ? ((uint32_t)(maxkeys * oversize + RIBBON128_EXTRA + 31)) & ~0x1f
@@ -278,7 +319,14 @@ bool create_ribbon128(char* filename, uint32_t maxkeys, uint8_t r, double oversi
         }
     }
     close_keys_file();
-    
+    return coeff;
+}
+
+static bool create_ribbon128_staged(char* filename, uint32_t maxkeys, uint8_t r, double oversize)
+{
+    __uint128_t* coeff = insert_ribbon128(filename, maxkeys, r, oversize);
+    if (coeff == NULL)
+        return false;
     uint32_t filtersize = filter.r*filter.m;
     filter.f = (uint8_t*)(coeff)+filter.m*(sizeof(__m128i)-filter.r);
     filter.r == 1 ? solve_avx2_r8((__m128i*)coeff) : solve_avx2_r16((__m128i*)coeff);
@@ -287,7 +335,44 @@ bool create_ribbon128(char* filename, uint32_t maxkeys, uint8_t r, double oversi
     return filter.f != NULL;
 }
 
-bool query_ribbon128_r8(const ribbon128_key_t* key)
+bool create_ribbon128(char* filename, uint32_t maxkeys, uint8_t r, double oversize)
+{
+    rcu_write_lock(&published);
+    bool res = publish_filter(create_ribbon128_staged(filename, maxkeys, r, oversize));
+    rcu_write_unlock(&published);
+    return res;
+}
+
+// Solves straight into the payload of a new filter file instead of memory.
+bool build_ribbon128(char* filename, char* destfile, uint32_t maxkeys, uint8_t r, double oversize)
+{
+    filterfile_header_t header;
+    filterfile_out_t out;
+    rcu_write_lock(&published);
+    __uint128_t* coeff = insert_ribbon128(filename, maxkeys, r, oversize);
+    if (coeff == NULL)
+    {
+        rcu_write_unlock(&published);
+        return false;
+    }
+    init_filterfile_header(&header, FILTER_RIBBON128, filter.nkeys, 0, (uint64_t)filter.m*filter.r);
+    header.params[0] = filter.r;
+    header.params[1] = filter.m;
+    // The solver reads up to RIBBON128_EXTRA rows past the end, as in memory.
+    filter.f = open_filterfile_out(destfile, &header, &out, RIBBON128_EXTRA*filter.r);
+    bool res = filter.f != NULL;
+    if (res)
+    {
+        filter.r == 1 ? solve_avx2_r8((__m128i*)coeff) : solve_avx2_r16((__m128i*)coeff);
+        res = close_filterfile_out(&out, &header);
+    }
+    free(coeff);
+    bzero(&filter, sizeof(ribbon128_t));
+    rcu_write_unlock(&published);
+    return res;
+}
+
+static inline bool query_ribbon128_r8(const ribbon128_t* f, const ribbon128_key_t* key)
 {
     const __m256i zero = _mm256_setzero_si256();
 	const __m256i shufmask = _mm256_set_epi64x(
@@ -299,9 +384,9 @@ bool query_ribbon128_r8(const ribbon128_key_t* key)
 	__m128i v = _mm_loadu_si128((__m128i *)&key->ribbon);
     v = _mm_or_si128(v, msbmask);
 
-    uint32_t index = ((uint64_t) key->index*(filter.m - RIBBON128_EXTRA))>>32; // From https://lemire.me/blog/2016/06/27/a-fast-alternative-to-the-modulo-reduction/
+    uint32_t index = ((uint64_t) key->index*(f->m - RIBBON128_EXTRA))>>32; // From https://lemire.me/blog/2016/06/27/a-fast-alternative-to-the-modulo-reduction/
     
-    __m256i* ptr = (__m256i *)(filter.f + index);
+    __m256i* ptr = (__m256i *)(f->f + index);
     __m256i vv = _mm256_setr_m128i(v,v);
 
     __m256i accum256 = 
@@ -345,7 +430,7 @@ bool query_ribbon128_r8(const ribbon128_key_t* key)
 	return !_mm256_extract_epi8(accum256, 0);
 }
 
-bool query_ribbon128_r16(const ribbon128_key_t* key)
+static inline bool query_ribbon128_r16(const ribbon128_t* f, const ribbon128_key_t* key)
 {
     const __m256i zero = _mm256_setzero_si256();
     const __m128i msbmask = _mm_set_epi64x((uint64_t)0x8000000000000000LL,(uint64_t)0);
@@ -363,9 +448,9 @@ bool query_ribbon128_r16(const ribbon128_key_t* key)
     v = _mm_or_si128(v, msbmask);
 	uint32_t index = key->index;
 
-    index = ((uint64_t) index*(filter.m - RIBBON128_EXTRA))>>32; // From https://lemire.me/blog/2016/06/27/a-fast-alternative-to-the-modulo-reduction/
+    index = ((uint64_t) index*(f->m - RIBBON128_EXTRA))>>32; // From https://lemire.me/blog/2016/06/27/a-fast-alternative-to-the-modulo-reduction/
 
-    uint16_t *fptr = (uint16_t*) filter.f;
+    uint16_t *fptr = (uint16_t*) f->f;
     __m256i* ptr = (__m256i *)(fptr + index);
     __m256i vv = _mm256_setr_m128i(v,v);
 
@@ -441,80 +526,94 @@ bool query_ribbon128_r16(const ribbon128_key_t* key)
 	return !_mm256_extract_epi16(accum256, 0);
 }
 
+static bool contain_key_r8(const void* f, const ribbon128_key_t* key)
+{
+    return query_ribbon128_r8(f, key);
+}
+
+static bool contain_key_r16(const void* f, const ribbon128_key_t* key)
+{
+    return query_ribbon128_r16(f, key);
+}
+
 bool filter_exist()
 {
-  return filter.f != NULL;
+  return rcu_peek(&published) != NULL;
 }
 
 bool query_ribbon128(char* pass, bool hashed)
 {
-    assert(filter_exist());
-    bool (*query)(const ribbon128_key_t*) = filter.r == 1 ? &query_ribbon128_r8 : &query_ribbon128_r16;
+    uint32_t slot;
+    const ribbon128_t* f = rcu_read_lock(&published, &slot);
     ribbon128_key_t key;
-    if((hashed && hash2key(pass, &key)) || password2key(pass, &key))
-        return query(&key);
-    else
-        return false;
+    bool res = f != NULL && ((hashed && hash2key(pass, &key)) || password2key(pass, &key))
+                && (f->r == 1 ? query_ribbon128_r8(f, &key) : query_ribbon128_r16(f, &key));
+    rcu_read_unlock(&published, slot);
+    return res;
 }
 
-bool sanity_check(char* filename, uint32_t maxkeys)
+// Answers n keys under one read section, prefetching the rows a few keys
+// ahead. Returns 0 when there is no filter.
+uint32_t query_ribbon128_batch(const ribbon128_key_t* keys, uint32_t n, uint8_t* results)
 {
-    assert(filter_exist());
-    ribbon128_key_t* key;
-    if (!open_keys_file(filename, &maxkeys))
-        return false;
-    bool (*query)(const ribbon128_key_t*) = filter.r == 1 ? &query_ribbon128_r8 : &query_ribbon128_r16;
-    while((key = read_key()) != NULL)
+    uint32_t slot;
+    const ribbon128_t* f = rcu_read_lock(&published, &slot);
+    if (f == NULL)
+        n = 0;
+    for (uint32_t i = 0; i < n; i++)
     {
-        if (!query(key))
-        {
-            printf("Sanity check failed.\n");
-            return false;
-        }
+        if (i + 8 < n)
+            __builtin_prefetch(f->f + (((uint64_t) keys[i+8].index*(f->m - RIBBON128_EXTRA))>>32)*f->r);
+        results[i] = f->r == 1 ? query_ribbon128_r8(f, &keys[i]) : query_ribbon128_r16(f, &keys[i]);
     }
-    close_keys_file();
-    return true;
+    rcu_read_unlock(&published, slot);
+    return n;
+}
+
+bool sanity_check(char* filename, uint32_t maxkeys)
+{
+    uint32_t slot;
+    const ribbon128_t* f = rcu_read_lock(&published, &slot);
+    bool res = f != NULL && check_keys_file(filename, maxkeys, f->r == 1 ? &contain_key_r8 : &contain_key_r16, f);
+    rcu_read_unlock(&published, slot);
+    return res;
 }
 
 uint32_t fp_filter(uint32_t n)
 {
-    assert(filter_exist());
+    uint32_t slot;
+    const ribbon128_t* f = rcu_read_lock(&published, &slot);
     uint32_t matches = 0;
     init_shishua(clock());
     ribbon128_key_t randomkey;
-    bool (*query)(const ribbon128_key_t*) = filter.r == 1 ? &query_ribbon128_r8 : &query_ribbon128_r16;
-    while(n--)
+    while(f != NULL && n--)
     {
         random_ribbon_key(&randomkey);
-        if(query(&randomkey))
+        if(f->r == 1 ? query_ribbon128_r8(f, &randomkey) : query_ribbon128_r16(f, &randomkey))
             matches++;
     }
+    rcu_read_unlock(&published, slot);
     return matches;
 }
 
 bool save_filter(char* filename)
 {
-    assert(filter_exist());
-    FILE* fp = fopen(filename, "wb");
-    if (fp == NULL)
+    uint32_t slot;
+    const ribbon128_t* f = rcu_read_lock(&published, &slot);
+    filterfile_header_t header;
+    bool res = false;
+    if (f != NULL)
     {
-        printf("Cannot open the output file %s.", filename);
-        return false;
-    }
-    if (!fwrite(MAGIC_FILTER, sizeof(MAGIC_FILTER), 1, fp)
-        || !fwrite(&filter.r, sizeof(uint8_t), 1, fp)
-        || !fwrite(&filter.m, sizeof(uint32_t), 1, fp)
-        || !fwrite(filter.f, filter.m*filter.r, 1, fp))
-    {
-        perror("Error when writing into file");
-        fclose(fp);
-        return false;
+        init_filterfile_header(&header, FILTER_RIBBON128, f->nkeys, 0, (uint64_t)f->m*f->r);
+        header.params[0] = f->r;
+        header.params[1] = f->m;
+        res = save_filterfile(filename, &header, f->f);
     }
-    fclose(fp);
-    return true;
+    rcu_read_unlock(&published, slot);
+    return res;
 }
 
-bool load_filter(char* filename, uint32_t maxkeys, uint8_t r, double oversize)
+static bool load_filter_v1(char* filename, uint32_t maxkeys, uint8_t r, double oversize)
 { 
     FILE* fp = fopen(filename, "rb");
     if (fp == NULL)
@@ -522,10 +621,11 @@ bool load_filter(char* filename, uint32_t maxkeys, uint8_t r, double oversize)
         printf("Cannot open the input file %s.", filename);
         return false;
     }
-    if (filter.f != NULL)
-        destroy_filter();
+    reset_filter();
 
     char magic[sizeof(MAGIC_FILTER)];
+    r = r ? r : 1;
+    oversize = oversize > 0 ? oversize : 1. + (4. + 2.*r)/128.;
     uint32_t expected_m = (uint32_t)(maxkeys * oversize + RIBBON128_EXTRA);
     if (!fread(magic, sizeof(MAGIC_FILTER), 1, fp) 
         || strcmp(magic, MAGIC_FILTER)
@@ -550,5 +650,49 @@ bool load_filter(char* filename, uint32_t maxkeys, uint8_t r, double oversize)
     return true;
 }
 
+// Build parameters are optional: each one is only checked when given.
+static bool load_filter_staged(char* filename, uint32_t maxkeys, uint8_t r, double oversize, bool shared)
+{
+    filterfile_header_t header;
+    if (!is_filterfile(filename))
+        return load_filter_v1(filename, maxkeys, r, oversize);
+    uint8_t* f = shared ? map_filterfile(filename, FILTER_RIBBON128, &header) : load_filterfile(filename, FILTER_RIBBON128, &header);
+    if (f == NULL)
+        return false;
+    if ((header.params[0] != 1 && header.params[0] != 2)
+        || header.payload_size != header.params[0]*header.params[1]
+        || (r && header.params[0] != r)
+        || (maxkeys && header.nkeys != maxkeys)
+        || (oversize > 0 && header.params[1] != (uint32_t)(header.nkeys * oversize + RIBBON128_EXTRA)))
+    {
+        printf("Filter file %s was built with other parameters.\n", filename);
+        free_filterfile(f, shared ? header.payload_size : 0);
+        return false;
+    }
+    reset_filter();
+    filter.r = header.params[0];
+    filter.m = header.params[1];
+    filter.nkeys = header.nkeys;
+    filter.f = f;
+    filter.mapped = shared ? header.payload_size : 0;
+    return true;
+}
+
+// Loads into the staging filter and swaps it in, so queries running on the
+// current filter are never interrupted. A shared filter maps the file instead
+// of copying it, so processes loading the same file share its memory.
+// With a keysfile the staged filter must answer every key in it first, or the
+// current filter is kept.
+bool load_filter(char* filename, uint32_t maxkeys, uint8_t r, double oversize, bool shared, char* keysfile)
+{
+    rcu_write_lock(&published);
+    bool res = load_filter_staged(filename, maxkeys, r, oversize, shared)
+                && (keysfile == NULL
+                    || check_keys_file(keysfile, maxkeys, filter.r == 1 ? &contain_key_r8 : &contain_key_r16, &filter));
+    res = publish_filter(res);
+    rcu_write_unlock(&published);
+    return res;
+}
+
 
 #endif
@@ -3,6 +3,8 @@
 #include <stdbool.h>
 
 #include "ribbon128_avx2.h"
+#include "sidecar.h"
+#include "queryserver.h"
 
 
 static PyObject* method_construct_filter(PyObject *self, PyObject *args, PyObject *kwargs)
@@ -21,7 +23,37 @@ static PyObject* method_construct_filter(PyObject *self, PyObject *args, PyObjec
     if(overfactor <= 0)
         overfactor = 1. + (4. + 2.*rbytes)/128.;
 
-    return PyBool_FromLong(create_ribbon128(filename, maxkeys, rbytes, overfactor));
+    bool res;
+    Py_BEGIN_ALLOW_THREADS
+    res = create_ribbon128(filename, maxkeys, rbytes, overfactor);
+    Py_END_ALLOW_THREADS
+
+    return PyBool_FromLong(res);
+}
+
+static PyObject* method_build_filter(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    char* filename;
+    char* destfile;
+    uint32_t maxkeys = 0;
+    uint8_t rbytes = 1;
+    double overfactor = 0.;
+
+    static char *kwlist[] = {"filename", "destfile", "maxkeys", "r", "overfactor", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "ss|IBd", kwlist, 
+                                     &filename, &destfile, &maxkeys, &rbytes, &overfactor)) 
+        return NULL;
+        
+    assert(rbytes == 1 || rbytes == 2);
+    if(overfactor <= 0)
+        overfactor = 1. + (4. + 2.*rbytes)/128.;
+
+    bool res;
+    Py_BEGIN_ALLOW_THREADS
+    res = build_ribbon128(filename, destfile, maxkeys, rbytes, overfactor);
+    Py_END_ALLOW_THREADS
+
+    return PyBool_FromLong(res);
 }
 
 static PyObject *method_query_filter(PyObject *self, PyObject *args, PyObject *kwargs)
@@ -36,6 +68,40 @@ static PyObject *method_query_filter(PyObject *self, PyObject *args, PyObject *k
     return PyBool_FromLong(query_ribbon128(pass, hashed));
 }
 
+static PyObject *method_query_hashes(PyObject *self, PyObject *args)
+{
+    Py_buffer hashes;
+
+    if (!PyArg_ParseTuple(args, "y*", &hashes)) 
+        return NULL;
+
+    if (hashes.len % sizeof(ribbon128_key_t))
+    {
+        PyBuffer_Release(&hashes);
+        Py_RETURN_NONE;
+    }
+    uint64_t n = hashes.len / sizeof(ribbon128_key_t);
+    PyObject* bitmap = PyBytes_FromStringAndSize(NULL, (n + 7)/8);
+    if (bitmap == NULL)
+    {
+        PyBuffer_Release(&hashes);
+        return NULL;
+    }
+
+    bool res;
+    Py_BEGIN_ALLOW_THREADS
+    res = query_keys_bitmap(&query_ribbon128_batch, hashes.buf, n, (uint8_t*) PyBytes_AS_STRING(bitmap));
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&hashes);
+
+    if (!res)
+    {
+        Py_DECREF(bitmap);
+        Py_RETURN_NONE;
+    }
+    return bitmap;
+}
+
 static PyObject* method_sanity_check(PyObject *self, PyObject *args, PyObject *kwargs)
 {
     char* filename;
@@ -46,7 +112,12 @@ static PyObject* method_sanity_check(PyObject *self, PyObject *args, PyObject *k
                                      &filename, &maxkeys)) 
         return NULL;
 
-    return PyBool_FromLong(sanity_check(filename, maxkeys));
+    bool res;
+    Py_BEGIN_ALLOW_THREADS
+    res = sanity_check(filename, maxkeys);
+    Py_END_ALLOW_THREADS
+
+    return PyBool_FromLong(res);
 }
 
 static PyObject *method_fp_filter(PyObject *self, PyObject *args)
@@ -66,26 +137,36 @@ static PyObject *method_save_filter(PyObject *self, PyObject *args)
     if (!PyArg_ParseTuple(args, "s", &destfile)) 
         return NULL;
 
-    return PyBool_FromLong(save_filter(destfile));
+    bool res;
+    Py_BEGIN_ALLOW_THREADS
+    res = save_filter(destfile);
+    Py_END_ALLOW_THREADS
+
+    return PyBool_FromLong(res);
 }
 
 static PyObject *method_load_filter(PyObject *self, PyObject *args, PyObject *kwargs)
 {
     char* sourcefile;
     uint32_t maxkeys = 0;
-    uint8_t rbytes = 1;
+    uint8_t rbytes = 0;
     double overfactor = 0.;
+    bool shared = false;
+    char* keysfile = NULL;
 
-    static char *kwlist[] = {"sourcefile", "maxkeys", "r", "overfactor", NULL};
-    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|IBd", kwlist, 
-                                     &sourcefile, &maxkeys, &rbytes, &overfactor)) 
+    static char *kwlist[] = {"sourcefile", "maxkeys", "r", "overfactor", "shared", "keysfile", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|IBdbz", kwlist, 
+                                     &sourcefile, &maxkeys, &rbytes, &overfactor, &shared, &keysfile)) 
         return NULL;
     
-    assert(rbytes == 1 || rbytes == 2);
-    if(overfactor <= 0)
-        overfactor = 1. + (4. + 2.*rbytes)/128.;
+    assert(rbytes <= 2);
+
+    bool res;
+    Py_BEGIN_ALLOW_THREADS
+    res = load_filter(sourcefile, maxkeys, rbytes, overfactor, shared, keysfile);
+    Py_END_ALLOW_THREADS
 
-    return PyBool_FromLong(load_filter(sourcefile, maxkeys, rbytes, overfactor));
+    return PyBool_FromLong(res);
 }
 
 static PyObject *method_exist_filter(PyObject *self, PyObject *args)
@@ -99,17 +180,114 @@ static PyObject *method_destroy_filter(PyObject *self, PyObject *args)
     Py_RETURN_NONE;
 }
 
+static PyObject *method_serve_sidecar(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    char* name;
+    uint32_t rings = 16;
+    sidecar_t server;
+
+    static char *kwlist[] = {"name", "rings", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|I", kwlist, &name, &rings)) 
+        return NULL;
+
+    if (!sidecar_open_server(&server, name, rings))
+        Py_RETURN_FALSE;
+
+    // Come back every 100ms so that signals like Ctrl-C are handled.
+    bool serving = true;
+    while (serving)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        serving = sidecar_serve(&server, &query_ribbon128_batch, 100);
+        Py_END_ALLOW_THREADS
+        if (PyErr_CheckSignals() < 0)
+        {
+            sidecar_close_server(&server);
+            return NULL;
+        }
+    }
+    sidecar_close_server(&server);
+    Py_RETURN_TRUE;
+}
+
+static queryserver_t http_server = {0};
+
+static PyObject *method_serve_http(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    uint16_t port;
+    char* url = "api/";
+    char* secret = NULL;
+    char* issuer = "FilterServer";
+    bool open = true;
+    uint32_t threads = 0;
+    char* host = "0.0.0.0";
+
+    static char *kwlist[] = {"port", "url", "secret", "issuer", "open", "threads", "host", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "H|szsbIs", kwlist, 
+                                     &port, &url, &secret, &issuer, &open, &threads, &host)) 
+        return NULL;
+
+    if (http_server.nthreads)
+        Py_RETURN_FALSE;
+    if (!open && (secret == NULL || !*secret))
+    {
+        printf("A secret is required to check tokens.\n");
+        Py_RETURN_FALSE;
+    }
+    http_server.query = &query_ribbon128;
+    http_server.exist = &filter_exist;
+    http_server.open = open;
+    snprintf(http_server.url, sizeof(http_server.url), "/%s", url);
+    snprintf(http_server.secret, sizeof(http_server.secret), "%s", secret ? secret : "");
+    snprintf(http_server.issuer, sizeof(http_server.issuer), "%s", issuer);
+
+    bool res;
+    Py_BEGIN_ALLOW_THREADS
+    res = queryserver_start(&http_server, host, port, threads);
+    Py_END_ALLOW_THREADS
+    if (!res)
+        Py_RETURN_FALSE;
+
+    // Come back every 100ms so that signals like Ctrl-C are handled.
+    bool stopped = false;
+    while (!stopped)
+    {
+        Py_BEGIN_ALLOW_THREADS
+        stopped = queryserver_wait(&http_server, 100);
+        Py_END_ALLOW_THREADS
+        if (PyErr_CheckSignals() < 0)
+            break;
+    }
+    Py_BEGIN_ALLOW_THREADS
+    queryserver_stop(&http_server);
+    Py_END_ALLOW_THREADS
+    if (!stopped)
+        return NULL;
+    Py_RETURN_TRUE;
+}
+
+static PyObject *method_stop_http(PyObject *self, PyObject *args)
+{
+    __atomic_store_n(&http_server.stop, 1, __ATOMIC_RELEASE);
+    Py_RETURN_NONE;
+}
+
 
 static PyMethodDef Ribbon128Methods[] =
 {
     {"construct_filter", (PyCFunction) method_construct_filter, METH_VARARGS | METH_KEYWORDS, ""},
+    {"build_filter", (PyCFunction) method_build_filter, METH_VARARGS | METH_KEYWORDS, ""},
     {"query_filter", (PyCFunction) method_query_filter, METH_VARARGS | METH_KEYWORDS, ""},
+    {"query_hashes", (PyCFunction) method_query_hashes, METH_VARARGS, ""},
     {"sanity_check", (PyCFunction) method_sanity_check, METH_VARARGS | METH_KEYWORDS, ""},
     {"fp_filter", (PyCFunction) method_fp_filter, METH_VARARGS, ""},
     {"save_filter", (PyCFunction) method_save_filter, METH_VARARGS, ""},
     {"load_filter", (PyCFunction) method_load_filter, METH_VARARGS | METH_KEYWORDS, ""},
     {"exist_filter", (PyCFunction) method_exist_filter, METH_NOARGS, ""},
     {"destroy_filter", (PyCFunction) method_destroy_filter, METH_NOARGS, ""},
+    {"serve_sidecar", (PyCFunction) method_serve_sidecar, METH_VARARGS | METH_KEYWORDS, ""},
+    {"serve_http", (PyCFunction) method_serve_http, METH_VARARGS | METH_KEYWORDS, ""},
+    {"stop_http", (PyCFunction) method_stop_http, METH_NOARGS, ""},
     {NULL, NULL, 0, NULL}
 };
 
@@ -0,0 +1,151 @@
+#ifndef SHA256_H
+#define SHA256_H
+
+#include <stdint.h>
+#include <string.h>
+
+#define SHA256_BLOCK (64)
+#define SHA256_DIGEST (32)
+
+
+// Plain C SHA-256 (FIPS 180-4), only used for HMAC-SHA256 on short inputs.
+typedef struct
+{
+    uint32_t h[8];
+    uint64_t len;
+    uint8_t buf[SHA256_BLOCK];
+    uint32_t n;
+} sha256_t;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define SHA256_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(sha256_t* s, const uint8_t* p)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+        w[i] = (uint32_t)p[4*i] << 24 | (uint32_t)p[4*i+1] << 16 | (uint32_t)p[4*i+2] << 8 | p[4*i+3];
+    for (int i = 16; i < 64; i++)
+    {
+        uint32_t s0 = SHA256_ROR(w[i-15], 7) ^ SHA256_ROR(w[i-15], 18) ^ (w[i-15] >> 3);
+        uint32_t s1 = SHA256_ROR(w[i-2], 17) ^ SHA256_ROR(w[i-2], 19) ^ (w[i-2] >> 10);
+        w[i] = w[i-16] + s0 + w[i-7] + s1;
+    }
+    uint32_t a = s->h[0], b = s->h[1], c = s->h[2], d = s->h[3];
+    uint32_t e = s->h[4], f = s->h[5], g = s->h[6], h = s->h[7];
+    for (int i = 0; i < 64; i++)
+    {
+        uint32_t t1 = h + (SHA256_ROR(e, 6) ^ SHA256_ROR(e, 11) ^ SHA256_ROR(e, 25))
+                        + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (SHA256_ROR(a, 2) ^ SHA256_ROR(a, 13) ^ SHA256_ROR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d;
+    s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+}
+
+static inline void sha256_init(sha256_t* s)
+{
+    static const uint32_t h0[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                   0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(s->h, h0, sizeof(h0));
+    s->len = 0;
+    s->n = 0;
+}
+
+static void sha256_update(sha256_t* s, const void* data, uint64_t len)
+{
+    const uint8_t* p = data;
+    s->len += len;
+    while (len)
+    {
+        if (s->n == 0 && len >= SHA256_BLOCK)
+        {
+            sha256_block(s, p);
+            p += SHA256_BLOCK;
+            len -= SHA256_BLOCK;
+            continue;
+        }
+        uint32_t k = SHA256_BLOCK - s->n < len ? SHA256_BLOCK - s->n : len;
+        memcpy(s->buf + s->n, p, k);
+        s->n += k;
+        p += k;
+        len -= k;
+        if (s->n == SHA256_BLOCK)
+        {
+            sha256_block(s, s->buf);
+            s->n = 0;
+        }
+    }
+}
+
+static void sha256_final(sha256_t* s, uint8_t* digest)
+{
+    uint64_t bits = s->len*8;
+    uint8_t pad = 0x80;
+    sha256_update(s, &pad, 1);
+    pad = 0;
+    while (s->n != SHA256_BLOCK - 8)
+        sha256_update(s, &pad, 1);
+    for (int i = 7; i >= 0; i--)
+    {
+        uint8_t b = bits >> (8*i);
+        sha256_update(s, &b, 1);
+    }
+    for (int i = 0; i < 8; i++)
+    {
+        digest[4*i] = s->h[i] >> 24;
+        digest[4*i+1] = s->h[i] >> 16;
+        digest[4*i+2] = s->h[i] >> 8;
+        digest[4*i+3] = s->h[i];
+    }
+}
+
+static void sha256(const void* data, uint64_t len, uint8_t* digest)
+{
+    sha256_t s;
+    sha256_init(&s);
+    sha256_update(&s, data, len);
+    sha256_final(&s, digest);
+}
+
+// RFC 2104 HMAC over SHA-256.
+static void hmac_sha256(const void* key, uint64_t keylen, const void* data, uint64_t len, uint8_t* digest)
+{
+    uint8_t k[SHA256_BLOCK] = {0};
+    uint8_t pad[SHA256_BLOCK];
+    uint8_t inner[SHA256_DIGEST];
+    sha256_t s;
+
+    if (keylen > SHA256_BLOCK)
+        sha256(key, keylen, k);
+    else
+        memcpy(k, key, keylen);
+
+    for (int i = 0; i < SHA256_BLOCK; i++)
+        pad[i] = k[i] ^ 0x36;
+    sha256_init(&s);
+    sha256_update(&s, pad, SHA256_BLOCK);
+    sha256_update(&s, data, len);
+    sha256_final(&s, inner);
+
+    for (int i = 0; i < SHA256_BLOCK; i++)
+        pad[i] = k[i] ^ 0x5c;
+    sha256_init(&s);
+    sha256_update(&s, pad, SHA256_BLOCK);
+    sha256_update(&s, inner, SHA256_DIGEST);
+    sha256_final(&s, digest);
+}
+
+
+#endif
@@ -0,0 +1,370 @@
+#ifndef SIDECAR_H
+#define SIDECAR_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <immintrin.h>
+
+#include "utils.h"
+
+#define MAGIC_SIDECAR "$pwned-sidecar-1.0\n"
+#define SIDECAR_RINGS_MAX (1024)
+#define SIDECAR_RING (1024)
+#define SIDECAR_SPIN (1 << 14)
+#define SIDECAR_TIMEOUT_MS (1000)
+#define SIDECAR_ERROR (2)
+
+
+/*
+ * Shared memory segment /<name> of a sidecar:
+ *
+ *   sidecar_shm_t | sidecar_ring_t[nrings]
+ *
+ * Each client thread claims one ring and is its only producer; the server is
+ * the only consumer of every ring. Request i goes to keys[i % SIDECAR_RING]
+ * and its answer to results[i % SIDECAR_RING]: the client publishes it by
+ * moving head past it and the server answers every pending request at once,
+ * then moves done up to head. While all rings stay empty the server sleeps on
+ * the datagram socket @<name> (abstract namespace), and clients that see
+ * sleeping set send it one byte after publishing their requests.
+ */
+typedef struct
+{
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t done __attribute__((aligned(64)));
+    int32_t owner __attribute__((aligned(64)));
+    ribbon128_key_t keys[SIDECAR_RING];
+    uint8_t results[SIDECAR_RING];
+} sidecar_ring_t;
+
+typedef struct
+{
+    char magic[32];
+    int32_t server;
+    uint32_t nrings;
+    uint32_t sleeping __attribute__((aligned(64)));
+    uint32_t stop;
+    sidecar_ring_t rings[];
+} sidecar_shm_t;
+
+typedef struct
+{
+    sidecar_shm_t* shm;
+    uint64_t size;
+    int sock;
+    struct sockaddr_un addr;
+    socklen_t addrlen;
+    char name[NAME_MAX];
+    sidecar_ring_t* ring;
+    pid_t pid;
+} sidecar_t;
+
+// Answers n keys into results (0 or 1), returning 0 when there is no filter.
+typedef uint32_t (*sidecar_batch_t)(const ribbon128_key_t* keys, uint32_t n, uint8_t* results);
+
+
+static inline uint64_t sidecar_size(uint32_t nrings)
+{
+    return sizeof(sidecar_shm_t) + (uint64_t)nrings*sizeof(sidecar_ring_t);
+}
+
+static inline uint64_t sidecar_now_ms()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec*1000 + now.tv_nsec/1000000;
+}
+
+static inline bool sidecar_alive(pid_t pid)
+{
+    return pid > 0 && (kill(pid, 0) == 0 || errno != ESRCH);
+}
+
+static bool sidecar_socket(sidecar_t* sc, const char* name)
+{
+    bzero(&sc->addr, sizeof(struct sockaddr_un));
+    sc->addr.sun_family = AF_UNIX;
+    snprintf(sc->addr.sun_path + 1, sizeof(sc->addr.sun_path) - 1, "%s", name);
+    sc->addrlen = offsetof(struct sockaddr_un, sun_path) + 1 + strlen(sc->addr.sun_path + 1);
+    sc->sock = socket(AF_UNIX, SOCK_DGRAM|SOCK_CLOEXEC|SOCK_NONBLOCK, 0);
+    return sc->sock >= 0;
+}
+
+static void sidecar_unmap(sidecar_t* sc)
+{
+    if (sc->shm != NULL)
+        munmap(sc->shm, sc->size);
+    if (sc->sock > 0)
+        close(sc->sock);
+    bzero(sc, sizeof(sidecar_t));
+}
+
+//-------------------------------------------------------------------------------------------------------
+
+void sidecar_close_server(sidecar_t* sc)
+{
+    char shmname[NAME_MAX+1];
+    if (sc->shm != NULL)
+    {
+        snprintf(shmname, sizeof(shmname), "/%s", sc->name);
+        shm_unlink(shmname);
+    }
+    sidecar_unmap(sc);
+}
+
+bool sidecar_open_server(sidecar_t* sc, const char* name, uint32_t nrings)
+{
+    char shmname[NAME_MAX+1];
+    bzero(sc, sizeof(sidecar_t));
+    nrings = nrings < 1 ? 1 : (nrings > SIDECAR_RINGS_MAX ? SIDECAR_RINGS_MAX : nrings);
+    snprintf(sc->name, NAME_MAX, "%s", name);
+    snprintf(shmname, sizeof(shmname), "/%s", name);
+    sc->size = sidecar_size(nrings);
+
+    // Binding the socket first makes it the lock: only one server per name.
+    if (!sidecar_socket(sc, name) || bind(sc->sock, (struct sockaddr*) &sc->addr, sc->addrlen))
+    {
+        printf("Cannot bind the sidecar socket @%s", name);
+        perror("");
+        sidecar_unmap(sc);
+        return false;
+    }
+    shm_unlink(shmname);
+    int fd = shm_open(shmname, O_CREAT|O_EXCL|O_RDWR, 0600);
+    if (fd < 0 || ftruncate(fd, sc->size)
+        || (sc->shm = mmap(NULL, sc->size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        printf("Cannot create the shared memory %s", shmname);
+        perror("");
+        sc->shm = NULL;
+        if (fd >= 0)
+        {
+            close(fd);
+            shm_unlink(shmname);
+        }
+        sidecar_unmap(sc);
+        return false;
+    }
+    close(fd);
+    sc->shm->server = getpid();
+    sc->shm->nrings = nrings;
+    __atomic_store_n(&sc->shm->stop, 0, __ATOMIC_RELAXED);
+    // Clients only attach once the magic is there.
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(sc->shm->magic, MAGIC_SIDECAR, sizeof(MAGIC_SIDECAR));
+    return true;
+}
+
+static inline bool sidecar_pending(const sidecar_shm_t* shm)
+{
+    for (uint32_t i = 0; i < shm->nrings; i++)
+        if (__atomic_load_n(&shm->rings[i].head, __ATOMIC_SEQ_CST) != shm->rings[i].done)
+            return true;
+    return false;
+}
+
+// Answers everything published in the ring so far, in at most two batches.
+static inline bool sidecar_drain(sidecar_ring_t* ring, sidecar_batch_t batch)
+{
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t done = ring->done;
+    if (head == done)
+        return false;
+    while (done != head)
+    {
+        uint32_t index = done % SIDECAR_RING;
+        uint32_t n = head - done < SIDECAR_RING - index ? head - done : SIDECAR_RING - index;
+        if (!batch(&ring->keys[index], n, &ring->results[index]))
+            memset(&ring->results[index], SIDECAR_ERROR, n);
+        done += n;
+    }
+    __atomic_store_n(&ring->done, head, __ATOMIC_RELEASE);
+    return true;
+}
+
+/*
+ * Serves requests for about timeout_ms, spinning over the rings while there
+ * is work and sleeping on the socket once they have been idle for a while.
+ * Returns false once a client asked the server to stop.
+ */
+bool sidecar_serve(sidecar_t* sc, sidecar_batch_t batch, uint32_t timeout_ms)
+{
+    sidecar_shm_t* shm = sc->shm;
+    uint64_t deadline = sidecar_now_ms() + timeout_ms;
+    uint32_t idle = 0;
+    char buf[64];
+    while (!__atomic_load_n(&shm->stop, __ATOMIC_ACQUIRE))
+    {
+        bool busy = false;
+        for (uint32_t i = 0; i < shm->nrings; i++)
+            busy |= sidecar_drain(&shm->rings[i], batch);
+        if (busy)
+        {
+            idle = 0;
+            continue;
+        }
+        if (++idle % 1024 == 0 && sidecar_now_ms() >= deadline)
+            return true;
+        if (idle < SIDECAR_SPIN)
+        {
+            _mm_pause();
+            continue;
+        }
+
+        // Announce the nap before the last look at the rings: a client either
+        // sees sleeping set or its request is seen here.
+        __atomic_store_n(&shm->sleeping, 1, __ATOMIC_SEQ_CST);
+        if (!sidecar_pending(shm))
+        {
+            uint64_t now = sidecar_now_ms();
+            struct pollfd pfd = {.fd = sc->sock, .events = POLLIN};
+            poll(&pfd, 1, now < deadline ? deadline - now : 0);
+            while (recv(sc->sock, buf, sizeof(buf), MSG_DONTWAIT) > 0);
+        }
+        __atomic_store_n(&shm->sleeping, 0, __ATOMIC_SEQ_CST);
+        idle = 0;
+        if (sidecar_now_ms() >= deadline)
+            return true;
+    }
+    return false;
+}
+
+//-------------------------------------------------------------------------------------------------------
+
+void sidecar_disconnect(sidecar_t* sc)
+{
+    if (sc->ring != NULL && sc->pid == getpid())
+        __atomic_store_n(&sc->ring->owner, 0, __ATOMIC_RELEASE);
+    sidecar_unmap(sc);
+}
+
+bool sidecar_connect(sidecar_t* sc, const char* name)
+{
+    char shmname[NAME_MAX+1];
+    struct stat st;
+    bzero(sc, sizeof(sidecar_t));
+    snprintf(sc->name, NAME_MAX, "%s", name);
+    snprintf(shmname, sizeof(shmname), "/%s", name);
+    sc->pid = getpid();
+    int fd = shm_open(shmname, O_RDWR, 0);
+    if (fd < 0)
+        return false;
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof(sidecar_shm_t)
+        || (sc->shm = mmap(NULL, st.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0)) == MAP_FAILED)
+    {
+        sc->shm = NULL;
+        close(fd);
+        return false;
+    }
+    close(fd);
+    sc->size = st.st_size;
+    if (strncmp(sc->shm->magic, MAGIC_SIDECAR, sizeof(sc->shm->magic))
+        || sc->size < sidecar_size(sc->shm->nrings)
+        || !sidecar_alive(sc->shm->server)
+        || !sidecar_socket(sc, name))
+    {
+        sidecar_unmap(sc);
+        return false;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    // Take a free ring, or one left behind by a process that is gone.
+    for (uint32_t i = 0; i < sc->shm->nrings && sc->ring == NULL; i++)
+    {
+        sidecar_ring_t* ring = &sc->shm->rings[i];
+        int32_t owner = __atomic_load_n(&ring->owner, __ATOMIC_ACQUIRE);
+        if ((owner == 0 || !sidecar_alive(owner))
+            && __atomic_compare_exchange_n(&ring->owner, &owner, sc->pid, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+            sc->ring = ring;
+    }
+    if (sc->ring == NULL)
+    {
+        printf("No free ring in sidecar %s.\n", name);
+        sidecar_unmap(sc);
+        return false;
+    }
+    return true;
+}
+
+static inline void sidecar_wake(sidecar_t* sc)
+{
+    if (__atomic_load_n(&sc->shm->sleeping, __ATOMIC_SEQ_CST))
+        sendto(sc->sock, "", 1, MSG_DONTWAIT, (struct sockaddr*) &sc->addr, sc->addrlen);
+}
+
+/*
+ * Sends up to SIDECAR_RING keys and waits for their answers (0, 1 or
+ * SIDECAR_ERROR when the server has no filter). Returns false if the server
+ * did not answer in time; the connection should be dropped then.
+ */
+bool sidecar_query_batch(sidecar_t* sc, const ribbon128_key_t* keys, uint32_t n, uint8_t* results)
+{
+    sidecar_ring_t* ring = sc->ring;
+    if (__atomic_load_n(&sc->shm->stop, __ATOMIC_ACQUIRE))
+        return false;
+    uint64_t seq = ring->head;
+    n = n < SIDECAR_RING ? n : SIDECAR_RING;
+    uint64_t deadline = 0;
+    for (uint32_t spin = 0; seq + n - __atomic_load_n(&ring->done, __ATOMIC_ACQUIRE) > SIDECAR_RING; spin++)
+    {
+        // Requests left behind by a previous owner of the ring.
+        if (!deadline)
+            deadline = sidecar_now_ms() + SIDECAR_TIMEOUT_MS;
+        if (spin % 1024 == 0 && sidecar_now_ms() >= deadline)
+            return false;
+        sched_yield();
+    }
+    for (uint32_t i = 0; i < n; i++)
+        ring->keys[(seq + i) % SIDECAR_RING] = keys[i];
+    __atomic_store_n(&ring->head, seq + n, __ATOMIC_SEQ_CST);
+    sidecar_wake(sc);
+
+    deadline = sidecar_now_ms() + SIDECAR_TIMEOUT_MS;
+    for (uint32_t spin = 0; __atomic_load_n(&ring->done, __ATOMIC_ACQUIRE) < seq + n; spin++)
+    {
+        if (spin < SIDECAR_SPIN)
+        {
+            _mm_pause();
+            continue;
+        }
+        if (spin % 1024 == 0 && (sidecar_now_ms() >= deadline || !sidecar_alive(sc->shm->server)
+                                 || __atomic_load_n(&sc->shm->stop, __ATOMIC_ACQUIRE)))
+            return false;
+        sidecar_wake(sc);
+        sched_yield();
+    }
+    for (uint32_t i = 0; i < n; i++)
+        results[i] = ring->results[(seq + i) % SIDECAR_RING];
+    return true;
+}
+
+// Asks the server behind name to stop serving.
+bool sidecar_shutdown(const char* name)
+{
+    sidecar_t sc;
+    if (!sidecar_connect(&sc, name))
+        return false;
+    __atomic_store_n(&sc.shm->stop, 1, __ATOMIC_RELEASE);
+    sendto(sc.sock, "", 1, MSG_DONTWAIT, (struct sockaddr*) &sc.addr, sc.addrlen);
+    sidecar_disconnect(&sc);
+    return true;
+}
+
+
+#endif
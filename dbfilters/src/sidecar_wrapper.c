@@ -0,0 +1,193 @@
+#include <Python.h>
+#include <stdio.h>
+#include <stdbool.h>
+
+#include "sidecar.h"
+
+
+// One connection per thread, each on a ring of its own, so threads never wait
+// for each other and there is no lock for a fork to leave held. A thread
+// gives its ring back when it exits. A forked child does not own its parent's
+// ring, so it connects again on its first query.
+static pthread_key_t client_key;
+static pthread_once_t client_once = PTHREAD_ONCE_INIT;
+
+static void client_release(void* arg)
+{
+    sidecar_t* client = arg;
+    if (client->shm != NULL)
+        sidecar_disconnect(client);
+    free(client);
+}
+
+static void client_init()
+{
+    pthread_key_create(&client_key, client_release);
+}
+
+// The calling thread's connection to the sidecar name, NULL if it cannot connect.
+static sidecar_t* sidecar_client(char* name)
+{
+    pthread_once(&client_once, client_init);
+    sidecar_t* client = pthread_getspecific(client_key);
+    if (client == NULL)
+    {
+        client = calloc(1, sizeof(sidecar_t));
+        if (client == NULL || pthread_setspecific(client_key, client))
+        {
+            free(client);
+            return NULL;
+        }
+    }
+    if (client->shm != NULL && (client->pid != getpid() || strcmp(client->name, name)))
+        sidecar_disconnect(client);
+    if (client->shm == NULL && !sidecar_connect(client, name))
+        return NULL;
+    return client;
+}
+
+static int sidecar_ask(char* name, char* pass, bool hashed)
+{
+    ribbon128_key_t key;
+    uint8_t result;
+
+    if (!((hashed && hash2key(pass, &key)) || password2key(pass, &key)))
+        return -1;
+    sidecar_t* client = sidecar_client(name);
+    if (client == NULL)
+        return -1;
+    if (!sidecar_query_batch(client, &key, 1, &result))
+    {
+        sidecar_disconnect(client);
+        result = SIDECAR_ERROR;
+    }
+    return result == SIDECAR_ERROR ? -1 : result;
+}
+
+// Packs the answers for n keys into bitmap, SIDECAR_RING keys per round trip.
+static bool sidecar_ask_bitmap(char* name, const ribbon128_key_t* keys, uint64_t n, uint8_t* bitmap)
+{
+    uint8_t results[SIDECAR_RING];
+
+    bzero(bitmap, (n + 7)/8);
+    sidecar_t* client = sidecar_client(name);
+    bool res = client != NULL;
+    for (uint64_t i = 0; i < n && res; i += SIDECAR_RING)
+    {
+        uint32_t k = n - i < SIDECAR_RING ? n - i : SIDECAR_RING;
+        if (!sidecar_query_batch(client, keys + i, k, results))
+        {
+            sidecar_disconnect(client);
+            res = false;
+        }
+        for (uint32_t j = 0; j < k && res; j++)
+        {
+            res = results[j] != SIDECAR_ERROR;
+            bitmap[(i + j)/8] |= (results[j] & 1) << ((i + j)%8);
+        }
+    }
+    return res;
+}
+
+static PyObject *method_query(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    char* name;
+    char* pass;
+    bool hashed = false;
+    int res;
+
+    static char *kwlist[] = {"name", "password", "hashed", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "ss|b", kwlist, &name, &pass, &hashed))
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    res = sidecar_ask(name, pass, hashed);
+    Py_END_ALLOW_THREADS
+
+    if (res < 0)
+        Py_RETURN_NONE;
+    return PyBool_FromLong(res);
+}
+
+static PyObject *method_query_hashes(PyObject *self, PyObject *args)
+{
+    char* name;
+    Py_buffer hashes;
+
+    if (!PyArg_ParseTuple(args, "sy*", &name, &hashes))
+        return NULL;
+
+    if (hashes.len % sizeof(ribbon128_key_t))
+    {
+        PyBuffer_Release(&hashes);
+        Py_RETURN_NONE;
+    }
+    uint64_t n = hashes.len / sizeof(ribbon128_key_t);
+    PyObject* bitmap = PyBytes_FromStringAndSize(NULL, (n + 7)/8);
+    if (bitmap == NULL)
+    {
+        PyBuffer_Release(&hashes);
+        return NULL;
+    }
+
+    bool res;
+    Py_BEGIN_ALLOW_THREADS
+    res = sidecar_ask_bitmap(name, hashes.buf, n, (uint8_t*) PyBytes_AS_STRING(bitmap));
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&hashes);
+
+    if (!res)
+    {
+        Py_DECREF(bitmap);
+        Py_RETURN_NONE;
+    }
+    return bitmap;
+}
+
+static PyObject *method_shutdown(PyObject *self, PyObject *args)
+{
+    char* name;
+
+    if (!PyArg_ParseTuple(args, "s", &name))
+        return NULL;
+
+    return PyBool_FromLong(sidecar_shutdown(name));
+}
+
+// Drops the calling thread's connection.
+static PyObject *method_disconnect(PyObject *self, PyObject *args)
+{
+    pthread_once(&client_once, client_init);
+    sidecar_t* client = pthread_getspecific(client_key);
+    if (client != NULL && client->shm != NULL)
+        sidecar_disconnect(client);
+    Py_RETURN_NONE;
+}
+
+
+static PyMethodDef SidecarMethods[] =
+{
+    {"query", (PyCFunction) method_query, METH_VARARGS | METH_KEYWORDS, ""},
+    {"query_hashes", (PyCFunction) method_query_hashes, METH_VARARGS, ""},
+    {"shutdown", (PyCFunction) method_shutdown, METH_VARARGS, ""},
+    {"disconnect", (PyCFunction) method_disconnect, METH_NOARGS, ""},
+    {NULL, NULL, 0, NULL}
+};
+
+static struct PyModuleDef SidecarModule =
+{
+    PyModuleDef_HEAD_INIT,
+    "sidecar",
+    "",
+    -1,
+    SidecarMethods,
+    NULL,
+    NULL,
+    NULL,
+    NULL
+};
+
+PyMODINIT_FUNC PyInit_sidecar(void)
+{
+    return PyModule_Create(&SidecarModule);
+}
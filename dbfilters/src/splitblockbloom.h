@@ -5,21 +5,32 @@
 #include <stdint.h>
 
 #include "utils.h"
+#include "filterfile.h"
+#include "rcu.h"
 
 #define MAGIC_FILTER "$splitblockbloom-filter-1.0\n"
 
 
 typedef struct splitblockbloom {
     uint32_t num_buckets;
+    uint64_t num_keys;
     __m256i* fingerprints;
+    uint64_t mapped; // Bytes of fingerprints mapped from the filter file, 0 if allocated.
 } splitblockbloom_t;
 
+// Constructions and loads fill the staging filter; queries only ever read the
+// published copy, which is replaced through RCU.
 static splitblockbloom_t filter = {0};
+static rcu_t published = RCU_INITIALIZER;
+// A second filter, independent of the one above, that REMOTE clients keep to
+// rule out passwords without asking the server. Staged through the same
+// filter, so loads hold both write locks.
+static rcu_t prefiltered = RCU_INITIALIZER;
 
 // Take a hash value and get the block to access within a filter with
 // num_buckets buckets.
-static inline uint64_t block_index(const uint64_t hash) {
-    return ((hash >> 32) * filter.num_buckets) >> 32;
+static inline uint64_t block_index(const splitblockbloom_t* f, const uint64_t hash) {
+    return ((hash >> 32) * f->num_buckets) >> 32;
 }
 
 // Takes a hash value and creates a mask with one bit set in each 32-bit lane.
@@ -41,17 +52,17 @@ static inline __m256i make_mask(uint32_t hash) {
 }
 
 static inline void add_hash(uint64_t hash) {
-    const uint64_t bucket_idx = block_index(hash);
+    const uint64_t bucket_idx = block_index(&filter, hash);
     const __m256i mask = make_mask(hash);
     __m256i *bucket = &filter.fingerprints[bucket_idx];
     // or the mask into the existing bucket
     _mm256_store_si256(bucket, _mm256_or_si256(*bucket, mask));
 }
 
-static inline bool find_hash(uint64_t hash) {
-    const uint64_t bucket_idx = block_index(hash);
+static inline bool find_hash(const splitblockbloom_t* f, uint64_t hash) {
+    const uint64_t bucket_idx = block_index(f, hash);
     const __m256i mask = make_mask(hash);
-    const __m256i *bucket = &filter.fingerprints[bucket_idx];
+    const __m256i *bucket = &f->fingerprints[bucket_idx];
     // checks if all the bits in mask are also set in *bucket. Scalar
     // equivalent: (~bucket & mask) == 0
     return _mm256_testc_si256(*bucket, mask);
@@ -60,21 +71,53 @@ static inline bool find_hash(uint64_t hash) {
 
 //-------------------------------------------------------------------------------------------------------
 
+static void splitblockbloom_reset()
+{
+  free_filterfile(filter.fingerprints, filter.mapped);
+  bzero(&filter, sizeof(splitblockbloom_t));
+}
+
+static void splitblockbloom_release(splitblockbloom_t* f)
+{
+  if (f == NULL)
+    return;
+  free_filterfile(f->fingerprints, f->mapped);
+  free(f);
+}
+
+// Publishes the staging filter into rcu if it was staged, otherwise drops it
+// and keeps serving the previous one.
+static bool splitblockbloom_publish(rcu_t* rcu, bool staged)
+{
+  splitblockbloom_t* f = staged ? malloc(sizeof(splitblockbloom_t)) : NULL;
+  if (f == NULL)
+  {
+    splitblockbloom_reset();
+    return false;
+  }
+  *f = filter;
+  bzero(&filter, sizeof(splitblockbloom_t));
+  splitblockbloom_release(rcu_publish(rcu, f));
+  return true;
+}
+
 void splitblockbloom_destroy()
 {
-  free(filter.fingerprints);
-  filter.num_buckets = 0;
-  filter.fingerprints = NULL;
+  rcu_write_lock(&published);
+  splitblockbloom_reset();
+  splitblockbloom_release(rcu_publish(&published, NULL));
+  rcu_write_unlock(&published);
 }
 
-bool splitblockbloom_create(char* filename, uint32_t maxkeys, double oversize)
+static bool splitblockbloom_create_staged(char* filename, uint32_t maxkeys, double oversize)
 {
   ribbon128_key_t* key;
   if (!open_keys_file(filename, &maxkeys))
     return false;
-  splitblockbloom_destroy();
+  splitblockbloom_reset();
 
 	filter.num_buckets = (uint32_t)(maxkeys * (oversize/32.));
+  filter.num_keys = maxkeys;
   filter.fingerprints = (__m256i*)aligned_alloc(sizeof(__m256i), filter.num_buckets*sizeof(__m256i));
   bzero(filter.fingerprints, filter.num_buckets*sizeof(__m256i));
 
@@ -86,78 +129,132 @@ bool splitblockbloom_create(char* filename, uint32_t maxkeys, double oversize)
   return true;
 }
 
-bool splitblockbloom_exist()
+bool splitblockbloom_create(char* filename, uint32_t maxkeys, double oversize)
 {
-  return filter.fingerprints != NULL;
+  rcu_write_lock(&published);
+  bool res = splitblockbloom_publish(&published, splitblockbloom_create_staged(filename, maxkeys, oversize));
+  rcu_write_unlock(&published);
+  return res;
 }
 
-bool splitblockbloom_sanity(char* filename, uint32_t maxkeys)
+// Sets the bits straight into the payload of a new filter file.
+bool splitblockbloom_build(char* filename, char* destfile, uint32_t maxkeys, double oversize)
 {
-    assert(splitblockbloom_exist());
-    ribbon128_key_t* key;
-    if (!open_keys_file(filename, &maxkeys))
-        return false;
+  ribbon128_key_t* key;
+  filterfile_header_t header;
+  filterfile_out_t out;
+  bool res = false;
+  rcu_write_lock(&published);
+  if (!open_keys_file(filename, &maxkeys))
+  {
+    rcu_write_unlock(&published);
+    return false;
+  }
+  splitblockbloom_reset();
+
+  filter.num_buckets = (uint32_t)(maxkeys * (oversize/32.));
+  filter.num_keys = maxkeys;
+  init_filterfile_header(&header, FILTER_SPLITBLOCKBLOOM, filter.num_keys, 0, sizeof(__m256i)*filter.num_buckets);
+  header.params[0] = filter.num_buckets;
+  filter.fingerprints = open_filterfile_out(destfile, &header, &out, 0);
+  if (filter.fingerprints != NULL)
+  {
     while((key = read_key()) != NULL)
     {
-        if (!find_hash((uint64_t)key->ribbon))
-        {
-            printf("Sanity check failed.\n");
-            return false;
-        }
-    }
-    close_keys_file();
-    return true;
+      add_hash((uint64_t) key->ribbon);
+    } 
+    filter.fingerprints = NULL;
+    res = close_filterfile_out(&out, &header);
+  }
+  close_keys_file();
+  splitblockbloom_reset();
+  rcu_write_unlock(&published);
+  return res;
+}
+
+bool splitblockbloom_exist()
+{
+  return rcu_peek(&published) != NULL;
+}
+
+static bool splitblockbloom_contain_key(const void* f, const ribbon128_key_t* key)
+{
+    return find_hash(f, (uint64_t)key->ribbon);
+}
+
+bool splitblockbloom_sanity(char* filename, uint32_t maxkeys)
+{
+    uint32_t slot;
+    const splitblockbloom_t* f = rcu_read_lock(&published, &slot);
+    bool res = f != NULL && check_keys_file(filename, maxkeys, &splitblockbloom_contain_key, f);
+    rcu_read_unlock(&published, slot);
+    return res;
 }
 
 uint32_t splitblockbloom_fp(uint32_t n)
 {
-    assert(splitblockbloom_exist());
+    uint32_t slot;
+    const splitblockbloom_t* f = rcu_read_lock(&published, &slot);
     uint32_t matches = 0;
     init_shishua(clock());
     ribbon128_key_t randomkey; 
 
-    while(n--)
+    while(f != NULL && n--)
     {
       random_ribbon_key(&randomkey);
-      if(find_hash((uint64_t)randomkey.ribbon))
+      if(find_hash(f, (uint64_t)randomkey.ribbon))
           matches++;
     }
+    rcu_read_unlock(&published, slot);
     return matches;
 }
 
 bool splitblockbloom_query(char* pass, bool hashed)
 {
-  assert(splitblockbloom_exist());
+  uint32_t slot;
+  const splitblockbloom_t* f = rcu_read_lock(&published, &slot);
   ribbon128_key_t key;
-  if((hashed && hash2key(pass, &key)) || password2key(pass, &key))
-    return find_hash((uint64_t)key.ribbon);
-  else
-    return false;
+  bool res = f != NULL && ((hashed && hash2key(pass, &key)) || password2key(pass, &key))
+              && find_hash(f, (uint64_t)key.ribbon);
+  rcu_read_unlock(&published, slot);
+  return res;
 }
 
+// Answers n keys under one read section, prefetching the blocks a few keys
+// ahead. Returns 0 when there is no filter.
+uint32_t splitblockbloom_query_batch(const ribbon128_key_t* keys, uint32_t n, uint8_t* results)
+{
+  uint32_t slot;
+  const splitblockbloom_t* f = rcu_read_lock(&published, &slot);
+  if (f == NULL)
+    n = 0;
+  for (uint32_t i = 0; i < n; i++)
+  {
+    if (i + 8 < n)
+      __builtin_prefetch(&f->fingerprints[block_index(f, (uint64_t)keys[i+8].ribbon)]);
+    results[i] = find_hash(f, (uint64_t)keys[i].ribbon);
+  }
+  rcu_read_unlock(&published, slot);
+  return n;
+}
 
 bool splitblockbloom_save(char* filename)
 {
-  assert(splitblockbloom_exist());
-  FILE* fp = fopen(filename, "wb");
-  if (fp == NULL)
+  uint32_t slot;
+  const splitblockbloom_t* f = rcu_read_lock(&published, &slot);
+  filterfile_header_t header;
+  bool res = false;
+  if (f != NULL)
   {
-    printf("Cannot open the output file %s.", filename);
-    return false;
+    init_filterfile_header(&header, FILTER_SPLITBLOCKBLOOM, f->num_keys, 0, sizeof(__m256i)*f->num_buckets);
+    header.params[0] = f->num_buckets;
+    res = save_filterfile(filename, &header, f->fingerprints);
   }
-  if (!fwrite(MAGIC_FILTER, sizeof(MAGIC_FILTER), 1, fp)
-      || !fwrite(&filter.num_buckets, sizeof(filter.num_buckets), 1, fp)
-      || !fwrite(filter.fingerprints, sizeof(__m256i)*filter.num_buckets, 1, fp))
-  {
-    perror("Error when writing into file");
-    fclose(fp);
-    return false;
-  }
-  fclose(fp);
-  return true;
+  rcu_read_unlock(&published, slot);
+  return res;
 }
 
-bool splitblockbloom_load(char* filename, uint32_t maxkeys, double oversize)
+static bool splitblockbloom_load_v1(char* filename, uint32_t maxkeys, double oversize)
 {
   FILE* fp = fopen(filename, "rb");
   if (fp == NULL)
@@ -165,10 +262,10 @@ bool splitblockbloom_load(char* filename, uint32_t maxkeys, double oversize)
     printf("Cannot open the input file %s.", filename);
     return false;
   }
-  if (filter.fingerprints != NULL)
-    splitblockbloom_destroy();
+  splitblockbloom_reset();
   
   char magic[sizeof(MAGIC_FILTER)];
+  oversize = oversize > 0 ? oversize : 1.315;
   uint32_t expected_num_buckets = (uint32_t)(maxkeys * (oversize/32.));
   if (!fread(magic, sizeof(MAGIC_FILTER), 1, fp) 
       || strcmp(magic, MAGIC_FILTER)
@@ -192,4 +289,79 @@ bool splitblockbloom_load(char* filename, uint32_t maxkeys, double oversize)
   return true;
 }
 
+static bool splitblockbloom_load_staged(char* filename, uint32_t maxkeys, double oversize, bool shared)
+{
+  filterfile_header_t header;
+  if (!is_filterfile(filename))
+    return splitblockbloom_load_v1(filename, maxkeys, oversize);
+  __m256i* fingerprints = shared ? map_filterfile(filename, FILTER_SPLITBLOCKBLOOM, &header)
+                                 : load_filterfile(filename, FILTER_SPLITBLOCKBLOOM, &header);
+  if (fingerprints == NULL)
+    return false;
+  if (header.payload_size != sizeof(__m256i)*header.params[0]
+      || (maxkeys && header.nkeys != maxkeys)
+      || (oversize > 0 && header.params[0] != (uint32_t)(header.nkeys * (oversize/32.))))
+  {
+    printf("Filter file %s was built with other parameters.\n", filename);
+    free_filterfile(fingerprints, shared ? header.payload_size : 0);
+    return false;
+  }
+  splitblockbloom_reset();
+  filter.num_buckets = header.params[0];
+  filter.num_keys = header.nkeys;
+  filter.fingerprints = fingerprints;
+  filter.mapped = shared ? header.payload_size : 0;
+  return true;
+}
+
+// Loads into the staging filter and swaps it in, so queries running on the
+// current filter are never interrupted. A shared filter maps the file instead
+// of copying it, so processes loading the same file share its memory.
+// With a keysfile the staged filter must answer every key in it first, or the
+// current filter is kept.
+bool splitblockbloom_load(char* filename, uint32_t maxkeys, double oversize, bool shared, char* keysfile)
+{
+  rcu_write_lock(&published);
+  bool res = splitblockbloom_load_staged(filename, maxkeys, oversize, shared)
+              && (keysfile == NULL || check_keys_file(keysfile, maxkeys, &splitblockbloom_contain_key, &filter));
+  res = splitblockbloom_publish(&published, res);
+  rcu_write_unlock(&published);
+  return res;
+}
+
+bool splitblockbloom_load_prefilter(char* filename, bool shared)
+{
+  rcu_write_lock(&published);
+  rcu_write_lock(&prefiltered);
+  bool res = splitblockbloom_publish(&prefiltered, splitblockbloom_load_staged(filename, 0, 0., shared));
+  rcu_write_unlock(&prefiltered);
+  rcu_write_unlock(&published);
+  return res;
+}
+
+void splitblockbloom_destroy_prefilter()
+{
+  rcu_write_lock(&prefiltered);
+  splitblockbloom_release(rcu_publish(&prefiltered, NULL));
+  rcu_write_unlock(&prefiltered);
+}
+
+bool splitblockbloom_exist_prefilter()
+{
+  return rcu_peek(&prefiltered) != NULL;
+}
+
+// False only when the prefilter rules the password out; without a prefilter
+// nothing is ruled out.
+bool splitblockbloom_query_prefilter(char* pass, bool hashed)
+{
+  uint32_t slot;
+  const splitblockbloom_t* f = rcu_read_lock(&prefiltered, &slot);
+  ribbon128_key_t key;
+  bool res = f == NULL || !((hashed && hash2key(pass, &key)) || password2key(pass, &key))
+              || find_hash(f, (uint64_t)key.ribbon);
+  rcu_read_unlock(&prefiltered, slot);
+  return res;
+}
+
 #endif
\ No newline at end of file
@@ -12,27 +12,29 @@
 #include <unistd.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <limits.h>
+#include <pthread.h>
+#include <libgen.h>
+#include <poll.h>
+#include <sys/inotify.h>
 
 #include "shishua.h"
 #include "sha1.h"
 #include "hex_avx2.h"
+#include "keys2.h"
 
 #if !defined(__AVX2__)
 #error AVX2 required: Compile with "-mavx2" option.
 #endif
 
 #define MAGIC_KEYS "$ribbon128-keys-1.0\n"
+#define MAGIC_SHARDS "$ribbon128-shards-1.0\n"
 #define SHISHUA_BUF (128)
 #define AIO_MAXKEYS (4096)
 #define AIO_BUF (AIO_MAXKEYS*sizeof(ribbon128_key_t))
+#define SHARDS_MAX (1024)
 
 
-typedef struct __attribute__((__packed__))
-{
-    __uint128_t ribbon;
-    uint32_t index;
-} ribbon128_key_t;
-
 typedef struct
 {
     prng_state s;
@@ -46,13 +48,50 @@ typedef struct
     ribbon128_key_t* bufs[2];
     uint32_t bindex;
     uint32_t kindex;
+    uint32_t count;
+    uint32_t pending;
+    uint64_t left;
     uint64_t offset;
-    int32_t nblocks;
-    
+    uint8_t version;
+    keys2_header_t header;
+    keys2_index_t* index;
+    uint8_t* raw[2];
+    uint32_t block;
 } aio_t;
 
+/*
+ * Shards manifest: the MAGIC_SHARDS line followed by one "<nkeys> <file>" line
+ * per keys file. Each file is a regular v1 or v2 keys file that can be read
+ * on its own.
+ */
+typedef struct
+{
+    uint32_t nfiles;
+    uint64_t total;
+    uint64_t* nkeys;
+    char** files;
+} shards_t;
+
+typedef struct
+{
+    shards_t shards;
+    uint32_t shard;
+    uint32_t maxkeys;
+} keys_t;
+
+typedef struct
+{
+    shards_t shards;
+    uint32_t maxkeys;
+    bool (*check)(const void*, const ribbon128_key_t*);
+    const void* ctx;
+    uint32_t next;
+    bool ok;
+} check_job_t;
+
 static shishua_t shishua = {0};
 static aio_t aio = {0};
+static keys_t keysfile = {0};
 
 
 void init_shishua(uint64_t s)
@@ -146,6 +185,27 @@ bool hash2key(char* hash, ribbon128_key_t* key)
     }
     key->ribbon = (__uint128_t) _mm256_extracti128_si256(res1, 1);
     key->index = (uint32_t) _mm256_extract_epi64(res2, 3);
+    return true;
+}
+
+/*
+ * Answers n keys through a filter's batch query, packing the results into
+ * bitmap (bit i of byte i/8 for key i). Returns false if there is no filter.
+ */
+bool query_keys_bitmap(uint32_t (*batch)(const ribbon128_key_t*, uint32_t, uint8_t*),
+                       const ribbon128_key_t* keys, uint64_t n, uint8_t* bitmap)
+{
+    uint8_t results[1024];
+    bzero(bitmap, (n + 7)/8);
+    for (uint64_t i = 0; i < n; i += sizeof(results))
+    {
+        uint32_t k = n - i < sizeof(results) ? n - i : sizeof(results);
+        if (batch(keys + i, k, results) != k)
+            return false;
+        for (uint32_t j = 0; j < k; j++)
+            bitmap[(i + j)/8] |= results[j] << ((i + j)%8);
+    }
+    return true;
 }
 
 bool synthetic(char* destfile, uint32_t nkeys)
@@ -168,21 +228,225 @@ bool synthetic(char* destfile, uint32_t nkeys)
     return true;
 }
 
-uint32_t calculate_nkeys(char* filename)
+bool read_keys2_header(int fd, keys2_header_t* header)
+{
+    if (pread(fd, header, sizeof(keys2_header_t), sizeof(MAGIC_KEYS2)) != sizeof(keys2_header_t)
+        || !header->blockkeys || header->blockkeys > KEYS2_BLOCK
+        || header->nblocks != (header->nkeys + header->blockkeys - 1)/header->blockkeys)
+        return false;
+    return true;
+}
+
+uint8_t read_keys_version(int fd)
+{
+    char magic[sizeof(MAGIC_KEYS)];
+    if (pread(fd, magic, sizeof(MAGIC_KEYS), 0) != sizeof(MAGIC_KEYS))
+        return 0;
+    if (!strcmp(magic, MAGIC_KEYS))
+        return 1;
+    if (!strcmp(magic, MAGIC_KEYS2))
+        return 2;
+    return 0;
+}
+
+void free_shards(shards_t* shards)
+{
+    for (uint32_t i = 0; shards->files != NULL && i < shards->nfiles; i++)
+        free(shards->files[i]);
+    free(shards->files);
+    free(shards->nkeys);
+    bzero(shards, sizeof(shards_t));
+}
+
+bool read_shards_file(char* filename, shards_t* shards)
 {
+    char line[PATH_MAX + 32];
+    char name[PATH_MAX];
+    uint64_t nkeys;
+    bzero(shards, sizeof(shards_t));
+    FILE* fp = fopen(filename, "r");
+    if (fp == NULL)
+        return false;
+    if (fgets(line, sizeof(line), fp) == NULL || strcmp(line, MAGIC_SHARDS))
+    {
+        fclose(fp);
+        return false;
+    }
+    const char* slash = strrchr(filename, '/');
+    int dirlen = slash ? slash - filename + 1 : 0;
+    shards->files = calloc(SHARDS_MAX, sizeof(char*));
+    shards->nkeys = calloc(SHARDS_MAX, sizeof(uint64_t));
+    while (shards->files != NULL && shards->nkeys != NULL && fgets(line, sizeof(line), fp) != NULL)
+    {
+        if (sscanf(line, "%lu %[^\n]", &nkeys, name) != 2 || shards->nfiles == SHARDS_MAX)
+        {
+            printf("Invalid shards file %s\n", filename);
+            fclose(fp);
+            free_shards(shards);
+            return false;
+        }
+        // Shard names are relative to the directory of the manifest.
+        char* path = malloc(dirlen + strlen(name) + 1);
+        if (path == NULL)
+            break;
+        sprintf(path, "%.*s%s", name[0] == '/' ? 0 : dirlen, filename, name);
+        shards->files[shards->nfiles] = path;
+        shards->nkeys[shards->nfiles++] = nkeys;
+        shards->total += nkeys;
+    }
+    bool eof = feof(fp);
+    fclose(fp);
+    if (!eof)
+    {
+        perror("Cannot read shards file");
+        free_shards(shards);
+        return false;
+    }
+    return true;
+}
+
+uint64_t calculate_file_nkeys(char* filename)
+{
+    keys2_header_t header;
     struct stat st;
-    if (stat(filename, &st) < 0)
+    uint64_t nkeys = 0;
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0)
     {
         printf("Invalid input file %s", filename);
         perror("");
+        if (fd >= 0)
+            close(fd);
         return 0;
     }
-    return (st.st_size-sizeof(MAGIC_KEYS))/sizeof(ribbon128_key_t);
+    switch (read_keys_version(fd))
+    {
+        case 1:
+            nkeys = (st.st_size-sizeof(MAGIC_KEYS))/sizeof(ribbon128_key_t);
+            break;
+        case 2:
+            if (read_keys2_header(fd, &header))
+                nkeys = header.nkeys;
+            break;
+        default:
+            printf("Invalid input file %s\n", filename);
+    }
+    close(fd);
+    return nkeys;
 }
 
-bool open_keys_file(char* filename, uint32_t* maxkeys)
+// A plain keys file is handled as a manifest with a single shard.
+bool open_shards(char* filename, shards_t* shards)
 {
-    char magic[sizeof(MAGIC_KEYS)];
+    if (read_shards_file(filename, shards))
+        return true;
+    shards->files = malloc(sizeof(char*));
+    shards->nkeys = malloc(sizeof(uint64_t));
+    if (shards->files == NULL || shards->nkeys == NULL || (shards->files[0] = strdup(filename)) == NULL)
+    {
+        free_shards(shards);
+        return false;
+    }
+    shards->nfiles = 1;
+    shards->nkeys[0] = shards->total = calculate_file_nkeys(filename);
+    return shards->total > 0;
+}
+
+uint32_t calculate_nkeys(char* filename)
+{
+    shards_t shards;
+    uint64_t nkeys = 0;
+    if (open_shards(filename, &shards))
+        nkeys = shards.total;
+    free_shards(&shards);
+    return nkeys > UINT32_MAX ? UINT32_MAX : nkeys;
+}
+
+static inline bool keys_aio_wait(aio_t* a)
+{
+    while (aio_error(&a->aiocb) == EINPROGRESS);
+    if (aio_return(&a->aiocb) < 0)
+    {
+        perror("aio_return");
+        return false;
+    }
+    return true;
+}
+
+static inline bool keys_aio_issue(aio_t* a, uint32_t slot)
+{
+    if (a->version == 1)
+    {
+        a->pending = a->left < AIO_MAXKEYS ? a->left : AIO_MAXKEYS;
+        a->aiocb.aio_buf = a->bufs[slot];
+        a->aiocb.aio_nbytes = a->pending*sizeof(ribbon128_key_t);
+        a->aiocb.aio_offset = a->offset;
+    }
+    else
+    {
+        uint32_t blockkeys = keys2_block_keys(&a->header, a->block);
+        a->pending = a->left < blockkeys ? a->left : blockkeys;
+        a->aiocb.aio_buf = a->raw[slot];
+        a->aiocb.aio_nbytes = keys2_block_size(&a->header, a->index, a->block);
+        a->aiocb.aio_offset = a->index[a->block].offset;
+        a->block++;
+    }
+    a->offset += a->aiocb.aio_nbytes;
+    a->left -= a->pending;
+    if (aio_read(&a->aiocb) < 0)
+    {
+        perror("aio_read");
+        a->pending = 0;
+        return false;
+    }
+    return true;
+}
+
+// Makes the pending read the current buffer and schedules the next one into the
+// buffer just released. Deferred until the caller asks for the next key so the
+// last key handed out is never overwritten while still in use.
+static inline bool keys_aio_advance(aio_t* a)
+{
+    if (!a->pending || !keys_aio_wait(a))
+        return false;
+    a->bindex ^= 1;
+    a->count = a->pending;
+    a->kindex = 0;
+    a->pending = 0;
+    if (a->version == 2
+        && !decode_keys2_block(a->raw[a->bindex], keys2_block_size(&a->header, a->index, a->block-1),
+                               a->index[a->block-1].first, a->count, a->bufs[a->bindex]))
+    {
+        printf("Corrupted block %u in keys file.\n", a->block-1);
+        return false;
+    }
+    if (a->left)
+        return keys_aio_issue(a, a->bindex^1);
+    return true;
+}
+
+void close_keys_reader(aio_t* a)
+{
+    if (a->pending)
+    {
+        aio_cancel(a->aiocb.aio_fildes, &a->aiocb);
+        keys_aio_wait(a);
+    }
+    if (a->aiocb.aio_fildes > 0)
+        close(a->aiocb.aio_fildes);
+    free(a->bufs[0]);
+    free(a->bufs[1]);
+    free(a->raw[0]);
+    free(a->raw[1]);
+    free(a->index);
+    bzero(a, sizeof(aio_t));
+}
+
+// Opens a single keys file, v1 or v2. A manifest is not accepted here.
+bool open_keys_reader(aio_t* a, char* filename, uint32_t* maxkeys)
+{
+    uint64_t filekeys = 0;
+    uint32_t bufkeys = AIO_MAXKEYS;
     int fd = open(filename, O_RDONLY);
     if (fd < 0)
     {
@@ -190,110 +454,250 @@ bool open_keys_file(char* filename, uint32_t* maxkeys)
         perror("");
         return false;
     }
-    if((read(fd, magic, sizeof(MAGIC_KEYS)) != sizeof(MAGIC_KEYS)) || strcmp(magic, MAGIC_KEYS))
+
+    bzero(a, sizeof(aio_t));
+    a->aiocb.aio_fildes = fd;
+    a->version = read_keys_version(fd);
+    if (a->version == 1)
     {
-        printf("Invalid input file %s", filename);
-        perror("");
-        close(fd);
+        filekeys = (lseek(fd, 0L, SEEK_END)-sizeof(MAGIC_KEYS))/sizeof(ribbon128_key_t);
+        a->offset = sizeof(MAGIC_KEYS);
+    }
+    else if (a->version == 2 && read_keys2_header(fd, &a->header))
+    {
+        uint64_t rawsize = 0;
+        a->index = malloc(a->header.nblocks*sizeof(keys2_index_t));
+        if (a->index == NULL
+            || pread(fd, a->index, a->header.nblocks*sizeof(keys2_index_t), a->header.index_offset)
+                != a->header.nblocks*sizeof(keys2_index_t))
+        {
+            printf("Invalid block index in input file %s\n", filename);
+            close_keys_reader(a);
+            return false;
+        }
+        for (uint32_t b = 0; b < a->header.nblocks; b++)
+        {
+            uint64_t size = keys2_block_size(&a->header, a->index, b);
+            rawsize = size > rawsize ? size : rawsize;
+        }
+        // Slack for the gathers that run past the last key of a block.
+        a->raw[0] = malloc(rawsize + sizeof(__m256i));
+        a->raw[1] = malloc(rawsize + sizeof(__m256i));
+        filekeys = a->header.nkeys;
+        bufkeys = a->header.blockkeys;
+    }
+    else
+    {
+        printf("Invalid input file %s\n", filename);
+        close_keys_reader(a);
         return false;
     }
-    
-    uint32_t filekeys = (lseek(fd, 0L, SEEK_END)-sizeof(MAGIC_KEYS))/sizeof(ribbon128_key_t);
+
     if (!*maxkeys || *maxkeys > filekeys)
-        *maxkeys = filekeys;
+        *maxkeys = filekeys > UINT32_MAX ? UINT32_MAX : filekeys;
     if (!*maxkeys)
     {
         printf("Empty input file %s", filename);
-        close(fd);
+        close_keys_reader(a);
         return false;
     }
-    
-    bzero(&aio, sizeof(aio_t));
-    aio.bufs[0] = malloc(AIO_BUF);
-    aio.bufs[1] = malloc(AIO_BUF);
-    aio.nblocks = *maxkeys/AIO_MAXKEYS;
-    aio.kindex = AIO_MAXKEYS - (*maxkeys - aio.nblocks*AIO_MAXKEYS);
-    if (aio.kindex != AIO_MAXKEYS)
+
+    a->bufs[0] = malloc(bufkeys*sizeof(ribbon128_key_t));
+    a->bufs[1] = malloc(bufkeys*sizeof(ribbon128_key_t));
+    a->left = *maxkeys;
+    a->bindex = 1;
+    if (!keys_aio_issue(a, 0) || !keys_aio_advance(a))
     {
-        aio.aiocb.aio_buf = &aio.bufs[0][aio.kindex];
-        aio.aiocb.aio_nbytes = (AIO_MAXKEYS-aio.kindex)*sizeof(ribbon128_key_t);
+        close_keys_reader(a);
+        return false;
     }
-    else
+    return true;
+}
+
+static inline ribbon128_key_t* read_keys_reader(aio_t* a)
+{
+    if (a->kindex >= a->count && !keys_aio_advance(a))
+        return NULL;
+    return &a->bufs[a->bindex][a->kindex++];
+}
+
+// Number of keys taken from each shard when only the first maxkeys are wanted.
+static inline uint32_t shard_quota(const shards_t* shards, uint32_t shard, uint32_t maxkeys)
+{
+    uint64_t before = 0;
+    for (uint32_t i = 0; i < shard; i++)
+        before += shards->nkeys[i];
+    if (!maxkeys)
+        return shards->nkeys[shard];
+    if (before >= maxkeys)
+        return 0;
+    return maxkeys - before < shards->nkeys[shard] ? maxkeys - before : shards->nkeys[shard];
+}
+
+static bool open_next_shard()
+{
+    uint32_t quota;
+    close_keys_reader(&aio);
+    while (keysfile.shard < keysfile.shards.nfiles)
     {
-        aio.nblocks--;
-        aio.aiocb.aio_buf = aio.bufs[0];
-        aio.aiocb.aio_nbytes = AIO_BUF;
+        quota = shard_quota(&keysfile.shards, keysfile.shard, keysfile.maxkeys);
+        if (quota)
+            return open_keys_reader(&aio, keysfile.shards.files[keysfile.shard++], &quota);
+        keysfile.shard++;
     }
-    aio.offset = sizeof(MAGIC_KEYS);
-    aio.aiocb.aio_offset = aio.offset;
-    aio.aiocb.aio_fildes = fd;
-    if (aio_read(&aio.aiocb) < 0)
+    return false;
+}
+
+void close_keys_file()
+{
+    close_keys_reader(&aio);
+    free_shards(&keysfile.shards);
+    bzero(&keysfile, sizeof(keys_t));
+}
+
+// Opens a keys file or a shards manifest. Shards are read one after the other,
+// as the builders insert keys from a single thread; only check_keys_file reads
+// them in parallel.
+bool open_keys_file(char* filename, uint32_t* maxkeys)
+{
+    bzero(&keysfile, sizeof(keys_t));
+    if (!open_shards(filename, &keysfile.shards))
     {
-        perror("aio_read");
-        close(fd);
+        printf("Invalid input file %s\n", filename);
+        close_keys_file();
         return false;
     }
-    while (aio_error(&aio.aiocb) == EINPROGRESS);
-    if ((aio_return(&aio.aiocb)) < 0)
+    if (!*maxkeys || *maxkeys > keysfile.shards.total)
+        *maxkeys = keysfile.shards.total > UINT32_MAX ? UINT32_MAX : keysfile.shards.total;
+    keysfile.maxkeys = *maxkeys;
+    if (!open_next_shard())
     {
-        perror("aio_return");
-        close(fd);
+        close_keys_file();
         return false;
     }
-    if (aio.nblocks)
+    return true;
+}
+
+ribbon128_key_t* read_key()
+{
+    ribbon128_key_t* key;
+    while ((key = read_keys_reader(&aio)) == NULL)
     {
-        aio.aiocb.aio_buf = aio.bufs[1];
-        aio.offset += aio.aiocb.aio_nbytes;
-        aio.aiocb.aio_nbytes = AIO_BUF;
-        aio.aiocb.aio_offset = aio.offset;
-        if (aio_read(&aio.aiocb) < 0)
+        if (!open_next_shard())
+            return NULL;
+    }
+    return key;
+}
+
+static void* check_shards_worker(void* arg)
+{
+    check_job_t* job = (check_job_t*) arg;
+    aio_t reader;
+    ribbon128_key_t* key;
+    uint32_t shard, quota;
+    while (__atomic_load_n(&job->ok, __ATOMIC_RELAXED)
+            && (shard = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->shards.nfiles)
+    {
+        if (!(quota = shard_quota(&job->shards, shard, job->maxkeys)))
+            continue;
+        if (!open_keys_reader(&reader, job->shards.files[shard], &quota))
         {
-            perror("aio_read");
-            close(fd);
-            return false;
+            __atomic_store_n(&job->ok, false, __ATOMIC_RELAXED);
+            break;
         }
+        while ((key = read_keys_reader(&reader)) != NULL)
+        {
+            if (!job->check(job->ctx, key))
+            {
+                printf("Sanity check failed.\n");
+                __atomic_store_n(&job->ok, false, __ATOMIC_RELAXED);
+                break;
+            }
+        }
+        close_keys_reader(&reader);
     }
-    return true;
+    return NULL;
 }
 
-void close_keys_file()
+// Runs check(ctx, key) on every key, one thread per shard up to the number of cores.
+bool check_keys_file(char* filename, uint32_t maxkeys, bool (*check)(const void*, const ribbon128_key_t*), const void* ctx)
 {
-    close(aio.aiocb.aio_fildes);
-    free(aio.bufs[0]);
-    free(aio.bufs[1]);
+    check_job_t job = {.maxkeys = maxkeys, .check = check, .ctx = ctx, .ok = true};
+    pthread_t threads[SHARDS_MAX];
+    uint32_t nthreads = 0;
+    if (!open_shards(filename, &job.shards))
+    {
+        printf("Invalid input file %s\n", filename);
+        return false;
+    }
+    long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+    uint32_t maxthreads = job.shards.nfiles < ncpus ? job.shards.nfiles : (ncpus > 0 ? ncpus : 1);
+    for (uint32_t i = 1; i < maxthreads; i++)
+    {
+        if (pthread_create(&threads[nthreads], NULL, check_shards_worker, &job))
+            break;
+        nthreads++;
+    }
+    check_shards_worker(&job);
+    for (uint32_t i = 0; i < nthreads; i++)
+        pthread_join(threads[i], NULL);
+    free_shards(&job.shards);
+    return job.ok;
 }
 
-ribbon128_key_t* read_key()
+// Blocks until one of the files is rewritten or replaced, or timeout_ms passes.
+// Returns the index of the file, -1 on timeout and -2 on error. The parent
+// directories are watched rather than the files, so a rename over a file is
+// seen as well.
+int wait_files_change(char** paths, uint32_t n, int timeout_ms)
 {
-    if (aio.nblocks < 0)
-        return NULL;
-    ribbon128_key_t* key = &aio.bufs[aio.bindex][aio.kindex++];
-    if(aio.kindex >= AIO_MAXKEYS)
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char copy[PATH_MAX];
+    int wd[n];
+    int res = -1;
+    struct timespec start, now;
+    int fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0)
     {
-        aio.kindex = 0;
-        if (aio.nblocks--)
+        perror("inotify_init1");
+        return -2;
+    }
+    for (uint32_t i = 0; i < n; i++)
+    {
+        snprintf(copy, PATH_MAX, "%s", paths[i]);
+        wd[i] = inotify_add_watch(fd, dirname(copy), IN_CLOSE_WRITE | IN_MOVED_TO);
+        if (wd[i] < 0)
         {
-            while(aio_error(&aio.aiocb) == EINPROGRESS);
-            if ((aio_return(&aio.aiocb)) < 0)
-            {
-                perror("aio_return2");
-            }
-            if (aio.nblocks)
+            printf("Cannot watch %s", paths[i]);
+            perror("");
+            close(fd);
+            return -2;
+        }
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    while (res == -1)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        int left = timeout_ms - ((now.tv_sec - start.tv_sec)*1000 + (now.tv_nsec - start.tv_nsec)/1000000);
+        if (left <= 0 || poll(&pfd, 1, left) <= 0)
+            break;
+        ssize_t len = read(fd, buf, sizeof(buf));
+        for (char* ptr = buf; len > 0 && ptr < buf + len; )
+        {
+            const struct inotify_event* event = (const struct inotify_event*) ptr;
+            for (uint32_t i = 0; event->len && i < n && res == -1; i++)
             {
-                aio.offset += AIO_BUF;
-                aio.aiocb.aio_offset = aio.offset;
-                aio.aiocb.aio_buf = aio.bufs[aio.bindex];
-                aio.aiocb.aio_nbytes = AIO_BUF;
-                if (aio_read(&aio.aiocb) < 0)
-                {
-                    perror("aio_read2");
-                }
+                snprintf(copy, PATH_MAX, "%s", paths[i]);
+                if (event->wd == wd[i] && !strcmp(event->name, basename(copy)))
+                    res = i;
             }
-            aio.bindex ^= 1;
+            ptr += sizeof(struct inotify_event) + event->len;
         }
     }
-    return key;
+    close(fd);
+    return res;
 }
 
-
-#endif
\ No newline at end of file
+#endif
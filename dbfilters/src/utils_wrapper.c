@@ -3,6 +3,9 @@
 #include <stdbool.h>
 
 #include "utils.h"
+#include "filterfile.h"
+#include "queryserver.h"
+#include "keystore.h"
 
 
 static PyObject *method_password_to_hash(PyObject *self, PyObject *args)
@@ -39,12 +42,255 @@ static PyObject *method_calculate_keys_file(PyObject *self, PyObject *args)
     return PyLong_FromUnsignedLong(calculate_nkeys(filename));
 }
 
+static PyObject *method_verify_filterfile(PyObject *self, PyObject *args)
+{
+    char* filename;
+    bool res;
+
+    if (!PyArg_ParseTuple(args, "s", &filename))
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    res = verify_filterfile(filename);
+    Py_END_ALLOW_THREADS
+
+    return PyBool_FromLong(res);
+}
+
+static PyObject *method_watch_files(PyObject *self, PyObject *args)
+{
+    PyObject* list;
+    int timeout = 1000;
+    int res;
+
+    if (!PyArg_ParseTuple(args, "O!|i", &PyList_Type, &list, &timeout))
+        return NULL;
+
+    Py_ssize_t n = PyList_Size(list);
+    char* paths[n > 0 ? n : 1];
+    for (Py_ssize_t i = 0; i < n; i++)
+    {
+        paths[i] = (char*) PyUnicode_AsUTF8(PyList_GetItem(list, i));
+        if (paths[i] == NULL)
+            return NULL;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    res = wait_files_change(paths, n, timeout);
+    Py_END_ALLOW_THREADS
+
+    return PyLong_FromLong(res);
+}
+
+static PyObject *method_bench_http(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    char* host;
+    uint16_t port;
+    char* request;
+    uint32_t connections = 64;
+    uint32_t pipeline = 16;
+    uint32_t seconds = 5;
+    uint32_t threads = 1;
+    uint64_t responses, errors;
+
+    static char *kwlist[] = {"host", "port", "request", "connections", "pipeline", "seconds", "threads", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "sHs|IIII", kwlist,
+                                     &host, &port, &request, &connections, &pipeline, &seconds, &threads))
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    responses = queryserver_bench(host, port, request, connections, pipeline, seconds, threads, &errors);
+    Py_END_ALLOW_THREADS
+
+    return Py_BuildValue("KK", (unsigned long long) responses, (unsigned long long) errors);
+}
+
+// Header of a filter file v2, given its path or an open descriptor, so that
+// it describes the same file that is being read. None if it is not one.
+static PyObject *method_filter_info(PyObject *self, PyObject *args)
+{
+    static const char* types[] = {NULL, "ribbon128", "binaryfuse8", "xor8", "xor16", "splitblockbloom", "binaryfuse16", "binaryfuse32"};
+    PyObject* source;
+    filterfile_header_t header;
+    bool res;
+
+    if (!PyArg_ParseTuple(args, "O", &source))
+        return NULL;
+
+    if (PyLong_Check(source))
+    {
+        int fd = PyLong_AsLong(source);
+        if (fd < 0 && PyErr_Occurred())
+            return NULL;
+        res = read_filterfile_header(fd, &header);
+    }
+    else
+    {
+        const char* filename = PyUnicode_AsUTF8(source);
+        if (filename == NULL)
+            return NULL;
+        int fd = open(filename, O_RDONLY);
+        res = fd >= 0 && read_filterfile_header(fd, &header);
+        if (fd >= 0)
+            close(fd);
+    }
+    if (!res || header.type == 0 || header.type >= sizeof(types)/sizeof(types[0]))
+        Py_RETURN_NONE;
+
+    PyObject* params = PyList_New(FILTERFILE_PARAMS);
+    if (params == NULL)
+        return NULL;
+    for (int i = 0; i < FILTERFILE_PARAMS; i++)
+        PyList_SET_ITEM(params, i, PyLong_FromUnsignedLongLong(header.params[i]));
+    return Py_BuildValue("{s:I,s:s,s:K,s:K,s:K,s:N,s:K,s:K,s:I}",
+                         "format", header.version,
+                         "type", types[header.type],
+                         "nkeys", (unsigned long long) header.nkeys,
+                         "seed", (unsigned long long) header.seed,
+                         "created", (unsigned long long) header.created,
+                         "params", params,
+                         "payload_offset", (unsigned long long) header.payload_offset,
+                         "payload_size", (unsigned long long) header.payload_size,
+                         "payload_crc", header.payload_crc);
+}
+
+
+static PyObject *method_load_keystore(PyObject *self, PyObject *args)
+{
+    char* filename;
+
+    if (!PyArg_ParseTuple(args, "s", &filename))
+        return NULL;
+
+    bool res;
+    Py_BEGIN_ALLOW_THREADS
+    res = keystore_create(filename);
+    Py_END_ALLOW_THREADS
+
+    return PyBool_FromLong(res);
+}
+
+static PyObject *method_exist_keystore(PyObject *self, PyObject *args)
+{
+    return PyBool_FromLong(keystore_exist());
+}
+
+static PyObject *method_destroy_keystore(PyObject *self, PyObject *args)
+{
+    keystore_destroy();
+    Py_RETURN_NONE;
+}
+
+static PyObject *method_verify_key(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+    char* pass;
+    bool hashed = false;
+
+    static char *kwlist[] = {"password", "hashed", NULL};
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|b", kwlist, &pass, &hashed))
+        return NULL;
+
+    bool res;
+    Py_BEGIN_ALLOW_THREADS
+    res = keystore_verify(pass, hashed);
+    Py_END_ALLOW_THREADS
+
+    return PyBool_FromLong(res);
+}
+
+// Returns a copy of bitmap without the hashes the keystore rules out, or None
+// when there is no keystore.
+static PyObject *method_verify_hashes(PyObject *self, PyObject *args)
+{
+    Py_buffer hashes;
+    Py_buffer bitmap;
+
+    if (!PyArg_ParseTuple(args, "y*y*", &hashes, &bitmap))
+        return NULL;
+
+    uint64_t n = hashes.len / sizeof(ribbon128_key_t);
+    PyObject* verified = NULL;
+    if (!(hashes.len % sizeof(ribbon128_key_t)) && (uint64_t) bitmap.len == (n + 7)/8)
+        verified = PyBytes_FromStringAndSize(bitmap.buf, bitmap.len);
+    PyBuffer_Release(&bitmap);
+    if (verified == NULL)
+    {
+        PyBuffer_Release(&hashes);
+        if (PyErr_Occurred())
+            return NULL;
+        Py_RETURN_NONE;
+    }
+
+    bool res;
+    Py_BEGIN_ALLOW_THREADS
+    res = keystore_verify_bitmap(hashes.buf, n, (uint8_t*) PyBytes_AS_STRING(verified));
+    Py_END_ALLOW_THREADS
+    PyBuffer_Release(&hashes);
+
+    if (!res)
+    {
+        Py_DECREF(verified);
+        Py_RETURN_NONE;
+    }
+    return verified;
+}
+
+// Hex version of the keys files the keystore was opened from, None without one.
+static PyObject *method_keystore_version(PyObject *self, PyObject *args)
+{
+    uint64_t version;
+    char hex[17];
+
+    if (!keystore_version(&version))
+        Py_RETURN_NONE;
+    sprintf(hex, "%016llx", (unsigned long long) version);
+    return PyUnicode_FromString(hex);
+}
+
+// The range API answer for a hex prefix of the hash, None without keystore.
+static PyObject *method_range_keys(PyObject *self, PyObject *args)
+{
+    const char* prefix;
+
+    if (!PyArg_ParseTuple(args, "s", &prefix))
+        return NULL;
+
+    size_t len = strlen(prefix);
+    if (len < 1 || len > 15 || strspn(prefix, "0123456789abcdefABCDEF") != len)
+    {
+        PyErr_SetString(PyExc_ValueError, "prefix must be 1 to 15 hex digits");
+        return NULL;
+    }
+
+    char* text;
+    uint64_t size;
+    Py_BEGIN_ALLOW_THREADS
+    text = keystore_range(strtoull(prefix, NULL, 16), len, &size);
+    Py_END_ALLOW_THREADS
+
+    if (text == NULL)
+        Py_RETURN_NONE;
+    PyObject* res = PyBytes_FromStringAndSize(text, size);
+    free(text);
+    return res;
+}
 
 static PyMethodDef UtilsMethods[] =
 {
     {"sha1", (PyCFunction) method_password_to_hash, METH_VARARGS, ""},
     {"synthetic", (PyCFunction) method_synthetic, METH_VARARGS, ""},
     {"calculate_keys", (PyCFunction) method_calculate_keys_file, METH_VARARGS, ""},
+    {"watch_files", (PyCFunction) method_watch_files, METH_VARARGS, ""},
+    {"bench_http", (PyCFunction) method_bench_http, METH_VARARGS | METH_KEYWORDS, ""},
+    {"filter_info", (PyCFunction) method_filter_info, METH_VARARGS, ""},
+    {"verify_filterfile", (PyCFunction) method_verify_filterfile, METH_VARARGS, ""},
+    {"load_keystore", (PyCFunction) method_load_keystore, METH_VARARGS, ""},
+    {"exist_keystore", (PyCFunction) method_exist_keystore, METH_NOARGS, ""},
+    {"destroy_keystore", (PyCFunction) method_destroy_keystore, METH_NOARGS, ""},
+    {"keystore_version", (PyCFunction) method_keystore_version, METH_NOARGS, ""},
+    {"verify_key", (PyCFunction) method_verify_key, METH_VARARGS | METH_KEYWORDS, ""},
+    {"verify_hashes", (PyCFunction) method_verify_hashes, METH_VARARGS, ""},
+    {"range_keys", (PyCFunction) method_range_keys, METH_VARARGS, ""},
     {NULL, NULL, 0, NULL}
 };
 
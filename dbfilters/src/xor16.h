@@ -8,6 +8,8 @@
 #include <string.h>
 
 #include "utils.h"
+#include "filterfile.h"
+#include "rcu.h"
 
 #ifndef XOR_MAX_ITERATIONS
 #define XOR_MAX_ITERATIONS 100 // probabillity of success should always be > 0.5 so 100 iterations is highly unlikely
@@ -69,24 +71,28 @@ static inline uint64_t xor_rng_splitmix64(uint64_t *seed) {
 typedef struct xor16_s {
   uint64_t seed;
   uint64_t blockLength;
+  uint64_t size;
   uint16_t *fingerprints; // after xor16_allocate, will point to 3*blockLength values
+  uint64_t mapped; // bytes of fingerprints mapped from the filter file, 0 if allocated
 } xor16_t;
 
+// Constructions and loads fill the staging filter; queries only ever read the
+// published copy, which is replaced through RCU.
 static xor16_t filter = {0};
-
+static rcu_t published = RCU_INITIALIZER;
 
 // Report if the key is in the set, with false positive rate.
-static inline bool xor16_contain(uint64_t key) {
-  uint64_t hash = xor_mix_split(key, filter.seed);
+static inline bool xor16_contain(const xor16_t *filter, uint64_t key) {
+  uint64_t hash = xor_mix_split(key, filter->seed);
   uint16_t f = xor_fingerprint(hash);
   uint32_t r0 = (uint32_t)hash;
   uint32_t r1 = (uint32_t)xor_rotl64(hash, 21);
   uint32_t r2 = (uint32_t)xor_rotl64(hash, 42);
-  uint32_t h0 = xor_reduce(r0, filter.blockLength);
-  uint32_t h1 = xor_reduce(r1, filter.blockLength) + filter.blockLength;
-  uint32_t h2 = xor_reduce(r2, filter.blockLength) + 2 * filter.blockLength;
-  return f == (filter.fingerprints[h0] ^ filter.fingerprints[h1] ^
-       filter.fingerprints[h2]);
+  uint32_t h0 = xor_reduce(r0, filter->blockLength);
+  uint32_t h1 = xor_reduce(r1, filter->blockLength) + filter->blockLength;
+  uint32_t h2 = xor_reduce(r2, filter->blockLength) + 2 * filter->blockLength;
+  return f == (filter->fingerprints[h0] ^ filter->fingerprints[h1] ^
+       filter->fingerprints[h2]);
 }
 
 // allocate enough capacity for a set containing up to 'size' elements
@@ -110,8 +116,9 @@ static inline size_t xor16_size_in_bytes() {
 
 // release memory
 static inline void xor16_free() {
-  free(filter.fingerprints);
+  free_filterfile(filter.fingerprints, filter.mapped);
   filter.fingerprints = NULL;
+  filter.mapped = 0;
   filter.blockLength = 0;
 }
 
@@ -773,24 +780,41 @@ bool xor16_populate(const uint64_t *keys, uint32_t size) {
 
 //-------------------------------------------------------------------------------------------------------
 
+static void xor16_release(xor16_t* f)
+{
+  if (f == NULL)
+    return;
+  free_filterfile(f->fingerprints, f->mapped);
+  free(f);
+}
+
+// Publishes the staging filter if it was staged, otherwise drops it and keeps
+// serving the previous one.
+static bool xor16_publish(bool staged)
+{
+  xor16_t* f = staged ? malloc(sizeof(xor16_t)) : NULL;
+  if (f == NULL)
+  {
+    xor16_free();
+    return false;
+  }
+  *f = filter;
+  bzero(&filter, sizeof(xor16_t));
+  xor16_release(rcu_publish(&published, f));
+  return true;
+}
+
 void xor16_destroy()
 {
+  rcu_write_lock(&published);
   xor16_free();
+  xor16_release(rcu_publish(&published, NULL));
+  rcu_write_unlock(&published);
 }
 
-bool xor16_create(char* filename, uint32_t size)
+static bool xor16_populate_file(char* filename, uint32_t size)
 {
   ribbon128_key_t* key;
-  uint32_t maxkeys = calculate_nkeys(filename);
-  if(!maxkeys)
-    return false;
-  if(!size)
-    size = maxkeys;
-  else
-    size = size < maxkeys ? size : maxkeys;
-  
-  xor16_destroy();
-  xor16_allocate(size);
 
   uint64_t rng_counter = 1;
   filter.seed = xor_rng_splitmix64(&rng_counter);
@@ -992,78 +1016,148 @@ bool xor16_create(char* filename, uint32_t size)
   return true;
 }
 
+static uint32_t xor16_keys(char* filename, uint32_t size)
+{
+  uint32_t maxkeys = calculate_nkeys(filename);
+  return !size || size > maxkeys ? maxkeys : size;
+}
+
+static bool xor16_create_staged(char* filename, uint32_t size)
+{
+  if(!(size = xor16_keys(filename, size)))
+    return false;
+  xor16_free();
+  xor16_allocate(size);
+  filter.size = size;
+  return xor16_populate_file(filename, size);
+}
+
+bool xor16_create(char* filename, uint32_t size)
+{
+  rcu_write_lock(&published);
+  bool res = xor16_publish(xor16_create_staged(filename, size));
+  rcu_write_unlock(&published);
+  return res;
+}
+
+// Writes the fingerprints straight into the payload of a new filter file.
+static bool xor16_build_staged(char* filename, char* destfile, uint32_t size)
+{
+  filterfile_header_t header;
+  filterfile_out_t out;
+  if(!(size = xor16_keys(filename, size)))
+    return false;
+  xor16_free();
+  xor16_allocate(size);
+  filter.size = size;
+  // The seed is picked while populating and filled in afterwards.
+  init_filterfile_header(&header, FILTER_XOR16, filter.size, 0, sizeof(uint16_t) * 3 * filter.blockLength);
+  header.params[0] = filter.blockLength;
+  free(filter.fingerprints);
+  filter.fingerprints = open_filterfile_out(destfile, &header, &out, 0);
+  if (filter.fingerprints == NULL)
+  {
+    xor16_free();
+    return false;
+  }
+  bool res = xor16_populate_file(filename, size);
+  header.seed = filter.seed;
+  filter.fingerprints = NULL;
+  xor16_free();
+  if (!res)
+  {
+    abort_filterfile_out(&out);
+    return false;
+  }
+  return close_filterfile_out(&out, &header);
+}
+
+bool xor16_build(char* filename, char* destfile, uint32_t size)
+{
+  rcu_write_lock(&published);
+  bool res = xor16_build_staged(filename, destfile, size);
+  rcu_write_unlock(&published);
+  return res;
+}
+
 bool xor16_exist()
 {
-  return filter.fingerprints != NULL;
+  return rcu_peek(&published) != NULL;
+}
+
+static bool xor16_contain_key(const void* f, const ribbon128_key_t* key)
+{
+    return xor16_contain(f, (uint64_t)key->ribbon);
 }
 
 bool xor16_sanity(char* filename, uint32_t maxkeys)
 {
-    assert(xor16_exist());
-    ribbon128_key_t* key;
-    if (!open_keys_file(filename, &maxkeys))
-        return false;
-    while((key = read_key()) != NULL)
-    {
-        if (!xor16_contain((uint64_t)key->ribbon))
-        {
-            printf("Sanity check failed.\n");
-            return false;
-        }
-    }
-    close_keys_file();
-    return true;
+    uint32_t slot;
+    const xor16_t* f = rcu_read_lock(&published, &slot);
+    bool res = f != NULL && check_keys_file(filename, maxkeys, &xor16_contain_key, f);
+    rcu_read_unlock(&published, slot);
+    return res;
 }
 
 uint32_t xor16_fp(uint32_t n)
 {
-    assert(xor16_exist());
+    uint32_t slot;
+    const xor16_t* f = rcu_read_lock(&published, &slot);
     uint32_t matches = 0;
     init_shishua(clock());
     ribbon128_key_t randomkey; 
 
-    while(n--)
+    while(f != NULL && n--)
     {
         random_ribbon_key(&randomkey);
-        if(xor16_contain((uint64_t)randomkey.ribbon))
+        if(xor16_contain(f, (uint64_t)randomkey.ribbon))
             matches++;
     }
+    rcu_read_unlock(&published, slot);
     return matches;
 }
 
 bool xor16_query(char* pass, bool hashed)
 {
-  assert(xor16_exist());
+  uint32_t slot;
+  const xor16_t* f = rcu_read_lock(&published, &slot);
   ribbon128_key_t key;
-  if((hashed && hash2key(pass, &key)) || password2key(pass, &key))
-    return xor16_contain((uint64_t)key.ribbon);
-  else
-    return false;
+  bool res = f != NULL && ((hashed && hash2key(pass, &key)) || password2key(pass, &key))
+              && xor16_contain(f, (uint64_t)key.ribbon);
+  rcu_read_unlock(&published, slot);
+  return res;
+}
+
+// Answers n keys under one read section. Returns 0 when there is no filter.
+uint32_t xor16_query_batch(const ribbon128_key_t* keys, uint32_t n, uint8_t* results)
+{
+  uint32_t slot;
+  const xor16_t* f = rcu_read_lock(&published, &slot);
+  if (f == NULL)
+    n = 0;
+  for (uint32_t i = 0; i < n; i++)
+    results[i] = xor16_contain(f, (uint64_t)keys[i].ribbon);
+  rcu_read_unlock(&published, slot);
+  return n;
 }
 
 bool xor16_save(char* filename)
 {
-  assert(xor16_exist());
-  FILE* fp = fopen(filename, "wb");
-  if (fp == NULL)
+  uint32_t slot;
+  const xor16_t* f = rcu_read_lock(&published, &slot);
+  filterfile_header_t header;
+  bool res = false;
+  if (f != NULL)
   {
-    printf("Cannot open the output file %s.", filename);
-    return false;
-  }
-  if (!fwrite(MAGIC_FILTER, sizeof(MAGIC_FILTER), 1, fp)
-      || !fwrite(&filter.seed, sizeof(filter.seed), 1, fp)
-      || !fwrite(&filter.blockLength, sizeof(filter.blockLength), 1, fp)
-      || !fwrite(filter.fingerprints, sizeof(uint16_t) * 3 * filter.blockLength, 1, fp))
-  {
-    perror("Error when writing into file");
-    fclose(fp);
-    return false;
+    init_filterfile_header(&header, FILTER_XOR16, f->size, f->seed, sizeof(uint16_t) * 3 * f->blockLength);
+    header.params[0] = f->blockLength;
+    res = save_filterfile(filename, &header, f->fingerprints);
   }
-  fclose(fp);
-  return true;
+  rcu_read_unlock(&published, slot);
+  return res;
 }
 
-bool xor16_load(char* filename, uint32_t size)
+static bool xor16_load_v1(char* filename, uint32_t size)
 {
   FILE* fp = fopen(filename, "rb");
   if (fp == NULL)
@@ -1071,8 +1165,7 @@ bool xor16_load(char* filename, uint32_t size)
     printf("Cannot open the input file %s.", filename);
     return false;
   }
-  if (filter.fingerprints != NULL)
-      xor16_destroy();
+  xor16_free();
 
   char magic[sizeof(MAGIC_FILTER)];
   uint64_t expected_blockLength = ((32 + 1.23 * size) / 3 * 3) / 3;
@@ -1098,5 +1191,45 @@ bool xor16_load(char* filename, uint32_t size)
   return true;
 }
 
+static bool xor16_load_staged(char* filename, uint32_t size, bool shared)
+{
+  filterfile_header_t header;
+  if (!is_filterfile(filename))
+    return xor16_load_v1(filename, size);
+  uint16_t* fingerprints = shared ? map_filterfile(filename, FILTER_XOR16, &header)
+                              : load_filterfile(filename, FILTER_XOR16, &header);
+  if (fingerprints == NULL)
+    return false;
+  if (header.payload_size != sizeof(uint16_t) * 3 * header.params[0]
+      || (size && header.nkeys != size))
+  {
+    printf("Filter file %s was built with other parameters.\n", filename);
+    free_filterfile(fingerprints, shared ? header.payload_size : 0);
+    return false;
+  }
+  xor16_free();
+  filter.seed = header.seed;
+  filter.blockLength = header.params[0];
+  filter.size = header.nkeys;
+  filter.fingerprints = fingerprints;
+  filter.mapped = shared ? header.payload_size : 0;
+  return true;
+}
+
+// Loads into the staging filter and swaps it in, so queries running on the
+// current filter are never interrupted. A shared filter maps the file instead
+// of copying it, so processes loading the same file share its memory.
+// With a keysfile the staged filter must answer every key in it first, or the
+// current filter is kept.
+bool xor16_load(char* filename, uint32_t size, bool shared, char* keysfile)
+{
+  rcu_write_lock(&published);
+  bool res = xor16_load_staged(filename, size, shared)
+              && (keysfile == NULL || check_keys_file(keysfile, size, &xor16_contain_key, &filter));
+  res = xor16_publish(res);
+  rcu_write_unlock(&published);
+  return res;
+}
+
 
 #endif
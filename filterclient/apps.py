@@ -4,14 +4,28 @@ from django.utils.translation import gettext as _
 from django.conf import settings
 from django.core.checks import Error, register
 from django.core.management.color import color_style
-from dbfilters import splitblockbloom, utils, ribbon128, binaryfuse8, xor8, xor16
+from dbfilters import splitblockbloom, utils, ribbon128, binaryfuse8, binaryfuse16, binaryfuse32, xor8, xor16, sidecar, hotset
 from enum import Enum
 
-import os, requests
+import os, re, requests, threading, time, fcntl, random, collections, contextlib, concurrent.futures
 
 
 filter = None
-client_token = None
+client_tokens = {}
+filter_ready = threading.Event()
+filter_thread = None
+filter_state = 'IDLE'
+filter_generation = 0
+filter_version = None
+filter_lock = threading.RLock()
+watch_thread = None
+remote_lock = threading.Lock()
+remote_session = None
+remote_pool = None
+hedge_pool = None
+replica_stats = {}
+prefilter_thread = None
+download_thread = None
 
 
 class ServerErrorCode(Enum):
@@ -23,6 +37,11 @@ class ServerErrorCode(Enum):
     TOKEN_UNNECESSARY = 6
     BAD_CREDENTIALS = 7
     BAD_FORMAT = 8
+    BAD_HASHES = 9
+    NO_PREFILTER = 10
+    NO_ARTIFACT = 11
+    WRONG_SHARD = 12
+    NO_RANGE = 13
 
 class ServerErrorMsg(Enum):
     BAD_PASSWORD = 'A password to check must be provided'
@@ -33,6 +52,92 @@ class ServerErrorMsg(Enum):
     TOKEN_UNNECESSARY = 'Server is already open, no authentication is needed'
     BAD_CREDENTIALS = 'Unauthorized to use this service'
     BAD_FORMAT = 'Recieved incorrect format, must be JSON of type {username:user, password:pass}'
+    BAD_HASHES = 'Recieved incorrect format, must be a JSON list of SHA1 hex digests or the packed 20 byte digests'
+    NO_PREFILTER = 'The prefilter is not available, KEYSFILE is missing'
+    NO_ARTIFACT = 'There is no built filter to download'
+    WRONG_SHARD = 'The hash is outside of the prefix range held by this server'
+    NO_RANGE = 'There is no compact keys file to answer ranges from'
+
+class ResultCache:
+    # The REMOTE server's answers by SHA1 hex digest, never by password, so
+    # that checking a password again within REMOTE_CACHE_TTL seconds costs no
+    # round trip. Kept in process up to REMOTE_CACHE_SIZE entries, least
+    # recently used first, or in the Django cache REMOTE_CACHE_BACKEND.
+
+    prefix = 'filterclient:'
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.results = collections.OrderedDict()
+        self.hits = 0
+        self.misses = 0
+
+    def backend(self):
+        if (settings.REMOTE_CACHE_BACKEND is None):
+            return None
+        from django.core.cache import caches
+        return caches[settings.REMOTE_CACHE_BACKEND]
+
+    def enabled(self):
+        return settings.REMOTE_CACHE_TTL > 0 and (settings.REMOTE_CACHE_SIZE > 0 or settings.REMOTE_CACHE_BACKEND is not None)
+
+    def get_many(self, hexes):
+        # The cached answers among the hex digests, as a dict.
+        if (not self.enabled() or not hexes):
+            return {}
+        backend = self.backend()
+        if (backend is not None):
+            found = {key[len(self.prefix):]: res for key, res in backend.get_many([self.prefix + h.lower() for h in hexes]).items()}
+        else:
+            found = {}
+            now = time.time()
+            with self.lock:
+                for h in hexes:
+                    entry = self.results.get(h.lower())
+                    if (entry is not None and entry[0] > now):
+                        self.results.move_to_end(h.lower())
+                        found[h.lower()] = entry[1]
+                    elif (entry is not None):
+                        del self.results[h.lower()]
+        with self.lock:
+            self.hits += len(found)
+            self.misses += len(hexes) - len(found)
+        return found
+
+    def get(self, hashed):
+        return self.get_many([hashed]).get(hashed.lower())
+
+    def put_many(self, results):
+        if (not self.enabled() or not results):
+            return
+        backend = self.backend()
+        if (backend is not None):
+            backend.set_many({self.prefix + h.lower(): bool(res) for h, res in results.items()}, settings.REMOTE_CACHE_TTL)
+            return
+        expires = time.time() + settings.REMOTE_CACHE_TTL
+        with self.lock:
+            for h, res in results.items():
+                self.results[h.lower()] = (expires, bool(res))
+                self.results.move_to_end(h.lower())
+            while (len(self.results) > settings.REMOTE_CACHE_SIZE):
+                self.results.popitem(last=False)
+
+    def put(self, hashed, result):
+        self.put_many({hashed: result})
+
+    def clear(self):
+        with self.lock:
+            self.results.clear()
+            self.hits = 0
+            self.misses = 0
+
+    def stats(self):
+        with self.lock:
+            total = self.hits + self.misses
+            return {'size': len(self.results), 'hits': self.hits, 'misses': self.misses,
+                    'hit_rate': self.hits/total if total else 0.0}
+
+result_cache = ResultCache()
 
 def dummy_false(password, hashed):
     return False
@@ -41,18 +146,20 @@ def dummy_true():
     return True
 
 def clear_token():
-    global client_token
-    client_token = None
+    client_tokens.clear()
     return
 
+# The binaryfuse module of each RBYTES; any other value is a configuration error.
+fuse_modules = {1: binaryfuse8, 2: binaryfuse16, 4: binaryfuse32}
+
 def filter_parser():
-    global filter
     #print('PARSER')
     #print(settings.FILTER)
     cons_args = [settings.KEYSFILE, settings.NKEYS]
     san_args = [settings.KEYSFILE, settings.NKEYS]
     save_args = [settings.FILTERFILE]
     load_args = [settings.FILTERFILE, settings.NKEYS]
+    load_kwargs = dict(shared = settings.FILTER_SHARED)
     if (settings.FILTER  == 'ribbon128'):
         cons_args += [settings.RBYTES]
         load_args += [settings.RBYTES]
@@ -63,134 +170,569 @@ def filter_parser():
         #print(load_args)
         filter = dict(cons = ribbon128.construct_filter,
                         cons_args = cons_args,
+                        build = ribbon128.build_filter,
+                        build_args = [settings.KEYSFILE, settings.FILTERFILE] + cons_args[1:],
                         san = ribbon128.sanity_check,
                         san_args = san_args,
                         query = ribbon128.query_filter,
+                        query_hashes = ribbon128.query_hashes,
                         save = ribbon128.save_filter,
                         save_args = save_args,
                         load = ribbon128.load_filter,
                         load_args = load_args,
-                        exist = ribbon128.exist_filter)
+                        load_kwargs = load_kwargs,
+                        exist = ribbon128.exist_filter,
+                        destroy = ribbon128.destroy_filter,
+                        serve = ribbon128.serve_sidecar,
+                        serve_http = ribbon128.serve_http)
     elif (settings.FILTER  == 'splitblockbloom'):
         if settings.OVERFACTOR is not None:
             cons_args += [settings.OVERFACTOR]
             load_args += [settings.OVERFACTOR]
         filter = dict(cons = splitblockbloom.construct_filter,
                         cons_args = cons_args,
+                        build = splitblockbloom.build_filter,
+                        build_args = [settings.KEYSFILE, settings.FILTERFILE] + cons_args[1:],
                         san = splitblockbloom.sanity_check,
                         san_args = san_args,
                         query = splitblockbloom.query_filter,
+                        query_hashes = splitblockbloom.query_hashes,
                         save = splitblockbloom.save_filter,
                         save_args = save_args,
                         load = splitblockbloom.load_filter,
                         load_args = load_args,
-                        exist = splitblockbloom.exist_filter)
-    elif (settings.FILTER  == 'binaryfuse8'):
-        filter = dict(cons = binaryfuse8.construct_filter,
+                        load_kwargs = load_kwargs,
+                        exist = splitblockbloom.exist_filter,
+                        destroy = splitblockbloom.destroy_filter,
+                        serve = splitblockbloom.serve_sidecar,
+                        serve_http = splitblockbloom.serve_http)
+    elif (settings.FILTER  in ('binaryfuse', 'binaryfuse8')):
+        # RBYTES picks the fingerprint of 'binaryfuse': 1, 2 or 4 bytes.
+        module = binaryfuse8 if settings.FILTER == 'binaryfuse8' else fuse_modules.get(settings.RBYTES)
+        if (module is None):
+            return None
+        cons_args += [settings.FUSE_ARITY]
+        load_kwargs['arity'] = settings.FUSE_ARITY
+        filter = dict(cons = module.construct_filter,
                         cons_args = cons_args,
-                        san = binaryfuse8.sanity_check,
+                        build = module.build_filter,
+                        build_args = [settings.KEYSFILE, settings.FILTERFILE] + cons_args[1:],
+                        san = module.sanity_check,
                         san_args = san_args,
-                        query = binaryfuse8.query_filter,
-                        save = binaryfuse8.save_filter,
+                        query = module.query_filter,
+                        query_hashes = module.query_hashes,
+                        save = module.save_filter,
                         save_args = save_args,
-                        load = binaryfuse8.load_filter,
+                        load = module.load_filter,
                         load_args = load_args,
-                        exist = binaryfuse8.exist_filter)
+                        load_kwargs = load_kwargs,
+                        exist = module.exist_filter,
+                        destroy = module.destroy_filter,
+                        serve = module.serve_sidecar,
+                        serve_http = module.serve_http)
     elif (settings.FILTER  == 'xor'):
         if (settings.RBYTES == 1):
             filter = dict(cons = xor8.construct_filter,
                         cons_args = cons_args,
+                        build = xor8.build_filter,
+                        build_args = [settings.KEYSFILE, settings.FILTERFILE] + cons_args[1:],
                         san = xor8.sanity_check,
                         san_args = san_args,
                         query = xor8.query_filter,
+                        query_hashes = xor8.query_hashes,
                         save = xor8.save_filter,
                         save_args = save_args,
                         load = xor8.load_filter,
                         load_args = load_args,
-                        exist = xor8.exist_filter)
+                        load_kwargs = load_kwargs,
+                        exist = xor8.exist_filter,
+                        destroy = xor8.destroy_filter,
+                        serve = xor8.serve_sidecar,
+                        serve_http = xor8.serve_http)
         else:
             filter = dict(cons = xor16.construct_filter,
                         cons_args = cons_args,
+                        build = xor16.build_filter,
+                        build_args = [settings.KEYSFILE, settings.FILTERFILE] + cons_args[1:],
                         san = xor16.sanity_check,
                         san_args = san_args,
                         query = xor16.query_filter,
+                        query_hashes = xor16.query_hashes,
                         save = xor16.save_filter,
                         save_args = save_args,
                         load = xor16.load_filter,
                         load_args = load_args,
-                        exist = xor16.exist_filter)
+                        load_kwargs = load_kwargs,
+                        exist = xor16.exist_filter,
+                        destroy = xor16.destroy_filter,
+                        serve = xor16.serve_sidecar,
+                        serve_http = xor16.serve_http)
     elif (settings.FILTER  == 'dummy'):
         filter = dict(dummy = True,
                     query = dummy_false,
                     exist = dummy_true)
     else:
         filter = None
-    return
+    return filter
         
 
-def add_filter():
+def publish_filter(parsed, state):
+    # Queries only ever see a finished filter: the dict is swapped in whole.
+    global filter, filter_state, filter_generation, filter_version
+    filter = parsed
+    filter_state = state
+    if (parsed is not None):
+        filter_generation += 1
+        # Names what the answers come from, the same on every node serving
+        # the same FILTERFILE.
+        info = utils.filter_info(settings.FILTERFILE) if settings.FILTER != 'dummy' else None
+        filter_version = artifact_version(info) if info is not None else '%s-%d' % (settings.FILTER, filter_generation)
+    else:
+        filter_version = None
+    filter_ready.set()
+    return
+
+@contextlib.contextmanager
+def build_lock():
+    # Held across processes on the host, so only one of them builds FILTERFILE.
+    with open(settings.FILTERFILE + '.lock', 'a') as lock:
+        fcntl.flock(lock, fcntl.LOCK_EX)
+        try:
+            yield
+        finally:
+            fcntl.flock(lock, fcntl.LOCK_UN)
+
+def build_filter(parsed):
+    with build_lock():
+        return parsed['build'](*parsed['build_args'])
+
+def load_parsed(parsed, checked = False):
+    # A checked load only swaps the filter in once it answers every key of
+    # KEYSFILE, so a bad build never replaces the filter being served.
+    kwargs = dict(parsed['load_kwargs'], keysfile = settings.KEYSFILE) if checked else parsed['load_kwargs']
+    return os.path.exists(settings.FILTERFILE) and parsed['load'](*parsed['load_args'], **kwargs)
+
+def prepare_filter():
 
     #print('OS APP:', os.environ.get('RUN_MAIN', None))
-    filter_parser()
-    if(filter == None or filter['exist']()):
+    parsed = filter_parser()
+    if(parsed == None or parsed['exist']()):
         #print("FILTER ALREADY EXISTS")
-        return
+        return parsed
     #print("FILTER NOT IN MEM")
-    if(os.path.exists(settings.FILTERFILE) and filter['load'](*filter['load_args'])):
+    signature = file_signature(settings.FILTERFILE)
+    if(load_parsed(parsed)):
         #print("FILTER LOADED")
-        return
+        return parsed
+    if(settings.FILTER_DOWNLOAD):
+        with contextlib.suppress(Exception):
+            download_filter()
+        if(load_parsed(parsed)):
+            return parsed
     #print("DJANGO1-BAD LOAD")
     if (os.path.exists(settings.KEYSFILE)):
         maxkeys = utils.calculate_keys(settings.KEYSFILE)
         if(settings.NKEYS > maxkeys):
             print("IGNORING NKEYS=%d SETTING... MAximum Keys in %s = %d" % (settings.NKEYS, settings.FILTERFILE, maxkeys))
-        #print("\nINICIO: ", datetime.datetime.now(), "\n")
-        if(filter['cons'](*filter['cons_args'])):
-            pass 
-            #print("\FIN CONS: ", datetime.datetime.now(), "\n")
-            if (filter['san'](*filter['san_args'])):
-                #print("\FIN SAN: ", datetime.datetime.now(), "\n")
-                #print("CONSTRUCTED AND SANITIZED CORRECTLY")
-                #print("SAVING1")
-                filter['save'](*filter['save_args'])
-                return
+        with build_lock():
+            # Another process may have built it while we waited for the lock.
+            if(file_signature(settings.FILTERFILE) != signature and load_parsed(parsed)):
+                return parsed
+            #print("\nINICIO: ", datetime.datetime.now(), "\n")
+            if(parsed['build'](*parsed['build_args']) and load_parsed(parsed, checked = True)):
+                #print("\FIN BUILD: ", datetime.datetime.now(), "\n")
+                #print("BUILT AND SANITIZED CORRECTLY")
+                return parsed
     #print("DJANGO1-BAD CONS")
-    #raise ValidationError(_("FilterVal check failed"),code='password_no_number',)
-    #common.synthetic(wd, nkeys)
-    #splitblockbloom.construct_filter(wd, nkeys, 0.6)
+    return None
+
+def load_hotset():
+    # The hot set answers the most common passwords while the filter is still
+    # loading, so it goes first.
+    if (settings.HOTSET_SIZE and os.path.exists(settings.HOTKEYSFILE)):
+        return hotset.construct_filter(settings.HOTKEYSFILE, settings.HOTSET_SIZE)
+    return False
+
+def load_keystore():
+    # Filter positives are confirmed against the keys file they came from. A
+    # keystore loaded for the range API is refreshed along with the filter too.
+    if ((settings.VERIFY_KEYS or utils.exist_keystore()) and os.path.exists(settings.KEYSFILE)):
+        return utils.load_keystore(settings.KEYSFILE)
+    return False
+
+def add_filter():
+    global filter_state
+    with filter_lock:
+        filter_state = 'LOADING'
+        load_hotset()
+        parsed = prepare_filter()
+        load_keystore()
+        publish_filter(parsed, 'READY' if parsed is not None else 'FAILED')
+    return parsed is not None
 
-def post_server():
+def start_filter():
+    global filter_thread, filter_state
+    with filter_lock:
+        if (filter_thread is not None or filter_ready.is_set()):
+            return
+        filter_state = 'LOADING'
+        filter_thread = threading.Thread(target=add_filter, name='filterclient-loader', daemon=True)
+        filter_thread.start()
+    return
+
+def reload_filter(rebuild = False):
+    # The filter modules swap the new filter in themselves, through RCU, once it
+    # is complete. Queries keep running on the old one until then, and for good
+    # if a rebuilt filter fails its sanity check.
+    with filter_lock:
+        parsed = filter_parser()
+        if (parsed is None or 'build' not in parsed):
+            return False
+        if (rebuild):
+            with build_lock():
+                # Other processes watching the same KEYSFILE find it already built.
+                built = (os.path.exists(settings.FILTERFILE)
+                    and os.path.getmtime(settings.FILTERFILE) >= os.path.getmtime(settings.KEYSFILE))
+                if (not built and not parsed['build'](*parsed['build_args'])):
+                    #print("DJANGO1-BAD REBUILD")
+                    return False
+        if (not load_parsed(parsed, checked = rebuild)):
+            #print("DJANGO1-BAD RELOAD")
+            return False
+        if (rebuild):
+            load_hotset()
+            load_keystore()
+        publish_filter(parsed, 'READY')
+    return True
+
+def file_signature(path):
+    try:
+        st = os.stat(path)
+        return (st.st_ino, st.st_size, st.st_mtime_ns)
+    except OSError:
+        return None
+
+def settled_signature(path):
+    # Waits for writers to finish before the file is read.
+    signature = file_signature(path)
+    while True:
+        time.sleep(1)
+        current = file_signature(path)
+        if (current == signature):
+            return current
+        signature = current
+
+def watch_filter():
+    files = [settings.FILTERFILE, settings.KEYSFILE]
+    seen = [file_signature(f) for f in files]
+    while True:
+        # inotify wakes us up early; comparing signatures also catches changes
+        # made while a reload was running.
+        utils.watch_files(files, int(settings.FILTER_RELOAD_INTERVAL*1000))
+        current = [file_signature(f) for f in files]
+        if (current[1] is not None and current[1] != seen[1]):
+            settled_signature(files[1])
+            reload_filter(rebuild = True)
+        elif (current[0] is not None and current[0] != seen[0]):
+            settled_signature(files[0])
+            reload_filter()
+        seen = [file_signature(f) for f in files]
+
+def start_watcher():
+    global watch_thread
+    with filter_lock:
+        if (watch_thread is not None):
+            return
+        watch_thread = threading.Thread(target=watch_filter, name='filterclient-watcher', daemon=True)
+        watch_thread.start()
+    return
+
+def sidecar_ready():
+    # The filterd command owns the filter, so the sidecar is ready once it answers.
+    return sidecar.query(settings.SIDECAR_NAME, '0'*40, True) is not None
+
+def filter_status():
+    # Servers started without the autoreloader load the filter on their first
+    # query or health probe.
+    if (settings.FILTER_MODE == 'LOCAL' and not filter_ready.is_set()):
+        start_filter()
+    if (settings.FILTER_MODE == 'SIDECAR'):
+        ready = sidecar_ready()
+    else:
+        ready = settings.FILTER_MODE == 'REMOTE' or filter_state == 'READY'
+    status = dict(state = filter_state,
+                  ready = ready,
+                  generation = filter_generation,
+                  version = filter_version,
+                  hotset = hotset.size_filter(),
+                  keystore = utils.exist_keystore(),
+                  filter = settings.FILTER,
+                  mode = settings.FILTER_MODE)
+    if (settings.FILTER_MODE == 'REMOTE'):
+        status['replicas'] = replica_status()
+        status['result_cache'] = result_cache.stats()
+    return status
+
+def get_session():
+    # One keep-alive connection pool per process, a forked child opens its own.
+    global remote_session
+    with remote_lock:
+        if (remote_session is None or remote_session[0] != os.getpid()):
+            session = requests.Session()
+            adapter = requests.adapters.HTTPAdapter(pool_connections=len(all_replicas()), pool_maxsize=settings.REMOTE_POOL_SIZE)
+            session.mount('http://', adapter)
+            session.mount('https://', adapter)
+            remote_session = (os.getpid(), session)
+        return remote_session[1]
+
+def fan_out(query, items):
+    # Runs query over items on up to REMOTE_FANOUT threads, keeping their order.
+    global remote_pool
+    with remote_lock:
+        if (remote_pool is None or remote_pool[0] != os.getpid()):
+            remote_pool = (os.getpid(), concurrent.futures.ThreadPoolExecutor(max_workers=settings.REMOTE_FANOUT,
+                                                                              thread_name_prefix='filterclient-remote'))
+    return list(remote_pool[1].map(query, items))
+
+def server_replicas(server = None):
+    # The replica URLs of a server setting, which is one URL or a list of them.
+    server = server or settings.REMOTE_SERVER
+    return [server] if isinstance(server, str) else list(server)
+
+def all_replicas():
+    return set(server_replicas()).union(*(server_replicas(server) for prefixes, server in settings.SHARD_MAP))
+
+def post_server(server = None):
     #print("QUERYING POST TO SERVER...")
-    response = requests.post(settings.REMOTE_SERVER, json=settings.SERVER_CREDENTIALS)
+    server = server_replicas(server)[0]
+    response = get_session().post(server, json=settings.SERVER_CREDENTIALS, timeout=settings.REMOTE_TIMEOUT)
     token = response.json().get('token')
     errorcode = response.json().get('errorcode')
     #print("TOKEN: %s  - ERRORCODE: %s" % (token, errorcode))
     if (token is not None or errorcode == ServerErrorCode.TOKEN_UNNECESSARY.value):
-        global client_token
-        client_token = token
+        client_tokens[server] = token
         return True
     return False
 
+def remote_url(path, server = None):
+    server = server_replicas(server)[0]
+    return server + ('' if not path or server.endswith('/') else '/') + path
+
+def shard_range(prefixes):
+    # The 64-bit hash prefixes spanned by 'first-last' hex prefixes, both included.
+    first, last = prefixes.split('-')
+    return (int(first.ljust(16, '0'), 16), int(last.ljust(16, 'f'), 16))
+
+def in_shard(digest):
+    # Whether this node holds the 20 byte digest, which is always the case
+    # without SHARD_RANGE.
+    if (not settings.SHARD_RANGE):
+        return True
+    first, last = shard_range(settings.SHARD_RANGE)
+    return first <= int.from_bytes(digest[:8], 'big') <= last
+
+def shard_server(hashed):
+    # The server of SHARD_MAP holding the SHA1 hex digest, REMOTE_SERVER if none does.
+    for prefixes, server in settings.SHARD_MAP:
+        first, last = shard_range(prefixes)
+        if (re.match('[0-9a-fA-F]{16}', hashed) and first <= int(hashed[:16], 16) <= last):
+            break
+    else:
+        server = settings.REMOTE_SERVER
+    return server if isinstance(server, str) else tuple(server)
+
+class Replica:
+    # What a client has seen from one replica URL: its latest latencies, to
+    # hedge past REMOTE_HEDGE_PERCENTILE of them, and the failures in a row
+    # that get it ejected for REMOTE_EJECT_TIME seconds.
+    window = 256
+    samples = 20
+
+    def __init__(self):
+        self.latencies = collections.deque(maxlen=self.window)
+        self.average = 0.0
+        self.inflight = 0
+        self.failures = 0
+        self.ejected = 0.0
+
+    def cost(self):
+        return self.average * (self.inflight + 1)
+
+    def hedge_delay(self):
+        if (len(self.latencies) < self.samples):
+            return settings.REMOTE_HEDGE_DELAY
+        latencies = sorted(self.latencies)
+        return latencies[min(len(latencies) - 1, len(latencies) * settings.REMOTE_HEDGE_PERCENTILE // 100)]
+
+    def status(self):
+        return dict(average = self.average, hedge_delay = self.hedge_delay(), inflight = self.inflight,
+                    failures = self.failures, ejected = self.ejected > time.time())
+
+def get_replica(url):
+    with remote_lock:
+        return replica_stats.setdefault(url, Replica())
+
+def replica_status():
+    with remote_lock:
+        return {url: replica.status() for url, replica in replica_stats.items()}
+
+def pick_replicas(server):
+    # The replicas in the order to ask them. The first is the cheaper of two
+    # random ones, ejected replicas are only asked once all others have failed.
+    urls = server_replicas(server)
+    if (len(urls) == 1):
+        return urls
+    now = time.time()
+    replicas = [get_replica(url) for url in urls]
+    healthy = [url for url, replica in zip(urls, replicas) if replica.ejected <= now]
+    ejected = [url for url, replica in zip(urls, replicas) if replica.ejected > now]
+    random.shuffle(healthy)
+    if (len(healthy) > 1 and get_replica(healthy[1]).cost() < get_replica(healthy[0]).cost()):
+        healthy[0], healthy[1] = healthy[1], healthy[0]
+    return healthy + ejected
+
+def settle_replica(url, answered):
+    # An answer clears the replica's failures, an exception or a 5xx adds to
+    # them. Slowness is judged from the latencies instead, by eject_slow.
+    replica = get_replica(url)
+    with remote_lock:
+        if (answered):
+            replica.failures = 0
+            replica.ejected = 0.0
+        else:
+            replica.failures += 1
+            if (replica.failures >= settings.REMOTE_EJECT_FAILURES):
+                replica.failures = 0
+                replica.ejected = time.time() + settings.REMOTE_EJECT_TIME
+
+def eject_slow(urls):
+    # A replica whose average latency, over enough answers, is
+    # REMOTE_EJECT_SLOWDOWN times the median of its peers' is ejected, and
+    # starts its latencies over once it is back.
+    if (len(urls) < 2 or not settings.REMOTE_EJECT_SLOWDOWN):
+        return
+    now = time.time()
+    with remote_lock:
+        replicas = [replica_stats.setdefault(url, Replica()) for url in urls]
+        for replica in replicas:
+            peers = sorted(other.average for other in replicas if other is not replica and other.latencies)
+            if (len(replica.latencies) >= replica.samples and peers and replica.ejected <= now
+                    and replica.average > settings.REMOTE_EJECT_SLOWDOWN * peers[len(peers)//2]):
+                replica.ejected = now + settings.REMOTE_EJECT_TIME
+                replica.latencies.clear()
+                replica.average = 0.0
+
+def send_timed(method, url, path, **kwargs):
+    replica = get_replica(url)
+    with remote_lock:
+        replica.inflight += 1
+    start = time.monotonic()
+    try:
+        response = send_replica(method, url, path, **kwargs)
+    finally:
+        with remote_lock:
+            replica.inflight -= 1
+    if (response.status_code < 500):
+        latency = time.monotonic() - start
+        with remote_lock:
+            replica.latencies.append(latency)
+            replica.average = latency if replica.average == 0.0 else 0.8*replica.average + 0.2*latency
+    return response
+
+def close_response(future):
+    if (not future.cancelled() and future.exception() is None):
+        future.result().close()
+
+def settle_late(url):
+    # Settles a request overtaken by another replica once it ends, by its own
+    # outcome, and drops its answer.
+    def settle(future):
+        answered = (not future.cancelled() and future.exception() is None
+                    and future.result().status_code < 500)
+        if (not future.cancelled()):
+            settle_replica(url, answered)
+        close_response(future)
+    return settle
+
+def send_replica(method, server, path, **kwargs):
+    # Sends an authenticated request, asking for a new token once if the
+    # server refuses the current one.
+    refused = (ServerErrorCode.TOKEN_REQUIRED.value, ServerErrorCode.BAD_TOKEN.value, ServerErrorCode.EXPIRED_TOKEN.value)
+    for retry in (True, False):
+        token = client_tokens.get(server)
+        header = dict(kwargs.get('headers', {}))
+        if (token is not None):
+            header['Authorization'] = 'Bearer %s' % token
+        response = get_session().request(method, remote_url(path, server),
+                                         **dict(kwargs, headers=header, timeout=settings.REMOTE_TIMEOUT))
+        if (not retry or response.headers.get('Content-Type') != 'application/json'
+                or response.json().get('errorcode') not in refused or not post_server(server)):
+            return response
+
+def send_server(method, server, path, **kwargs):
+    # Sends the request to one of the replicas of server, or of REMOTE_SERVER.
+    # The next replica is asked too when it fails, or when it takes longer
+    # than REMOTE_HEDGE_PERCENTILE of its answers, and the first answer wins.
+    global hedge_pool
+    eject_slow(server_replicas(server))
+    urls = pick_replicas(server)
+    if (len(urls) == 1):
+        return send_replica(method, urls[0], path, **kwargs)
+    with remote_lock:
+        if (hedge_pool is None or hedge_pool[0] != os.getpid()):
+            hedge_pool = (os.getpid(), concurrent.futures.ThreadPoolExecutor(max_workers=2*settings.REMOTE_POOL_SIZE,
+                                                                             thread_name_prefix='filterclient-hedge'))
+    attempts = {}
+    pending = set()
+    failed = None
+    while (urls or pending):
+        if (urls):
+            url = urls.pop(0)
+            future = hedge_pool[1].submit(send_timed, method, url, path, **kwargs)
+            attempts[future] = url
+            pending.add(future)
+        delay = get_replica(url).hedge_delay() if (urls and settings.REMOTE_HEDGE) else None
+        done, pending = concurrent.futures.wait(pending, timeout=delay, return_when=concurrent.futures.FIRST_COMPLETED)
+        for future in done:
+            try:
+                response = future.result()
+            except Exception as e:
+                response, failed = None, e
+            if (response is not None and response.status_code < 500):
+                settle_replica(attempts[future], True)
+                for other in pending:
+                    other.add_done_callback(settle_late(attempts[other]))
+                for other in done - {future}:
+                    close_response(other)
+                return response
+            settle_replica(attempts[future], False)
+            if (response is not None):
+                if (isinstance(failed, requests.Response)):
+                    failed.close()
+                failed = response
+    if (isinstance(failed, Exception)):
+        raise failed
+    return failed
+
+def request_server(method, server, path, **kwargs):
+    return send_server(method, server, path, **kwargs).json()
+
 def query_server(password):
     #print("QUERYING GET TO SERVER...")
+    cached = result_cache.get(password)
+    if (cached is not None):
+        return cached
     try:
-        global client_token
-        if (client_token is None):
-            response = requests.get(settings.REMOTE_SERVER, params={'password':password})
-        else:
-            header = {'Authorization': 'Bearer %s' % client_token}
-            response = requests.get(settings.REMOTE_SERVER, headers=header, params={'password':password})
-        result = response.json().get('compromised')
-        errorcode = response.json().get('errorcode')
+        data = request_server('GET', shard_server(password), '', params={'password':password})
+        result = data.get('compromised')
+        errorcode = data.get('errorcode')
         #print("RESULT: %s  - ERRORCODE: %s" % (result, errorcode))
         if (result is not None):
+            result_cache.put(password, result)
             return result
         else:
             if (errorcode == ServerErrorCode.TOKEN_REQUIRED.value or errorcode == ServerErrorCode.BAD_TOKEN.value):
-                if(post_server()):
-                    return query_server(password)
-                else:
-                    raise Exception('Unauthorized service')
+                raise Exception('Unauthorized service')
             elif (errorcode == ServerErrorCode.BAD_PASSWORD.value):
                 raise Exception('Password cannot be None or Empty')
             elif (errorcode == ServerErrorCode.BAD_ISSUER.value):
@@ -202,16 +744,207 @@ def query_server(password):
         #print(e)
     return True
 
+def query_server_batch(server, hexes):
+    # One server's answers through its batch endpoint, or one by one
+    # concurrently when it has none.
+    try:
+        result = request_server('POST', server, 'batch/', json=hexes).get('compromised')
+    except Exception:
+        result = None
+    if (not isinstance(result, list) or len(result) != len(hexes)):
+        return fan_out(query_server, hexes)
+    result_cache.put_many(dict(zip(hexes, result)))
+    return result
+
+def query_server_hashes(hashes):
+    # Asks the servers holding the packed digests about those neither the
+    # prefilter nor the result cache can answer, every shard at the same time.
+    hexes = [hashes[20*i:20*i+20].hex() for i in range(len(hashes)//20)]
+    cached = result_cache.get_many([h for h in hexes if splitblockbloom.query_prefilter(h, True)])
+    shards = {}
+    for h in hexes:
+        if (h not in cached and splitblockbloom.query_prefilter(h, True)):
+            shards.setdefault(shard_server(h), []).append(h)
+    groups = list(shards.items())
+    if (len(groups) > 1):
+        # Not on the fan_out pool, which query_server_batch may need itself.
+        with concurrent.futures.ThreadPoolExecutor(max_workers=len(groups)) as pool:
+            answers = list(pool.map(lambda group: query_server_batch(*group), groups))
+    else:
+        answers = [query_server_batch(*group) for group in groups]
+    compromised = set(h for h, res in cached.items() if res)
+    for (server, group), result in zip(groups, answers):
+        compromised.update(h for h, res in zip(group, result) if res)
+    return hashes_bitmap(hashes, lambda h: h in compromised)
+
+def fetch_prefilter():
+    # Downloads the server's prefilter into PREFILTERFILE and swaps it in,
+    # keeping the last downloaded one if the server cannot be reached.
+    temp = settings.PREFILTERFILE + '.tmp'
+    try:
+        with send_server('GET', None, 'prefilter/', stream=True) as response:
+            if (response.ok and response.headers.get('Content-Type') == 'application/octet-stream'):
+                with open(temp, 'wb') as f:
+                    for chunk in response.iter_content(1 << 20):
+                        f.write(chunk)
+                os.replace(temp, settings.PREFILTERFILE)
+    except Exception as e:
+        pass
+        #print(e)
+    return os.path.exists(settings.PREFILTERFILE) and splitblockbloom.load_prefilter(settings.PREFILTERFILE,
+                                                                                     shared=settings.FILTER_SHARED)
+
+def refresh_prefilter():
+    while True:
+        fetch_prefilter()
+        time.sleep(settings.PREFILTER_REFRESH)
+
+def start_prefilter():
+    global prefilter_thread
+    with filter_lock:
+        if (prefilter_thread is not None):
+            return
+        prefilter_thread = threading.Thread(target=refresh_prefilter, name='filterclient-prefilter', daemon=True)
+        prefilter_thread.start()
+    return
+
+def filter_type():
+    # The type recorded in the files of the filter the settings pick.
+    if (settings.FILTER == 'xor'):
+        return 'xor8' if settings.RBYTES == 1 else 'xor16'
+    if (settings.FILTER == 'binaryfuse'):
+        return {1: 'binaryfuse8', 2: 'binaryfuse16', 4: 'binaryfuse32'}.get(settings.RBYTES)
+    return settings.FILTER
+
+def artifact_version(info):
+    # Tells built filter files apart, whichever node built or copied them.
+    return '%d-%08x' % (info['created'], info['payload_crc'])
+
+def download_filter():
+    # Fetches the server's FILTERFILE when its version differs from ours,
+    # resuming an interrupted download of the same version from
+    # FILTERFILE.part. Returns whether FILTERFILE was replaced.
+    with build_lock():
+        info = request_server('GET', None, 'artifact/info/')
+        local = utils.filter_info(settings.FILTERFILE)
+        if (info.get('type') != filter_type() or (local is not None and artifact_version(local) == info['version'])):
+            return False
+        part = settings.FILTERFILE + '.part'
+        offset = os.path.getsize(part) if os.path.exists(part) else 0
+        header = {'Range': 'bytes=%d-' % offset, 'If-Range': '"%s"' % info['version']} if offset else {}
+        with send_server('GET', None, 'artifact/', headers=header, stream=True) as response:
+            if (response.status_code in (200, 206) and response.headers.get('Content-Type') == 'application/octet-stream'):
+                with open(part, 'ab' if response.status_code == 206 else 'wb') as f:
+                    for chunk in response.iter_content(1 << 20):
+                        f.write(chunk)
+            elif (response.status_code != 416):
+                return False
+        downloaded = utils.filter_info(part)
+        if (downloaded is None or artifact_version(downloaded) != info['version']
+                or os.path.getsize(part) != downloaded['payload_offset'] + downloaded['payload_size']
+                or not utils.verify_filterfile(part)):
+            os.remove(part)
+            return False
+        os.replace(part, settings.FILTERFILE)
+        return True
+
+def sync_filter():
+    # Without FILTER_RELOAD nobody watches FILTERFILE, so swap it in here.
+    while True:
+        try:
+            if (download_filter() and not settings.FILTER_RELOAD):
+                reload_filter()
+        except Exception as e:
+            pass
+            #print(e)
+        time.sleep(settings.FILTER_DOWNLOAD_INTERVAL)
+
+def start_download():
+    global download_thread
+    with filter_lock:
+        if (download_thread is not None):
+            return
+        download_thread = threading.Thread(target=sync_filter, name='filterclient-download', daemon=True)
+        download_thread.start()
+    return
+
+def query_sidecar(password, hashed = False):
+    # The filterd command owns the filter; while it is down or has none, the
+    # pending policy decides, with WAIT treated as CLOSED.
+    res = sidecar.query(settings.SIDECAR_NAME, password, hashed)
+    if(res is not None):
+        return res
+    if(settings.FILTER_PENDING_POLICY == 'OPEN'):
+        return False
+    elif(settings.FILTER_PENDING_POLICY == 'REMOTE'):
+        return query_server(password if hashed else utils.sha1(password))
+    return True
+
 def find_password(password, hashed = False):
     #print('OS VALIDATE:', os.environ.get('RUN_MAIN', None))
     if(settings.FILTER_MODE == 'REMOTE'):
         #print("HASHING...")
         hashed_pass = utils.sha1(password)
         #print("HASHED:", hashed_pass)
+        if(not splitblockbloom.query_prefilter(hashed_pass, True)):
+            return False
         return query_server(hashed_pass)
+    if(settings.FILTER_MODE == 'SIDECAR'):
+        return query_sidecar(password, hashed)
+    if(settings.HOTSET_SIZE and hotset.query_filter(password, hashed)):
+        return True
+    if(not filter_ready.is_set()):
+        start_filter()
+        if(settings.FILTER_PENDING_POLICY == 'OPEN'):
+            return False
+        elif(settings.FILTER_PENDING_POLICY == 'CLOSED'):
+            return True
+        elif(settings.FILTER_PENDING_POLICY == 'REMOTE'):
+            return query_server(password if hashed else utils.sha1(password))
+        filter_ready.wait()
     if(filter is None):
-        add_filter()
-    return filter['query'](password, hashed)
+        return False
+    return filter['query'](password, hashed) and (not settings.VERIFY_KEYS or utils.verify_key(password, hashed))
+
+def password_digest(password, hashed = False):
+    # The 20 byte SHA1 digest that find_password(password, hashed) looks up.
+    if(hashed and re.match('[0-9a-fA-F]{40}', password)):
+        return bytes.fromhex(password[:40])
+    return bytes.fromhex(utils.sha1(password))
+
+def hashes_bitmap(hashes, query):
+    bitmap = bytearray((len(hashes)//20 + 7)//8)
+    for i in range(len(hashes)//20):
+        if(query(hashes[20*i:20*i+20].hex())):
+            bitmap[i//8] |= 1 << (i%8)
+    return bytes(bitmap)
+
+def find_hashes(hashes):
+    # Takes packed 20 byte SHA1 digests and answers them all at once, hash i
+    # in bit i%8 of byte i//8. Falls back to one find_password per hash when
+    # there is no native batch path.
+    res = None
+    if(settings.FILTER_MODE == 'SIDECAR'):
+        res = sidecar.query_hashes(settings.SIDECAR_NAME, hashes)
+    elif(settings.FILTER_MODE == 'REMOTE'):
+        res = query_server_hashes(hashes)
+    elif(settings.FILTER_MODE == 'LOCAL'):
+        if(not filter_ready.is_set() and settings.FILTER_PENDING_POLICY == 'WAIT'):
+            start_filter()
+            filter_ready.wait()
+        parsed = filter
+        if(filter_ready.is_set() and parsed is not None and 'query_hashes' in parsed):
+            res = parsed['query_hashes'](hashes)
+            if(res is not None and settings.VERIFY_KEYS):
+                res = utils.verify_hashes(hashes, res) or res
+    if(res is None):
+        res = hashes_bitmap(hashes, lambda h: find_password(h, True))
+    return res
+
+def find_passwords(passwords, hashed = False):
+    # find_password for several candidates at once, in a single batch query.
+    bitmap = find_hashes(b''.join(password_digest(p, hashed) for p in passwords))
+    return [bool(bitmap[i//8] >> (i%8) & 1) for i in range(len(passwords))]
 
 
 class FilterclientConfig(AppConfig):
@@ -223,7 +956,13 @@ class FilterclientConfig(AppConfig):
         #print("FILTER ", settings.FILTER)
         if (os.environ.get('RUN_MAIN', None) == 'true'):
             if (settings.FILTER_MODE == 'LOCAL'):
-                add_filter()
+                start_filter()
+                if (settings.FILTER_RELOAD):
+                    start_watcher()
+                if (settings.FILTER_DOWNLOAD):
+                    start_download()
+            elif (settings.FILTER_MODE == 'REMOTE' and settings.PREFILTER and not settings.SHARD_MAP):
+                start_prefilter()
         return
 
 
@@ -234,14 +973,23 @@ def example_check(app_configs, **kwargs):
     #print('TESTING:', os.environ.get('TESTING', None))
     #print("MODE:", settings.FILTER_MODE)
     if (os.environ.get('TESTING', None) != 'true'):
-        if (settings.FILTER_MODE != 'LOCAL' and settings.FILTER_MODE != 'REMOTE'):
+        if (settings.FILTER_MODE not in ['LOCAL', 'REMOTE', 'SIDECAR']):
             errors.append(
                 Error(
                     'Bad configuration of setting "FILTER_MODE',
-                    hint='FILTER_MODE must be either <LOCAL> or <REMOTE>',
+                    hint='FILTER_MODE must be one of <LOCAL>, <REMOTE> or <SIDECAR>',
                     id='filterclient.E001',
                 )
             )
+        elif (settings.FILTER_MODE == 'SIDECAR'):
+            if (settings.FILTER_PENDING_POLICY not in ['WAIT', 'OPEN', 'CLOSED', 'REMOTE']):
+                errors.append(
+                    Error(
+                        'Bad configuration of setting "FILTER_PENDING_POLICY',
+                        hint='FILTER_PENDING_POLICY must be one of these: WAIT, OPEN, CLOSED, REMOTE',
+                        id='filterclient.E004',
+                    )
+                )
         elif (settings.FILTER_MODE == 'LOCAL'):
             if (settings.FILTER not in settings.POSSIBLE_FILTERS):
                 errors.append(
@@ -251,15 +999,38 @@ def example_check(app_configs, **kwargs):
                         id='filterclient.E002',
                     )
             )
-            else:
-                if(filter is None):
-                    add_filter()
-                elif(filter is not None and not filter['exist']()):
-                    errors.append(
-                        Error(
-                            'Unknown error',
-                            hint='Verify you have executed "preprocess" command after running django.',
-                            id='filterclient.E003',
-                        )
+            elif (settings.FILTER in ('binaryfuse', 'binaryfuse8') and settings.FUSE_ARITY not in (3, 4)):
+                errors.append(
+                    Error(
+                        'Bad configuration of setting "FUSE_ARITY',
+                        hint='FUSE_ARITY must be 3 or 4',
+                        id='filterclient.E005',
+                    )
+                )
+            elif (settings.FILTER == 'binaryfuse' and settings.RBYTES not in fuse_modules):
+                errors.append(
+                    Error(
+                        'Bad configuration of setting "RBYTES',
+                        hint='RBYTES must be 1, 2 or 4 for the binaryfuse filter',
+                        id='filterclient.E006',
+                    )
+                )
+            elif (settings.FILTER_PENDING_POLICY not in ['WAIT', 'OPEN', 'CLOSED', 'REMOTE']):
+                errors.append(
+                    Error(
+                        'Bad configuration of setting "FILTER_PENDING_POLICY',
+                        hint='FILTER_PENDING_POLICY must be one of these: WAIT, OPEN, CLOSED, REMOTE',
+                        id='filterclient.E004',
                     )
+                )
+            elif(filter_ready.is_set() and (filter is None or not filter['exist']())):
+                # Checks run for every management command, so they never start
+                # the load themselves.
+                errors.append(
+                    Error(
+                        'Unknown error',
+                        hint='Verify you have executed "preprocess" command after running django.',
+                        id='filterclient.E003',
+                    )
+                )
     return errors
@@ -0,0 +1,29 @@
+from django.core.management.base import BaseCommand
+from django.conf import settings
+from filterclient import apps
+
+import os
+
+
+class Command(BaseCommand):
+    help = 'Builds FILTERFILE from KEYSFILE, writing the filter straight into the file'
+    BaseCommand.requires_system_checks = []
+
+    def add_arguments(self, parser):
+        parser.add_argument('--check', action='store_true', help='Load the built filter and run the sanity check against KEYSFILE')
+
+    def handle(self, *args, **options):
+        print('OS COMMAND:', os.environ.get('RUN_MAIN', None))
+
+        filter = apps.filter_parser()
+        if(filter is None or 'build' not in filter):
+            print("FILTER NOT BUILDABLE")
+        elif(not os.path.exists(settings.KEYSFILE)):
+            print("KEYS NOT FOUND")
+        elif(not apps.build_filter(filter)):
+            print("DJANGO1-BAD BUILD")
+        elif(options['check'] and not (apps.load_parsed(filter) and filter['san'](*filter['san_args']))):
+            print("DJANGO1-BAD SANITY")
+        else:
+            print('BUILD DONE')
+        return
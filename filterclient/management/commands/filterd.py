@@ -0,0 +1,30 @@
+from django.core.management.base import BaseCommand
+from django.conf import settings
+from filterclient import apps
+
+import os
+
+
+class Command(BaseCommand):
+    help = 'Serves the filter to every process on this host through the shared memory rings of SIDECAR_NAME'
+    BaseCommand.requires_system_checks = []
+
+    def handle(self, *args, **options):
+        print('OS COMMAND:', os.environ.get('RUN_MAIN', None))
+
+        if(not apps.add_filter()):
+            print("DJANGO1-BAD FILTER")
+        elif('serve' not in apps.filter):
+            print("FILTER NOT SERVABLE")
+        else:
+            if (settings.FILTER_RELOAD):
+                apps.start_watcher()
+            print('SERVING %s ON %s' % (settings.FILTER, settings.SIDECAR_NAME))
+            try:
+                if(not apps.filter['serve'](settings.SIDECAR_NAME, settings.SIDECAR_RINGS)):
+                    print("DJANGO1-BAD SIDECAR")
+                    return
+            except KeyboardInterrupt:
+                pass
+            print('SIDECAR STOPPED')
+        return
@@ -1,6 +1,7 @@
 from django.core.management.base import BaseCommand
 from dbfilters import preprocess
 from django.conf import settings
+from filterclient.apps import shard_range
 
 import os
 
@@ -9,11 +10,26 @@ class Command(BaseCommand):
     help = 'Closes the specified poll for voting'
     BaseCommand.requires_system_checks = []
 
+    def add_arguments(self, parser):
+        parser.add_argument('--update', action='store_true', help='Merge a hash sorted PWDFILE into the existing compact KEYSFILE')
+
     def handle(self, *args, **options):
         print('OS COMMAND:', os.environ.get('RUN_MAIN', None))
+        # A shard server only keeps the keys of its own prefix range.
+        first, last = shard_range(settings.SHARD_RANGE) if settings.SHARD_RANGE else (0, 2**64 - 1)
 
-        if(os.path.exists(settings.PWDFILE)):
-            if(preprocess.preprocess_pwd_file(settings.PWDFILE, settings.KEYSFILE, settings.PREPKEYS, settings.CHECKPREP)):
+        if(options['update']):
+            if(not os.path.exists(settings.PWDFILE) or not os.path.exists(settings.KEYSFILE)):
+                print("PWD OR KEYS NOT FOUND")
+            elif(preprocess.update_pwd_file(settings.PWDFILE, settings.KEYSFILE, settings.PREPKEYS, settings.CHECKPREP, first, last)):
+                print('UPDATE DONE')
+            else:
+                print("DJANGO1-BAD UPDATE")
+        elif(os.path.exists(settings.PWDFILE)):
+            # Before KEYSFILE, so a server reloading on its change finds both new.
+            if(settings.HOTSET_SIZE and not preprocess.hot_keys(settings.PWDFILE, settings.HOTKEYSFILE, settings.HOTSET_SIZE, settings.CHECKPREP, first, last)):
+                print("DJANGO1-BAD HOT KEYS")
+            if(preprocess.preprocess_pwd_file(settings.PWDFILE, settings.KEYSFILE, settings.PREPKEYS, settings.CHECKPREP, settings.COMPACTKEYS, settings.KEYSHARDS, first, last)):
                 print('PREPROCESS DONE')
             else:
                 print("DJANGO1-BAD PREPROCESS")
@@ -21,7 +37,18 @@ class Command(BaseCommand):
             print("PWD NOT FOUND")
         return
     
-    def test(pwdfile, testfile, nkeys):
+    def test(pwdfile, testfile, nkeys, compact=False, shards=0, prefixes=None):
         if(os.path.exists(pwdfile)):
-            preprocess.preprocess_pwd_file(pwdfile, testfile, nkeys, True)
+            first, last = shard_range(prefixes) if prefixes else (0, 2**64 - 1)
+            preprocess.preprocess_pwd_file(pwdfile, testfile, nkeys, True, compact, shards, first, last)
         return
+
+    def test_hot(pwdfile, testfile, nkeys):
+        if(os.path.exists(pwdfile)):
+            return preprocess.hot_keys(pwdfile, testfile, nkeys, True)
+        return False
+
+    def test_update(pwdfile, testfile, nkeys):
+        if(os.path.exists(pwdfile)):
+            return preprocess.update_pwd_file(pwdfile, testfile, nkeys, True)
+        return False
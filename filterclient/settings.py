@@ -2,7 +2,7 @@ from django.conf import settings
 
 FILTER = getattr(settings, 'FILTER', 'ribbon128')
 settings.FILTER = FILTER
-POSSIBLE_FILTERS = getattr(settings, 'POSSIBLE_FILTERS', ['ribbon128', 'xor', 'binaryfuse8', 'splitblockbloom', 'dummy'])
+POSSIBLE_FILTERS = getattr(settings, 'POSSIBLE_FILTERS', ['ribbon128', 'xor', 'binaryfuse', 'binaryfuse8', 'splitblockbloom', 'dummy'])
 settings.POSSIBLE_FILTERS = POSSIBLE_FILTERS
 NKEYS = getattr(settings, 'NKEYS', 0)
 settings.NKEYS = NKEYS
@@ -10,11 +10,21 @@ RBYTES = getattr(settings, 'RBYTES', 1)
 settings.RBYTES = RBYTES
 OVERFACTOR = getattr(settings, 'OVERFACTOR', None)
 settings.OVERFACTOR = OVERFACTOR
+FUSE_ARITY = getattr(settings, 'FUSE_ARITY', 3)
+settings.FUSE_ARITY = FUSE_ARITY
 
 PREPKEYS = getattr(settings, 'PREPKEYS', 1000000)
 settings.PREPKEYS = PREPKEYS
 CHECKPREP = getattr(settings, 'CHECKPREP', True)
 settings.CHECKPREP = CHECKPREP
+COMPACTKEYS = getattr(settings, 'COMPACTKEYS', False)
+settings.COMPACTKEYS = COMPACTKEYS
+KEYSHARDS = getattr(settings, 'KEYSHARDS', 0)
+settings.KEYSHARDS = KEYSHARDS
+HOTSET_SIZE = getattr(settings, 'HOTSET_SIZE', 0)
+settings.HOTSET_SIZE = HOTSET_SIZE
+VERIFY_KEYS = getattr(settings, 'VERIFY_KEYS', False)
+settings.VERIFY_KEYS = VERIFY_KEYS
 
 PWDFILE = getattr(settings, 'PWDFILE', '../../FilterPassword/pwd_full.txt')
 settings.PWDFILE = PWDFILE
@@ -22,11 +32,63 @@ KEYSFILE = getattr(settings, 'KEYSFILE', 'filterclient/FilterFiles/keys.bin')
 settings.KEYSFILE = KEYSFILE
 FILTERFILE = getattr(settings, 'FILTERFILE', 'filterclient/FilterFiles/filter.bin')
 settings.FILTERFILE = FILTERFILE
+HOTKEYSFILE = getattr(settings, 'HOTKEYSFILE', 'filterclient/FilterFiles/hotkeys.bin')
+settings.HOTKEYSFILE = HOTKEYSFILE
 
 FILTER_MODE = getattr(settings, 'FILTER_MODE', 'LOCAL')
 settings.FILTER_MODE = FILTER_MODE
 REMOTE_SERVER = getattr(settings, 'REMOTE_SERVER', 'http://127.0.0.1:8000/reqfilter')
 settings.REMOTE_SERVER = REMOTE_SERVER
+SHARD_MAP = getattr(settings, 'SHARD_MAP', [])
+settings.SHARD_MAP = SHARD_MAP
+SHARD_RANGE = getattr(settings, 'SHARD_RANGE', None)
+settings.SHARD_RANGE = SHARD_RANGE
+REMOTE_POOL_SIZE = getattr(settings, 'REMOTE_POOL_SIZE', 10)
+settings.REMOTE_POOL_SIZE = REMOTE_POOL_SIZE
+REMOTE_TIMEOUT = getattr(settings, 'REMOTE_TIMEOUT', 5)
+settings.REMOTE_TIMEOUT = REMOTE_TIMEOUT
+REMOTE_FANOUT = getattr(settings, 'REMOTE_FANOUT', 8)
+settings.REMOTE_FANOUT = REMOTE_FANOUT
+REMOTE_HEDGE = getattr(settings, 'REMOTE_HEDGE', True)
+settings.REMOTE_HEDGE = REMOTE_HEDGE
+REMOTE_HEDGE_PERCENTILE = getattr(settings, 'REMOTE_HEDGE_PERCENTILE', 95)
+settings.REMOTE_HEDGE_PERCENTILE = REMOTE_HEDGE_PERCENTILE
+REMOTE_HEDGE_DELAY = getattr(settings, 'REMOTE_HEDGE_DELAY', 0.05)
+settings.REMOTE_HEDGE_DELAY = REMOTE_HEDGE_DELAY
+REMOTE_EJECT_FAILURES = getattr(settings, 'REMOTE_EJECT_FAILURES', 3)
+settings.REMOTE_EJECT_FAILURES = REMOTE_EJECT_FAILURES
+REMOTE_EJECT_TIME = getattr(settings, 'REMOTE_EJECT_TIME', 30)
+settings.REMOTE_EJECT_TIME = REMOTE_EJECT_TIME
+REMOTE_EJECT_SLOWDOWN = getattr(settings, 'REMOTE_EJECT_SLOWDOWN', 4)
+settings.REMOTE_EJECT_SLOWDOWN = REMOTE_EJECT_SLOWDOWN
+REMOTE_CACHE_SIZE = getattr(settings, 'REMOTE_CACHE_SIZE', 10000)
+settings.REMOTE_CACHE_SIZE = REMOTE_CACHE_SIZE
+REMOTE_CACHE_TTL = getattr(settings, 'REMOTE_CACHE_TTL', 300)
+settings.REMOTE_CACHE_TTL = REMOTE_CACHE_TTL
+REMOTE_CACHE_BACKEND = getattr(settings, 'REMOTE_CACHE_BACKEND', None)
+settings.REMOTE_CACHE_BACKEND = REMOTE_CACHE_BACKEND
+PREFILTER = getattr(settings, 'PREFILTER', False)
+settings.PREFILTER = PREFILTER
+PREFILTERFILE = getattr(settings, 'PREFILTERFILE', 'filterclient/FilterFiles/prefilter.bin')
+settings.PREFILTERFILE = PREFILTERFILE
+PREFILTER_REFRESH = getattr(settings, 'PREFILTER_REFRESH', 86400)
+settings.PREFILTER_REFRESH = PREFILTER_REFRESH
+FILTER_DOWNLOAD = getattr(settings, 'FILTER_DOWNLOAD', False)
+settings.FILTER_DOWNLOAD = FILTER_DOWNLOAD
+FILTER_DOWNLOAD_INTERVAL = getattr(settings, 'FILTER_DOWNLOAD_INTERVAL', 300)
+settings.FILTER_DOWNLOAD_INTERVAL = FILTER_DOWNLOAD_INTERVAL
+FILTER_SHARED = getattr(settings, 'FILTER_SHARED', True)
+settings.FILTER_SHARED = FILTER_SHARED
+FILTER_RELOAD = getattr(settings, 'FILTER_RELOAD', True)
+settings.FILTER_RELOAD = FILTER_RELOAD
+FILTER_RELOAD_INTERVAL = getattr(settings, 'FILTER_RELOAD_INTERVAL', 5)
+settings.FILTER_RELOAD_INTERVAL = FILTER_RELOAD_INTERVAL
+FILTER_PENDING_POLICY = getattr(settings, 'FILTER_PENDING_POLICY', 'WAIT')
+settings.FILTER_PENDING_POLICY = FILTER_PENDING_POLICY
+SIDECAR_NAME = getattr(settings, 'SIDECAR_NAME', 'pwnedfilter')
+settings.SIDECAR_NAME = SIDECAR_NAME
+SIDECAR_RINGS = getattr(settings, 'SIDECAR_RINGS', 64)
+settings.SIDECAR_RINGS = SIDECAR_RINGS
 SERVER_CREDENTIALS = getattr(settings, 'SERVER_CREDENTIALS', {'username':'admin', 'password':'admin'})
 settings.SERVER_CREDENTIALS = SERVER_CREDENTIALS
 
@@ -7,11 +7,14 @@ from django.core.management.color import color_style
 from django.conf import settings
 from django.apps import apps
 from filterclient.management.commands import purge, preprocess
-from dbfilters import splitblockbloom, utils, ribbon128, binaryfuse8, xor8, xor16
-from filterclient.apps import clear_token, post_server, query_server
+from dbfilters import splitblockbloom, utils, ribbon128, binaryfuse8, binaryfuse16, binaryfuse32, xor8, xor16, sidecar, hotset
+from filterclient.apps import clear_token, post_server, query_server, build_lock
+from filterclient import apps as client
+from unittest import mock
 from filterserver.apps import random_secret
+from filterserver import views
 
-import os, glob, filecmp, hashlib, sys
+import os, glob, filecmp, hashlib, struct, sys, threading, time, requests
 
 
 def testing_mode(switch):
@@ -103,6 +106,193 @@ class FilterLocalClient(TestCase):
         self.assertTrue(filecmp.cmp(testing_keysfile, os.path.join(settings.TESTING_DIR, prepfile)), color.ERROR("PREPROCESS COMMAND FAILED TEST"))
         return
 
+    def test_preprocess_compact(self):
+        sys.stdout.write(color.HTTP_INFO('\nTesting command "preprocess" with compact keys...'))
+        pwdfile = "pwd.txt"
+        prepfile = "keyscompact.bin"
+        with open(os.path.join(settings.TESTING_DIR, pwdfile), 'w') as pwd:
+            with open(testing_keysfile, 'rb') as keys:
+                keys.seek(21)
+                while True:
+                    data = keys.read(20)
+                    if not data: break
+                    pwd.write(data.hex() + "\n")
+            keys.close()
+        pwd.close()
+        preprocess.Command.test(os.path.join(settings.TESTING_DIR, pwdfile), os.path.join(settings.TESTING_DIR, prepfile), testing_nkeys, True)
+        os.remove(os.path.join(settings.TESTING_DIR, pwdfile))
+        compactfile = os.path.join(settings.TESTING_DIR, prepfile)
+        self.assertEqual(utils.calculate_keys(compactfile), testing_nkeys, color.ERROR("PREPROCESS COMMAND FAILED TEST"))
+        self.assertLess(os.path.getsize(compactfile), os.path.getsize(testing_keysfile), color.ERROR("PREPROCESS COMMAND FAILED TEST"))
+        self.assertTrue(ribbon128.construct_filter(compactfile, testing_nkeys), "Filter's construction failed.")
+        self.assertTrue(ribbon128.sanity_check(testing_keysfile), "Filter's sanity check failed.")
+        self.assertTrue(ribbon128.sanity_check(compactfile), "Filter's sanity check failed.")
+        ribbon128.destroy_filter()
+        return
+
+    def test_preprocess_shards(self):
+        sys.stdout.write(color.HTTP_INFO('\nTesting command "preprocess" with sharded keys...'))
+        pwdfile = os.path.join(settings.TESTING_DIR, "pwd.txt")
+        shardfile = os.path.join(settings.TESTING_DIR, "keysshards.bin")
+        compactfile = os.path.join(settings.TESTING_DIR, "keysshardscompact.bin")
+        with open(pwdfile, 'w') as pwd:
+            with open(testing_keysfile, 'rb') as keys:
+                keys.seek(21)
+                while True:
+                    data = keys.read(20)
+                    if not data: break
+                    pwd.write(data.hex() + "\n")
+        preprocess.Command.test(pwdfile, shardfile, testing_nkeys, False, 4)
+        preprocess.Command.test(pwdfile, compactfile, testing_nkeys, True, 8)
+        os.remove(pwdfile)
+        self.assertEqual(len(glob.glob(shardfile + ".*")), 4, color.ERROR("PREPROCESS COMMAND FAILED TEST"))
+        self.assertEqual(len(glob.glob(compactfile + ".*")), 8, color.ERROR("PREPROCESS COMMAND FAILED TEST"))
+        self.assertEqual(utils.calculate_keys(shardfile), testing_nkeys, color.ERROR("PREPROCESS COMMAND FAILED TEST"))
+        self.assertEqual(utils.calculate_keys(compactfile), testing_nkeys, color.ERROR("PREPROCESS COMMAND FAILED TEST"))
+        self.assertTrue(binaryfuse8.construct_filter(shardfile), "Filter's construction failed.")
+        self.assertTrue(binaryfuse8.sanity_check(testing_keysfile), "Filter's sanity check failed.")
+        self.assertTrue(binaryfuse8.sanity_check(shardfile), "Filter's sanity check failed.")
+        self.assertTrue(binaryfuse8.sanity_check(compactfile), "Filter's sanity check failed.")
+        binaryfuse8.destroy_filter()
+        return
+
+    def test_preprocess_range(self):
+        sys.stdout.write(color.HTTP_INFO('\nTesting command "preprocess" with a shard range...'))
+        pwdfile = os.path.join(settings.TESTING_DIR, "pwd.txt")
+        lowfile = os.path.join(settings.TESTING_DIR, "keyslow.bin")
+        highfile = os.path.join(settings.TESTING_DIR, "keyshigh.bin")
+        hashes = []
+        with open(pwdfile, 'w') as pwd:
+            with open(testing_keysfile, 'rb') as keys:
+                keys.seek(21)
+                while True:
+                    data = keys.read(20)
+                    if not data: break
+                    hashes.append(data.hex())
+                    pwd.write(data.hex() + "\n")
+        preprocess.Command.test(pwdfile, lowfile, testing_nkeys, False, 0, '0-7')
+        preprocess.Command.test(pwdfile, highfile, testing_nkeys, True, 0, '8-F')
+        os.remove(pwdfile)
+        low = [h for h in hashes if h[0] < '8']
+        self.assertEqual(utils.calculate_keys(lowfile), len(low), color.ERROR("PREPROCESS COMMAND FAILED TEST"))
+        self.assertEqual(utils.calculate_keys(highfile), len(hashes) - len(low), color.ERROR("PREPROCESS COMMAND FAILED TEST"))
+        self.assertTrue(ribbon128.construct_filter(lowfile), "Filter's construction failed.")
+        self.assertTrue(all(ribbon128.query_filter(h, True) for h in low), "Filter missed a key of its range.")
+        self.assertTrue(ribbon128.sanity_check(lowfile), "Filter's sanity check failed.")
+        ribbon128.destroy_filter()
+        return
+
+    def test_preprocess_hot(self):
+        sys.stdout.write(color.HTTP_INFO('\nTesting command "preprocess" for the hot set...'))
+        pwdfile = os.path.join(settings.TESTING_DIR, "pwd.txt")
+        hotfile = os.path.join(settings.TESTING_DIR, "keyshot.bin")
+        passwords = ['hot%d' % i for i in range(5000)]
+        counts = [(i*7919) % 100003 + 1 for i in range(len(passwords))]
+        with open(pwdfile, 'w', newline='') as pwd:
+            for p, count in zip(passwords, counts):
+                pwd.write('%s:%d\r\n' % (utils.sha1(p).upper(), count))
+        self.assertTrue(preprocess.Command.test_hot(pwdfile, hotfile, 100), color.ERROR("PREPROCESS COMMAND FAILED TEST"))
+        os.remove(pwdfile)
+        ranked = [p for count, p in sorted(zip(counts, passwords), reverse=True)]
+        hot, cold = ranked[:100], ranked[100:]
+        self.assertEqual(utils.calculate_keys(hotfile), 100, color.ERROR("PREPROCESS COMMAND FAILED TEST"))
+        self.assertTrue(hotset.construct_filter(hotfile), "Hot set's construction failed.")
+        self.assertEqual(hotset.size_filter(), 100)
+        self.assertTrue(all(hotset.query_filter(p) for p in hot), "Hot set missed a hot key.")
+        self.assertTrue(all(hotset.query_filter(utils.sha1(p), True) for p in hot), "Hot set missed a hot key.")
+        self.assertFalse(any(hotset.query_filter(p) for p in cold), "Hot set matched a cold key.")
+        packed = b''.join(bytes.fromhex(utils.sha1(p)) for p in hot[:8] + cold[:8])
+        self.assertEqual(hotset.query_hashes(packed), bytes([255, 0]))
+        ready = threading.Event()
+        ready.set()
+        with self.settings(FILTER_MODE='LOCAL', HOTSET_SIZE=100):
+            with mock.patch.object(client, 'filter_ready', ready), mock.patch.object(client, 'filter', None):
+                self.assertTrue(client.find_password(hot[0]), "Hot set was not asked first.")
+                self.assertFalse(client.find_password(cold[0]))
+        hotset.destroy_filter()
+        self.assertFalse(hotset.exist_filter())
+        return
+
+    def test_verify_keys(self):
+        sys.stdout.write(color.HTTP_INFO('\nTesting exact verification against the keys file...'))
+        pwdfile = os.path.join(settings.TESTING_DIR, "pwd.txt")
+        compactfile = os.path.join(settings.TESTING_DIR, "keysverify.bin")
+        shardfile = os.path.join(settings.TESTING_DIR, "keysverifyshards.bin")
+        updatefile = os.path.join(settings.TESTING_DIR, "keysverifyupdate.bin")
+        hashes = []
+        with open(testing_keysfile, 'rb') as keys:
+            keys.seek(21)
+            while True:
+                data = keys.read(20)
+                if not data: break
+                hashes.append(data.hex())
+        with open(pwdfile, 'w') as pwd:
+            pwd.writelines(h + "\n" for h in hashes)
+        preprocess.Command.test(pwdfile, compactfile, testing_nkeys, True)
+        preprocess.Command.test(pwdfile, shardfile, testing_nkeys, True, 8)
+        for f in glob.glob(updatefile + "*"):
+            os.remove(f)
+        with open(pwdfile, 'w') as pwd:
+            pwd.writelines(h + "\n" for h in sorted(hashes[:len(hashes)//2]))
+        preprocess.Command.test(pwdfile, updatefile, testing_nkeys, True)
+        with open(pwdfile, 'w') as pwd:
+            pwd.writelines(h + "\n" for h in sorted(hashes))
+        self.assertTrue(preprocess.Command.test_update(pwdfile, updatefile, testing_nkeys), "Keys file's update failed.")
+        os.remove(pwdfile)
+        members = hashes[::50]
+        others = [os.urandom(20).hex() for i in range(2000)]
+        self.assertFalse(utils.load_keystore(testing_keysfile), "Plain keys file is not sorted.")
+        self.assertFalse(utils.exist_keystore())
+        self.assertTrue(all(utils.verify_key(h, True) for h in others), "Without keystore the filter answer stands.")
+        # Base keys and the keys an update added must both be found.
+        for keysfile in (compactfile, shardfile, updatefile):
+            self.assertTrue(utils.load_keystore(keysfile), "Keystore's load failed.")
+            self.assertTrue(utils.exist_keystore())
+            self.assertTrue(all(utils.verify_key(h, True) for h in members), "Keystore missed a key.")
+            self.assertFalse(any(utils.verify_key(h, True) for h in others), "Keystore matched a random key.")
+        packed = b''.join(bytes.fromhex(h) for h in members[:8] + others[:8])
+        self.assertEqual(utils.verify_hashes(packed, bytes([255, 255])), bytes([255, 0]))
+        ready = threading.Event()
+        ready.set()
+        parsed = {'query': lambda password, hashed: True, 'query_hashes': lambda hashes: bytes([255, 255])}
+        with self.settings(FILTER_MODE='LOCAL', VERIFY_KEYS=True):
+            with mock.patch.object(client, 'filter_ready', ready), mock.patch.object(client, 'filter', parsed):
+                self.assertTrue(client.find_password(members[0], True))
+                self.assertFalse(client.find_password(others[0], True), "Filter positive was not verified.")
+                self.assertEqual(client.find_hashes(packed), bytes([255, 0]))
+        utils.destroy_keystore()
+        self.assertFalse(utils.exist_keystore())
+        return
+
+    def test_preprocess_update(self):
+        sys.stdout.write(color.HTTP_INFO('\nTesting command "preprocess" with an update...'))
+        pwdfile = os.path.join(settings.TESTING_DIR, "pwd.txt")
+        updatefile = os.path.join(settings.TESTING_DIR, "keysupdate.bin")
+        hashes = []
+        with open(testing_keysfile, 'rb') as keys:
+            keys.seek(21)
+            while True:
+                data = keys.read(20)
+                if not data: break
+                hashes.append(data.hex())
+        with open(pwdfile, 'w') as pwd:
+            pwd.write("\n".join(sorted(hashes[:testing_nkeys//2])) + "\n")
+        preprocess.Command.test(pwdfile, updatefile, testing_nkeys, True)
+        with open(pwdfile, 'w') as pwd:
+            pwd.write("\n".join(sorted(hashes)) + "\n")
+        self.assertTrue(preprocess.Command.test_update(pwdfile, updatefile, testing_nkeys), color.ERROR("PREPROCESS COMMAND FAILED TEST"))
+        self.assertEqual(len(glob.glob(updatefile + ".*")), 2, color.ERROR("PREPROCESS COMMAND FAILED TEST"))
+        self.assertEqual(utils.calculate_keys(updatefile), testing_nkeys, color.ERROR("PREPROCESS COMMAND FAILED TEST"))
+        with open(pwdfile, 'w') as pwd:
+            pwd.write("\n".join(hashes) + "\n")
+        self.assertFalse(preprocess.Command.test_update(pwdfile, updatefile, testing_nkeys), color.ERROR("PREPROCESS COMMAND FAILED TEST"))
+        os.remove(pwdfile)
+        self.assertEqual(utils.calculate_keys(updatefile), testing_nkeys, color.ERROR("PREPROCESS COMMAND FAILED TEST"))
+        self.assertTrue(xor8.construct_filter(updatefile), "Filter's construction failed.")
+        self.assertTrue(xor8.sanity_check(testing_keysfile), "Filter's sanity check failed.")
+        xor8.destroy_filter()
+        return
+
     def test_calculate_keys(self):
         sys.stdout.write(color.HTTP_INFO('\nTesting c library "calculate_nkeys" function...'))
         self.assertEqual(utils.calculate_keys(testing_keysfile), testing_nkeys, color.HTTP_INFO("LIBRARY FUNCTION FAILED TEST"))
@@ -177,6 +367,73 @@ class FilterLocalClient(TestCase):
         binaryfuse8.destroy_filter()
         return
 
+    def test_binaryfuse_2(self):
+        sys.stdout.write(color.HTTP_INFO('\nTesting binary fuse filter with r=16...'))
+        self.assertTrue(binaryfuse16.construct_filter(testing_keysfile, testing_nkeys), "Filter's construction failed.")
+        self.assertTrue(binaryfuse16.exist_filter(), "Filter's construction failed.")
+        self.assertTrue(binaryfuse16.sanity_check(testing_keysfile), "Filter's sanity check failed.")
+        self.assertTrue(binaryfuse16.save_filter(testing_filterfile), "Filter's save failed.")
+        binaryfuse16.destroy_filter()
+        self.assertFalse(binaryfuse16.exist_filter(), "Filter's destruction failed.")
+        self.assertTrue(binaryfuse16.load_filter(testing_filterfile), "Filter's load failed.")
+        self.assertTrue(binaryfuse16.exist_filter(), "Filter's load failed.")
+        self.assertTrue(binaryfuse16.sanity_check(testing_keysfile), "Filter's sanity check failed.")
+        self.assertEqual(utils.filter_info(testing_filterfile)['type'], 'binaryfuse16')
+        self.assertLessEqual(binaryfuse16.fp_filter(testing_nkeys*100)/(testing_nkeys*100), (1/65536)*1.30, color.ERROR("Filter's false positive ratio does not match theoretical value"))
+        binaryfuse16.destroy_filter()
+        return
+
+    def test_binaryfuse_3(self):
+        sys.stdout.write(color.HTTP_INFO('\nTesting binary fuse filter with r=32...'))
+        self.assertTrue(binaryfuse32.construct_filter(testing_keysfile, testing_nkeys), "Filter's construction failed.")
+        self.assertTrue(binaryfuse32.exist_filter(), "Filter's construction failed.")
+        self.assertTrue(binaryfuse32.sanity_check(testing_keysfile), "Filter's sanity check failed.")
+        self.assertTrue(binaryfuse32.save_filter(testing_filterfile), "Filter's save failed.")
+        binaryfuse32.destroy_filter()
+        self.assertFalse(binaryfuse32.exist_filter(), "Filter's destruction failed.")
+        self.assertTrue(binaryfuse32.load_filter(testing_filterfile), "Filter's load failed.")
+        self.assertTrue(binaryfuse32.exist_filter(), "Filter's load failed.")
+        self.assertTrue(binaryfuse32.sanity_check(testing_keysfile), "Filter's sanity check failed.")
+        self.assertLess(os.path.getsize(testing_filterfile)/testing_nkeys, 5, "Filter takes more than 5 bytes per key.")
+        # At 2^-32, 10M random keys almost never match even once.
+        self.assertLessEqual(binaryfuse32.fp_filter(testing_nkeys*100), 1, color.ERROR("Filter's false positive ratio does not match theoretical value"))
+        with self.settings(FILTER='binaryfuse', RBYTES=4):
+            self.assertIs(client.filter_parser()['query'], binaryfuse32.query_filter)
+            self.assertEqual(client.filter_type(), utils.filter_info(testing_filterfile)['type'])
+        with self.settings(FILTER='binaryfuse', RBYTES=3, FILTER_MODE='LOCAL'), mock.patch.dict(os.environ, TESTING='false'):
+            self.assertIsNone(client.filter_parser(), "An unknown RBYTES picked a filter.")
+            self.assertIsNone(client.filter_type())
+            self.assertIn('filterclient.E006', [e.id for e in client.example_check(None)])
+        binaryfuse32.destroy_filter()
+        return
+
+    def test_binaryfuse_4(self):
+        sys.stdout.write(color.HTTP_INFO('\nTesting 4-wise binary fuse filter...'))
+        wisefile = testing_filterfile + ".4wise"
+        self.assertTrue(binaryfuse8.build_filter(testing_keysfile, testing_filterfile, testing_nkeys), "Filter's build failed.")
+        self.assertTrue(binaryfuse8.build_filter(testing_keysfile, wisefile, testing_nkeys, 4), "Filter's build failed.")
+        self.assertLess(os.path.getsize(wisefile), os.path.getsize(testing_filterfile), "4-wise filter is not smaller.")
+        self.assertEqual(utils.filter_info(wisefile)['params'][5], 4)
+        self.assertFalse(binaryfuse8.load_filter(wisefile, testing_nkeys, arity=3), "Filter loaded with other arity.")
+        self.assertTrue(binaryfuse8.load_filter(wisefile, testing_nkeys, arity=4), "Filter's load failed.")
+        self.assertTrue(binaryfuse8.sanity_check(testing_keysfile), "Filter's sanity check failed.")
+        self.assertLessEqual(binaryfuse8.fp_filter(testing_nkeys)/testing_nkeys, (1/256)*1.30, color.ERROR("Filter's false positive ratio does not match theoretical value"))
+        binaryfuse8.destroy_filter()
+        self.assertTrue(binaryfuse32.construct_filter(testing_keysfile, testing_nkeys, 4), "Filter's construction failed.")
+        self.assertTrue(binaryfuse32.sanity_check(testing_keysfile), "Filter's sanity check failed.")
+        self.assertTrue(binaryfuse32.save_filter(wisefile), "Filter's save failed.")
+        binaryfuse32.destroy_filter()
+        self.assertTrue(binaryfuse32.load_filter(wisefile), "Filter's load failed.")
+        self.assertTrue(binaryfuse32.sanity_check(testing_keysfile), "Filter's sanity check failed.")
+        binaryfuse32.destroy_filter()
+        with self.assertRaises(ValueError):
+            binaryfuse8.construct_filter(testing_keysfile, testing_nkeys, 5)
+        with self.settings(FILTER='binaryfuse', FUSE_ARITY=4):
+            parsed = client.filter_parser()
+            self.assertEqual((parsed['build_args'][-1], parsed['load_kwargs']['arity']), (4, 4))
+        os.remove(wisefile)
+        return
+
     def test_xor_1(self):
         sys.stdout.write(color.HTTP_INFO('\nTesting xor filter with r=8...'))
         self.assertTrue(xor8.construct_filter(testing_keysfile, testing_nkeys), "Filter's construction failed.")
@@ -207,6 +464,192 @@ class FilterLocalClient(TestCase):
         xor16.destroy_filter()
         return
 
+    def test_build(self):
+        sys.stdout.write(color.HTTP_INFO('\nTesting filters built straight into their file...'))
+        for module in [ribbon128, splitblockbloom, binaryfuse8, binaryfuse16, binaryfuse32, xor8, xor16]:
+            self.assertTrue(module.build_filter(testing_keysfile, testing_filterfile, testing_nkeys), "Filter's build failed.")
+            self.assertFalse(module.exist_filter(), "Filter's build left a filter in memory.")
+            self.assertFalse(os.path.exists(testing_filterfile + ".tmp"), "Filter's build failed.")
+            self.assertTrue(module.load_filter(testing_filterfile, testing_nkeys), "Filter's load failed.")
+            self.assertTrue(module.sanity_check(testing_keysfile), "Filter's sanity check failed.")
+            module.destroy_filter()
+        savedfile = testing_filterfile + ".saved"
+        self.assertTrue(ribbon128.construct_filter(testing_keysfile, testing_nkeys), "Filter's construction failed.")
+        self.assertTrue(ribbon128.save_filter(savedfile), "Filter's save failed.")
+        ribbon128.destroy_filter()
+        self.assertTrue(ribbon128.build_filter(testing_keysfile, testing_filterfile, testing_nkeys), "Filter's build failed.")
+        with open(savedfile, 'rb') as saved, open(testing_filterfile, 'rb') as built:
+            saved.seek(4096)
+            built.seek(4096)
+            self.assertEqual(saved.read(), built.read(), "Filter's build does not match its construction.")
+        os.remove(savedfile)
+        return
+
+    def test_reload(self):
+        sys.stdout.write(color.HTTP_INFO('\nTesting filter reloads under concurrent queries...'))
+        self.assertTrue(ribbon128.construct_filter(testing_keysfile, testing_nkeys), "Filter's construction failed.")
+        self.assertTrue(ribbon128.save_filter(testing_filterfile), "Filter's save failed.")
+        loads = []
+        reloader = threading.Thread(target=lambda: loads.extend(ribbon128.load_filter(testing_filterfile) for i in range(4)))
+        reloader.start()
+        checks = [ribbon128.sanity_check(testing_keysfile)]
+        while reloader.is_alive():
+            checks.append(ribbon128.sanity_check(testing_keysfile))
+        reloader.join()
+        self.assertTrue(all(loads), "Filter's reload failed.")
+        self.assertTrue(all(checks), "Filter's sanity check failed during a reload.")
+        changed = []
+        watcher = threading.Thread(target=lambda: changed.append(utils.watch_files([testing_keysfile, testing_filterfile], 10000)))
+        watcher.start()
+        while watcher.is_alive():
+            ribbon128.save_filter(testing_filterfile)
+            watcher.join(0.1)
+        self.assertEqual(changed, [1], "Filter file change was not noticed.")
+        ribbon128.destroy_filter()
+        # A rebuilt filter that fails its sanity check never replaces the current one.
+        halffile = testing_filterfile + ".half"
+        for module in [ribbon128, splitblockbloom, binaryfuse8, xor8, xor16]:
+            self.assertTrue(module.build_filter(testing_keysfile, testing_filterfile, testing_nkeys), "Filter's build failed.")
+            self.assertTrue(module.build_filter(testing_keysfile, halffile, testing_nkeys//2), "Filter's build failed.")
+            self.assertTrue(module.load_filter(testing_filterfile, keysfile=testing_keysfile), "Filter's checked load failed.")
+            self.assertFalse(module.load_filter(halffile, keysfile=testing_keysfile), "A filter failing its sanity check was loaded.")
+            self.assertTrue(module.sanity_check(testing_keysfile), "Filter was replaced by one failing its sanity check.")
+            module.destroy_filter()
+        os.remove(halffile)
+        return
+
+    def test_shared(self):
+        sys.stdout.write(color.HTTP_INFO('\nTesting filters mapped from their file...'))
+        for module in [ribbon128, splitblockbloom, binaryfuse8, xor8, xor16]:
+            self.assertTrue(module.build_filter(testing_keysfile, testing_filterfile, testing_nkeys), "Filter's build failed.")
+            self.assertTrue(module.load_filter(testing_filterfile, testing_nkeys, shared=True), "Filter's shared load failed.")
+            # Replacing the file must not disturb the mapped filter.
+            self.assertTrue(module.build_filter(testing_keysfile, testing_filterfile, testing_nkeys//2), "Filter's build failed.")
+            self.assertTrue(module.sanity_check(testing_keysfile), "Filter's sanity check failed.")
+            module.destroy_filter()
+        return
+
+    def test_query_hashes(self):
+        sys.stdout.write(color.HTTP_INFO('\nTesting batch queries of packed hashes...'))
+        with open(testing_keysfile, 'rb') as keys:
+            keys.seek(21)
+            packed = keys.read(20*1000) + os.urandom(20*1000)
+        hashes = [packed[i:i+20].hex() for i in range(0, len(packed), 20)]
+        for module in [ribbon128, splitblockbloom, binaryfuse8, xor8, xor16]:
+            self.assertIsNone(module.query_hashes(packed), "Batch query answered without a filter.")
+            self.assertTrue(module.construct_filter(testing_keysfile, testing_nkeys), "Filter's construction failed.")
+            self.assertIsNone(module.query_hashes(packed[:-1]), "Batch query accepted a truncated hash.")
+            bitmap = module.query_hashes(packed)
+            results = [bool(bitmap[i//8] >> (i%8) & 1) for i in range(len(hashes))]
+            self.assertTrue(all(results[:1000]), "Batch query missed a key.")
+            self.assertEqual(results, [module.query_filter(h, True) for h in hashes], "Batch and single queries disagree.")
+            module.destroy_filter()
+        return
+
+    def test_build_lock(self):
+        sys.stdout.write(color.HTTP_INFO('\nTesting the host wide build lock...'))
+        acquired = threading.Event()
+        def contender():
+            with build_lock():
+                acquired.set()
+        with self.settings(FILTERFILE=testing_filterfile):
+            with build_lock():
+                thread = threading.Thread(target=contender)
+                thread.start()
+                self.assertFalse(acquired.wait(0.5), "Build lock was taken twice.")
+            thread.join()
+        self.assertTrue(acquired.is_set(), "Build lock was not released.")
+        return
+
+    def test_system_check(self):
+        sys.stdout.write(color.HTTP_INFO('\nTesting system checks have no side effects...'))
+        started = []
+        with self.settings(FILTER_MODE='LOCAL', FILTER='ribbon128'), mock.patch.dict(os.environ, TESTING='false'), \
+                mock.patch.object(client, 'filter_ready', threading.Event()), \
+                mock.patch.object(client, 'start_filter', lambda: started.append(True)):
+            self.assertEqual(client.example_check(None), [])
+            self.assertEqual(started, [], "A system check started the filter's load.")
+            self.assertFalse(client.filter_status()['ready'])
+            self.assertEqual(started, [True], "A health probe did not start the filter's load.")
+        return
+
+    def test_sidecar(self):
+        sys.stdout.write(color.HTTP_INFO('\nTesting the sidecar query daemon...'))
+        hashes = []
+        with open(testing_keysfile, 'rb') as keys:
+            keys.seek(21)
+            for i in range(1000):
+                hashes.append(keys.read(20).hex())
+        passwords = [get_random_secret_key() for i in range(1000)]
+        self.assertIsNone(sidecar.query('pwnedtest', hashes[0], True), "Sidecar answered without a server.")
+        self.assertTrue(ribbon128.construct_filter(testing_keysfile, testing_nkeys), "Filter's construction failed.")
+        server = threading.Thread(target=ribbon128.serve_sidecar, args=('pwnedtest', 4), daemon=True)
+        server.start()
+        for i in range(100):
+            if (sidecar.query('pwnedtest', hashes[0], True) is not None): break
+            server.join(0.05)
+        for h in hashes:
+            self.assertEqual(sidecar.query('pwnedtest', h, True), ribbon128.query_filter(h, True), "Sidecar and filter disagree.")
+        for p in passwords:
+            self.assertEqual(sidecar.query('pwnedtest', p), ribbon128.query_filter(p), "Sidecar and filter disagree.")
+        # Every thread queries on a ring of its own, given back when it exits:
+        # the main thread holds one of the 4 rings, so each round needs them back.
+        for round in range(2):
+            answers = {}
+            def ask(t):
+                answers[t] = all(sidecar.query('pwnedtest', h, True) == ribbon128.query_filter(h, True) for h in hashes[t::3])
+            threads = [threading.Thread(target=ask, args=(t,)) for t in range(3)]
+            for thread in threads:
+                thread.start()
+            for thread in threads:
+                thread.join()
+            self.assertEqual(answers, {0: True, 1: True, 2: True}, "Concurrent sidecar clients failed.")
+        # A forked child connects on a ring of its own.
+        pid = os.fork()
+        if (pid == 0):
+            os._exit(0 if sidecar.query('pwnedtest', hashes[0], True) == ribbon128.query_filter(hashes[0], True) else 1)
+        self.assertEqual(os.waitpid(pid, 0)[1], 0, "Forked sidecar client failed.")
+        with self.settings(FILTER_MODE='SIDECAR', SIDECAR_NAME='pwnedtest'):
+            self.assertTrue(client.filter_status()['ready'], "Sidecar client not ready with a serving sidecar.")
+            ribbon128.destroy_filter()
+            self.assertFalse(client.filter_status()['ready'], "Sidecar client ready without a filter.")
+        self.assertIsNone(sidecar.query('pwnedtest', hashes[0], True), "Sidecar answered without a filter.")
+        self.assertTrue(sidecar.shutdown('pwnedtest'), "Sidecar shutdown failed.")
+        server.join()
+        sidecar.disconnect()
+        self.assertIsNone(sidecar.query('pwnedtest', hashes[0], True), "Sidecar answered after its shutdown.")
+        return
+
+    def test_filterfile(self):
+        sys.stdout.write(color.HTTP_INFO('\nTesting filter file format v2...'))
+        self.assertTrue(ribbon128.construct_filter(testing_keysfile, testing_nkeys, 2), "Filter's construction failed.")
+        self.assertTrue(ribbon128.save_filter(testing_filterfile), "Filter's save failed.")
+        ribbon128.destroy_filter()
+        with open(testing_filterfile, 'rb') as f:
+            header = f.read(160)
+        magic, version, ftype, nkeys = struct.unpack_from('<32sIIQ', header)
+        payload_offset, payload_size = struct.unpack_from('<QQ', header, 128)
+        self.assertTrue(magic.startswith(b'$pwned-filter-2.0\n'), "Filter's save failed.")
+        self.assertEqual((version, nkeys), (2, testing_nkeys), "Filter's save failed.")
+        self.assertEqual(payload_offset % 4096, 0, "Filter's save failed.")
+        self.assertEqual(os.path.getsize(testing_filterfile), payload_offset + payload_size, "Filter's save failed.")
+        self.assertFalse(binaryfuse8.load_filter(testing_filterfile), "Filter's load accepted another filter type.")
+        self.assertFalse(ribbon128.load_filter(testing_filterfile, r=1), "Filter's load accepted other parameters.")
+        self.assertFalse(ribbon128.load_filter(testing_filterfile, testing_nkeys//2), "Filter's load accepted other parameters.")
+        self.assertTrue(ribbon128.load_filter(testing_filterfile, testing_nkeys), "Filter's load failed.")
+        ribbon128.destroy_filter()
+        self.assertTrue(ribbon128.load_filter(testing_filterfile), "Filter's load failed.")
+        self.assertTrue(ribbon128.sanity_check(testing_keysfile), "Filter's sanity check failed.")
+        ribbon128.destroy_filter()
+        with open(testing_filterfile, 'r+b') as f:
+            f.seek(payload_offset + payload_size//2)
+            byte = f.read(1)
+            f.seek(payload_offset + payload_size//2)
+            f.write(bytes([byte[0] ^ 0xFF]))
+        self.assertFalse(ribbon128.load_filter(testing_filterfile), "Filter's load accepted a corrupted file.")
+        self.assertFalse(ribbon128.exist_filter(), "Filter's load accepted a corrupted file.")
+        return
+
 
 
 @override_settings(FILTER='dummy')
@@ -227,6 +670,11 @@ class FilterRemoteClient(LiveServerTestCase):
         testing_mode('true')
         return
 
+    def setUp(self):
+        # Answers cached by an earlier test may come from another server setup.
+        client.result_cache.clear()
+        return
+
     @classmethod
     def tearDownClass(cls):
         super().tearDownClass()
@@ -305,3 +753,199 @@ class FilterRemoteClient(LiveServerTestCase):
         res = self.aux(random_user)
         self.assertFalse(res[0])
         self.assertTrue(res[1])
+
+    @override_settings(OPEN_SERVER=False)
+    def test_remote_client_pool(self):
+        sys.stdout.write(color.HTTP_INFO('\nTesting pooled remote client and fan-out...'))
+        clear_token()
+        User.objects.create_superuser(username='admin', email=None, password='admin')
+        hashes = b''.join(bytes.fromhex(utils.sha1(str(i))) for i in range(20))
+        with self.settings(REMOTE_SERVER=self.live_server_url + '/' + settings.SERVER_URL, SERVER_CREDENTIALS=superuser):
+            client.client_tokens[settings.REMOTE_SERVER] = 'stale'
+            self.assertFalse(query_server(utils.sha1('whatever_pass')))
+            self.assertIs(client.get_session(), client.get_session())
+            self.assertEqual(client.query_server_hashes(hashes), bytes(3))
+            request_server = client.request_server
+            def no_batch(method, server, path, **kwargs):
+                if (method == 'POST'):
+                    raise Exception('No batch endpoint')
+                return request_server(method, server, path, **kwargs)
+            with mock.patch.object(client, 'request_server', no_batch):
+                self.assertEqual(client.query_server_hashes(hashes), bytes(3))
+                client.result_cache.clear()
+                with mock.patch.object(client, 'query_server', lambda h: h == utils.sha1('3')):
+                    self.assertEqual(client.query_server_hashes(hashes), bytes([8, 0, 0]))
+
+    @override_settings(OPEN_SERVER=False)
+    def test_remote_prefilter(self):
+        sys.stdout.write(color.HTTP_INFO('\nTesting remote prefilter download...'))
+        clear_token()
+        User.objects.create_superuser(username='admin', email=None, password='admin')
+        keysfile = os.path.join(settings.TESTING_DIR, "keysprefilter.bin")
+        prefilterfile = os.path.join(settings.TESTING_DIR, "prefilter.bin")
+        utils.synthetic(keysfile, 10000)
+        if (os.path.exists(prefilterfile)):
+            os.remove(prefilterfile)
+        with open(keysfile, 'rb') as keys:
+            keys.seek(21)
+            packed = keys.read(20*1000) + os.urandom(20*1000)
+        hashes = [packed[i:i+20].hex() for i in range(0, len(packed), 20)]
+        asked = []
+        request_server = client.request_server
+        def counting(method, server, path, **kwargs):
+            asked.extend(kwargs.get('json', []))
+            return request_server(method, server, path, **kwargs)
+        with self.settings(REMOTE_SERVER=self.live_server_url + '/' + settings.SERVER_URL, SERVER_CREDENTIALS=superuser,
+                           KEYSFILE=keysfile + '.missing', NKEYS=0, PREFILTERFILE=prefilterfile):
+            self.assertFalse(client.fetch_prefilter(), "Prefilter was loaded without a KEYSFILE.")
+            self.assertFalse(splitblockbloom.exist_prefilter(), "Prefilter was loaded without a KEYSFILE.")
+            with self.settings(KEYSFILE=keysfile):
+                try:
+                    with build_lock():
+                        self.assertTrue(client.fetch_prefilter(), "Prefilter's download waited for a filter build.")
+                    self.assertTrue(all(splitblockbloom.query_prefilter(h, True) for h in hashes[:1000]), "Prefilter missed a key.")
+                    self.assertGreater(sum(not splitblockbloom.query_prefilter(h, True) for h in hashes[1000:]), 600,
+                                        "Prefilter ruled out too few hashes.")
+                    with mock.patch.object(client, 'request_server', counting):
+                        self.assertEqual(client.query_server_hashes(packed), bytes(len(hashes)//8))
+                    self.assertEqual(asked, [h for h in hashes if splitblockbloom.query_prefilter(h, True)])
+                finally:
+                    splitblockbloom.destroy_prefilter()
+        self.assertTrue(splitblockbloom.query_prefilter(hashes[-1], True), "Missing prefilter ruled out a hash.")
+
+    @override_settings(OPEN_SERVER=False)
+    def test_remote_artifact(self):
+        sys.stdout.write(color.HTTP_INFO('\nTesting filter download from the server...'))
+        clear_token()
+        User.objects.create_superuser(username='admin', email=None, password='admin')
+        keysfile = os.path.join(settings.TESTING_DIR, "keysartifact.bin")
+        served = os.path.join(settings.TESTING_DIR, "served.bin")
+        downloaded = os.path.join(settings.TESTING_DIR, "downloaded.bin")
+        utils.synthetic(keysfile, 10000)
+        self.assertTrue(ribbon128.build_filter(keysfile, served, 0, 1), "Filter's construction failed.")
+        for f in [downloaded, downloaded + '.part']:
+            if (os.path.exists(f)):
+                os.remove(f)
+        with open(served, 'rb') as f:
+            content = f.read()
+        # The live server shares our settings, so it serves its own FILTERFILE.
+        class ServerSettings:
+            FILTERFILE = served
+            def __getattr__(self, name):
+                return getattr(settings, name)
+        with self.settings(REMOTE_SERVER=self.live_server_url + '/' + settings.SERVER_URL, SERVER_CREDENTIALS=superuser,
+                           FILTERFILE=downloaded, FILTER='ribbon128', RBYTES=1):
+            with mock.patch.object(views, 'settings', ServerSettings()):
+                with open(downloaded + '.part', 'wb') as f:
+                    f.write(content[:5000])
+                self.assertTrue(client.download_filter(), "Filter's download failed.")
+                self.assertTrue(filecmp.cmp(served, downloaded, shallow=False), "Resumed download differs.")
+                self.assertFalse(os.path.exists(downloaded + '.part'))
+                self.assertFalse(client.download_filter(), "Filter was downloaded again.")
+                os.remove(downloaded)
+                with open(downloaded + '.part', 'wb') as f:
+                    f.write(bytes(5000))
+                self.assertFalse(client.download_filter(), "A corrupted download was accepted.")
+                self.assertFalse(os.path.exists(downloaded + '.part'))
+                self.assertTrue(client.download_filter(), "Filter's download failed.")
+                # A good header over a corrupted payload is caught by the block CRCs.
+                os.remove(downloaded)
+                corrupt = utils.filter_info(served)['payload_offset'] + 10
+                with open(downloaded + '.part', 'wb') as f:
+                    f.write(content[:corrupt] + bytes([content[corrupt] ^ 1]) + content[corrupt + 1:-10])
+                self.assertFalse(client.download_filter(), "A download with a corrupted payload was accepted.")
+                self.assertFalse(os.path.exists(downloaded) or os.path.exists(downloaded + '.part'))
+                self.assertTrue(client.download_filter(), "Filter's download failed.")
+                with self.settings(FILTER='binaryfuse8'):
+                    os.remove(downloaded)
+                    self.assertFalse(client.download_filter(), "A filter of another type was downloaded.")
+
+    def test_remote_shard_map(self):
+        sys.stdout.write(color.HTTP_INFO('\nTesting routing by hash prefix...'))
+        asked = {}
+        def answer(method, server, path, **kwargs):
+            hexes = kwargs['json'] if method == 'POST' else [kwargs['params']['password']]
+            asked.setdefault(server, []).extend(hexes)
+            return {'compromised': [server == 'http://low/' for h in hexes] if method == 'POST' else server == 'http://low/'}
+        hashes = [utils.sha1(str(i)) for i in range(64)]
+        packed = b''.join(bytes.fromhex(h) for h in hashes)
+        with self.settings(SHARD_MAP=[('0-7', 'http://low/'), ('8-f', 'http://high/')]):
+            with mock.patch.object(client, 'request_server', answer):
+                self.assertTrue(query_server(hashes[0]) == (hashes[0][0] < '8'))
+                asked.clear()
+                client.result_cache.clear()
+                bitmap = client.query_server_hashes(packed)
+        self.assertEqual([bool(bitmap[i//8] >> (i%8) & 1) for i in range(len(hashes))], [h[0] < '8' for h in hashes])
+        self.assertEqual(sorted(asked['http://low/']), sorted(h for h in hashes if h[0] < '8'))
+        self.assertEqual(sorted(asked['http://high/']), sorted(h for h in hashes if h[0] >= '8'))
+
+    def test_remote_replicas(self):
+        sys.stdout.write(color.HTTP_INFO('\nTesting hedged requests across replicas...'))
+        class Answer:
+            status_code = 200
+            headers = {'Content-Type': 'application/json'}
+            def json(self):
+                return {'compromised': False}
+            def close(self):
+                return
+        def answer(method, server, path, **kwargs):
+            if (server == 'http://dead/'):
+                raise requests.ConnectionError('Connection refused')
+            if (server == 'http://slow/'):
+                time.sleep(0.5)
+            return Answer()
+        client.replica_stats.clear()
+        with self.settings(REMOTE_SERVER=['http://dead/', 'http://fast/'], REMOTE_EJECT_FAILURES=2):
+            with mock.patch.object(client, 'send_replica', answer):
+                for i in range(10):
+                    self.assertFalse(query_server(utils.sha1(str(i))), "A failed replica was not skipped.")
+        self.assertTrue(client.replica_status()['http://dead/']['ejected'], "A failed replica was not ejected.")
+        self.assertEqual(client.pick_replicas(['http://dead/', 'http://fast/']), ['http://fast/', 'http://dead/'])
+        with self.settings(REMOTE_SERVER=['http://slow/', 'http://fast/'], REMOTE_HEDGE_DELAY=0.01):
+            with mock.patch.object(client, 'send_replica', answer), mock.patch.object(client.random, 'shuffle', lambda urls: None), \
+                    mock.patch.object(client.Replica, 'samples', 10):
+                start = time.monotonic()
+                for i in range(10):
+                    self.assertFalse(query_server(utils.sha1('slow%d' % i)))
+                self.assertLess(time.monotonic() - start, 2.5, "Slow replica was not hedged.")
+                # Lets the overtaken requests end.
+                client.hedge_pool[1].shutdown(wait=True)
+                client.hedge_pool = None
+                status = client.replica_status()['http://slow/']
+                self.assertFalse(status['ejected'] or status['failures'], "An overtaken replica was counted as failed.")
+                self.assertGreater(status['average'], 0.4, "An overtaken replica's latency was not kept.")
+                self.assertFalse(query_server(utils.sha1('slow')))
+                self.assertTrue(client.replica_status()['http://slow/']['ejected'], "A slow replica was not ejected.")
+                self.assertFalse(client.replica_status()['http://fast/']['ejected'])
+        client.replica_stats.clear()
+
+    def test_remote_result_cache(self):
+        sys.stdout.write(color.HTTP_INFO('\nTesting remote result cache...'))
+        asked = []
+        def answer(method, server, path, **kwargs):
+            hexes = kwargs['json'] if method == 'POST' else [kwargs['params']['password']]
+            asked.extend(hexes)
+            return {'compromised': [h == utils.sha1('1') for h in hexes] if method == 'POST' else hexes[0] == utils.sha1('1')}
+        hashes = [utils.sha1(str(i)) for i in range(16)]
+        packed = b''.join(bytes.fromhex(h) for h in hashes)
+        with mock.patch.object(client, 'request_server', answer):
+            self.assertTrue(query_server(hashes[1]))
+            self.assertTrue(query_server(hashes[1]))
+            self.assertEqual(asked, [hashes[1]], "A cached answer was asked again.")
+            self.assertEqual(client.query_server_hashes(packed), bytes([2, 0]))
+            self.assertEqual(client.query_server_hashes(packed), bytes([2, 0]))
+            self.assertEqual(sorted(asked[1:]), sorted(hashes[:1] + hashes[2:]), "Cached answers were asked again.")
+            self.assertNotIn('1', client.result_cache.results, "A password was cached instead of its hash.")
+            with self.settings(REMOTE_CACHE_SIZE=4):
+                client.result_cache.put_many({h: False for h in hashes})
+                self.assertEqual(len(client.result_cache.results), 4)
+            with self.settings(REMOTE_CACHE_TTL=0):
+                self.assertIsNone(client.result_cache.get(hashes[15]))
+            with self.settings(CACHES={'default': {'BACKEND': 'django.core.cache.backends.locmem.LocMemCache'}},
+                               REMOTE_CACHE_BACKEND='default'):
+                self.assertIsNone(client.result_cache.get(hashes[0]))
+                client.result_cache.put(hashes[0], True)
+                self.assertTrue(client.result_cache.get(hashes[0]))
+        stats = client.result_cache.stats()
+        self.assertGreater(stats['hits'], 0)
+        self.assertGreater(stats['misses'], 0)
@@ -3,20 +3,102 @@ from django.apps import apps
 from django.core.checks import Error, register
 from django.core.management.utils import get_random_secret_key
 from django.conf import settings
+from filterclient.apps import file_signature
+from dbfilters import splitblockbloom, utils
 
-import os
+import os, time, hashlib, threading, collections, contextlib, fcntl
 
 
 secret = None
+range_lock = threading.Lock()
+
+class TokenCache:
+    # Tokens that already passed jwt.decode, keyed by their SHA-256 so that a
+    # client reusing its token pays for the HMAC once. Entries are dropped at
+    # their exp, or least recently used first past TOKEN_CACHE_SIZE.
+
+    def __init__(self):
+        self.lock = threading.Lock()
+        self.tokens = collections.OrderedDict()
+        self.hits = 0
+        self.misses = 0
+
+    def get(self, token):
+        # The issuer of a verified, unexpired token, None if it must be decoded.
+        key = hashlib.sha256(token.encode()).digest()
+        with self.lock:
+            entry = self.tokens.get(key)
+            if (entry is not None and entry[0] > time.time()):
+                self.tokens.move_to_end(key)
+                self.hits += 1
+                return entry[1]
+            if (entry is not None):
+                del self.tokens[key]
+            self.misses += 1
+        return None
+
+    def put(self, token, exp, issuer):
+        if (settings.TOKEN_CACHE_SIZE <= 0):
+            return
+        key = hashlib.sha256(token.encode()).digest()
+        with self.lock:
+            self.tokens[key] = (exp, issuer)
+            self.tokens.move_to_end(key)
+            while (len(self.tokens) > settings.TOKEN_CACHE_SIZE):
+                self.tokens.popitem(last=False)
+
+    def clear(self):
+        with self.lock:
+            self.tokens.clear()
+
+    def stats(self):
+        with self.lock:
+            total = self.hits + self.misses
+            return {'size': len(self.tokens), 'hits': self.hits, 'misses': self.misses,
+                    'hit_rate': self.hits/total if total else 0.0}
+
+token_cache = TokenCache()
 
 def random_secret():
+    # A fixed SERVER_SECRET lets other servers, like queryserver, check our tokens.
     global secret
-    secret = get_random_secret_key()
+    secret = settings.SERVER_SECRET or get_random_secret_key()
+    token_cache.clear()
 
 def get_secret():
     global secret
     return secret
 
+@contextlib.contextmanager
+def prefilter_lock():
+    # Only one process builds PREFILTERFILE. Separate from the FILTERFILE build
+    # lock, so a prefilter request never waits behind a filter build.
+    with open(settings.PREFILTERFILE + '.lock', 'a') as lock:
+        fcntl.flock(lock, fcntl.LOCK_EX)
+        try:
+            yield
+        finally:
+            fcntl.flock(lock, fcntl.LOCK_UN)
+
+def build_prefilter():
+    # Builds PREFILTERFILE for REMOTE clients, again whenever KEYSFILE is newer.
+    with prefilter_lock():
+        keys = file_signature(settings.KEYSFILE)
+        built = file_signature(settings.PREFILTERFILE)
+        if (built is not None and (keys is None or built[2] >= keys[2])):
+            return True
+        temp = settings.PREFILTERFILE + '.tmp'
+        if (keys is None or not splitblockbloom.build_filter(settings.KEYSFILE, temp, settings.NKEYS, settings.PREFILTER_BITS/8)):
+            return False
+        os.replace(temp, settings.PREFILTERFILE)
+        return True
+
+def load_range():
+    # The range API reads the keystore of KEYSFILE, opened on the first request
+    # and reopened by the filterclient reload when KEYSFILE changes.
+    with range_lock:
+        return utils.exist_keystore() or (os.path.exists(settings.KEYSFILE) and utils.load_keystore(settings.KEYSFILE))
+
 class FilterserverConfig(AppConfig):
     default_auto_field = 'django.db.models.BigAutoField'
     name = 'filterserver'
@@ -0,0 +1,47 @@
+from django.core.management.base import BaseCommand
+from django.conf import settings
+from dbfilters import utils
+from filterserver.apps import random_secret, get_secret
+
+import datetime, jwt, os
+
+
+class Command(BaseCommand):
+    help = 'Measures queries per second of the native queryserver and, optionally, of the Django server'
+    BaseCommand.requires_system_checks = []
+
+    def add_arguments(self, parser):
+        parser.add_argument('--host', default='127.0.0.1', help='Host running both servers')
+        parser.add_argument('--port', type=int, default=settings.QUERYSERVER_PORT, help='Port of the queryserver command')
+        parser.add_argument('--django-port', type=int, default=None, help='Port of the Django server, skipped if not given')
+        parser.add_argument('--connections', type=int, default=64, help='Concurrent connections')
+        parser.add_argument('--pipeline', type=int, default=16, help='Requests in flight per connection on the queryserver')
+        parser.add_argument('--threads', type=int, default=4, help='Client threads')
+        parser.add_argument('--seconds', type=int, default=5, help='Duration of each run')
+        parser.add_argument('--password', default=utils.sha1('password'), help='SHA1 hash to query')
+
+    def handle(self, *args, **options):
+        print('OS COMMAND:', os.environ.get('RUN_MAIN', None))
+
+        headers = 'Host: %s\r\n' % options['host']
+        if(not settings.OPEN_SERVER):
+            if(not settings.SERVER_SECRET):
+                print("SERVER_SECRET REQUIRED TO SIGN TOKENS")
+                return
+            random_secret()
+            token = jwt.encode({"user": "querybench",
+                                "exp": datetime.datetime.now(tz=datetime.timezone.utc) + datetime.timedelta(hours=1),
+                                "iss": settings.TOKEN_ISSUER},
+                                get_secret(), algorithm="HS256")
+            headers += 'Authorization: Bearer %s\r\n' % token
+        request = 'GET /%s?password=%s HTTP/1.1\r\n%s\r\n' % (settings.SERVER_URL, options['password'], headers)
+
+        # Django's servers do not pipeline, so it gets one request in flight per connection.
+        targets = [('QUERYSERVER', options['port'], options['pipeline'])]
+        if(options['django_port'] is not None):
+            targets.append(('DJANGO', options['django_port'], 1))
+        for name, port, pipeline in targets:
+            responses, errors = utils.bench_http(options['host'], port, request, options['connections'],
+                                                pipeline, options['seconds'], options['threads'])
+            print('%s: %d queries/s, %d errors' % (name, responses // options['seconds'], errors))
+        return
@@ -0,0 +1,38 @@
+from django.core.management.base import BaseCommand
+from django.conf import settings
+from filterclient import apps
+
+import os
+
+
+class Command(BaseCommand):
+    help = 'Serves SERVER_URL queries from a native epoll server on QUERYSERVER_PORT, without going through Django'
+    BaseCommand.requires_system_checks = []
+
+    def add_arguments(self, parser):
+        parser.add_argument('--port', type=int, default=settings.QUERYSERVER_PORT, help='Port to listen on')
+        parser.add_argument('--threads', type=int, default=settings.QUERYSERVER_THREADS, help='Worker threads, one per CPU if 0')
+
+    def handle(self, *args, **options):
+        print('OS COMMAND:', os.environ.get('RUN_MAIN', None))
+
+        if(not settings.OPEN_SERVER and not settings.SERVER_SECRET):
+            print("SERVER_SECRET REQUIRED TO CHECK TOKENS")
+        elif(not apps.add_filter()):
+            print("DJANGO1-BAD FILTER")
+        elif('serve_http' not in apps.filter):
+            print("FILTER NOT SERVABLE")
+        else:
+            if (settings.FILTER_RELOAD):
+                apps.start_watcher()
+            print('SERVING %s ON %s:%d' % (settings.FILTER, settings.QUERYSERVER_HOST, options['port']))
+            try:
+                if(not apps.filter['serve_http'](options['port'], url=settings.SERVER_URL, secret=settings.SERVER_SECRET,
+                        issuer=settings.TOKEN_ISSUER, open=settings.OPEN_SERVER, threads=options['threads'],
+                        host=settings.QUERYSERVER_HOST)):
+                    print("DJANGO1-BAD QUERYSERVER")
+                    return
+            except KeyboardInterrupt:
+                pass
+            print('QUERYSERVER STOPPED')
+        return
@@ -8,3 +8,23 @@ OPEN_SERVER = getattr(settings, 'OPEN_SERVER', True)
 settings.OPEN_SERVER = OPEN_SERVER
 SERVER_URL = getattr(settings, 'SERVER_URL', 'api/')
 settings.SERVER_URL = SERVER_URL
+SERVER_SECRET = getattr(settings, 'SERVER_SECRET', None)
+settings.SERVER_SECRET = SERVER_SECRET
+TOKEN_CACHE_SIZE = getattr(settings, 'TOKEN_CACHE_SIZE', 4096)
+settings.TOKEN_CACHE_SIZE = TOKEN_CACHE_SIZE
+SERVER_CACHE_MAX_AGE = getattr(settings, 'SERVER_CACHE_MAX_AGE', 60)
+settings.SERVER_CACHE_MAX_AGE = SERVER_CACHE_MAX_AGE
+PREFILTER_BITS = getattr(settings, 'PREFILTER_BITS', 4)
+settings.PREFILTER_BITS = PREFILTER_BITS
+QUERYSERVER_HOST = getattr(settings, 'QUERYSERVER_HOST', '0.0.0.0')
+settings.QUERYSERVER_HOST = QUERYSERVER_HOST
+QUERYSERVER_PORT = getattr(settings, 'QUERYSERVER_PORT', 8001)
+settings.QUERYSERVER_PORT = QUERYSERVER_PORT
+QUERYSERVER_THREADS = getattr(settings, 'QUERYSERVER_THREADS', 0)
+settings.QUERYSERVER_THREADS = QUERYSERVER_THREADS
+SERVER_ASYNC = getattr(settings, 'SERVER_ASYNC', False)
+settings.SERVER_ASYNC = SERVER_ASYNC
+COALESCE_WINDOW = getattr(settings, 'COALESCE_WINDOW', 0.0005)
+settings.COALESCE_WINDOW = COALESCE_WINDOW
+COALESCE_MAX = getattr(settings, 'COALESCE_MAX', 1024)
+settings.COALESCE_MAX = COALESCE_MAX
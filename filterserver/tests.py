@@ -6,9 +6,15 @@ from django.core.management.color import color_style
 from django.conf import settings
 from django.apps import apps
 from filterclient.apps import add_filter, ServerErrorMsg, ServerErrorCode
-from filterserver.apps import random_secret
+from filterclient import apps as client
+from filterserver.apps import random_secret, get_secret, token_cache
+from filterserver import views
+from filterclient.management.commands import preprocess
+from django.test import RequestFactory
+from unittest import mock
+from dbfilters import ribbon128, utils
 
-import os, time, sys
+import os, time, sys, socket, threading, requests, asyncio, json, jwt, datetime, glob
 
 
 def testing_mode(switch):
@@ -259,3 +265,290 @@ class FilterServer(TestCase):
         response = c.get(url, get_request, content_type='application/json', **{'HTTP_AUTHORIZATION': 'Bearer ' + token})
         self.assertDictEqual(response.json(), {'errorcode': ServerErrorCode.BAD_ISSUER.value, 
                                         'errormsg': ServerErrorMsg.BAD_ISSUER.value})
+
+    @override_settings(OPEN_SERVER=True, FILTER_PENDING_POLICY='CLOSED')
+    def test_health(self):
+        sys.stdout.write(color.HTTP_INFO('\nTesting health and pending policy...'))
+        c = Client()
+        response = c.get(url + 'health/')
+        self.assertEqual(response.status_code, 200)
+        self.assertTrue(response.json()['ready'])
+        # Holding the lock keeps the background loader from finishing.
+        with client.filter_lock:
+            client.filter_ready.clear()
+            client.filter_thread = None
+            response = c.get(url, get_request, content_type='application/json')
+            self.assertTrue(response.json()['compromised'])
+            response = c.get(url + 'health/')
+            self.assertEqual(response.status_code, 503)
+            self.assertEqual(response.json()['state'], 'LOADING')
+        client.filter_thread.join()
+        response = c.get(url + 'health/')
+        self.assertEqual(response.status_code, 200)
+        response = c.get(url, get_request, content_type='application/json')
+        self.assertDictEqual(response.json(), get_response)
+
+    @override_settings(OPEN_SERVER=False)
+    def test_batch(self):
+        sys.stdout.write(color.HTTP_INFO('\nTesting batch queries...'))
+        c = Client()
+        hashes = [utils.sha1(str(i)) for i in range(20)]
+        response = c.post(url + 'batch/', hashes, content_type='application/json')
+        self.assertDictEqual(response.json(), {'errorcode': ServerErrorCode.TOKEN_REQUIRED.value,
+                                        'errormsg': ServerErrorMsg.TOKEN_REQUIRED.value})
+        token = c.post(url, perm_user, content_type='application/json').json().get('token')
+        auth = {'HTTP_AUTHORIZATION': 'Bearer ' + token}
+        response = c.post(url + 'batch/', hashes, content_type='application/json', **auth)
+        self.assertDictEqual(response.json(), {'compromised': [False]*len(hashes)})
+        packed = b''.join(bytes.fromhex(h) for h in hashes)
+        response = c.post(url + 'batch/', packed, content_type='application/octet-stream', **auth)
+        self.assertEqual(response.content, bytes(3))
+        for body, content_type in [(hashes + ['1234'], 'application/json'), ({'password': hashes[0]}, 'application/json'),
+                                   (packed[:-1], 'application/octet-stream')]:
+            response = c.post(url + 'batch/', body, content_type=content_type, **auth)
+            self.assertDictEqual(response.json(), {'errorcode': ServerErrorCode.BAD_HASHES.value,
+                                            'errormsg': ServerErrorMsg.BAD_HASHES.value})
+
+    @override_settings(OPEN_SERVER=False, TOKEN_CACHE_SIZE=2)
+    def test_token_cache(self):
+        sys.stdout.write(color.HTTP_INFO('\nTesting verified token cache...'))
+        c = Client()
+        token_cache.clear()
+        token = c.post(url, perm_user, content_type='application/json').json().get('token')
+        auth = {'HTTP_AUTHORIZATION': 'Bearer ' + token}
+        before = token_cache.stats()
+        for i in range(10):
+            self.assertDictEqual(c.get(url, get_request, **auth).json(), get_response)
+        after = token_cache.stats()
+        self.assertEqual(after['misses'] - before['misses'], 1)
+        self.assertEqual(after['hits'] - before['hits'], 9)
+        self.assertEqual(c.get(url + 'health/').json()['token_cache']['size'], 1)
+        for i in range(3):
+            other = jwt.encode({"user": str(i), "iss": settings.TOKEN_ISSUER,
+                                "exp": datetime.datetime.now(tz=datetime.timezone.utc) + datetime.timedelta(hours=1)},
+                                get_secret(), algorithm="HS256")
+            self.assertDictEqual(c.get(url, get_request, HTTP_AUTHORIZATION='Bearer ' + other).json(), get_response)
+        self.assertEqual(token_cache.stats()['size'], 2)
+        expired = jwt.encode({"user": "expired", "iss": settings.TOKEN_ISSUER,
+                              "exp": datetime.datetime.now(tz=datetime.timezone.utc) + datetime.timedelta(seconds=1)},
+                              get_secret(), algorithm="HS256")
+        self.assertDictEqual(c.get(url, get_request, HTTP_AUTHORIZATION='Bearer ' + expired).json(), get_response)
+        time.sleep(1.1)
+        self.assertDictEqual(c.get(url, get_request, HTTP_AUTHORIZATION='Bearer ' + expired).json(),
+                            {'errorcode': ServerErrorCode.EXPIRED_TOKEN.value, 'errormsg': ServerErrorMsg.EXPIRED_TOKEN.value})
+        with override_settings(TOKEN_ISSUER='Other'):
+            self.assertDictEqual(c.get(url, get_request, HTTP_AUTHORIZATION='Bearer ' + other).json(),
+                                {'errorcode': ServerErrorCode.BAD_ISSUER.value, 'errormsg': ServerErrorMsg.BAD_ISSUER.value})
+        random_secret()
+        self.assertDictEqual(c.get(url, get_request, **auth).json(),
+                            {'errorcode': ServerErrorCode.BAD_TOKEN.value, 'errormsg': ServerErrorMsg.BAD_TOKEN.value})
+
+    @override_settings(OPEN_SERVER=True, COALESCE_WINDOW=0.01)
+    def test_async_coalescing(self):
+        sys.stdout.write(color.HTTP_INFO('\nTesting async request coalescing...'))
+        passwords = ['coalesced%d' % i for i in range(64)]
+        compromised = {bytes.fromhex(utils.sha1(p)) for p in passwords[::3]}
+        batches = []
+        def find_hashes(hashes):
+            batches.append(len(hashes)//20)
+            return client.hashes_bitmap(hashes, lambda h: bytes.fromhex(h) in compromised)
+        async def gather():
+            view = views.FilterserverAsyncView.as_view()
+            factory = RequestFactory()
+            return await asyncio.gather(*[view(factory.get(url, {'password': p})) for p in passwords + ['']])
+        with mock.patch.object(views, 'find_hashes', find_hashes):
+            responses = asyncio.run(gather())
+        for p, response in zip(passwords, responses):
+            self.assertDictEqual(json.loads(response.content), {'password': p, 'compromised': p in passwords[::3]})
+        self.assertDictEqual(json.loads(responses[-1].content), {'errorcode': ServerErrorCode.BAD_PASSWORD.value,
+                                        'errormsg': ServerErrorMsg.BAD_PASSWORD.value})
+        self.assertEqual(sum(batches), len(passwords))
+        self.assertLess(len(batches), len(passwords))
+        # Parked requests go out as soon as the running batch ends, not at the end of the window.
+        batches.clear()
+        with self.settings(COALESCE_WINDOW=5), mock.patch.object(views, 'find_hashes', find_hashes):
+            start = time.monotonic()
+            responses = asyncio.run(gather())
+            self.assertLess(time.monotonic() - start, 2, "Parked requests waited for the whole window.")
+        self.assertEqual(sum(batches), len(passwords))
+
+    @override_settings(OPEN_SERVER=True, SHARD_RANGE='0-7')
+    def test_shard_range(self):
+        sys.stdout.write(color.HTTP_INFO('\nTesting shard range checks...'))
+        c = Client()
+        wrong = {'errorcode': ServerErrorCode.WRONG_SHARD.value, 'errormsg': ServerErrorMsg.WRONG_SHARD.value}
+        hashes = [utils.sha1(str(i)) for i in range(20)]
+        low = [h for h in hashes if h[0] < '8']
+        self.assertDictEqual(c.get(url, {'password': low[0]}).json(), {'password': low[0], 'compromised': False})
+        self.assertDictEqual(c.get(url, {'password': 'f' * 40}).json(), wrong)
+        self.assertDictEqual(c.post(url + 'batch/', low, content_type='application/json').json(), {'compromised': [False]*len(low)})
+        self.assertDictEqual(c.post(url + 'batch/', hashes, content_type='application/json').json(), wrong)
+
+    @override_settings(OPEN_SERVER=True)
+    def test_http_caching(self):
+        sys.stdout.write(color.HTTP_INFO('\nTesting cache headers and conditional requests...'))
+        c = Client()
+        response = c.get(url, get_request)
+        etag = response['ETag']
+        self.assertEqual(etag, '"%s"' % client.filter_version)
+        self.assertEqual(response['Cache-Control'], 'public, max-age=%d' % settings.SERVER_CACHE_MAX_AGE)
+        with mock.patch.object(views, 'find_password', side_effect=AssertionError('Queried a cached answer')):
+            response = c.get(url, get_request, HTTP_IF_NONE_MATCH='"other", W/' + etag)
+            self.assertEqual((response.status_code, response['ETag'], response.content), (304, etag, b''))
+            async def conditional():
+                view = views.FilterserverAsyncView.as_view()
+                return await view(RequestFactory().get(url, get_request, HTTP_IF_NONE_MATCH=etag))
+            self.assertEqual(asyncio.run(conditional()).status_code, 304)
+        response = c.get(url, {'password': ''}, HTTP_IF_NONE_MATCH=etag)
+        self.assertEqual((response.status_code, response['Cache-Control']), (200, 'no-store'))
+        self.assertFalse(response.has_header('ETag'))
+        self.assertEqual(c.get(url, get_request, HTTP_IF_NONE_MATCH='"other"').json(), get_response)
+        with mock.patch.object(client, 'filter_version', 'rebuilt'):
+            self.assertEqual(c.get(url, get_request, HTTP_IF_NONE_MATCH=etag).status_code, 200)
+        with mock.patch.object(client, 'filter_state', 'LOADING'):
+            self.assertEqual(c.get(url, get_request, HTTP_IF_NONE_MATCH=etag)['Cache-Control'], 'no-store')
+        with self.settings(OPEN_SERVER=False):
+            token = c.post(url, perm_user, content_type='application/json').json().get('token')
+            response = c.get(url, get_request, HTTP_AUTHORIZATION='Bearer ' + token)
+            self.assertTrue(response['Cache-Control'].startswith('private'))
+            response = c.get(url, get_request, HTTP_IF_NONE_MATCH=etag)
+            self.assertEqual(response.json()['errorcode'], ServerErrorCode.TOKEN_REQUIRED.value)
+
+    @override_settings(OPEN_SERVER=True)
+    def test_artifact(self):
+        sys.stdout.write(color.HTTP_INFO('\nTesting filter artifact download...'))
+        c = Client()
+        keysfile = os.path.join(settings.TESTING_DIR, "keysartifact.bin")
+        artifact = os.path.join(settings.TESTING_DIR, "artifact.bin")
+        utils.synthetic(keysfile, 10000)
+        self.assertTrue(ribbon128.build_filter(keysfile, artifact, 0, 1), "Filter's construction failed.")
+        with open(artifact, 'rb') as f:
+            content = f.read()
+        with self.settings(FILTERFILE=keysfile):
+            self.assertDictEqual(c.get(url + 'artifact/info/').json(), {'errorcode': ServerErrorCode.NO_ARTIFACT.value,
+                                                                'errormsg': ServerErrorMsg.NO_ARTIFACT.value})
+            self.assertEqual(c.get(url + 'artifact/').json()['errorcode'], ServerErrorCode.NO_ARTIFACT.value)
+        with self.settings(FILTERFILE=artifact):
+            info = c.get(url + 'artifact/info/').json()
+            self.assertEqual((info['type'], info['nkeys'], info['size']), ('ribbon128', 10000, len(content)))
+            response = c.get(url + 'artifact/')
+            self.assertEqual(response.status_code, 200)
+            self.assertEqual(b''.join(response.streaming_content), content)
+            self.assertEqual(response['ETag'], '"%s"' % info['version'])
+            response = c.get(url + 'artifact/', HTTP_RANGE='bytes=4096-', HTTP_IF_RANGE=response['ETag'])
+            self.assertEqual(response.status_code, 206)
+            self.assertEqual(response['Content-Range'], 'bytes 4096-%d/%d' % (len(content) - 1, len(content)))
+            self.assertEqual(b''.join(response.streaming_content), content[4096:])
+            response = c.get(url + 'artifact/', HTTP_RANGE='bytes=-10')
+            self.assertEqual(b''.join(response.streaming_content), content[-10:])
+            response = c.get(url + 'artifact/', HTTP_RANGE='bytes=4096-', HTTP_IF_RANGE='"other"')
+            self.assertEqual(response.status_code, 200)
+            self.assertEqual(b''.join(response.streaming_content), content)
+            response = c.get(url + 'artifact/', HTTP_RANGE='bytes=%d-' % len(content))
+            self.assertEqual(response.status_code, 416)
+
+    @override_settings(OPEN_SERVER=True)
+    def test_range(self):
+        sys.stdout.write(color.HTTP_INFO('\nTesting the range API...'))
+        c = Client()
+        pwdfile = os.path.join(settings.TESTING_DIR, "pwdrange.txt")
+        keysfile = os.path.join(settings.TESTING_DIR, "keysrange.bin")
+        # More keys under one prefix than a block holds, among random ones.
+        hashes = ['ABCDE' + os.urandom(18).hex().upper()[:35] for i in range(5000)]
+        hashes += [os.urandom(20).hex().upper() for i in range(20000)]
+        # Half of them in the keys file, the rest in the delta of an update,
+        # whose lines must be merged in hash order.
+        for f in glob.glob(keysfile + "*"):
+            os.remove(f)
+        with open(pwdfile, 'w') as pwd:
+            pwd.writelines(h + "\n" for h in sorted(hashes[::2]))
+        preprocess.Command.test(pwdfile, keysfile, len(hashes), True)
+        with open(pwdfile, 'w') as pwd:
+            pwd.writelines(h + "\n" for h in sorted(hashes))
+        self.assertTrue(preprocess.Command.test_update(pwdfile, keysfile, len(hashes)), "Keys file's update failed.")
+        os.remove(pwdfile)
+        utils.destroy_keystore()
+        with self.settings(KEYSFILE=pwdfile):
+            self.assertEqual(c.get(url + 'range/ABCDE').json()['errorcode'], ServerErrorCode.NO_RANGE.value)
+        with self.settings(KEYSFILE=keysfile):
+            for prefix in ('ABCDE', hashes[-1][:5], '00000'):
+                expected = sorted(set(h[5:] + ':1' for h in hashes if h.startswith(prefix)))
+                response = c.get(url + 'range/' + prefix.lower())
+                self.assertEqual(response['Content-Type'], 'text/plain')
+                self.assertEqual(response.content.decode().split('\r\n') if expected else [], expected)
+            response = c.get(url + 'range/ABCDE')
+            etag = response['ETag']
+            self.assertEqual(etag, '"keys-%s"' % utils.keystore_version())
+            self.assertEqual(c.get(url + 'range/ABCDE', HTTP_IF_NONE_MATCH=etag).status_code, 304)
+            self.assertEqual(c.get(url + 'range/ABCD').json()['errorcode'], ServerErrorCode.BAD_HASHES.value)
+            # Rewriting the keys file changes the tag, even with the same filter.
+            with open(pwdfile, 'w') as pwd:
+                pwd.writelines(h + "\n" for h in hashes[::2])
+            preprocess.Command.test(pwdfile, keysfile, len(hashes), True)
+            os.remove(pwdfile)
+            self.assertTrue(utils.load_keystore(keysfile))
+            response = c.get(url + 'range/ABCDE', HTTP_IF_NONE_MATCH=etag)
+            self.assertEqual(response.status_code, 200, "A changed keys file was answered as not modified.")
+            self.assertEqual(response.content.decode().split('\r\n'),
+                             sorted(set(h[5:] + ':1' for h in hashes[::2] if h.startswith('ABCDE'))))
+        utils.destroy_keystore()
+
+    @override_settings(OPEN_SERVER=False)
+    def test_queryserver(self):
+        sys.stdout.write(color.HTTP_INFO('\nTesting native queryserver...'))
+        keysfile = os.path.join(settings.TESTING_DIR, "keysquery.bin")
+        utils.synthetic(keysfile, 10000)
+        self.assertTrue(ribbon128.construct_filter(keysfile), "Filter's construction failed.")
+        with socket.socket() as s:
+            s.bind(('127.0.0.1', 0))
+            port = s.getsockname()[1]
+        server = threading.Thread(target=ribbon128.serve_http, args=(port,), daemon=True,
+                                kwargs=dict(url=settings.SERVER_URL, secret=get_secret(), issuer=settings.TOKEN_ISSUER,
+                                            open=False, threads=2, host='127.0.0.1'))
+        server.start()
+        native = 'http://127.0.0.1:%d%s' % (port, url)
+        session = requests.Session()
+        for i in range(100):
+            try:
+                self.assertEqual(session.get(native + 'health/').status_code, 200)
+                break
+            except requests.ConnectionError:
+                server.join(0.05)
+        token = Client().post(url, perm_user, content_type='application/json').json().get('token')
+        for password in [get_request['password'], utils.sha1('password'), 'caf\u00e9 "quoted"']:
+            response = session.get(native, params={'password': password}, headers={'Authorization': 'Bearer ' + token})
+            self.assertDictEqual(response.json(), {'password': password, 'compromised': ribbon128.query_filter(password, True)})
+        response = session.get(native, params=get_request)
+        self.assertDictEqual(response.json(), {'errorcode': ServerErrorCode.TOKEN_REQUIRED.value,
+                                        'errormsg': ServerErrorMsg.TOKEN_REQUIRED.value})
+        response = session.get(native, params=get_request, headers={'Authorization': 'Bearer ' + token[:-2]})
+        self.assertDictEqual(response.json(), {'errorcode': ServerErrorCode.BAD_TOKEN.value,
+                                        'errormsg': ServerErrorMsg.BAD_TOKEN.value})
+        response = session.get(native, params={'password': ''}, headers={'Authorization': token})
+        self.assertDictEqual(response.json(), {'errorcode': ServerErrorCode.BAD_PASSWORD.value,
+                                        'errormsg': ServerErrorMsg.BAD_PASSWORD.value})
+        # Pipelined requests are all answered after the client stops sending.
+        with socket.create_connection(('127.0.0.1', port)) as s:
+            s.sendall(('GET %shealth/ HTTP/1.1\r\nHost: test\r\n\r\n' % url).encode()*1000)
+            s.shutdown(socket.SHUT_WR)
+            answers = b''
+            while (data := s.recv(65536)):
+                answers += data
+        self.assertEqual(answers.count(b"HTTP/1.1 200"), 1000, "Queued answers were dropped on a half close.")
+        # A request whose body cannot be framed is refused, and nothing after it is answered.
+        health = 'GET %shealth/ HTTP/1.1\r\nHost: test\r\n%s\r\n'
+        for header, status in (('Content-Length: -1\r\n', b"400"), ('Content-Length: 18446744073709551615\r\n', b"400"),
+                               ('Content-Length: 1x\r\n', b"400"), ('Transfer-Encoding: chunked\r\n', b"501"),
+                               ('Connection: Keep-Alive , CLOSE\r\n', b"200"), ('Connection: cl0se\r\n', b"200")):
+            with socket.create_connection(('127.0.0.1', port)) as s:
+                s.sendall(((health % (url, header)) + (health % (url, ''))).encode())
+                s.shutdown(socket.SHUT_WR)
+                answers = b''
+                while (data := s.recv(65536)):
+                    answers += data
+            self.assertTrue(answers.startswith(b"HTTP/1.1 " + status), header)
+            self.assertEqual(answers.count(b"HTTP/1.1 "), 2 if header.endswith('cl0se\r\n') else 1, header)
+        ribbon128.stop_http()
+        server.join()
+        ribbon128.destroy_filter()
+        os.remove(keysfile)
@@ -2,14 +2,20 @@ from django.urls import path
 from django.views.decorators.csrf import csrf_exempt
 from django.apps import apps
 from django.conf import settings
-from .views import FilterserverView
+from .views import FilterserverView, FilterserverAsyncView, FilterhealthView, FilterbatchView, FilterprefilterView, FilterartifactView, FilterartifactInfoView, FilterrangeView
 
 import os
 
 
 if apps.is_installed("filterserver") or os.environ.get("TESTING") == 'true':
     urlpatterns = [
-            path(settings.SERVER_URL, csrf_exempt(FilterserverView.as_view())),
+            path(settings.SERVER_URL, csrf_exempt((FilterserverAsyncView if settings.SERVER_ASYNC else FilterserverView).as_view())),
+            path(settings.SERVER_URL + 'health/', FilterhealthView.as_view()),
+            path(settings.SERVER_URL + 'batch/', csrf_exempt(FilterbatchView.as_view())),
+            path(settings.SERVER_URL + 'prefilter/', FilterprefilterView.as_view()),
+            path(settings.SERVER_URL + 'artifact/', FilterartifactView.as_view()),
+            path(settings.SERVER_URL + 'artifact/info/', FilterartifactInfoView.as_view()),
+            path(settings.SERVER_URL + 'range/<str:prefix>', FilterrangeView.as_view()),
     ]
 else:
     urlpatterns = [
@@ -1,12 +1,15 @@
 from django.shortcuts import render
-from django.http import JsonResponse
+from django.http import JsonResponse, HttpResponse, FileResponse, StreamingHttpResponse
 from django.views import View
 from django.contrib.auth import authenticate
 from django.conf import settings
-from .apps import get_secret
-from filterclient.apps import ServerErrorCode, ServerErrorMsg, find_password
+from .apps import get_secret, token_cache, build_prefilter, load_range
+from filterclient.apps import ServerErrorCode, ServerErrorMsg, find_password, find_hashes, filter_status, password_digest, artifact_version, in_shard
+from filterclient import apps as client
+from dbfilters import utils
+from asgiref.sync import sync_to_async
 
-import json, jwt, datetime
+import asyncio, json, jwt, datetime, weakref, os, re
 
 
 def check_password(request):
@@ -21,52 +24,183 @@ def check_password(request):
         data = None
     return data
 
+def check_shard(hashes):
+    # A shard server must not answer for hashes its filter was not built with.
+    for i in range(0, len(hashes), 20):
+        if (not in_shard(hashes[i:i+20])):
+            return ServerErrorCode.WRONG_SHARD
+    return None
 
-class FilterserverView(View):
+def query_etag():
+    # Answers only change with the filter, so its version tags them all. None
+    # while the filter is not ready and the pending policy answers instead.
+    if (client.filter_state != 'READY' or client.filter_version is None):
+        return None
+    return '"%s"' % client.filter_version
 
-    def get(self, request):
-        errorcode = ServerErrorCode.BAD_TOKEN
-        errormsg = ServerErrorMsg.BAD_TOKEN
+def range_etag():
+    # Range answers come from the keystore, so its keys files tag them, not
+    # the filter.
+    version = utils.keystore_version()
+    return None if version is None else '"keys-%s"' % version
+
+def not_modified(request, etag):
+    # Whether the cached answer the request was made with is still valid.
+    match = request.headers.get('If-None-Match')
+    if (etag is None or match is None):
+        return False
+    return match.strip() == '*' or etag in [tag.strip().removeprefix('W/') for tag in match.split(',')]
+
+def query_response(request, data, etag):
+    # Closed servers only let the client cache their answers, so that a
+    # shared cache never hands them to a request without a token.
+    if (etag is None or 'errorcode' in data):
+        response = JsonResponse(data)
+        response['Cache-Control'] = 'no-store'
+        return response
+    return cache_response(HttpResponse(status=304) if not_modified(request, etag) else JsonResponse(data), etag)
+
+def cache_response(response, etag):
+    response['ETag'] = etag
+    response['Cache-Control'] = '%s, max-age=%d' % ('public' if settings.OPEN_SERVER else 'private', settings.SERVER_CACHE_MAX_AGE)
+    return response
+
+def check_token(request):
+    # The error code that keeps the request from querying, None if it may.
+    if(settings.OPEN_SERVER):
+        return None
+    token = request.headers.get('Authorization')
+    if token is None:
+        return ServerErrorCode.TOKEN_REQUIRED
+    token = str.replace(str(token), 'Bearer ', '')
+    issuer = token_cache.get(token)
+    if (issuer is None):
         try:
-            if(settings.OPEN_SERVER):
-                data = check_password(request)
-                if (data is None):
-                    errorcode = ServerErrorCode.BAD_PASSWORD
-                    errormsg = ServerErrorMsg.BAD_PASSWORD
-                    raise Exception('A password to check must be provided')
-            else:
-                token = request.headers.get('Authorization')
-                #print(token)
-            
-                if token is not None:
-                    token = str.replace(str(token), 'Bearer ', '')
-                    #print(token)
-                    decoded_jwt = jwt.decode(token, get_secret(), algorithms=["HS256"], options={"require": ["exp", "iss"]})
-                    if (decoded_jwt.get('iss') == settings.TOKEN_ISSUER):
-                        data = check_password(request)
-                        if (data is None):
-                            errorcode = ServerErrorCode.BAD_PASSWORD
-                            errormsg = ServerErrorMsg.BAD_PASSWORD
-                            raise Exception('A password to check must be provided')
-                    else:
-                        errorcode = ServerErrorCode.BAD_ISSUER
-                        errormsg = ServerErrorMsg.BAD_ISSUER
-                        raise Exception('Incorrect Issuer')
-                else:
-                    errorcode = ServerErrorCode.TOKEN_REQUIRED
-                    errormsg = ServerErrorMsg.TOKEN_REQUIRED
-                    raise Exception('A Bearer Authorization token must be provided')
+            decoded_jwt = jwt.decode(token, get_secret(), algorithms=["HS256"], options={"require": ["exp", "iss"]})
+        except jwt.ExpiredSignatureError:
+            return ServerErrorCode.EXPIRED_TOKEN
+        except Exception:
+            return ServerErrorCode.BAD_TOKEN
+        issuer = decoded_jwt.get('iss')
+        token_cache.put(token, decoded_jwt['exp'], issuer)
+    if (issuer != settings.TOKEN_ISSUER):
+        return ServerErrorCode.BAD_ISSUER
+    return None
+
+def parse_hashes(request):
+    # Packed 20 byte SHA1 digests from either body format, None if malformed.
+    if (request.content_type == 'application/octet-stream'):
+        return request.body if len(request.body) % 20 == 0 else None
+    try:
+        hashes = json.loads(request.body)
+        packed = b''.join(bytes.fromhex(h) for h in hashes)
+        return packed if isinstance(hashes, list) and len(packed) == 20*len(hashes) else None
+    except Exception:
+        return None
+
+def parse_range(header, size):
+    # (first, last) byte of a single bytes range, False if it lies past the
+    # end and None if there is none, in which case the whole file is sent.
+    match = re.fullmatch(r'bytes=(\d*)-(\d*)', header or '')
+    if (match is None or match.group(1) == match.group(2) == ''):
+        return None
+    if (match.group(1) == ''):
+        first, last = max(size - int(match.group(2)), 0), size - 1
+    else:
+        first = int(match.group(1))
+        last = min(int(match.group(2)), size - 1) if match.group(2) else size - 1
+    if (first > last):
+        return False if first >= size else None
+    return (first, last)
+
+def read_range(artifact, first, last):
+    try:
+        artifact.seek(first)
+        remaining = last - first + 1
+        while (remaining > 0):
+            chunk = artifact.read(min(remaining, 1 << 20))
+            if (not chunk):
+                break
+            remaining -= len(chunk)
+            yield chunk
+    finally:
+        artifact.close()
+
+class Coalescer:
+    # Gathers the digests of concurrent requests on one event loop and answers
+    # them with a single find_hashes call, run off the loop since it releases
+    # the GIL. A request arriving while no batch is running goes out at once;
+    # the others wait for the running batch, COALESCE_WINDOW seconds at most,
+    # or until COALESCE_MAX of them are parked.
+    loops = weakref.WeakKeyDictionary()
+
+    @classmethod
+    def get(cls):
+        loop = asyncio.get_running_loop()
+        if (loop not in cls.loops):
+            cls.loops[loop] = cls(loop)
+        return cls.loops[loop]
+
+    def __init__(self, loop):
+        self.loop = loop
+        self.pending = []
+        self.timer = None
+        self.running = 0
+
+    def query(self, digest):
+        future = self.loop.create_future()
+        self.pending.append((digest, future))
+        if (not self.running or len(self.pending) >= settings.COALESCE_MAX):
+            self.flush()
+        elif (self.timer is None):
+            self.timer = self.loop.call_later(settings.COALESCE_WINDOW, self.flush)
+        return future
+
+    def flush(self):
+        if (self.timer is not None):
+            self.timer.cancel()
+            self.timer = None
+        batch, self.pending = self.pending, []
+        if (batch):
+            self.running += 1
+            self.loop.create_task(self.answer(batch))
+
+    async def answer(self, batch):
+        try:
+            bitmap = await self.loop.run_in_executor(None, find_hashes, b''.join(digest for digest, future in batch))
+            for i, (digest, future) in enumerate(batch):
+                if (not future.done()):
+                    future.set_result(bool(bitmap[i//8] >> (i%8) & 1))
         except Exception as e:
-            if str(e) == 'Signature has expired':
-                errorcode = ServerErrorCode.EXPIRED_TOKEN
-                errormsg = ServerErrorMsg.EXPIRED_TOKEN
+            for digest, future in batch:
+                if (not future.done()):
+                    future.set_exception(e)
+        finally:
+            self.running -= 1
+            if (self.pending):
+                self.flush()
+
+
+class FilterserverView(View):
+
+    def get(self, request):
+        etag = query_etag()
+        errorcode = check_token(request)
+        pwd = request.GET.get('password')
+        if (errorcode is None and pwd and settings.SHARD_RANGE):
+            errorcode = check_shard(password_digest(pwd, True))
+        if (errorcode is None and pwd and not_modified(request, etag)):
+            return query_response(request, {'password': pwd}, etag)
+        if (errorcode is None):
+            data = check_password(request)
+            if (data is None):
+                errorcode = ServerErrorCode.BAD_PASSWORD
+        if (errorcode is not None):
             data = {
                     'errorcode': errorcode.value,
-                    'errormsg': errormsg.value,
+                    'errormsg': ServerErrorMsg[errorcode.name].value,
                 }
-            #print("INVALID GET: ", str(e))
-
-        return JsonResponse(data)
+        return query_response(request, data, etag)
     
 
     def post(self, request):
@@ -106,3 +240,167 @@ class FilterserverView(View):
             #print("INVALID POST: ", str(e))
 
         return JsonResponse(data)
+
+
+class FilterserverAsyncView(FilterserverView):
+
+    async def get(self, request):
+        etag = query_etag()
+        errorcode = check_token(request)
+        pwd = request.GET.get('password')
+        if (errorcode is None and (pwd is None or pwd == '')):
+            errorcode = ServerErrorCode.BAD_PASSWORD
+        if (errorcode is None and settings.SHARD_RANGE):
+            errorcode = check_shard(password_digest(pwd, True))
+        if (errorcode is not None):
+            return query_response(request, {
+                    'errorcode': errorcode.value,
+                    'errormsg': ServerErrorMsg[errorcode.name].value,
+                }, etag)
+        if (not_modified(request, etag)):
+            return query_response(request, {'password': pwd}, etag)
+        compromised = await Coalescer.get().query(password_digest(pwd, True))
+        return query_response(request, {'password': pwd, 'compromised': compromised}, etag)
+
+    async def post(self, request):
+        return await sync_to_async(super().post)(request)
+
+
+class FilterrangeView(View):
+    # The range API of Pwned Passwords, GET range/<5 hex digits>, for services
+    # that cannot reach api.pwnedpasswords.com. Answers from KEYSFILE, which
+    # must be compact, with the suffix of every hash starting with the prefix.
+    # Keys files keep no counts: every count is 1, not the Pwned Passwords one.
+
+    def get(self, request, prefix):
+        errorcode = check_token(request)
+        if (errorcode is None and not re.fullmatch('[0-9a-fA-F]{5}', prefix)):
+            errorcode = ServerErrorCode.BAD_HASHES
+        if (errorcode is None):
+            first = int(prefix, 16) << 44
+            if (not in_shard(first.to_bytes(8, 'big')) or not in_shard((first | (1 << 44) - 1).to_bytes(8, 'big'))):
+                errorcode = ServerErrorCode.WRONG_SHARD
+        if (errorcode is None and not load_range()):
+            errorcode = ServerErrorCode.NO_RANGE
+        etag = range_etag() if errorcode is None else None
+        if (errorcode is None and etag is not None and not_modified(request, etag)):
+            return cache_response(HttpResponse(status=304), etag)
+        if (errorcode is None):
+            text = utils.range_keys(prefix)
+            if (text is None):
+                errorcode = ServerErrorCode.NO_RANGE
+        if (errorcode is not None):
+            response = JsonResponse({
+                    'errorcode': errorcode.value,
+                    'errormsg': ServerErrorMsg[errorcode.name].value,
+                })
+            response['Cache-Control'] = 'no-store'
+            return response
+        response = HttpResponse(text, content_type='text/plain')
+        if (etag is None):
+            response['Cache-Control'] = 'no-store'
+            return response
+        return cache_response(response, etag)
+
+
+class FilterhealthView(View):
+
+    def get(self, request):
+        data = filter_status()
+        data['token_cache'] = token_cache.stats()
+        return JsonResponse(data, status=200 if data['ready'] else 503)
+
+
+class FilterbatchView(View):
+
+    def post(self, request):
+        errorcode = check_token(request)
+        if (errorcode is None):
+            hashes = parse_hashes(request)
+            if (hashes is None):
+                errorcode = ServerErrorCode.BAD_HASHES
+            else:
+                errorcode = check_shard(hashes)
+        if (errorcode is not None):
+            return JsonResponse({
+                    'errorcode': errorcode.value,
+                    'errormsg': ServerErrorMsg[errorcode.name].value,
+                })
+        bitmap = find_hashes(hashes)
+        if (request.content_type == 'application/octet-stream'):
+            return HttpResponse(bitmap, content_type='application/octet-stream')
+        return JsonResponse({'compromised': [bool(bitmap[i//8] >> (i%8) & 1) for i in range(len(hashes)//20)]})
+
+
+class FilterprefilterView(View):
+
+    def get(self, request):
+        errorcode = check_token(request)
+        if (errorcode is None and not build_prefilter()):
+            errorcode = ServerErrorCode.NO_PREFILTER
+        if (errorcode is not None):
+            return JsonResponse({
+                    'errorcode': errorcode.value,
+                    'errormsg': ServerErrorMsg[errorcode.name].value,
+                })
+        return FileResponse(open(settings.PREFILTERFILE, 'rb'), content_type='application/octet-stream')
+
+
+class FilterartifactInfoView(View):
+
+    def get(self, request):
+        errorcode = check_token(request)
+        info = utils.filter_info(settings.FILTERFILE) if errorcode is None else None
+        if (errorcode is None and info is None):
+            errorcode = ServerErrorCode.NO_ARTIFACT
+        if (errorcode is not None):
+            return JsonResponse({
+                    'errorcode': errorcode.value,
+                    'errormsg': ServerErrorMsg[errorcode.name].value,
+                })
+        info['version'] = artifact_version(info)
+        info['size'] = info['payload_offset'] + info['payload_size']
+        return JsonResponse(info)
+
+
+class FilterartifactView(View):
+
+    def get(self, request):
+        # Reads the header from the open file, so a rebuild renamed over
+        # FILTERFILE meanwhile cannot mix two versions in one response.
+        errorcode = check_token(request)
+        artifact = info = None
+        if (errorcode is None):
+            try:
+                artifact = open(settings.FILTERFILE, 'rb')
+                info = utils.filter_info(artifact.fileno())
+            except OSError:
+                pass
+            if (info is None):
+                errorcode = ServerErrorCode.NO_ARTIFACT
+        if (errorcode is not None):
+            if (artifact is not None):
+                artifact.close()
+            return JsonResponse({
+                    'errorcode': errorcode.value,
+                    'errormsg': ServerErrorMsg[errorcode.name].value,
+                })
+        size = os.fstat(artifact.fileno()).st_size
+        etag = '"%s"' % artifact_version(info)
+        span = parse_range(request.headers.get('Range'), size)
+        if (span is not None and request.headers.get('If-Range', etag) != etag):
+            span = None
+        if (span is False):
+            artifact.close()
+            response = HttpResponse(status=416)
+            response['Content-Range'] = 'bytes */%d' % size
+            return response
+        first, last = span or (0, size - 1)
+        response = StreamingHttpResponse(read_range(artifact, first, last), status=206 if span else 200,
+                                         content_type='application/octet-stream')
+        response['Content-Length'] = last - first + 1
+        if (span):
+            response['Content-Range'] = 'bytes %d-%d/%d' % (first, last, size)
+        response['Accept-Ranges'] = 'bytes'
+        response['ETag'] = etag
+        return response
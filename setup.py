@@ -1,3 +1,4 @@
+import os
 from setuptools.command.build_ext import build_ext
 from setuptools import setup, Extension
 
@@ -13,12 +14,22 @@ class custom_build_ext(build_ext):
         self.compiler.set_executable("linker_so", "gcc")
         build_ext.build_extensions(self)
 
+    def build_extension(self, ext):
+        # The binary fuse modules compile the same source with different
+        # macros, so each extension keeps its objects apart.
+        build_temp = self.build_temp
+        self.build_temp = os.path.join(build_temp, ext.name)
+        try:
+            build_ext.build_extension(self, ext)
+        finally:
+            self.build_temp = build_temp
+
 ext_modules = [
     Extension('dbfilters.utils', 
                 sources = ['dbfilters/src/utils_wrapper.c'],
                 extra_objects=["dbfilters/src/sha1-avx.S"],
-                extra_compile_args = ["-fPIC", "-fno-strict-aliasing", "-mlzcnt", "-O3", "-mavx2", "-march=native"],
-                extra_link_args=["-shared", "-Wl,-O3", "-Wl,-Bsymbolic-functions", "-lstdc++"]
+                extra_compile_args = ["-fPIC", "-fno-strict-aliasing", "-mlzcnt", "-O3", "-mavx2", "-march=native", "-pthread"],
+                extra_link_args=["-shared", "-Wl,-O3", "-Wl,-Bsymbolic-functions", "-lstdc++", "-pthread"]
                 ),
     Extension('dbfilters.preprocess', 
                sources = ['dbfilters/src/preprocess_wrapper.c'],
@@ -29,32 +40,59 @@ ext_modules = [
     Extension('dbfilters.ribbon128', 
                 sources = ['dbfilters/src/ribbon_wrapper.c'],
                 extra_objects=["dbfilters/src/sha1-avx.S"],
-                extra_compile_args = ["-fPIC", "-fno-strict-aliasing", "-mlzcnt", "-O3", "-mavx2", "-march=native"],
-                extra_link_args=["-shared", "-Wl,-O3", "-Wl,-Bsymbolic-functions", "-lstdc++"]
+                extra_compile_args = ["-fPIC", "-fno-strict-aliasing", "-mlzcnt", "-O3", "-mavx2", "-march=native", "-pthread"],
+                extra_link_args=["-shared", "-Wl,-O3", "-Wl,-Bsymbolic-functions", "-lstdc++", "-pthread"]
                 ),
     Extension('dbfilters.binaryfuse8', 
                 sources = ['dbfilters/src/binaryfuse_wrapper.c'],
+                define_macros = [('BINARYFUSE_BITS', '8')],
+                extra_objects=["dbfilters/src/sha1-avx.S"],
+                extra_compile_args = ["-fPIC", "-fno-strict-aliasing", "-mlzcnt", "-O3", "-mavx2", "-march=native", "-pthread"],
+                extra_link_args=["-shared", "-Wl,-O3", "-Wl,-Bsymbolic-functions", "-lstdc++", "-pthread"]
+                ),
+    Extension('dbfilters.binaryfuse16', 
+                sources = ['dbfilters/src/binaryfuse_wrapper.c'],
+                define_macros = [('BINARYFUSE_BITS', '16')],
                 extra_objects=["dbfilters/src/sha1-avx.S"],
-                extra_compile_args = ["-fPIC", "-fno-strict-aliasing", "-mlzcnt", "-O3", "-mavx2", "-march=native"],
-                extra_link_args=["-shared", "-Wl,-O3", "-Wl,-Bsymbolic-functions", "-lstdc++"]
+                extra_compile_args = ["-fPIC", "-fno-strict-aliasing", "-mlzcnt", "-O3", "-mavx2", "-march=native", "-pthread"],
+                extra_link_args=["-shared", "-Wl,-O3", "-Wl,-Bsymbolic-functions", "-lstdc++", "-pthread"]
+                ),
+    Extension('dbfilters.binaryfuse32', 
+                sources = ['dbfilters/src/binaryfuse_wrapper.c'],
+                define_macros = [('BINARYFUSE_BITS', '32')],
+                extra_objects=["dbfilters/src/sha1-avx.S"],
+                extra_compile_args = ["-fPIC", "-fno-strict-aliasing", "-mlzcnt", "-O3", "-mavx2", "-march=native", "-pthread"],
+                extra_link_args=["-shared", "-Wl,-O3", "-Wl,-Bsymbolic-functions", "-lstdc++", "-pthread"]
                 ),
     Extension('dbfilters.xor8', 
                 sources = ['dbfilters/src/xor8_wrapper.c'],
                 extra_objects=["dbfilters/src/sha1-avx.S"],
-                extra_compile_args = ["-fPIC", "-fno-strict-aliasing", "-mlzcnt", "-O3", "-mavx2", "-march=native"],
-                extra_link_args=["-shared", "-Wl,-O3", "-Wl,-Bsymbolic-functions", "-lstdc++"]
+                extra_compile_args = ["-fPIC", "-fno-strict-aliasing", "-mlzcnt", "-O3", "-mavx2", "-march=native", "-pthread"],
+                extra_link_args=["-shared", "-Wl,-O3", "-Wl,-Bsymbolic-functions", "-lstdc++", "-pthread"]
                 ),
     Extension('dbfilters.xor16', 
                 sources = ['dbfilters/src/xor16_wrapper.c'],
                 extra_objects=["dbfilters/src/sha1-avx.S"],
-                extra_compile_args = ["-fPIC", "-fno-strict-aliasing", "-mlzcnt", "-O3", "-mavx2", "-march=native"],
-                extra_link_args=["-shared", "-Wl,-O3", "-Wl,-Bsymbolic-functions", "-lstdc++"]
+                extra_compile_args = ["-fPIC", "-fno-strict-aliasing", "-mlzcnt", "-O3", "-mavx2", "-march=native", "-pthread"],
+                extra_link_args=["-shared", "-Wl,-O3", "-Wl,-Bsymbolic-functions", "-lstdc++", "-pthread"]
                 ),
     Extension('dbfilters.splitblockbloom', 
                 sources = ['dbfilters/src/splitblockbloom_wrapper.c'],
                 extra_objects=["dbfilters/src/sha1-avx.S"],
-                extra_compile_args = ["-fPIC", "-fno-strict-aliasing", "-mlzcnt", "-O3", "-mavx2", "-march=native"],
-                extra_link_args=["-shared", "-Wl,-O3", "-Wl,-Bsymbolic-functions", "-lstdc++"]
+                extra_compile_args = ["-fPIC", "-fno-strict-aliasing", "-mlzcnt", "-O3", "-mavx2", "-march=native", "-pthread"],
+                extra_link_args=["-shared", "-Wl,-O3", "-Wl,-Bsymbolic-functions", "-lstdc++", "-pthread"]
+                ),
+    Extension('dbfilters.hotset', 
+                sources = ['dbfilters/src/hotset_wrapper.c'],
+                extra_objects=["dbfilters/src/sha1-avx.S"],
+                extra_compile_args = ["-fPIC", "-fno-strict-aliasing", "-mlzcnt", "-O3", "-mavx2", "-march=native", "-pthread"],
+                extra_link_args=["-shared", "-Wl,-O3", "-Wl,-Bsymbolic-functions", "-lstdc++", "-pthread"]
+                ),
+    Extension('dbfilters.sidecar', 
+                sources = ['dbfilters/src/sidecar_wrapper.c'],
+                extra_objects=["dbfilters/src/sha1-avx.S"],
+                extra_compile_args = ["-fPIC", "-fno-strict-aliasing", "-mlzcnt", "-O3", "-mavx2", "-march=native", "-pthread"],
+                extra_link_args=["-shared", "-Wl,-O3", "-Wl,-Bsymbolic-functions", "-lstdc++", "-pthread"]
                 )
 ]
 setup(